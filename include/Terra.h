@@ -131,13 +131,25 @@ typedef enum {
 } TerraTonemappingOperator;
 
 typedef enum {
-    kTerraAcceleratorBVH
+    kTerraAcceleratorBVH,
+    kTerraAcceleratorBVH4,          // 4-wide nodes tested with SSE
+    kTerraAcceleratorBVH4Quantized, // 4-wide nodes with child bounds quantized to 8 bits, one cache line per node
+    kTerraAcceleratorBVH8,          // 8-wide nodes tested with AVX (or two SSE tests when not available)
+    kTerraAcceleratorKDTree         // SAH kd-tree, built in O(N log(N)). Not refitted nor cached
 } TerraAccelerator;
 
+// How the BVH (binary or wide) is built on commit
+typedef enum {
+    kTerraBVHBuilderSAH,    // Binned SAH, good trees at a moderate build cost
+    kTerraBVHBuilderLBVH,   // Morton codes sorted in parallel, builds much faster for interactive edits at some traversal cost
+    kTerraBVHBuilderSBVH    // Binned SAH plus spatial splits duplicating straddling triangles, slower builds for final renders
+} TerraBVHBuilder;
+
 typedef enum {
     kTerraSamplingMethodRandom,
     kTerraSamplingMethodStratified,
-    kTerraSamplingMethodHalton
+    kTerraSamplingMethodHalton,
+    kTerraSamplingMethodSobol       // Owen-scrambled Sobol over every dimension of a path, blue noise across pixels
 } TerraSamplingMethod;
 
 typedef enum {
@@ -150,20 +162,52 @@ typedef enum {
     kTerraIntegratorDebugMisWeights,
 } TerraIntegrator;
 
+// How terra_render advances the paths of a tile
+typedef enum {
+    kTerraPathTracerMegakernel, // Each path is traced to its end, traversal and shading interleaved, before the next one starts
+    kTerraPathTracerWavefront   // Path states are queued and advance together one stage at a time (extend, shade, shadow)
+} TerraPathTracer;
+
+// Terra does not spawn threads on its own. Work that can run in parallel (e.g. building the acceleration
+// structure in terra_scene_commit) is handed to the client through `dispatch`, which has to call
+// routine ( args, idx ) for every idx in [0, count) on whatever threads it owns and return only once all
+// of them have completed. A NULL dispatch runs everything on the calling thread.
+typedef void ( TerraJobRoutine ) ( void* args, size_t idx );
+typedef void ( *TerraJobDispatch ) ( void* client, TerraJobRoutine* routine, void* args, size_t count );
+
+typedef struct {
+    TerraJobDispatch dispatch;
+    void*            client;    // Passed back as first argument to dispatch
+    size_t           workers;   // Number of threads dispatch runs jobs on, used to size the work
+} TerraJobSystem;
+
 typedef struct {
     TerraAttribute              environment_map;
     TerraTonemappingOperator    tonemapping_operator;
     TerraAccelerator            accelerator;
+    TerraBVHBuilder             bvh_builder;
     TerraSamplingMethod         sampling_method;
     TerraIntegrator             integrator;
+    TerraPathTracer             path_tracer;
 
     float   subpixel_jitter;
     size_t  samples_per_pixel;
     size_t  bounces;
     size_t  strata;
 
+    // Adaptive sampling. Pixels stop receiving samples once the standard error of their luminance is below
+    // adaptive_error times their luminance (e.g. 0.01 for 1%), 0 traces samples_per_pixel on every pixel.
+    float   adaptive_error;
+
     float   manual_exposure;
     float   gamma;
+
+    TerraJobSystem jobs;
+
+    // Directory built acceleration structures are saved to and loaded from when the triangles and the
+    // accelerator options match. NULL disables the cache. Scenes with instances are not cached, neither are
+    // rebuilds following terra_scene_object_moved.
+    const char* accelerator_cache_dir;
 } TerraSceneOptions;
 
 // Scene
@@ -176,6 +220,7 @@ typedef struct {
 
 typedef struct {
     TerraFloat3 acc;
+    float       acc_luminance2;     // Sum of the squared luminance of the samples, for the variance of the pixel
     int         samples;
 } TerraRawIntegrationResult;
 
@@ -187,10 +232,24 @@ typedef struct {
 } TerraFramebuffer;
 
 typedef struct {
-    uint32_t object_idx : 8;
-    uint32_t triangle_idx : 24;
+    uint32_t object_idx;
+    uint32_t triangle_idx;
 } TerraPrimitiveRef;
 
+// Ray/triangle tests compared by terra_benchmark_triangle_intersection
+typedef enum {
+    kTerraTriangleTestMollerTrumbore,
+    kTerraTriangleTestWald,         // Scalar watertight test
+    kTerraTriangleTestWaldSSE,      // 4 triangles at a time, what leaves use without AVX
+    kTerraTriangleTestWaldAVX,      // 8 triangles at a time, only run if compiled with AVX
+    kTerraTriangleTestCount
+} TerraTriangleTest;
+
+typedef struct {
+    double mtests_per_second[kTerraTriangleTestCount];  // Millions of ray/triangle tests per second, 0 if not run
+    size_t hits[kTerraTriangleTestCount];               // Should be the same for all the Wald tests
+} TerraTriangleBenchmark;
+
 //--------------------------------------------------------------------------------------------------
 // Terra public API
 //--------------------------------------------------------------------------------------------------
@@ -199,6 +258,17 @@ typedef void*   HTerraScene;
 HTerraScene         terra_scene_create();
 TerraObject*        terra_scene_add_object ( HTerraScene scene, size_t triangle_count );
 size_t              terra_scene_count_objects ( HTerraScene scene );
+TerraObject*        terra_scene_get_object ( HTerraScene scene, size_t idx );
+// The triangles of object have been moved in place (same count and order). The next commit refits the
+// acceleration structure instead of rebuilding it, unless its quality degraded too much.
+void                terra_scene_object_moved ( HTerraScene scene, TerraObject* object );
+// Places object_idx in the world with an affine object to world transform (last row 0 0 0 1). Objects without
+// instances are placed as they are, objects with instances only appear through them. Changing instances only
+// rebuilds the top level of the acceleration structure on commit.
+// Instanced emissive objects are not sampled as lights.
+size_t              terra_scene_add_instance ( HTerraScene scene, size_t object_idx, const TerraFloat4x4* transform );
+void                terra_scene_move_instance ( HTerraScene scene, size_t instance_idx, const TerraFloat4x4* transform );
+void                terra_scene_remove_instance ( HTerraScene scene, size_t instance_idx );
 void                terra_scene_commit ( HTerraScene scene );
 void                terra_scene_clear ( HTerraScene scene );
 TerraSceneOptions*  terra_scene_get_options ( HTerraScene scene );
@@ -206,6 +276,10 @@ void                terra_scene_destroy ( HTerraScene scene );
 
 bool                terra_framebuffer_create ( TerraFramebuffer* framebuffer, size_t width, size_t height );
 void                terra_framebuffer_clear ( TerraFramebuffer* framebuffer );
+// Root mean square over the width x height pixels at x, y of the standard error of their luminance, relative to their
+// average luminance. Estimated from the samples accumulated so far, FLT_MAX while a pixel has too few samples for the
+// estimate to be trusted (same minimum as adaptive sampling).
+float               terra_framebuffer_error ( const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height );
 void                terra_framebuffer_destroy ( TerraFramebuffer* framebuffer );
 
 bool                terra_texture_init ( TerraTexture* texture, size_t width, size_t height, size_t components, const void* data );
@@ -222,6 +296,9 @@ void                terra_attribute_init_cubemap ( TerraAttribute* attr, TerraTe
 
 void                terra_render ( const TerraCamera* camera, HTerraScene scene, const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height );
 
+// Runs every ray/triangle test on rays_count random rays against triangles_count random triangles
+void                terra_benchmark_triangle_intersection ( size_t rays_count, size_t triangles_count, TerraTriangleBenchmark* benchmark_out );
+
 //--------------------------------------------------------------------------------------------------
 // Terra system API
 //--------------------------------------------------------------------------------------------------
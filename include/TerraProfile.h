@@ -128,7 +128,7 @@ void                terra_profile_add_sample_time ( size_t session, size_t targe
 #define TERRA_PROFILE_REGISTER_THREAD( session )                            0
 #define TERRA_PROFILE_CREATE_SESSION( session, threads )                    0
 #define TERRA_PROFILE_CREATE_TARGET( format, session, target, sample_cap)   0
-#define TERRA_PROFILE_ADD_SAMPLE( format, session, target, value)           0
+#define TERRA_PROFILE_ADD_SAMPLE( format, session, target, value)           ( ( void ) ( value ) )
 #define TERRA_PROFILE_UPDATE_STATS( session, target )                       0
 #define TERRA_PROFILE_UPDATE_LOCAL_STATS( session, target )                 0
 #define TERRA_PROFILE_CLEAR_TARGET( session, target )                       0
@@ -15,6 +15,14 @@
 #define RENDER_OPT_TILE_SIZE_NAME "tile-size"
 #define RENDER_OPT_TILE_SIZE_DEFAULT 128
 
+#define RENDER_OPT_TARGET_ERROR_DESC "Relative error under which tiles are retired, the rendering stops once all are (0 for none)"
+#define RENDER_OPT_TARGET_ERROR_NAME "target-error"
+#define RENDER_OPT_TARGET_ERROR_DEFAULT 0.f
+
+#define RENDER_OPT_TIME_BUDGET_DESC "Seconds after which the rendering stops at the end of the current iteration (0 for none)"
+#define RENDER_OPT_TIME_BUDGET_NAME "time-budget"
+#define RENDER_OPT_TIME_BUDGET_DEFAULT 0.f
+
 #define RENDER_OPT_BOUNCES_DESC "Maximum ray bounces (-1 for unbounded)"
 #define RENDER_OPT_BOUNCES_NAME "bounces"
 #define RENDER_OPT_BOUNCES_DEFAULT 4
@@ -40,18 +48,35 @@
 #define RENDER_OPT_TONEMAP_UNCHARTED2 "uncharted"
 #define RENDER_OPT_TONEMAP_DEFAULT RENDER_OPT_TONEMAP_LINEAR
 
-#define RENDER_OPT_SAMPLER_DESC "Monte carlo sampler [random|stratified|halton]"
+#define RENDER_OPT_SAMPLER_DESC "Monte carlo sampler [random|stratified|halton|sobol]"
 #define RENDER_OPT_SAMPLER_NAME "sampler"
 #define RENDER_OPT_SAMPLER_RANDOM "random"
 #define RENDER_OPT_SAMPLER_STRATIFIED "stratified"
 #define RENDER_OPT_SAMPLER_HALTON "halton"
+#define RENDER_OPT_SAMPLER_SOBOL "sobol"
 #define RENDER_OPT_SAMPLER_DEFAULT RENDER_OPT_SAMPLER_RANDOM
 
-#define RENDER_OPT_ACCELERATOR_DESC "Intersection acceleration structure [bvh]"
+#define RENDER_OPT_ACCELERATOR_DESC "Intersection acceleration structure [bvh|bvh4|bvh4q|bvh8|kdtree]"
 #define RENDER_OPT_ACCELERATOR_NAME "accelerator"
 #define RENDER_OPT_ACCELERATOR_BVH "bvh"
+#define RENDER_OPT_ACCELERATOR_BVH4 "bvh4"
+#define RENDER_OPT_ACCELERATOR_BVH4Q "bvh4q"
+#define RENDER_OPT_ACCELERATOR_BVH8 "bvh8"
+#define RENDER_OPT_ACCELERATOR_KDTREE "kdtree"
 #define RENDER_OPT_ACCELERATOR_DEFAULT RENDER_OPT_ACCELERATOR_BVH
 
+#define RENDER_OPT_BVH_BUILDER_DESC "Acceleration structure builder [sah|sbvh|lbvh]"
+#define RENDER_OPT_BVH_BUILDER_NAME "bvh-builder"
+#define RENDER_OPT_BVH_BUILDER_SAH "sah"
+#define RENDER_OPT_BVH_BUILDER_SBVH "sbvh"
+#define RENDER_OPT_BVH_BUILDER_LBVH "lbvh"
+#define RENDER_OPT_BVH_BUILDER_DEFAULT RENDER_OPT_BVH_BUILDER_SAH
+
+#define RENDER_OPT_BVH_CACHE_DESC "Directory built acceleration structures are cached in [<dir>|none]"
+#define RENDER_OPT_BVH_CACHE_NAME "bvh-cache"
+#define RENDER_OPT_BVH_CACHE_NONE "none"
+#define RENDER_OPT_BVH_CACHE_DEFAULT RENDER_OPT_BVH_CACHE_NONE
+
 #define RENDER_OPT_WIDTH_DESC "Render width"
 #define RENDER_OPT_WIDTH_NAME "width"
 #define RENDER_OPT_WIDTH_DEFAULT 800
@@ -92,6 +117,10 @@
 #define RENDER_OPT_JITTER_NAME "jitter"
 #define RENDER_OPT_JITTER_DEFAULT 0.f
 
+#define RENDER_OPT_ADAPTIVE_ERROR_DESC "Relative error under which pixels stop receiving samples, 0 disables adaptive sampling"
+#define RENDER_OPT_ADAPTIVE_ERROR_NAME "adaptive-error"
+#define RENDER_OPT_ADAPTIVE_ERROR_DEFAULT 0.f
+
 #define RENDER_OPT_INTEGRATOR_DESC "Integrator [simple|direct|mis|debug-mono|debug-depth|debug-normals|debug-mis]"
 #define RENDER_OPT_INTEGRATOR_NAME "integrator"
 #define RENDER_OPT_INTEGRATOR_BASIC "simple"
@@ -103,6 +132,12 @@
 #define RENDER_OPT_INTEGRATOR_DEBUG_MIS "debug-mis"
 #define RENDER_OPT_INTEGRATOR_DEFAULT RENDER_OPT_INTEGRATOR_DIRECT
 
+#define RENDER_OPT_PATH_TRACER_DESC "Path tracer [megakernel|wavefront]"
+#define RENDER_OPT_PATH_TRACER_NAME "path-tracer"
+#define RENDER_OPT_PATH_TRACER_MEGAKERNEL "megakernel"
+#define RENDER_OPT_PATH_TRACER_WAVEFRONT "wavefront"
+#define RENDER_OPT_PATH_TRACER_DEFAULT RENDER_OPT_PATH_TRACER_MEGAKERNEL
+
 //
 // Config wraps any configurable bit of the app.
 // Can be safely read/written from anywhere, although writing should probably
@@ -120,14 +155,20 @@ namespace Config {
     TerraTonemappingOperator to_terra_tonemap ( std::string&& str );
     TerraAccelerator         to_terra_accelerator ( std::string& str );
     TerraAccelerator         to_terra_accelerator ( std::string&& str );
+    TerraBVHBuilder          to_terra_bvh_builder ( std::string& str );
+    TerraBVHBuilder          to_terra_bvh_builder ( std::string&& str );
     TerraSamplingMethod      to_terra_sampling ( std::string& str );
     TerraSamplingMethod      to_terra_sampling ( std::string&& str );
     TerraIntegrator          to_terra_integrator ( std::string& str );
     TerraIntegrator          to_terra_integrator ( std::string&& str );
+    TerraPathTracer          to_terra_path_tracer ( std::string& str );
+    TerraPathTracer          to_terra_path_tracer ( std::string&& str );
     const char*              from_terra_tonemap ( TerraTonemappingOperator v );
     const char*              from_terra_accelerator ( TerraAccelerator v );
+    const char*              from_terra_bvh_builder ( TerraBVHBuilder v );
     const char*              from_terra_sampling ( TerraSamplingMethod v );
     const char*              from_terra_integrator ( TerraIntegrator v );
+    const char*              from_terra_path_tracer ( TerraPathTracer v );
 
     // Possible effects caused by changing a config options.
     enum Effect {
@@ -140,6 +181,8 @@ namespace Config {
 
         JOB_N_WORKERS = 0,
         JOB_TILE_SIZE,
+        JOB_TARGET_ERROR,
+        JOB_TIME_BUDGET,
 
 
         RENDER_MAX_BOUNCES,
@@ -148,9 +191,13 @@ namespace Config {
         RENDER_EXPOSURE,
         RENDER_TONEMAP,
         RENDER_ACCELERATOR,
+        RENDER_BVH_BUILDER,
+        RENDER_BVH_CACHE,
         RENDER_SAMPLING,
         RENDER_JITTER,
+        RENDER_ADAPTIVE_ERROR,
         RENDER_INTEGRATOR,
+        RENDER_PATH_TRACER,
         RENDER_WIDTH,
         RENDER_HEIGHT,
         RENDER_SCENE_PATH,
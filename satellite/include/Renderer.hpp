@@ -5,6 +5,8 @@
 #include <memory>
 #include <functional>
 #include <mutex>
+#include <chrono>
+#include <atomic>
 
 // Terra
 #include <Terra.h>
@@ -51,11 +53,15 @@ class TerraRenderer {
     int                         iterations() const;
     ClotoThread*                thread() const;
 
+    // TerraJobDispatch running the jobs on the rendering workers (client is the TerraRenderer). Waits for the
+    // tiles in flight to finish first, the calling thread takes part in the work.
+    static void dispatch_jobs ( void* client, TerraJobRoutine* routine, void* args, size_t count );
+
   private:
     bool     _launch();
     void     _setup_threads();
-    void     _push_jobs();
-    void     _restart_jobs();
+    void     _setup_workers();
+    bool     _push_jobs();
     void     _update_stats();
     void     _clear_stats();
     void     _process_messages();
@@ -66,9 +72,19 @@ class TerraRenderer {
         TerraRenderer*  th;
         int             x, y;
         int             width, height;
+        float           error;      // Relative error of the tile when the iteration was scheduled
+        int             passes;     // Number of terra_render calls on the tile this iteration
     } TerraRenderArgs;
     friend void terra_render_launcher ( void* );
 
+    typedef struct TerraDispatchArgs {
+        TerraJobRoutine*     routine;
+        void*                args;
+        size_t               idx;
+        std::atomic<size_t>* pending;
+    } TerraDispatchArgs;
+    friend void terra_dispatch_launcher ( void* );
+
     // Threading
     std::unique_ptr<ClotoSlaveGroup> _workers;
     uint32_t                         _tile_counter;
@@ -86,6 +102,7 @@ class TerraRenderer {
     bool         _iterative;
     bool         _clear_framebuffer = true;
     int          _iterations;
+    std::chrono::steady_clock::time_point _start_time;
     Event        _on_step_end;   // Also called at the end of every loop iteration
     TileEvent    _on_tile_begin;
     TileEvent    _on_tile_end;
@@ -11,6 +11,7 @@
 #include <Config.hpp>
 
 struct ApolloModel;
+struct ApolloMesh;
 struct ApolloMaterial;
 struct ApolloTexture;
 
@@ -53,7 +54,10 @@ class Scene {
 
     const TerraCamera& get_camera();
 
-    // This invalidates the current scene! Need to call construct_terra_scene() again
+    // Where terra_scene_commit runs its jobs (e.g. TerraRenderer::dispatch_jobs), NULL builds on the calling thread
+    void set_job_dispatch ( TerraJobDispatch dispatch, void* client );
+
+    // Moves the mesh vertices in place and commits the scene, refitting the acceleration structure
     bool move_mesh ( const char* name, const TerraFloat3& new_pos );
 
     bool mesh_exists ( const char* name );
@@ -66,6 +70,7 @@ class Scene {
     TerraTexture* _allocate_texture ( const char* texture );
     bool          _load_scene ( const char* filename );
     bool          _build_scene();
+    void          _read_positions ( TerraObject* object, const ApolloMesh* mesh );
     void          _read_config();
 
     ApolloModel* _apollo_model = NULL;
@@ -77,7 +82,10 @@ class Scene {
     TerraCamera       _camera;
     HTerraScene       _scene;
     TerraSceneOptions _opts;
+    std::string       _bvh_cache_dir;     // _opts.accelerator_cache_dir points into it
     bool              _first_load = true;
+    TerraJobDispatch  _job_dispatch = NULL;
+    void*             _job_client = NULL;
 
     TerraFloat3       _envmap_color;
 
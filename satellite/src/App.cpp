@@ -47,6 +47,7 @@ using namespace std;
 #define CMD_MESH_NAME "mesh"
 #define CMD_MESH_LIST_NAME "list"
 #define CMD_MESH_MOVE_NAME "move"
+#define CMD_BENCH_NAME "bench"
 
 #define DEFAULT_UI_FONT "Inconsolata.ttf"
 
@@ -128,6 +129,7 @@ namespace {
 App::App ( int argc, char** argv ) {
     Log::set_targets ( stdout, stderr, stderr, stdout );
     Config::init();
+    _scene.set_job_dispatch ( &TerraRenderer::dispatch_jobs, &_renderer );
 }
 
 App::~App() {
@@ -560,6 +562,31 @@ success:
 
         return 0;
     };
+    // bench
+    auto cmd_bench = [] ( const CommandArgs & args ) {
+        size_t rays = args.size() > 0 ? strtoul ( args[0].c_str(), nullptr, 10 ) : 16384;
+        size_t triangles = args.size() > 1 ? strtoul ( args[1].c_str(), nullptr, 10 ) : 1024;
+
+        if ( rays == 0 || triangles == 0 ) {
+            Log::error ( STR ( "bench [rays] [triangles]" ) );
+            return 1;
+        }
+
+        const char* names[kTerraTriangleTestCount] = { "Moller-Trumbore", "Wald", "Wald SSE", "Wald AVX" };
+        TerraTriangleBenchmark benchmark;
+        terra_benchmark_triangle_intersection ( rays, triangles, &benchmark );
+        Log::console ( "Ray/triangle tests, %zu rays x %zu triangles", rays, triangles );
+
+        for ( int i = 0; i < kTerraTriangleTestCount; ++i ) {
+            if ( benchmark.mtests_per_second[i] == 0. ) {
+                Log::console ( "\t%-16s not compiled", names[i] );
+            } else {
+                Log::console ( "\t%-16s %8.1f Mtests/s (%zu hits)", names[i], benchmark.mtests_per_second[i], benchmark.hits[i] );
+            }
+        }
+
+        return 0;
+    };
     //
     _c_map[CMD_CLEAR_NAME] = cmd_clear;
     _c_map[CMD_HELP_NAME] = cmd_help;
@@ -575,6 +602,7 @@ success:
     _c_map[CMD_HIDE_NAME] = cmd_hide;
     _c_map[CMD_STATS_NAME] = cmd_stats;
     _c_map[CMD_MESH_NAME] = cmd_mesh;
+    _c_map[CMD_BENCH_NAME] = cmd_bench;
 }
 
 int App::_boot() {
@@ -257,9 +257,26 @@ namespace Config {
         transform ( str.begin(), str.end(), str.begin(), ::tolower );
         const char* s = str.data();
         TRY_COMPARE_S ( s, RENDER_OPT_ACCELERATOR_BVH, kTerraAcceleratorBVH );
+        TRY_COMPARE_S ( s, RENDER_OPT_ACCELERATOR_BVH4, kTerraAcceleratorBVH4 );
+        TRY_COMPARE_S ( s, RENDER_OPT_ACCELERATOR_BVH4Q, kTerraAcceleratorBVH4Quantized );
+        TRY_COMPARE_S ( s, RENDER_OPT_ACCELERATOR_BVH8, kTerraAcceleratorBVH8 );
+        TRY_COMPARE_S ( s, RENDER_OPT_ACCELERATOR_KDTREE, kTerraAcceleratorKDTree );
         return ( TerraAccelerator ) - 1;
     }
 
+    TerraBVHBuilder to_terra_bvh_builder ( string& str ) {
+        return to_terra_bvh_builder ( std::move ( str ) );
+    }
+
+    TerraBVHBuilder to_terra_bvh_builder ( string&& str ) {
+        transform ( str.begin(), str.end(), str.begin(), ::tolower );
+        const char* s = str.data();
+        TRY_COMPARE_S ( s, RENDER_OPT_BVH_BUILDER_SAH, kTerraBVHBuilderSAH );
+        TRY_COMPARE_S ( s, RENDER_OPT_BVH_BUILDER_SBVH, kTerraBVHBuilderSBVH );
+        TRY_COMPARE_S ( s, RENDER_OPT_BVH_BUILDER_LBVH, kTerraBVHBuilderLBVH );
+        return ( TerraBVHBuilder ) - 1;
+    }
+
     TerraSamplingMethod to_terra_sampling ( string& str ) {
         return to_terra_sampling ( std::move ( str ) );
     }
@@ -270,6 +287,7 @@ namespace Config {
         TRY_COMPARE_S ( s, RENDER_OPT_SAMPLER_RANDOM, kTerraSamplingMethodRandom );
         TRY_COMPARE_S ( s, RENDER_OPT_SAMPLER_STRATIFIED, kTerraSamplingMethodStratified );
         TRY_COMPARE_S ( s, RENDER_OPT_SAMPLER_HALTON, kTerraSamplingMethodHalton );
+        TRY_COMPARE_S ( s, RENDER_OPT_SAMPLER_SOBOL, kTerraSamplingMethodSobol );
         return ( TerraSamplingMethod ) - 1;
     }
 
@@ -290,6 +308,18 @@ namespace Config {
         return ( TerraIntegrator ) - 1;
     }
 
+    TerraPathTracer to_terra_path_tracer ( std::string& str ) {
+        return to_terra_path_tracer ( std::move ( str ) );
+    }
+
+    TerraPathTracer to_terra_path_tracer ( std::string&& str ) {
+        transform ( str.begin(), str.end(), str.begin(), ::tolower );
+        const char* s = str.data();
+        TRY_COMPARE_S ( s, RENDER_OPT_PATH_TRACER_MEGAKERNEL, kTerraPathTracerMegakernel );
+        TRY_COMPARE_S ( s, RENDER_OPT_PATH_TRACER_WAVEFRONT, kTerraPathTracerWavefront );
+        return ( TerraPathTracer ) - 1;
+    }
+
     const char* from_terra_tonemap ( TerraTonemappingOperator v ) {
         switch ( v ) {
             case kTerraTonemappingOperatorNone:
@@ -315,6 +345,33 @@ namespace Config {
         switch ( v ) {
             case kTerraAcceleratorBVH:
                 return RENDER_OPT_ACCELERATOR_BVH;
+
+            case kTerraAcceleratorBVH4:
+                return RENDER_OPT_ACCELERATOR_BVH4;
+
+            case kTerraAcceleratorBVH4Quantized:
+                return RENDER_OPT_ACCELERATOR_BVH4Q;
+
+            case kTerraAcceleratorBVH8:
+                return RENDER_OPT_ACCELERATOR_BVH8;
+
+            case kTerraAcceleratorKDTree:
+                return RENDER_OPT_ACCELERATOR_KDTREE;
+        }
+
+        return nullptr;
+    }
+
+    const char* from_terra_bvh_builder ( TerraBVHBuilder v ) {
+        switch ( v ) {
+            case kTerraBVHBuilderSAH:
+                return RENDER_OPT_BVH_BUILDER_SAH;
+
+            case kTerraBVHBuilderSBVH:
+                return RENDER_OPT_BVH_BUILDER_SBVH;
+
+            case kTerraBVHBuilderLBVH:
+                return RENDER_OPT_BVH_BUILDER_LBVH;
         }
 
         return nullptr;
@@ -330,6 +387,9 @@ namespace Config {
 
             case kTerraSamplingMethodHalton:
                 return RENDER_OPT_SAMPLER_HALTON;
+
+            case kTerraSamplingMethodSobol:
+                return RENDER_OPT_SAMPLER_SOBOL;
         }
 
         return nullptr;
@@ -362,6 +422,18 @@ namespace Config {
         return nullptr;
     }
 
+    const char* from_terra_path_tracer ( TerraPathTracer v ) {
+        switch ( v ) {
+            case kTerraPathTracerMegakernel:
+                return RENDER_OPT_PATH_TRACER_MEGAKERNEL;
+
+            case kTerraPathTracerWavefront:
+                return RENDER_OPT_PATH_TRACER_WAVEFRONT;
+        }
+
+        return nullptr;
+    }
+
 
     Effect query_change_effect ( int opt ) {
         if ( opt > RENDER_BEGIN && opt < RENDER_END ) {
@@ -399,12 +471,16 @@ namespace Config {
         float envmap[] = RENDER_OPT_ENVMAP_COLOR_DEFAULT;
         add_opt ( JOB_N_WORKERS,            RENDER_OPT_WORKERS_DEFAULT,             RENDER_OPT_WORKERS_NAME,            RENDER_OPT_WORKERS_DESC );
         add_opt ( JOB_TILE_SIZE,            RENDER_OPT_TILE_SIZE_DEFAULT,           RENDER_OPT_TILE_SIZE_NAME,          RENDER_OPT_TILE_SIZE_DESC );
+        add_opt ( JOB_TARGET_ERROR,         RENDER_OPT_TARGET_ERROR_DEFAULT,        RENDER_OPT_TARGET_ERROR_NAME,       RENDER_OPT_TARGET_ERROR_DESC );
+        add_opt ( JOB_TIME_BUDGET,          RENDER_OPT_TIME_BUDGET_DEFAULT,         RENDER_OPT_TIME_BUDGET_NAME,        RENDER_OPT_TIME_BUDGET_DESC );
         add_opt ( RENDER_MAX_BOUNCES,       RENDER_OPT_BOUNCES_DEFAULT,             RENDER_OPT_BOUNCES_NAME,            RENDER_OPT_BOUNCES_DESC );
         add_opt ( RENDER_SAMPLES,           RENDER_OPT_SAMPLES_DEFAULT,             RENDER_OPT_SAMPLES_NAME,            RENDER_OPT_SAMPLES_DESC );
         add_opt ( RENDER_GAMMA,             RENDER_OPT_GAMMA_DEFAULT,               RENDER_OPT_GAMMA_NAME,              RENDER_OPT_GAMMA_DESC );
         add_opt ( RENDER_EXPOSURE,          RENDER_OPT_EXPOSURE_DEFAULT,            RENDER_OPT_EXPOSURE_NAME,           RENDER_OPT_EXPOSURE_DESC );
         add_opt ( RENDER_TONEMAP,           RENDER_OPT_TONEMAP_DEFAULT,             RENDER_OPT_TONEMAP_NAME,            RENDER_OPT_TONEMAP_DESC );
         add_opt ( RENDER_ACCELERATOR,       RENDER_OPT_ACCELERATOR_DEFAULT,         RENDER_OPT_ACCELERATOR_NAME,        RENDER_OPT_ACCELERATOR_DESC );
+        add_opt ( RENDER_BVH_BUILDER,       RENDER_OPT_BVH_BUILDER_DEFAULT,         RENDER_OPT_BVH_BUILDER_NAME,        RENDER_OPT_BVH_BUILDER_DESC );
+        add_opt ( RENDER_BVH_CACHE,         RENDER_OPT_BVH_CACHE_DEFAULT,           RENDER_OPT_BVH_CACHE_NAME,          RENDER_OPT_BVH_CACHE_DESC );
         add_opt ( RENDER_SAMPLING,          RENDER_OPT_SAMPLER_DEFAULT,             RENDER_OPT_SAMPLER_NAME,            RENDER_OPT_SAMPLER_DESC );
         add_opt ( RENDER_WIDTH,             RENDER_OPT_WIDTH_DEFAULT,               RENDER_OPT_WIDTH_NAME,              RENDER_OPT_WIDTH_DESC );
         add_opt ( RENDER_HEIGHT,            RENDER_OPT_HEIGHT_DEFAULT,              RENDER_OPT_HEIGHT_NAME,             RENDER_OPT_HEIGHT_DESC );
@@ -416,7 +492,9 @@ namespace Config {
         add_opt ( RENDER_SCENE_PATH,        RENDER_OPT_SCENE_PATH_DEFAULT,          RENDER_OPT_SCENE_PATH_NAME,         RENDER_OPT_SCENE_PATH_DESC );
         add_opt ( RENDER_ENVMAP_COLOR,      envmap,                                 RENDER_OPT_ENVMAP_COLOR_NAME,       RENDER_OPT_ENVMAP_COLOR_DESC );
         add_opt ( RENDER_JITTER,            RENDER_OPT_JITTER_DEFAULT,              RENDER_OPT_JITTER_NAME,             RENDER_OPT_JITTER_DESC );
+        add_opt ( RENDER_ADAPTIVE_ERROR,    RENDER_OPT_ADAPTIVE_ERROR_DEFAULT,      RENDER_OPT_ADAPTIVE_ERROR_NAME,     RENDER_OPT_ADAPTIVE_ERROR_DESC );
         add_opt ( RENDER_INTEGRATOR,        RENDER_OPT_INTEGRATOR_DEFAULT,          RENDER_OPT_INTEGRATOR_NAME,         RENDER_OPT_INTEGRATOR_DESC );
+        add_opt ( RENDER_PATH_TRACER,       RENDER_OPT_PATH_TRACER_DEFAULT,         RENDER_OPT_PATH_TRACER_NAME,        RENDER_OPT_PATH_TRACER_DESC );
         /*if ( !load () ) {
             Log::info ( STR ( "No configuration file loaded." ) );
             return true;
@@ -511,12 +589,16 @@ namespace Config {
         float envmap[] = RENDER_OPT_ENVMAP_COLOR_DEFAULT;
         write_i ( JOB_N_WORKERS, n_threads );
         write_i ( JOB_TILE_SIZE, RENDER_OPT_TILE_SIZE_DEFAULT );
+        write_f ( JOB_TARGET_ERROR, RENDER_OPT_TARGET_ERROR_DEFAULT );
+        write_f ( JOB_TIME_BUDGET, RENDER_OPT_TIME_BUDGET_DEFAULT );
         write_i ( RENDER_MAX_BOUNCES, RENDER_OPT_BOUNCES_DEFAULT );
         write_i ( RENDER_SAMPLES, RENDER_OPT_SAMPLES_DEFAULT );
         write_f ( RENDER_GAMMA, RENDER_OPT_GAMMA_DEFAULT );
         write_f ( RENDER_EXPOSURE, RENDER_OPT_EXPOSURE_DEFAULT );
         write_s ( RENDER_TONEMAP, RENDER_OPT_TONEMAP_DEFAULT );
         write_s ( RENDER_ACCELERATOR, RENDER_OPT_ACCELERATOR_DEFAULT );
+        write_s ( RENDER_BVH_BUILDER, RENDER_OPT_BVH_BUILDER_DEFAULT );
+        write_s ( RENDER_BVH_CACHE, RENDER_OPT_BVH_CACHE_DEFAULT );
         write_s ( RENDER_SAMPLING, RENDER_OPT_SAMPLER_DEFAULT );
         write_i ( RENDER_WIDTH, RENDER_OPT_WIDTH_DEFAULT );
         write_i ( RENDER_HEIGHT, RENDER_OPT_HEIGHT_DEFAULT );
@@ -528,7 +610,9 @@ namespace Config {
         write_s ( RENDER_SCENE_PATH, RENDER_OPT_SCENE_PATH_DEFAULT );
         write_f3 ( RENDER_ENVMAP_COLOR, envmap );
         write_f ( RENDER_JITTER, RENDER_OPT_JITTER_DEFAULT );
+        write_f ( RENDER_ADAPTIVE_ERROR, RENDER_OPT_ADAPTIVE_ERROR_DEFAULT );
         write_s ( RENDER_INTEGRATOR, RENDER_OPT_INTEGRATOR_DEFAULT );
+        write_s ( RENDER_PATH_TRACER, RENDER_OPT_PATH_TRACER_DEFAULT );
     }
 
     bool load ( const char* path ) {
@@ -14,6 +14,12 @@
 // Terra
 #include <TerraProfile.h>
 #include <TerraPresets.h>
+
+// Most terra_render calls a tile gets in one iteration, however noisier than the others it is
+#define RENDER_MAX_TILE_PASSES 4
+// Smallest job queue, the workers can be created for terra_scene_commit before there is a framebuffer to tile
+#define RENDER_MIN_JOB_QUEUE 64
+
 namespace {
     // fnv1a
     constexpr uint64_t fnv_basis = 14695981039346656037ull;
@@ -80,7 +86,10 @@ void terra_render_launcher ( void* _args ) {
         cloto_thread_send_message ( args->th->thread(), CLOTO_MSG_JOB_LOCAL_ARGS, &msg, sizeof ( msg ) );
     }
 
-    terra_render ( args->th->_target_camera, args->th->_target_scene, &args->th->_framebuffer, args->x, args->y, args->width, args->height );
+    for ( int i = 0; i < args->passes; ++i ) {
+        terra_render ( args->th->_target_camera, args->th->_target_scene, &args->th->_framebuffer, args->x, args->y, args->width, args->height );
+    }
+
     TERRA_PROFILE_UPDATE_LOCAL_STATS ( TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RENDER );
     TERRA_PROFILE_UPDATE_LOCAL_STATS ( TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RAY );
     TERRA_PROFILE_UPDATE_LOCAL_STATS ( TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_TRACE );
@@ -98,6 +107,13 @@ void terra_render_launcher ( void* _args ) {
     cloto_atomic_fetch_add_u32 ( &args->th->_tile_counter, -1 );
 }
 
+void terra_dispatch_launcher ( void* _args ) {
+    using Args = TerraRenderer::TerraDispatchArgs;
+    Args* args = ( Args* ) _args;
+    args->routine ( args->args, args->idx );
+    --*args->pending;
+}
+
 TerraRenderer::TerraRenderer ( ) {
     cloto_thread_register();
     _this_thread = cloto_thread_get();
@@ -143,12 +159,13 @@ void TerraRenderer::update() {
                 if ( _opt_job_change ) {
                     _setup_threads();
                     _opt_job_change = false;
-                    _push_jobs();
-                } else {
-                    _restart_jobs();
                 }
 
-                ++_iterations;
+                if ( _push_jobs() ) {
+                    ++_iterations;
+                } else {
+                    _paused = true;
+                }
             }
         } else {
             Log::verbose ( STR ( "Finished step" ) );
@@ -240,6 +257,47 @@ ClotoThread* TerraRenderer::thread() const {
     return _this_thread;
 }
 
+void TerraRenderer::dispatch_jobs ( void* client, TerraJobRoutine* routine, void* args, size_t count ) {
+    TerraRenderer* th = ( TerraRenderer* ) client;
+
+    if ( th->_workers == nullptr ) {
+        th->_setup_workers();
+    }
+
+    // Tiles still in flight read the scene being committed
+    while ( th->_tile_counter != 0 ) {
+        th->_process_messages();
+        cloto_thread_yield();
+    }
+
+    vector<TerraDispatchArgs> jobs ( count );
+    atomic<size_t> pending ( count );
+    ClotoJob job;
+    cloto_workqueue_clear ( &th->_workers->queue );
+
+    for ( size_t i = 0; i < count; ++i ) {
+        jobs[i] = { routine, args, i, &pending };
+        ClotoJob dispatch_job;
+        dispatch_job.routine = &terra_dispatch_launcher;
+        dispatch_job.args = &jobs[i];
+
+        // Queue is full, help draining it
+        while ( !cloto_workqueue_push ( &th->_workers->queue, &dispatch_job ) ) {
+            if ( cloto_workqueue_steal ( &th->_workers->queue, &job ) ) {
+                job.routine ( job.args );
+            }
+        }
+    }
+
+    while ( pending != 0 ) {
+        if ( cloto_workqueue_steal ( &th->_workers->queue, &job ) ) {
+            job.routine ( job.args );
+        } else {
+            cloto_thread_yield();
+        }
+    }
+}
+
 void TerraRenderer::_update_stats() {
     TERRA_PROFILE_UPDATE_STATS ( TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RENDER );
     TERRA_PROFILE_UPDATE_STATS ( TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_TRACE );
@@ -266,7 +324,7 @@ void TerraRenderer::_num_tiles ( int& tiles_x, int& tiles_y ) {
     tiles_y = ( int ) ceilf ( ( float ) _framebuffer.height / tile_size );
 }
 
-void TerraRenderer::_setup_threads () {
+void TerraRenderer::_setup_workers () {
     int workers = Config::read_i ( Config::JOB_N_WORKERS );
 
     // Free previous allocations
@@ -277,9 +335,14 @@ void TerraRenderer::_setup_threads () {
     }
 
     // Compute tile/queue size
-    int tx, ty;
-    _num_tiles ( tx, ty );
-    int job_buffer_size = tx * ty;
+    int job_buffer_size = RENDER_MIN_JOB_QUEUE;
+
+    if ( _framebuffer.pixels != nullptr ) {
+        int tx, ty;
+        _num_tiles ( tx, ty );
+        job_buffer_size = max ( job_buffer_size, tx * ty );
+    }
+
     // Rounding to next power of two, we should also try the `countleadingzeros` intrinsic
     // http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
     {
@@ -315,6 +378,10 @@ void TerraRenderer::_setup_threads () {
         memcpy ( payload.buffer, &session, sizeof ( session ) );
         cloto_thread_send_message ( &_workers->slaves[i].thread, CLOTO_MSG_JOB_LOCAL_ARGS, &payload, CLOTO_MSG_PAYLOAD_SIZE );
     }
+}
+
+void TerraRenderer::_setup_threads () {
+    _setup_workers();
 
     // create jobs
     int tile_size = Config::read_i ( Config::Opts::JOB_TILE_SIZE );
@@ -335,30 +402,66 @@ void TerraRenderer::_setup_threads () {
     }
 }
 
-void TerraRenderer::_push_jobs() {
-    int num_tiles_x, num_tiles_y;
-    _num_tiles ( num_tiles_x, num_tiles_y );
-    _tile_counter = num_tiles_x * num_tiles_y;
-    Log::verbose ( FMT ( "Pushing %d jobs", _tile_counter ) );
+// With a target error or a time budget, tiles are queued noisiest first and the ones over the average error get more
+// passes. Tiles under the target error are retired. Without either every tile gets one pass per iteration.
+// Returns false if there's nothing left to render or the time budget is over.
+bool TerraRenderer::_push_jobs() {
+    float target_error = Config::read_f ( Config::JOB_TARGET_ERROR );
+    float time_budget = Config::read_f ( Config::JOB_TIME_BUDGET );
+    float elapsed = chrono::duration<float> ( chrono::steady_clock::now() - _start_time ).count();
+    bool scheduled = target_error > 0 || time_budget > 0;
+
+    if ( time_budget > 0 && elapsed >= time_budget ) {
+        Log::info ( FMT ( "Time budget of %.1fs reached after %d iterations", time_budget, _iterations ) );
+        return false;
+    }
+
+    // Tiles without an estimate yet (FLT_MAX) are all rendered once
+    vector<TerraRenderArgs*> queue;
+    float error_sum = 0;
+    bool estimated = scheduled;
+
+    for ( TerraRenderArgs& args : _job_args ) {
+        args.error = scheduled ? terra_framebuffer_error ( &_framebuffer, args.x, args.y, args.width, args.height ) : FLT_MAX;
+
+        if ( target_error <= 0 || args.error > target_error ) {
+            queue.push_back ( &args );
+            estimated = estimated && args.error != FLT_MAX;
+            error_sum += args.error;
+        }
+    }
+
+    if ( queue.empty() ) {
+        Log::info ( FMT ( "All tiles are under the target error %f after %d iterations", target_error, _iterations ) );
+        return false;
+    }
+
+    if ( scheduled ) {
+        sort ( queue.begin(), queue.end(), [] ( const TerraRenderArgs * a, const TerraRenderArgs * b ) {
+            return a->error > b->error;
+        } );
+    }
+
+    float error_avg = error_sum / queue.size();
+    _tile_counter = ( uint32_t ) queue.size();
+    Log::verbose ( FMT ( "Pushing %d jobs, %d tiles retired", _tile_counter, ( int ) ( _job_args.size() - queue.size() ) ) );
     cloto_workqueue_clear ( &_workers->queue );
 
-    for ( int i = 0; i < num_tiles_y; ++i ) {
-        for ( int j = 0; j < num_tiles_x; ++j ) {
-            TerraRenderArgs* args = _job_args.data() + i * num_tiles_x + j;
-            ClotoJob job;
-            job.routine = &terra_render_launcher;
-            job.args = args;
-            cloto_workqueue_push ( &_workers->queue, &job );
+    for ( TerraRenderArgs* args : queue ) {
+        args->passes = 1;
+
+        if ( estimated && error_avg > 0 ) {
+            int passes = ( int ) roundf ( args->error / error_avg );
+            args->passes = passes < 1 ? 1 : passes > RENDER_MAX_TILE_PASSES ? RENDER_MAX_TILE_PASSES : passes;
         }
+
+        ClotoJob job;
+        job.routine = &terra_render_launcher;
+        job.args = args;
+        cloto_workqueue_push ( &_workers->queue, &job );
     }
-}
 
-void TerraRenderer::_restart_jobs() {
-    int tx, ty;
-    _num_tiles ( tx, ty );
-    int n_jobs = tx * ty;
-    _tile_counter = n_jobs;
-    cloto_slavegroup_reset ( _workers.get() );
+    return true;
 }
 
 bool TerraRenderer::_launch () {
@@ -400,8 +503,13 @@ bool TerraRenderer::_launch () {
     _paused             = false;
     _iterations         = 0;
     _clear_framebuffer  = false;
+    _start_time         = chrono::steady_clock::now();
+
     // Push jobs
-    _push_jobs();
+    if ( !_push_jobs() ) {
+        _paused = true;
+    }
+
     return true;
 }
 
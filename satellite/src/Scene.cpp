@@ -148,19 +148,11 @@ bool Scene::_build_scene() {
         //
         // Reading geometry
         //
+        _read_positions ( object, &_apollo_model->meshes[m] );
 
         for ( size_t i = 0; i < object->triangles_count; ++i ) {
             const ApolloMeshFaceData* face = &_apollo_model->meshes[m].face_data;
             const ApolloModelVertexData* vertex_data = &_apollo_model->vertex_data;
-            object->triangles[i].a.x = vertex_data->pos_x[face->idx_a[i]];
-            object->triangles[i].a.y = vertex_data->pos_y[face->idx_a[i]];
-            object->triangles[i].a.z = vertex_data->pos_z[face->idx_a[i]];
-            object->triangles[i].b.x = vertex_data->pos_x[face->idx_b[i]];
-            object->triangles[i].b.y = vertex_data->pos_y[face->idx_b[i]];
-            object->triangles[i].b.z = vertex_data->pos_z[face->idx_b[i]];
-            object->triangles[i].c.x = vertex_data->pos_x[face->idx_c[i]];
-            object->triangles[i].c.y = vertex_data->pos_y[face->idx_c[i]];
-            object->triangles[i].c.z = vertex_data->pos_z[face->idx_c[i]];
             object->properties[i].normal_a.x = vertex_data->norm_x[face->idx_a[i]];
             object->properties[i].normal_a.y = vertex_data->norm_y[face->idx_a[i]];
             object->properties[i].normal_a.z = vertex_data->norm_z[face->idx_a[i]];
@@ -233,6 +225,7 @@ bool Scene::_build_scene() {
 
     // TODO free materials/textures?
     Log::info ( FMT ( "Building acceleration structure for %zu triangles", n_triangles ) );
+    *terra_scene_get_options ( _scene ) = _opts;
     terra_scene_commit ( _scene );
     // Log::info(FMT("Finished importing %s. objects(%d) textures(%d)", _apollo_model->name, terra_scene_count_objects(_scene), _textures.size()));
     Log::info ( FMT ( "Finished building %s", _apollo_model->name ) );
@@ -243,6 +236,23 @@ bool Scene::_build_scene() {
     return true;
 }
 
+void Scene::_read_positions ( TerraObject* object, const ApolloMesh* mesh ) {
+    const ApolloMeshFaceData* face = &mesh->face_data;
+    const ApolloModelVertexData* vertex_data = &_apollo_model->vertex_data;
+
+    for ( size_t i = 0; i < object->triangles_count; ++i ) {
+        object->triangles[i].a.x = vertex_data->pos_x[face->idx_a[i]];
+        object->triangles[i].a.y = vertex_data->pos_y[face->idx_a[i]];
+        object->triangles[i].a.z = vertex_data->pos_z[face->idx_a[i]];
+        object->triangles[i].b.x = vertex_data->pos_x[face->idx_b[i]];
+        object->triangles[i].b.y = vertex_data->pos_y[face->idx_b[i]];
+        object->triangles[i].b.z = vertex_data->pos_z[face->idx_b[i]];
+        object->triangles[i].c.x = vertex_data->pos_x[face->idx_c[i]];
+        object->triangles[i].c.y = vertex_data->pos_y[face->idx_c[i]];
+        object->triangles[i].c.z = vertex_data->pos_z[face->idx_c[i]];
+    }
+}
+
 bool Scene::load ( const char* filename ) {
     if ( !_load_scene ( filename ) ) {
         return false;
@@ -311,7 +321,12 @@ bool Scene::move_mesh ( const char* name, const TerraFloat3& pos ) {
             m->aabb_max[0] += delta.x;
             m->aabb_max[1] += delta.y;
             m->aabb_max[2] += delta.z;
-            _build_scene();
+            // Same triangles in the same order, the acceleration structure is refit instead of rebuilt.
+            // It is rebuilt with the configured builder only if the refit tree degraded too much.
+            TerraObject* object = terra_scene_get_object ( _scene, i );
+            _read_positions ( object, m );
+            terra_scene_object_moved ( _scene, object );
+            terra_scene_commit ( _scene );
             return true;
         }
     }
@@ -346,12 +361,16 @@ void Scene::clear() {
 void Scene::_read_config() {
     string tonemap_str     = Config::read_s ( Config::RENDER_TONEMAP );
     string accelerator_str = Config::read_s ( Config::RENDER_ACCELERATOR );
+    string builder_str     = Config::read_s ( Config::RENDER_BVH_BUILDER );
     string sampling_str    = Config::read_s ( Config::RENDER_SAMPLING );
     string integrator_str = Config::read_s ( Config::RENDER_INTEGRATOR );
+    string path_tracer_str = Config::read_s ( Config::RENDER_PATH_TRACER );
     TerraTonemappingOperator tonemap = Config::to_terra_tonemap ( tonemap_str );
     TerraAccelerator accelerator     = Config::to_terra_accelerator ( accelerator_str );
+    TerraBVHBuilder builder          = Config::to_terra_bvh_builder ( builder_str );
     TerraSamplingMethod sampling     = Config::to_terra_sampling ( sampling_str );
     TerraIntegrator integrator       = Config::to_terra_integrator ( integrator_str );
+    TerraPathTracer path_tracer      = Config::to_terra_path_tracer ( path_tracer_str );
 
     if ( tonemap == -1 ) {
         Log::error ( FMT ( "Invalid configuration RENDER_TONEMAP value %s. Defaulting to none.", tonemap_str.c_str() ) );
@@ -363,6 +382,11 @@ void Scene::_read_config() {
         accelerator = kTerraAcceleratorBVH;
     }
 
+    if ( builder == -1 ) {
+        Log::error ( FMT ( "Invalid configuration RENDER_BVH_BUILDER value %s. Defaulting to SAH.", builder_str.c_str() ) );
+        builder = kTerraBVHBuilderSAH;
+    }
+
     if ( sampling == -1 ) {
         Log::error ( FMT ( "Invalid configuration RENDER_SAMPLING value %s. Defaulting to random.", sampling_str.c_str() ) );
         sampling = kTerraSamplingMethodRandom;
@@ -373,11 +397,18 @@ void Scene::_read_config() {
         integrator = kTerraIntegratorSimple;
     }
 
+    if ( path_tracer == -1 ) {
+        Log::error ( FMT ( "Invalid configuration RENDER_PATH_TRACER value %s. Defaulting to megakernel.", path_tracer_str.c_str() ) );
+        path_tracer = kTerraPathTracerMegakernel;
+    }
+
     int bounces = Config::read_i ( Config::RENDER_MAX_BOUNCES );
     int samples = Config::read_i ( Config::RENDER_SAMPLES );
     float exposure = Config::read_f ( Config::RENDER_EXPOSURE );
     float gamma = Config::read_f ( Config::RENDER_GAMMA );
     float jitter = Config::read_f ( Config::RENDER_JITTER );
+    float adaptive_error = Config::read_f ( Config::RENDER_ADAPTIVE_ERROR );
+    int workers = Config::read_i ( Config::JOB_N_WORKERS );
 
     if ( bounces < 0 ) {
         Log::error ( FMT ( "Invalid configuration RENDER_MAX_BOUNCES (%d < 0). Defaulting to 64.", bounces ) );
@@ -404,16 +435,34 @@ void Scene::_read_config() {
         jitter = 0;
     }
 
+    if ( adaptive_error < 0 ) {
+        Log::error ( FMT ( "Invalid configuration RENDER_ADAPTIVE_ERROR (%f < 0) Defaulting to 0.", adaptive_error ) );
+        adaptive_error = 0;
+    }
+
+    if ( workers < 1 ) {
+        Log::error ( FMT ( "Invalid configuration JOB_N_WORKERS (%d < 1). Defaulting to 1.", workers ) );
+        workers = 1;
+    }
+
     _opts.bounces              = bounces;
     _opts.samples_per_pixel    = samples;
     _opts.subpixel_jitter      = jitter;
+    _opts.adaptive_error       = adaptive_error;
     _opts.tonemapping_operator = tonemap;
     _opts.manual_exposure      = exposure;
     _opts.gamma                = gamma;
     _opts.accelerator          = accelerator;
+    _opts.bvh_builder          = builder;
+    _bvh_cache_dir             = Config::read_s ( Config::RENDER_BVH_CACHE );
+    _opts.accelerator_cache_dir = _bvh_cache_dir.empty() || _bvh_cache_dir.compare ( RENDER_OPT_BVH_CACHE_NONE ) == 0 ? NULL : _bvh_cache_dir.c_str();
     _opts.strata               = 4;
     _opts.sampling_method      = sampling;
     _opts.integrator           = integrator;
+    _opts.path_tracer          = path_tracer;
+    _opts.jobs.dispatch        = _job_dispatch;
+    _opts.jobs.client          = _job_client;
+    _opts.jobs.workers         = workers;
     _envmap_color     = Config::read_f3 ( Config::RENDER_ENVMAP_COLOR );
     terra_attribute_init_constant ( &_opts.environment_map, &_envmap_color );
     _camera.fov       = Config::read_f ( Config::RENDER_CAMERA_VFOV_DEG );
@@ -428,10 +477,15 @@ void Scene::update_config() {
             || _opts.gamma != Config::read_f ( Config::RENDER_GAMMA )
             || _opts.manual_exposure != Config::read_f ( Config::RENDER_EXPOSURE )
             || _opts.subpixel_jitter != Config::read_f ( Config::RENDER_JITTER )
+            || _opts.adaptive_error != Config::read_f ( Config::RENDER_ADAPTIVE_ERROR )
             || _opts.tonemapping_operator != Config::to_terra_tonemap ( Config::read_s ( Config::RENDER_TONEMAP ) )
             || _opts.accelerator != Config::to_terra_accelerator ( Config::read_s ( Config::RENDER_ACCELERATOR ) )
+            || _opts.bvh_builder != Config::to_terra_bvh_builder ( Config::read_s ( Config::RENDER_BVH_BUILDER ) )
+            || _bvh_cache_dir.compare ( Config::read_s ( Config::RENDER_BVH_CACHE ) ) != 0
             || _opts.sampling_method != Config::to_terra_sampling ( Config::read_s ( Config::RENDER_SAMPLING ) )
             || _opts.integrator != Config::to_terra_integrator ( Config::read_s ( Config::RENDER_INTEGRATOR ) )
+            || _opts.path_tracer != Config::to_terra_path_tracer ( Config::read_s ( Config::RENDER_PATH_TRACER ) )
+            || _opts.jobs.workers != Config::read_i ( Config::JOB_N_WORKERS )
             || !terra_equalf3 ( &Config::read_f3 ( Config::RENDER_ENVMAP_COLOR ), &_envmap_color )
             || !terra_equalf3 ( &Config::read_f3 ( Config::RENDER_CAMERA_POS ), &_camera.position )
             || !terra_equalf3 ( &Config::read_f3 ( Config::RENDER_CAMERA_DIR ), &_camera.direction )
@@ -453,6 +507,13 @@ HTerraScene Scene::construct_terra_scene() {
     return _scene;
 }
 
+void Scene::set_job_dispatch ( TerraJobDispatch dispatch, void* client ) {
+    _job_dispatch = dispatch;
+    _job_client = client;
+    _opts.jobs.dispatch = dispatch;
+    _opts.jobs.client = client;
+}
+
 const TerraCamera& Scene::get_camera() {
     return _camera;
 }
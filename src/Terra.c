@@ -9,6 +9,11 @@
 // Terra
 #include "TerraPrivate.h"
 #include "TerraBVH.h"
+#include "TerraBVHWide.h"
+#include "TerraBVHTwoLevel.h"
+#include "TerraBVHCache.h"
+#include "TerraKDTree.h"
+#include "TerraLightBVH.h"
 #include "TerraPresets.h"
 #include "TerraProfile.h"
 
@@ -24,29 +29,109 @@
 // A copy of the current options is stored and returned when the getter is called.
 // On commit it gets diffed with the one in use before updating it and the scene state is updated appropriately.
 // The dirty_objects flag is set on scene object add, cleared on commit.
+// The moved_objects flag is set when the triangles of an object are moved, cleared on commit. objects_moved tells which
+// ones, so that only their bottom level trees are refit.
+// The dirty_instances flag is set when instances are added, moved or removed, cleared on commit.
+// As long as there's any instance the two level accelerator is used in place of bvh/bvh_wide.
+// Kd-trees are only built for the whole scene, with instances the bottom level falls back to a BVH.
 typedef struct {
     TerraSceneOptions   opts;
     TerraObject*        objects;
     size_t              objects_pop;
     size_t              objects_cap;
+    bool*               objects_moved;      // objects_cap entries
     TerraLight*         lights;
     size_t              lights_pop;
     size_t              lights_cap;
     size_t              lights_triangles_count;
     TerraFloat3         total_light_power;
     TerraFloat3         envmap_light_power;
+    TerraLightBVH       light_bvh;          // Over the triangles of all the lights, one light after the other
+    uint32_t*           object_lights;      // Light of each object, UINT32_MAX for the ones not sampled as lights
     TerraBVH            bvh;
+    TerraBVHWide        bvh_wide;
+    TerraKDTree         kdtree;
+    TerraFileMapping    accelerator_mapping;    // bvh/bvh_wide point into it when loaded from the cache
+    TerraBVHTwoLevel    two_level_bvh;
+    bool                two_level;
+    TerraInstance*      instances;          // Removed instances have object_idx set to UINT32_MAX
+    size_t              instances_pop;
+    size_t              instances_cap;
+    size_t              instances_active;
+    uint32_t*           blue_noise;         // Shifts of the Sobol sampler, created on the first commit selecting it
 
     TerraSceneOptions   new_opts;
     bool                dirty_objects;
     bool                dirty_lights;
+    bool                moved_objects;
+    bool                dirty_instances;
 } TerraScene;
 
 #define TERRA_SCENE_PREALLOCATED_OBJECTS    64
 #define TERRA_SCENE_PREALLOCATED_LIGHTS     16
+#define TERRA_SCENE_PREALLOCATED_INSTANCES  16
 
-TerraFloat3     terra_trace     ( TerraScene* scene, const TerraRay* primary_ray );
+// Pixels are rendered in blocks of TERRA_RENDER_PACKET_SIZE x TERRA_RENDER_PACKET_SIZE, the camera rays of a block
+// are cast together. At most TERRA_BVH_PACKET_MAX_RAYS.
+#ifndef TERRA_RENDER_PACKET_SIZE
+#define TERRA_RENDER_PACKET_SIZE 8
+#endif
+
+// First hit of a path. Camera rays are cast in packets, the paths are then traced one at a time from their hit.
+typedef struct {
+    TerraObject*        object;     // NULL if the ray missed
+    TerraShadingSurface surface;
+    TerraFloat3         point;
+} TerraSceneHit;
+
+// Next event estimation sample. The radiance reaches the surface if nothing is hit along the ray before t_max.
+typedef struct {
+    TerraRay    ray;
+    float       t_max;      // 0 if there's nothing to test
+    TerraFloat3 radiance;
+} TerraShadowRay;
+
+// Energy of the blue noise void-and-cluster is accumulated this many texels around each point, sigma is 1.5
+#define TERRA_BLUE_NOISE_RADIUS 6
+
+// Paths traced by the wavefront path tracer at once, split into batches when a tile has more pixel samples
+#ifndef TERRA_WAVEFRONT_PATHS
+#define TERRA_WAVEFRONT_PATHS 4096
+#endif
+
+// Path waiting in the queue of the next wavefront stage
+typedef struct {
+    TerraRay    ray;
+    TerraFloat3 throughput;
+    uint32_t    sample;     // Index of the camera sample in the batch
+    uint32_t    bounce;
+    TerraSamplerCounter sampler;
+} TerraPathState;
+
+// Shadow ray waiting for its visibility test, its radiance is added to the sample if it's not occluded
+typedef struct {
+    TerraShadowRay shadow;
+    uint32_t       sample;
+} TerraShadowState;
+
+// Adaptive sampling (TerraSceneOptions.adaptive_error) traces the samples of a render in passes of this many,
+// the error of each pixel is estimated in between. Pixels are not considered converged with fewer samples.
+#ifndef TERRA_ADAPTIVE_PASS_SAMPLES
+#define TERRA_ADAPTIVE_PASS_SAMPLES 16
+#endif
+
+#ifndef TERRA_ADAPTIVE_MIN_SAMPLES
+#define TERRA_ADAPTIVE_MIN_SAMPLES 16
+#endif
+
+// The error of pixels darker than this is relative to it, keeps noise in black areas from being chased forever
+#define TERRA_ADAPTIVE_MIN_LUMINANCE 1e-3f
+
+// primary_hit is NULL if the primary ray has not been cast yet
+TerraFloat3     terra_trace     ( TerraScene* scene, const TerraRay* primary_ray, const TerraSceneHit* primary_hit, TerraSamplerCounter* sampler );
 
+// The direct lighting integrators test their light sample right away if shadow_out is NULL, otherwise it is
+// returned there (throughput included) and left out of the returned radiance.
 TerraFloat3     terra_integrate (
     const TerraScene* scene,
     const TerraRay* ray,
@@ -55,7 +140,9 @@ TerraFloat3     terra_integrate (
     const TerraFloat3* point,
     const TerraFloat3* wo,
     const TerraFloat3* throughput,
-    size_t bounce
+    size_t bounce,
+    TerraSamplerCounter* sampler,
+    TerraShadowRay* shadow_out
 );
 
 TerraFloat3 terra_integrate_simple ( const TerraFloat3* throughput, const TerraShadingSurface* surface, const TerraFloat3* wo );
@@ -67,7 +154,9 @@ TerraFloat3 terra_integrate_direct (
     const TerraFloat3* ray_point,
     const TerraFloat3* wo,
     const TerraFloat3* throughput,
-    size_t bounce
+    size_t bounce,
+    TerraSamplerCounter* sampler,
+    TerraShadowRay* shadow_out
 );
 
 TerraFloat3 terra_integrate_direct_mis (
@@ -77,7 +166,20 @@ TerraFloat3 terra_integrate_direct_mis (
     const TerraFloat3* ray_point,
     const TerraFloat3* wo,
     const TerraFloat3* throughput,
-    size_t bounce
+    size_t bounce,
+    TerraSamplerCounter* sampler,
+    TerraShadowRay* shadow_out
+);
+
+bool terra_integrate_light_sample (
+    const TerraScene* scene,
+    const TerraObject* ray_object,
+    const TerraShadingSurface* ray_surface,
+    const TerraFloat3* ray_point,
+    const TerraFloat3* wo,
+    bool mis,
+    TerraSamplerCounter* sampler,
+    TerraShadowRay* shadow_out
 );
 
 TerraFloat3 terra_integrate_debug_mono ( size_t bounce );
@@ -89,10 +191,34 @@ TerraFloat3 terra_integrate_debug_mis_weight ( const TerraScene* scene,
                                                const TerraFloat3* ray_point,
                                                const TerraFloat3* wo,
                                                const TerraFloat3* throughput,
-                                               size_t bounce );
+                                               size_t bounce,
+                                               TerraSamplerCounter* sampler );
 
 float           terra_luminance ( const TerraFloat3* color );
 
+// active has a flag for each of the width x height pixels at x, y (row major), the others are skipped. NULL renders all of them.
+void            terra_render_megakernel ( const TerraCamera* camera, TerraScene* scene, const TerraFramebuffer* framebuffer, size_t x, size_t y,
+                                          size_t width, size_t height, size_t spp, const uint8_t* active );
+void            terra_render_wavefront  ( const TerraCamera* camera, TerraScene* scene, const TerraFramebuffer* framebuffer, size_t x, size_t y,
+                                          size_t width, size_t height, size_t spp, const uint8_t* active );
+// Standard error of the mean luminance of the pixel, FLT_MAX under 2 samples
+float           terra_pixel_error ( const TerraRawIntegrationResult* result, float* mean_out );
+// Flags the pixels whose relative error is still over TerraSceneOptions.adaptive_error, returns how many
+size_t          terra_render_adaptive_mask ( const TerraScene* scene, const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height,
+                                             uint8_t* active_out );
+// Adds the radiance and squared luminance accumulated over pixels (framebuffer indices) to the framebuffer and stores their tonemapped color
+void            terra_render_resolve    ( const TerraScene* scene, const TerraFramebuffer* framebuffer, const uint32_t* pixels, size_t pixels_count,
+                                          const TerraFloat3* acc, const float* acc_luminance2, size_t samples );
+// Reorders count queue entries by the octant of their ray direction, each entry starts with its TerraRay
+void            terra_render_sort_octants ( const void* states, size_t stride, size_t count, void* states_out );
+int             terra_ray_octant ( const TerraRay* ray );
+
+uint32_t        terra_hash32 ( uint32_t x );
+uint32_t        terra_reverse_bits32 ( uint32_t x );
+uint32_t        terra_owen_scramble ( uint32_t x, uint32_t seed );
+void            terra_blue_noise_splat ( float* energy, const float* kernel, int p, float sign );
+int             terra_blue_noise_find  ( const float* energy, const uint8_t* pattern, bool cluster );
+
 TerraRay        terra_ray ( const TerraFloat3* origin, const TerraFloat3* direction );
 
 TerraRay        terra_surface_ray  ( const TerraShadingSurface* surface, const TerraFloat3* point, const TerraFloat3* direction, float sign );
@@ -101,19 +227,30 @@ void            terra_surface_init ( TerraShadingSurface* surface, const TerraTr
 TerraFloat3     terra_camera_perspective_sample ( const TerraCamera* camera, const TerraFramebuffer* frame, size_t x, size_t y, float jitter, float r1, float r2 );
 TerraFloat4x4   terra_camera_to_world_frame  ( const TerraCamera* camera );
 
-TerraLight*     terra_scene_pick_light ( TerraScene* scene, float e, float* pdf );
+// Picks a light triangle with probability proportional to its estimated contribution to the surface at point.
+// Returns NULL if no light can reach it.
+TerraLight*     terra_scene_pick_light ( const TerraScene* scene, const TerraFloat3* point, const TerraFloat3* normal, float e, size_t* triangle_out, float* pdf );
+// Probability of terra_scene_pick_light picking the triangle of object, 0 if it's not sampled as a light
+float           terra_scene_light_pdf  ( const TerraScene* scene, const TerraFloat3* point, const TerraFloat3* normal, const TerraObject* object, size_t triangle );
 TerraObject*    terra_scene_raycast    ( TerraScene* scene, const TerraRay* ray, const TerraRayState* state, TerraShadingSurface* surface_out, TerraFloat3* intersection_point, size_t* triangle );
+void            terra_scene_raycast_packet ( TerraScene* scene, const TerraRay* rays, int rays_count, TerraSceneHit* hits_out );
+TerraObject*    terra_scene_hit_surface ( TerraScene* scene, const TerraPrimitiveRef* primitive, int instance, TerraFloat3* intersection_point, TerraShadingSurface* surface_out );
+bool            terra_scene_occluded   ( const TerraScene* scene, const TerraRay* ray, float t_max );
+void            terra_scene_log_accelerator_memory ( const TerraScene* scene );
+bool            terra_accelerator_is_wide ( TerraAccelerator accelerator );
+bool            terra_scene_refit_accelerator ( TerraScene* scene );
+void            terra_scene_destroy_accelerator ( TerraScene* scene );
+void            terra_scene_create_accelerator ( TerraScene* scene );
+bool            terra_scene_load_accelerator ( TerraScene* scene, const char* path, uint64_t hash );
+void            terra_scene_create_top_level ( TerraScene* scene );
+bool            terra_scene_object_instanced ( const TerraScene* scene, size_t object_idx );
 
-size_t          terra_light_pick_triangle   ( const TerraLight* light, float e, float* pdf );
 void            terra_light_sample_triangle ( const TerraLight* light, size_t triangle_idx, float e1, float e2, TerraFloat3* pos, TerraFloat2* uv, TerraFloat3* norm, float* pdf );
 
 float           terra_triangle_area          ( const TerraTriangle* triangle );
 TerraFloat3     terra_attribute_eval         ( const TerraAttribute* attribute, const void* uv, const TerraFloat3* xyz );
 TerraFloat3     terra_tonemapping_uncharted2 ( const TerraFloat3* x );
 
-// TODO remove this?
-#define _randf() (float)rand() / RAND_MAX
-
 //--------------------------------------------------------------------------------------------------
 // @TerraAPI
 //  _______                             _____ _____
@@ -132,8 +269,11 @@ HTerraScene terra_scene_create() {
     memset ( scene, 0, sizeof ( TerraScene ) );
     scene->objects = ( TerraObject* ) terra_malloc ( sizeof ( TerraObject ) * TERRA_SCENE_PREALLOCATED_OBJECTS );
     scene->objects_cap = TERRA_SCENE_PREALLOCATED_OBJECTS;
+    scene->objects_moved = ( bool* ) terra_malloc ( sizeof ( bool ) * TERRA_SCENE_PREALLOCATED_OBJECTS );
     scene->lights = ( TerraLight* ) terra_malloc ( sizeof ( TerraLight ) * TERRA_SCENE_PREALLOCATED_LIGHTS );
     scene->lights_cap = TERRA_SCENE_PREALLOCATED_LIGHTS;
+    scene->instances = ( TerraInstance* ) terra_malloc ( sizeof ( TerraInstance ) * TERRA_SCENE_PREALLOCATED_INSTANCES );
+    scene->instances_cap = TERRA_SCENE_PREALLOCATED_INSTANCES;
     return scene;
 }
 
@@ -141,7 +281,8 @@ TerraObject* terra_scene_add_object ( HTerraScene _scene, size_t triangles_count
     TerraScene* scene = ( TerraScene* ) _scene;
 
     if ( scene->objects_pop == scene->objects_cap ) {
-        scene->objects = ( TerraObject* ) terra_realloc ( scene->objects, scene->objects_cap * 2 );
+        scene->objects = ( TerraObject* ) terra_realloc ( scene->objects, sizeof ( TerraObject ) * scene->objects_cap * 2 );
+        scene->objects_moved = ( bool* ) terra_realloc ( scene->objects_moved, sizeof ( bool ) * scene->objects_cap * 2 );
         scene->objects_cap *= 2;
     }
 
@@ -149,6 +290,7 @@ TerraObject* terra_scene_add_object ( HTerraScene _scene, size_t triangles_count
     scene->objects[scene->objects_pop].triangles = ( TerraTriangle* ) terra_malloc ( sizeof ( TerraTriangle ) * triangles_count );
     scene->objects[scene->objects_pop].properties = ( TerraTriangleProperties* ) terra_malloc ( sizeof ( TerraTriangleProperties ) * triangles_count );
     scene->objects[scene->objects_pop].triangles_count = triangles_count;
+    scene->objects_moved[scene->objects_pop] = false;
     scene->dirty_objects = true;
     scene->dirty_lights = true;     // TODO
     return &scene->objects[scene->objects_pop++];
@@ -159,50 +301,166 @@ size_t terra_scene_count_objects ( HTerraScene _scene ) {
     return scene->objects_pop;
 }
 
+TerraObject* terra_scene_get_object ( HTerraScene _scene, size_t idx ) {
+    TerraScene* scene = ( TerraScene* ) _scene;
+    assert ( idx < scene->objects_pop );
+    return &scene->objects[idx];
+}
+
+void terra_scene_object_moved ( HTerraScene _scene, TerraObject* object ) {
+    TerraScene* scene = ( TerraScene* ) _scene;
+    assert ( object >= scene->objects && object < scene->objects + scene->objects_pop );
+    scene->objects_moved[object - scene->objects] = true;
+    scene->moved_objects = true;
+
+    // Triangle areas might have changed
+    TerraFloat2 uv = terra_f2_set ( 0.5, 0.5 );
+    TerraFloat3 emissive = terra_attribute_eval ( &object->material.emissive, &uv, NULL );
+
+    if ( !terra_f3_is_zero ( &emissive ) ) {
+        scene->dirty_lights = true;
+    }
+}
+
+size_t terra_scene_add_instance ( HTerraScene _scene, size_t object_idx, const TerraFloat4x4* transform ) {
+    TerraScene* scene = ( TerraScene* ) _scene;
+    assert ( object_idx < scene->objects_pop );
+
+    if ( scene->instances_pop == scene->instances_cap ) {
+        scene->instances = ( TerraInstance* ) terra_realloc ( scene->instances, sizeof ( TerraInstance ) * scene->instances_cap * 2 );
+        scene->instances_cap *= 2;
+    }
+
+    terra_instance_init ( &scene->instances[scene->instances_pop], ( uint32_t ) object_idx, transform );
+    ++scene->instances_active;
+    scene->dirty_instances = true;
+    scene->dirty_lights = true;     // The object might not be sampled as a light anymore
+    return scene->instances_pop++;
+}
+
+void terra_scene_move_instance ( HTerraScene _scene, size_t instance_idx, const TerraFloat4x4* transform ) {
+    TerraScene* scene = ( TerraScene* ) _scene;
+    assert ( instance_idx < scene->instances_pop && scene->instances[instance_idx].object_idx != UINT32_MAX );
+    terra_instance_init ( &scene->instances[instance_idx], scene->instances[instance_idx].object_idx, transform );
+    scene->dirty_instances = true;
+}
+
+void terra_scene_remove_instance ( HTerraScene _scene, size_t instance_idx ) {
+    TerraScene* scene = ( TerraScene* ) _scene;
+    assert ( instance_idx < scene->instances_pop && scene->instances[instance_idx].object_idx != UINT32_MAX );
+    scene->instances[instance_idx].object_idx = UINT32_MAX;
+    --scene->instances_active;
+    scene->dirty_instances = true;
+    scene->dirty_lights = true;
+}
+
 void terra_scene_commit ( HTerraScene _scene ) {
     // TODO: Transform objects' vertices into world space ?
     TerraScene* scene = ( TerraScene* ) _scene;
     // Check if it is necessary to rebuild the acceleration structure.
-    bool dirty_accelerator = scene->dirty_objects;
+    bool two_level = scene->instances_active > 0;
+    bool dirty_accelerator = scene->dirty_objects || two_level != scene->two_level;
+    bool dirty_top_level = scene->dirty_instances;
 
-    if ( scene->opts.accelerator != scene->new_opts.accelerator ) {
+    if ( scene->opts.accelerator != scene->new_opts.accelerator || scene->opts.bvh_builder != scene->new_opts.bvh_builder ) {
         dirty_accelerator = true;
     }
 
-    // Destroy previous acceleration structure, if necessary.
-    if ( dirty_accelerator ) {
-        if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
-            terra_bvh_destroy ( &scene->bvh );
+    // Moved geometry keeps the topology valid, refitting is enough unless the tree degraded too much.
+    // With instances only the bottom levels of the moved objects are refit, the top level is rebuilt over the new bounds.
+    if ( !dirty_accelerator && scene->moved_objects ) {
+        if ( scene->two_level ) {
+            terra_bvh_two_level_refit_bottom ( &scene->two_level_bvh, scene->objects, scene->objects_moved, scene->opts.bvh_builder,
+                                              &scene->new_opts.jobs );
+            dirty_top_level = true;
         } else {
-            assert ( false );
+            dirty_accelerator = !terra_scene_refit_accelerator ( scene );
         }
     }
 
+    // Destroy previous acceleration structure, if necessary.
+    if ( dirty_accelerator ) {
+        terra_scene_destroy_accelerator ( scene );
+    }
+
     // Commit the new options values, lose the old ones.
     scene->opts = scene->new_opts;
+    scene->two_level = two_level;
+
+    if ( scene->opts.sampling_method == kTerraSamplingMethodSobol && scene->blue_noise == NULL ) {
+        scene->blue_noise = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * TERRA_SAMPLER_BLUE_NOISE_SIZE * TERRA_SAMPLER_BLUE_NOISE_SIZE );
+        terra_sampler_blue_noise_create ( scene->blue_noise );
+    }
 
     // Rebuild the acceleration structure, if necessary.
-    if ( dirty_accelerator ) {
-        if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
-            terra_bvh_create ( &scene->bvh, scene->objects, ( int ) scene->objects_pop );
-        } else {
-            assert ( false );
+    if ( dirty_accelerator && two_level ) {
+        TerraAccelerator bottom_accelerator = scene->opts.accelerator == kTerraAcceleratorKDTree ? kTerraAcceleratorBVH : scene->opts.accelerator;
+        terra_bvh_two_level_create_bottom ( &scene->two_level_bvh, bottom_accelerator, scene->objects, ( int ) scene->objects_pop,
+                                            scene->opts.bvh_builder, &scene->opts.jobs );
+        dirty_top_level = true;
+    } else if ( dirty_accelerator ) {
+        char     cache_path[1024];
+        uint64_t cache_hash = 0;
+        bool     cached = false;
+
+        // The cache only stores BVHs. Moved geometry is being edited, its trees would only pile up on disk.
+        if ( scene->opts.accelerator_cache_dir != NULL && scene->opts.accelerator != kTerraAcceleratorKDTree && !scene->moved_objects ) {
+            cache_hash = terra_bvh_cache_hash ( scene->objects, ( int ) scene->objects_pop, scene->opts.accelerator, scene->opts.bvh_builder );
+            cached = terra_bvh_cache_path ( scene->opts.accelerator_cache_dir, cache_hash, cache_path, sizeof ( cache_path ) );
+        }
+
+        if ( !cached || !terra_scene_load_accelerator ( scene, cache_path, cache_hash ) ) {
+            terra_scene_create_accelerator ( scene );
+
+            if ( cached ) {
+                const TerraBVHWide* bvh_wide = terra_accelerator_is_wide ( scene->opts.accelerator ) ? &scene->bvh_wide : NULL;
+
+                if ( !terra_bvh_cache_save ( cache_path, cache_hash, bvh_wide == NULL ? &scene->bvh : NULL, bvh_wide ) ) {
+                    terra_log ( "Failed to write accelerator cache %s\n", cache_path );
+                }
+            }
         }
+
+        terra_scene_log_accelerator_memory ( scene );
+    }
+
+    if ( two_level && dirty_top_level ) {
+        terra_scene_create_top_level ( scene );
     }
 
     // lights
     if ( scene->dirty_lights ) {
+        for ( size_t i = 0; i < scene->lights_pop; ++i ) {
+            terra_free ( scene->lights[i].triangle_area );
+        }
+
+        terra_light_bvh_destroy ( &scene->light_bvh );
+        terra_free ( scene->object_lights );
+        scene->object_lights = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * terra_maxi ( scene->objects_pop, 1 ) );
         scene->lights_pop = 0;
+        scene->lights_triangles_count = 0;
         scene->total_light_power = terra_f3_zero;
 
         for ( size_t i = 0; i < scene->objects_pop; ++i ) {
             TerraFloat2 uv = terra_f2_set ( 0.5, 0.5 );
             TerraFloat3 emissive = terra_attribute_eval ( &scene->objects[i].material.emissive, &uv, NULL );
+            scene->object_lights[i] = UINT32_MAX;
 
             if ( terra_f3_is_zero ( &emissive ) ) {
                 continue;
             }
 
+            // Lights are sampled in object space, which only matches the world for objects placed as they are
+            if ( two_level && terra_scene_object_instanced ( scene, i ) ) {
+                terra_log ( "Emissive object %zu is instanced, it is only reached by BSDF sampling\n", i );
+                continue;
+            }
+
+            if ( scene->lights_pop == scene->lights_cap ) {
+                scene->lights = ( TerraLight* ) terra_realloc ( scene->lights, sizeof ( TerraLight ) * scene->lights_cap * 2 );
+                scene->lights_cap *= 2;
+            }
+
             size_t idx = scene->lights_pop;
             float area = 0;
             scene->lights[idx].triangle_area = terra_malloc ( sizeof ( float ) * scene->objects[i].triangles_count );
@@ -216,36 +474,62 @@ void terra_scene_commit ( HTerraScene _scene ) {
 
             TerraFloat3 power = terra_mulf3 ( &emissive, area * terra_PI );
             scene->total_light_power = terra_addf3 ( &scene->total_light_power, &power );
-
-            if ( scene->lights_pop == scene->lights_cap ) {
-                scene->lights = ( TerraLight* ) terra_realloc ( scene->lights, scene->lights_cap * 2 );
-                scene->lights_cap *= 2;
-            }
-
             scene->lights[idx].object = &scene->objects[i];
             scene->lights[idx].area = area;
             scene->lights[idx].power = power;
+            scene->lights[idx].triangles_offset = ( uint32_t ) scene->lights_triangles_count;
+            scene->object_lights[i] = ( uint32_t ) idx;
             scene->lights_triangles_count += scene->objects[i].triangles_count;
             ++scene->lights_pop;
         }
+
+        // Every triangle of a light gets its share of the light power
+        TerraLightTriangle* triangles = ( TerraLightTriangle* ) terra_malloc ( sizeof ( TerraLightTriangle ) * terra_maxi ( scene->lights_triangles_count, 1 ) );
+        TerraLightBounds* bounds = ( TerraLightBounds* ) terra_malloc ( sizeof ( TerraLightBounds ) * terra_maxi ( scene->lights_triangles_count, 1 ) );
+
+        for ( size_t i = 0; i < scene->lights_pop; ++i ) {
+            const TerraLight* light = &scene->lights[i];
+            float power = light->area > 0 ? terra_luminance ( &light->power ) / light->area : 0;
+
+            for ( size_t j = 0; j < light->object->triangles_count; ++j ) {
+                size_t k = light->triangles_offset + j;
+                triangles[k].light = ( uint32_t ) i;
+                triangles[k].triangle = ( uint32_t ) j;
+                terra_light_bounds_triangle ( &bounds[k], &light->object->triangles[j], &light->object->properties[j], power * light->triangle_area[j] );
+            }
+        }
+
+        terra_light_bvh_create ( &scene->light_bvh, triangles, bounds, ( int ) scene->lights_triangles_count );
+        terra_free ( triangles );
+        terra_free ( bounds );
     }
 
     // Clear the scene dirty flags.
+    if ( scene->moved_objects ) {
+        memset ( scene->objects_moved, 0, sizeof ( bool ) * scene->objects_pop );
+    }
+
     scene->dirty_objects = false;
     scene->dirty_lights = false;
+    scene->moved_objects = false;
+    scene->dirty_instances = false;
 }
 
 void terra_scene_clear ( HTerraScene _scene ) {
     TerraScene* scene = ( TerraScene* ) _scene;
     // TODO also free memory?
     scene->objects_pop = 0;
+    scene->instances_pop = 0;
+    scene->instances_active = 0;
 
     for ( size_t i = 0; i < scene->lights_pop; ++i ) {
         terra_free ( scene->lights[i].triangle_area );
     }
 
+    terra_light_bvh_destroy ( &scene->light_bvh );
     scene->lights_pop = 0;
     scene->dirty_objects = true;
+    scene->dirty_lights = true;
 }
 
 TerraSceneOptions* terra_scene_get_options ( HTerraScene _scene ) {
@@ -267,15 +551,20 @@ void terra_scene_destroy ( HTerraScene _scene ) {
         terra_free ( scene->objects[i].properties );
     }
 
+    for ( size_t i = 0; i < scene->lights_pop; ++i ) {
+        terra_free ( scene->lights[i].triangle_area );
+    }
+
     terra_free ( scene->objects );
+    terra_free ( scene->objects_moved );
     terra_free ( scene->lights );
+    terra_free ( scene->object_lights );
+    terra_light_bvh_destroy ( &scene->light_bvh );
+    terra_free ( scene->instances );
+    terra_free ( scene->blue_noise );
 
     // Free acceleration structure
-    if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
-        terra_bvh_destroy ( &scene->bvh );
-    } else {
-        assert ( false );
-    }
+    terra_scene_destroy_accelerator ( scene );
 
     // Free scene
     terra_free ( scene );
@@ -319,6 +608,7 @@ bool terra_framebuffer_create ( TerraFramebuffer* framebuffer, size_t width, siz
     for ( size_t i = 0; i < width * height; ++i ) {
         framebuffer->pixels[i] = terra_f3_zero;
         framebuffer->results[i].acc = terra_f3_zero;
+        framebuffer->results[i].acc_luminance2 = 0.f;
         framebuffer->results[i].samples = 0;
     }
 
@@ -330,11 +620,49 @@ void terra_framebuffer_clear ( TerraFramebuffer* framebuffer ) {
         for ( size_t j = 0; j < framebuffer->width; ++j ) {
             framebuffer->pixels[i * framebuffer->width + j] = terra_f3_zero;
             framebuffer->results[i * framebuffer->width + j].acc = terra_f3_zero;
+            framebuffer->results[i * framebuffer->width + j].acc_luminance2 = 0.f;
             framebuffer->results[i * framebuffer->width + j].samples = 0;
         }
     }
 }
 
+float terra_framebuffer_error ( const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height ) {
+    float error2 = 0.f;
+    float luminance = 0.f;
+
+    for ( size_t i = y; i < y + height; ++i ) {
+        for ( size_t j = x; j < x + width; ++j ) {
+            const TerraRawIntegrationResult* result = &framebuffer->results[i * framebuffer->width + j];
+
+            // A few samples can all miss the light paths a pixel will eventually find
+            if ( result->samples < TERRA_ADAPTIVE_MIN_SAMPLES ) {
+                return FLT_MAX;
+            }
+
+            float mean;
+            float error = terra_pixel_error ( result, &mean );
+
+            error2 += error * error;
+            luminance += mean;
+        }
+    }
+
+    return sqrtf ( error2 / ( width * height ) ) / terra_maxf ( luminance / ( width * height ), TERRA_ADAPTIVE_MIN_LUMINANCE );
+}
+
+// The variance is estimated from the first and second moments of the samples luminance
+float terra_pixel_error ( const TerraRawIntegrationResult* result, float* mean_out ) {
+    if ( result->samples < 2 ) {
+        return FLT_MAX;
+    }
+
+    float n = ( float ) result->samples;
+    float mean = terra_luminance ( &result->acc ) / n;
+    float variance = terra_maxf ( result->acc_luminance2 / n - mean * mean, 0.f ) * n / ( n - 1 );
+    *mean_out = mean;
+    return sqrtf ( variance / n );
+}
+
 void terra_framebuffer_destroy ( TerraFramebuffer* framebuffer ) {
     if ( framebuffer == NULL ) {
         return;
@@ -512,7 +840,6 @@ void terra_texture_finalize ( void* _texture ) {
 void terra_render ( const TerraCamera* camera, HTerraScene _scene, const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height ) {
     TerraScene* scene = ( TerraScene* ) _scene;
     TerraClockTime t = TERRA_CLOCK();
-    TerraFloat4x4 camera_rotation = terra_camera_to_world_frame ( camera );
     size_t spp = scene->opts.samples_per_pixel;
     size_t samples_per_strata = 0;
 
@@ -526,112 +853,394 @@ void terra_render ( const TerraCamera* camera, HTerraScene _scene, const TerraFr
         spp = cur;
     }
 
-    TerraSamplerRandom random_sampler;
-    terra_sampler_random_init ( &random_sampler );
+    // Adaptive renders go in passes, the pixels that have converged are left out of the next ones
+    uint8_t* active = NULL;
+    size_t pass_samples = spp;
 
-    for ( size_t i = y; i < y + height; ++i ) {
-        for ( size_t j = x; j < x + width; ++j ) {
-            // Init sampler
-            TerraSampler2D hemisphere_sampler;
-            hemisphere_sampler.sampler = NULL;
-            TerraSamplerStratified stratified_sampler;
-            TerraSamplerHalton halton_sampler;
-
-            if ( scene->opts.sampling_method == kTerraSamplingMethodStratified ) {
-                hemisphere_sampler.sampler = &stratified_sampler;
-                hemisphere_sampler.sample = terra_sampler_stratified_next_pair;
-                terra_sampler_stratified_init ( &stratified_sampler, &random_sampler, ( int ) scene->opts.strata, 16 );
-            } else if ( scene->opts.sampling_method == kTerraSamplingMethodHalton ) {
-                hemisphere_sampler.sampler = &halton_sampler;
-                hemisphere_sampler.sample = terra_sampler_halton_next_pair;
-                terra_sampler_halton_init ( &halton_sampler );
+    if ( scene->opts.adaptive_error > 0.f ) {
+        active = ( uint8_t* ) terra_malloc ( width * height );
+        pass_samples = TERRA_ADAPTIVE_PASS_SAMPLES;
+    }
+
+    for ( size_t s = 0; s < spp; s += pass_samples ) {
+        size_t samples = spp - s < pass_samples ? spp - s : pass_samples;
+
+        if ( active != NULL && terra_render_adaptive_mask ( scene, framebuffer, x, y, width, height, active ) == 0 ) {
+            break;
+        }
+
+        if ( scene->opts.path_tracer == kTerraPathTracerWavefront ) {
+            terra_render_wavefront ( camera, scene, framebuffer, x, y, width, height, samples, active );
+        } else {
+            terra_render_megakernel ( camera, scene, framebuffer, x, y, width, height, samples, active );
+        }
+    }
+
+    terra_free ( active );
+    TERRA_PROFILE_ADD_SAMPLE ( time, TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RENDER, TERRA_CLOCK() - t );
+}
+
+size_t terra_render_adaptive_mask ( const TerraScene* scene, const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height,
+                                    uint8_t* active_out ) {
+    size_t active_count = 0;
+
+    for ( size_t i = 0; i < height; ++i ) {
+        for ( size_t j = 0; j < width; ++j ) {
+            const TerraRawIntegrationResult* result = &framebuffer->results[( y + i ) * framebuffer->width + x + j];
+            bool active = true;
+
+            if ( result->samples >= TERRA_ADAPTIVE_MIN_SAMPLES ) {
+                float mean;
+                float error = terra_pixel_error ( result, &mean );
+                active = error > scene->opts.adaptive_error * terra_maxf ( mean, TERRA_ADAPTIVE_MIN_LUMINANCE );
             }
 
-            // Integrate
-            TerraFloat3 acc = terra_f3_zero;
+            active_out[i * width + j] = active;
+            active_count += active;
+        }
+    }
 
-            for ( size_t s = 0; s < spp; ++s ) {
-                // Sample random jitter
-                float r1 = terra_sampler_random_next ( &random_sampler );
-                float r2 = terra_sampler_random_next ( &random_sampler );
-                // Build camera ray
-                TerraFloat3 ray_dir = terra_camera_perspective_sample ( camera, framebuffer, j, i, scene->opts.subpixel_jitter, r1, r2 );
-                ray_dir = terra_transformf3 ( &camera_rotation, &ray_dir );
-                TerraRay ray = terra_ray ( &camera->position, &ray_dir );
-                // Trace
-                TerraClockTime t = TERRA_CLOCK();
-                TerraFloat3 dL = terra_trace ( scene, &ray );
-                TERRA_PROFILE_ADD_SAMPLE ( time, TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_TRACE, TERRA_CLOCK() - t );
-                // Accumulate radiance
-                acc = terra_addf3 ( &acc, &dL );
+    return active_count;
+}
+
+// Camera rays are cast a block at a time as a packet, each path is then traced to its end before the next one.
+void terra_render_megakernel ( const TerraCamera* camera, TerraScene* scene, const TerraFramebuffer* framebuffer, size_t x, size_t y,
+                               size_t width, size_t height, size_t spp, const uint8_t* active ) {
+    TerraFloat4x4 camera_rotation = terra_camera_to_world_frame ( camera );
+    const uint32_t* blue_noise = scene->opts.sampling_method == kTerraSamplingMethodSobol ? scene->blue_noise : NULL;
+
+    assert ( TERRA_RENDER_PACKET_SIZE * TERRA_RENDER_PACKET_SIZE <= TERRA_BVH_PACKET_MAX_RAYS );
+
+    for ( size_t block_y = y; block_y < y + height; block_y += TERRA_RENDER_PACKET_SIZE ) {
+        for ( size_t block_x = x; block_x < x + width; block_x += TERRA_RENDER_PACKET_SIZE ) {
+            size_t block_end_x = block_x + TERRA_RENDER_PACKET_SIZE < x + width ? block_x + TERRA_RENDER_PACKET_SIZE : x + width;
+            size_t block_end_y = block_y + TERRA_RENDER_PACKET_SIZE < y + height ? block_y + TERRA_RENDER_PACKET_SIZE : y + height;
+            uint32_t pixels[TERRA_RENDER_PACKET_SIZE * TERRA_RENDER_PACKET_SIZE];
+            TerraRay rays[TERRA_RENDER_PACKET_SIZE * TERRA_RENDER_PACKET_SIZE];
+            TerraSceneHit hits[TERRA_RENDER_PACKET_SIZE * TERRA_RENDER_PACKET_SIZE];
+            TerraSamplerCounter samplers[TERRA_RENDER_PACKET_SIZE * TERRA_RENDER_PACKET_SIZE];
+            TerraFloat3 acc[TERRA_RENDER_PACKET_SIZE * TERRA_RENDER_PACKET_SIZE];
+            float acc_luminance2[TERRA_RENDER_PACKET_SIZE * TERRA_RENDER_PACKET_SIZE];
+            int rays_count = 0;
+
+            for ( size_t i = block_y; i < block_end_y; ++i ) {
+                for ( size_t j = block_x; j < block_end_x; ++j ) {
+                    if ( active == NULL || active[( i - y ) * width + j - x] ) {
+                        acc[rays_count] = terra_f3_zero;
+                        acc_luminance2[rays_count] = 0.f;
+                        pixels[rays_count++] = ( uint32_t ) ( i * framebuffer->width + j );
+                    }
+                }
+            }
+
+            if ( rays_count == 0 ) {
+                continue;
             }
 
-            // Accumulate with previous integrations
-            TerraRawIntegrationResult* partial = &framebuffer->results[i * framebuffer->width + j];
-            partial->acc = terra_addf3 ( &acc, &partial->acc );
-            partial->samples += spp;
-            // Manual exposure
-            TerraFloat3 color = terra_divf3 ( &partial->acc, ( float ) partial->samples );
-            color = terra_mulf3 ( &color, scene->opts.manual_exposure );
-
-            // Tonemapping
-            switch ( scene->opts.tonemapping_operator ) {
-                // TODO: Should exposure be 2^exposure as with f-stops ?
-                // Gamma correction
-                case kTerraTonemappingOperatorLinear: {
-                    color = terra_powf3 ( &color, 1.f / scene->opts.gamma );
-                    break;
+            // Integrate
+            for ( size_t s = 0; s < spp; ++s ) {
+                for ( int k = 0; k < rays_count; ++k ) {
+                    size_t i = pixels[k] / framebuffer->width;
+                    size_t j = pixels[k] % framebuffer->width;
+                    terra_sampler_counter_init ( &samplers[k], blue_noise, j, i, framebuffer->width, ( uint32_t ) ( framebuffer->results[pixels[k]].samples + s ) );
+                    // Sample random jitter
+                    float r1 = terra_sampler_counter_next ( &samplers[k] );
+                    float r2 = terra_sampler_counter_next ( &samplers[k] );
+                    // Build camera ray
+                    TerraFloat3 ray_dir = terra_camera_perspective_sample ( camera, framebuffer, j, i, scene->opts.subpixel_jitter, r1, r2 );
+                    ray_dir = terra_transformf3 ( &camera_rotation, &ray_dir );
+                    rays[k] = terra_ray ( &camera->position, &ray_dir );
                 }
 
-                // Simple version, local operator w/o white balancing
-                case kTerraTonemappingOperatorReinhard: {
-                    // TODO: same as inv_dir invf3
-                    color.x = color.x / ( 1.f + color.x );
-                    color.y = color.y / ( 1.f + color.y );
-                    color.z = color.z / ( 1.f + color.z );
-                    color = terra_powf3 ( &color, 1.f / scene->opts.gamma );
-                    break;
+                // Camera rays are cast together, the paths then continue one at a time
+                terra_scene_raycast_packet ( scene, rays, rays_count, hits );
+
+                for ( int k = 0; k < rays_count; ++k ) {
+                    TerraClockTime t = TERRA_CLOCK();
+                    TerraFloat3 dL = terra_trace ( scene, &rays[k], &hits[k], &samplers[k] );
+                    TERRA_PROFILE_ADD_SAMPLE ( time, TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_TRACE, TERRA_CLOCK() - t );
+                    // Accumulate radiance
+                    float luminance = terra_luminance ( &dL );
+                    acc[k] = terra_addf3 ( &acc[k], &dL );
+                    acc_luminance2[k] += luminance * luminance;
                 }
+            }
+
+            terra_render_resolve ( scene, framebuffer, pixels, rays_count, acc, acc_luminance2, spp );
+        }
+    }
+}
 
-                // Approx
-                case kTerraTonemappingOperatorFilmic: {
-                    TerraFloat3 x;
-                    x.x = terra_maxf ( 0.f, color.x - 0.004f );
-                    x.y = terra_maxf ( 0.f, color.y - 0.004f );
-                    x.z = terra_maxf ( 0.f, color.z - 0.004f );
-                    color.x = ( x.x * ( 6.2f * x.x + 0.5f ) ) / ( x.x * ( 6.2f * x.x + 1.7f ) + 0.06f );
-                    color.y = ( x.y * ( 6.2f * x.y + 0.5f ) ) / ( x.y * ( 6.2f * x.y + 1.7f ) + 0.06f );
-                    color.x = ( x.z * ( 6.2f * x.z + 0.5f ) ) / ( x.z * ( 6.2f * x.z + 1.7f ) + 0.06f );
-                    // Gamma 2.2 included
-                    break;
+// Paths are queued and advanced a stage at a time, the whole queue is extended (closest hit) before it is shaded.
+// Shading queues the light sample of each path for a single pass of shadow rays, the paths that go on are sorted by
+// the octant of their next direction. Camera rays are generated in blocks as for the megakernel and cast as packets.
+void terra_render_wavefront ( const TerraCamera* camera, TerraScene* scene, const TerraFramebuffer* framebuffer, size_t x, size_t y,
+                              size_t width, size_t height, size_t spp, const uint8_t* active ) {
+    TerraFloat4x4 camera_rotation = terra_camera_to_world_frame ( camera );
+    const uint32_t* blue_noise = scene->opts.sampling_method == kTerraSamplingMethodSobol ? scene->blue_noise : NULL;
+    TerraFloat3* acc = ( TerraFloat3* ) terra_malloc ( sizeof ( TerraFloat3 ) * width * height );
+    float* acc_luminance2 = ( float* ) terra_malloc ( sizeof ( float ) * width * height );
+    uint32_t* pixels = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * width * height );
+    size_t pixels_count = 0;
+
+    // Active pixels (framebuffer indices) in the order their paths are generated, TERRA_RENDER_PACKET_SIZE^2 blocks at a time
+    for ( size_t block_y = y; block_y < y + height; block_y += TERRA_RENDER_PACKET_SIZE ) {
+        for ( size_t block_x = x; block_x < x + width; block_x += TERRA_RENDER_PACKET_SIZE ) {
+            size_t block_end_x = block_x + TERRA_RENDER_PACKET_SIZE < x + width ? block_x + TERRA_RENDER_PACKET_SIZE : x + width;
+            size_t block_end_y = block_y + TERRA_RENDER_PACKET_SIZE < y + height ? block_y + TERRA_RENDER_PACKET_SIZE : y + height;
+
+            for ( size_t i = block_y; i < block_end_y; ++i ) {
+                for ( size_t j = block_x; j < block_end_x; ++j ) {
+                    if ( active == NULL || active[( i - y ) * width + j - x] ) {
+                        acc[pixels_count] = terra_f3_zero;
+                        acc_luminance2[pixels_count] = 0.f;
+                        pixels[pixels_count++] = ( uint32_t ) ( i * framebuffer->width + j );
+                    }
                 }
+            }
+        }
+    }
+
+    // Radiance of each camera sample of the batch, kept apart until the path ends for the second moment of the pixel
+    size_t paths_count = pixels_count * spp;
+    size_t queue_cap = paths_count < TERRA_WAVEFRONT_PATHS ? paths_count : TERRA_WAVEFRONT_PATHS;
+    TerraFloat3* radiance = ( TerraFloat3* ) terra_malloc ( sizeof ( TerraFloat3 ) * queue_cap );
+    TerraPathState* paths = ( TerraPathState* ) terra_malloc ( sizeof ( TerraPathState ) * queue_cap );
+    TerraPathState* paths_next = ( TerraPathState* ) terra_malloc ( sizeof ( TerraPathState ) * queue_cap );
+    TerraShadowState* shadows = ( TerraShadowState* ) terra_malloc ( sizeof ( TerraShadowState ) * queue_cap );
+    TerraShadowState* shadows_sorted = ( TerraShadowState* ) terra_malloc ( sizeof ( TerraShadowState ) * queue_cap );
+
+
+    for ( size_t batch = 0; batch < paths_count; batch += queue_cap ) {
+        size_t paths_pop = 0;
+
+        // Generate camera rays
+        for ( size_t p = batch; p < batch + queue_cap && p < paths_count; ++p ) {
+            uint32_t pixel = pixels[p % pixels_count];
+            size_t i = pixel / framebuffer->width;
+            size_t j = pixel % framebuffer->width;
+            TerraPathState* path = &paths[paths_pop++];
+            terra_sampler_counter_init ( &path->sampler, blue_noise, j, i, framebuffer->width, ( uint32_t ) ( framebuffer->results[pixel].samples + p / pixels_count ) );
+            float r1 = terra_sampler_counter_next ( &path->sampler );
+            float r2 = terra_sampler_counter_next ( &path->sampler );
+            TerraFloat3 ray_dir = terra_camera_perspective_sample ( camera, framebuffer, j, i, scene->opts.subpixel_jitter, r1, r2 );
+            ray_dir = terra_transformf3 ( &camera_rotation, &ray_dir );
+            path->ray = terra_ray ( &camera->position, &ray_dir );
+            path->throughput = terra_f3_one;
+            path->sample = ( uint32_t ) ( p - batch );
+            path->bounce = 0;
+            radiance[p - batch] = terra_f3_zero;
+        }
 
-                case kTerraTonemappingOperatorUncharted2: {
-                    // TODO: Should white be tweaked ?
-                    // This is the white point in linear space
-                    const TerraFloat3 linear_white = terra_f3_set1 ( 11.2f );
-                    TerraFloat3 white_scale = terra_tonemapping_uncharted2 ( &linear_white );
-                    white_scale.x = 1.f / white_scale.x;
-                    white_scale.y = 1.f / white_scale.y;
-                    white_scale.z = 1.f / white_scale.z;
-                    const float exposure_bias = 2.f;
-                    TerraFloat3 t = terra_mulf3 ( &color, exposure_bias );
-                    t = terra_tonemapping_uncharted2 ( &t );
-                    color = terra_pointf3 ( &t, &white_scale );
-                    color = terra_powf3 ( &color, 1.f / scene->opts.gamma );
-                    break;
+        // Every path in the queue is at the same bounce
+        while ( paths_pop > 0 ) {
+            size_t survivors_pop = 0;
+            size_t shadows_pop = 0;
+
+            for ( size_t first = 0; first < paths_pop; first += TERRA_BVH_PACKET_MAX_RAYS ) {
+                int rays_count = ( int ) ( paths_pop - first < TERRA_BVH_PACKET_MAX_RAYS ? paths_pop - first : TERRA_BVH_PACKET_MAX_RAYS );
+                TerraSceneHit hits[TERRA_BVH_PACKET_MAX_RAYS];
+
+                // Extend
+                if ( paths[first].bounce == 0 ) {
+                    TerraRay rays[TERRA_BVH_PACKET_MAX_RAYS];
+
+                    for ( int k = 0; k < rays_count; ++k ) {
+                        rays[k] = paths[first + k].ray;
+                    }
+
+                    terra_scene_raycast_packet ( scene, rays, rays_count, hits );
+                } else {
+                    for ( int k = 0; k < rays_count; ++k ) {
+                        TerraRayState ray_state;
+                        terra_ray_state_init ( &paths[first + k].ray, &ray_state );
+                        hits[k].object = terra_scene_raycast ( scene, &paths[first + k].ray, &ray_state, &hits[k].surface, &hits[k].point, NULL );
+                    }
                 }
 
-                default:
-                    break;
+                // Shade, the paths that go on are compacted into paths_next
+                for ( int k = 0; k < rays_count; ++k ) {
+                    TerraPathState* path = &paths[first + k];
+                    const TerraSceneHit* hit = &hits[k];
+
+                    if ( hit->object == NULL ) {
+                        continue;
+                    }
+
+                    TerraFloat3 wo = terra_negf3 ( &path->ray.direction );
+                    TerraShadowRay shadow;
+                    TerraFloat3 dL = terra_integrate ( scene, &path->ray, hit->object, &hit->surface, &hit->point, &wo, &path->throughput, path->bounce, &path->sampler, &shadow );
+                    radiance[path->sample] = terra_addf3 ( &radiance[path->sample], &dL );
+
+                    if ( shadow.t_max > 0 ) {
+                        shadows[shadows_pop].shadow = shadow;
+                        shadows[shadows_pop].sample = path->sample;
+                        ++shadows_pop;
+                    }
+
+                    if ( path->bounce == scene->opts.bounces ) {
+                        continue;
+                    }
+
+                    // Continue path
+                    TerraFloat3 wi;
+                    float pdf;
+                    {
+                        float e0 = terra_sampler_counter_next ( &path->sampler );
+                        float e1 = terra_sampler_counter_next ( &path->sampler );
+                        float e2 = terra_sampler_counter_next ( &path->sampler );
+                        wi = hit->object->material.bsdf.sample ( &hit->surface, e0, e1, e2, &wo );
+                        pdf = terra_maxf ( hit->object->material.bsdf.pdf ( &hit->surface, &wi, &wo ), terra_Epsilon );
+                    }
+                    // Update throughput
+                    TerraFloat3 f_brdf = hit->object->material.bsdf.eval ( &hit->surface, &wi, &wo );
+                    f_brdf = terra_mulf3 ( &f_brdf, 1.f / pdf );
+                    TerraFloat3 throughput = terra_pointf3 ( &path->throughput, &f_brdf );
+                    float NoL = terra_dotf3 ( &hit->surface.normal, &wi );
+                    throughput = terra_mulf3 ( &throughput, NoL );
+                    // Russian roulette
+                    {
+                        float p = terra_maxf ( throughput.x, terra_maxf ( throughput.y, throughput.z ) );
+                        float e3 = terra_sampler_counter_next ( &path->sampler );
+
+                        if ( e3 > p ) {
+                            continue;
+                        }
+
+                        throughput = terra_mulf3 ( &throughput, 1.f / ( p + terra_Epsilon ) );
+                    }
+                    TerraPathState* next = &paths_next[survivors_pop++];
+                    next->ray = terra_surface_ray ( &hit->surface, &hit->point, &wi, 1.f );
+                    next->throughput = throughput;
+                    next->sample = path->sample;
+                    next->bounce = path->bounce + 1;
+                    next->sampler = path->sampler;
+                }
             }
 
-            // Store the final color value on the framebuffer
-            framebuffer->pixels[i * framebuffer->width + j] = color;
+            // Shadow
+            terra_render_sort_octants ( shadows, sizeof ( TerraShadowState ), shadows_pop, shadows_sorted );
+
+            for ( size_t k = 0; k < shadows_pop; ++k ) {
+                const TerraShadowState* state = &shadows_sorted[k];
+
+                if ( !terra_scene_occluded ( scene, &state->shadow.ray, state->shadow.t_max ) ) {
+                    radiance[state->sample] = terra_addf3 ( &radiance[state->sample], &state->shadow.radiance );
+                }
+            }
+
+            // The survivors are extended in direction order
+            terra_render_sort_octants ( paths_next, sizeof ( TerraPathState ), survivors_pop, paths );
+            paths_pop = survivors_pop;
+        }
+
+        for ( size_t p = batch; p < batch + queue_cap && p < paths_count; ++p ) {
+            size_t k = p % pixels_count;
+            float luminance = terra_luminance ( &radiance[p - batch] );
+            acc[k] = terra_addf3 ( &acc[k], &radiance[p - batch] );
+            acc_luminance2[k] += luminance * luminance;
         }
     }
 
-    TERRA_PROFILE_ADD_SAMPLE ( time, TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RENDER, TERRA_CLOCK() - t );
+    terra_render_resolve ( scene, framebuffer, pixels, pixels_count, acc, acc_luminance2, spp );
+    terra_free ( shadows_sorted );
+    terra_free ( shadows );
+    terra_free ( paths_next );
+    terra_free ( paths );
+    terra_free ( radiance );
+    terra_free ( pixels );
+    terra_free ( acc_luminance2 );
+    terra_free ( acc );
+}
+
+// Counting sort over the 8 octants, stable
+void terra_render_sort_octants ( const void* states, size_t stride, size_t count, void* states_out ) {
+    size_t offsets[8] = { 0 };
+
+    for ( size_t i = 0; i < count; ++i ) {
+        ++offsets[terra_ray_octant ( ( const TerraRay* ) ( ( const uint8_t* ) states + i * stride ) )];
+    }
+
+    for ( size_t o = 0, sum = 0; o < 8; ++o ) {
+        size_t octant_count = offsets[o];
+        offsets[o] = sum;
+        sum += octant_count;
+    }
+
+    for ( size_t i = 0; i < count; ++i ) {
+        const uint8_t* state = ( const uint8_t* ) states + i * stride;
+        int octant = terra_ray_octant ( ( const TerraRay* ) state );
+        memcpy ( ( uint8_t* ) states_out + offsets[octant]++ * stride, state, stride );
+    }
+}
+
+void terra_render_resolve ( const TerraScene* scene, const TerraFramebuffer* framebuffer, const uint32_t* pixels, size_t pixels_count,
+                            const TerraFloat3* acc, const float* acc_luminance2, size_t samples ) {
+    for ( size_t k = 0; k < pixels_count; ++k ) {
+        // Accumulate with previous integrations
+        TerraRawIntegrationResult* partial = &framebuffer->results[pixels[k]];
+        partial->acc = terra_addf3 ( &acc[k], &partial->acc );
+        partial->acc_luminance2 += acc_luminance2[k];
+        partial->samples += ( int ) samples;
+        // Manual exposure
+        TerraFloat3 color = terra_divf3 ( &partial->acc, ( float ) partial->samples );
+        color = terra_mulf3 ( &color, scene->opts.manual_exposure );
+
+        // Tonemapping
+        switch ( scene->opts.tonemapping_operator ) {
+            // TODO: Should exposure be 2^exposure as with f-stops ?
+            // Gamma correction
+            case kTerraTonemappingOperatorLinear: {
+                color = terra_powf3 ( &color, 1.f / scene->opts.gamma );
+                break;
+            }
+
+            // Simple version, local operator w/o white balancing
+            case kTerraTonemappingOperatorReinhard: {
+                // TODO: same as inv_dir invf3
+                color.x = color.x / ( 1.f + color.x );
+                color.y = color.y / ( 1.f + color.y );
+                color.z = color.z / ( 1.f + color.z );
+                color = terra_powf3 ( &color, 1.f / scene->opts.gamma );
+                break;
+            }
+
+            // Approx
+            case kTerraTonemappingOperatorFilmic: {
+                TerraFloat3 x;
+                x.x = terra_maxf ( 0.f, color.x - 0.004f );
+                x.y = terra_maxf ( 0.f, color.y - 0.004f );
+                x.z = terra_maxf ( 0.f, color.z - 0.004f );
+                color.x = ( x.x * ( 6.2f * x.x + 0.5f ) ) / ( x.x * ( 6.2f * x.x + 1.7f ) + 0.06f );
+                color.y = ( x.y * ( 6.2f * x.y + 0.5f ) ) / ( x.y * ( 6.2f * x.y + 1.7f ) + 0.06f );
+                color.x = ( x.z * ( 6.2f * x.z + 0.5f ) ) / ( x.z * ( 6.2f * x.z + 1.7f ) + 0.06f );
+                // Gamma 2.2 included
+                break;
+            }
+
+            case kTerraTonemappingOperatorUncharted2: {
+                // TODO: Should white be tweaked ?
+                // This is the white point in linear space
+                const TerraFloat3 linear_white = terra_f3_set1 ( 11.2f );
+                TerraFloat3 white_scale = terra_tonemapping_uncharted2 ( &linear_white );
+                white_scale.x = 1.f / white_scale.x;
+                white_scale.y = 1.f / white_scale.y;
+                white_scale.z = 1.f / white_scale.z;
+                const float exposure_bias = 2.f;
+                TerraFloat3 t = terra_mulf3 ( &color, exposure_bias );
+                t = terra_tonemapping_uncharted2 ( &t );
+                color = terra_pointf3 ( &t, &white_scale );
+                color = terra_powf3 ( &color, 1.f / scene->opts.gamma );
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        // Store the final color value on the framebuffer
+        framebuffer->pixels[pixels[k]] = color;
+    }
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -651,6 +1260,46 @@ void terra_free ( void* ptr ) {
 }
 #endif
 
+// The pointer returned by terra_malloc is stored right before the aligned block
+void* terra_malloc_aligned ( size_t size, size_t alignment ) {
+    assert ( alignment >= sizeof ( void* ) && ( alignment & ( alignment - 1 ) ) == 0 );
+    uint8_t* ptr = ( uint8_t* ) terra_malloc ( size + alignment + sizeof ( void* ) );
+
+    if ( ptr == NULL ) {
+        return NULL;
+    }
+
+    uint8_t* aligned = ( uint8_t* ) ( ( ( uintptr_t ) ptr + sizeof ( void* ) + alignment - 1 ) & ~ ( uintptr_t ) ( alignment - 1 ) );
+    memcpy ( aligned - sizeof ( void* ), &ptr, sizeof ( void* ) );
+    return aligned;
+}
+
+void terra_free_aligned ( void* ptr ) {
+    if ( ptr == NULL ) {
+        return;
+    }
+
+    void* base;
+    memcpy ( &base, ( uint8_t* ) ptr - sizeof ( void* ), sizeof ( void* ) );
+    terra_free ( base );
+}
+
+void terra_jobs_run ( const TerraJobSystem* jobs, TerraJobRoutine* routine, void* args, size_t count ) {
+    if ( count == 0 ) {
+        return;
+    }
+
+    if ( jobs == NULL || jobs->dispatch == NULL || count == 1 ) {
+        for ( size_t i = 0; i < count; ++i ) {
+            routine ( args, i );
+        }
+
+        return;
+    }
+
+    jobs->dispatch ( jobs->client, routine, args, count );
+}
+
 #ifndef TERRA_LOG
 #include <stdio.h>
 #include <stdarg.h>
@@ -675,8 +1324,7 @@ void terra_log ( const char* str, ... ) {
 //--------------------------------------------------------------------------------------------------
 // @TerraSampler
 //--------------------------------------------------------------------------------------------------
-void terra_sampler_random_init ( TerraSamplerRandom* sampler ) {
-    uint32_t seed = ( uint32_t ) ( ( uint64_t ) time ( NULL ) ^ ( uint64_t ) &exit );
+void terra_sampler_random_init ( TerraSamplerRandom* sampler, uint64_t seed ) {
     sampler->state = 0;
     sampler->inc = 1;
     terra_sampler_random_next ( sampler );
@@ -700,6 +1348,253 @@ float terra_sampler_random_next ( void* _sampler ) {
     return rndi * resolution;
 }
 
+void terra_sampler_counter_init ( TerraSamplerCounter* sampler, const uint32_t* blue_noise, size_t x, size_t y, size_t width, uint32_t sample ) {
+    sampler->pixel = ( uint32_t ) ( y * width + x );
+    sampler->sample = sample;
+    sampler->dimension = 0;
+    sampler->x = ( uint32_t ) x;
+    sampler->y = ( uint32_t ) y;
+    sampler->blue_noise = blue_noise;
+}
+
+// Each Philox block holds four dimensions, it's generated when the first one is drawn
+float terra_sampler_counter_next ( void* _sampler ) {
+    TerraSamplerCounter* sampler = ( TerraSamplerCounter* ) _sampler;
+
+    if ( sampler->blue_noise != NULL ) {
+        return terra_sampler_sobol_next ( sampler );
+    }
+
+    if ( ( sampler->dimension & 3 ) == 0 ) {
+        uint32_t c0 = sampler->dimension >> 2;
+        uint32_t c1 = sampler->sample;
+        uint32_t c2 = sampler->pixel;
+        uint32_t c3 = 0;
+        uint32_t k0 = TERRA_SAMPLER_SEED;
+        uint32_t k1 = 0;
+
+        for ( int round = 0; round < 10; ++round ) {
+            uint64_t p0 = ( uint64_t ) 0xD2511F53u * c0;
+            uint64_t p1 = ( uint64_t ) 0xCD9E8D57u * c2;
+            c0 = ( uint32_t ) ( p1 >> 32 ) ^ c1 ^ k0;
+            c2 = ( uint32_t ) ( p0 >> 32 ) ^ c3 ^ k1;
+            c1 = ( uint32_t ) p1;
+            c3 = ( uint32_t ) p0;
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+
+        sampler->block[0] = c0;
+        sampler->block[1] = c1;
+        sampler->block[2] = c2;
+        sampler->block[3] = c3;
+    }
+
+    // 24 bits, [0, 1)
+    return ( sampler->block[sampler->dimension++ & 3] >> 8 ) * ( 1.f / 16777216.f );
+}
+
+// Owen-scrambled Sobol [Burley 2020]. Dimensions are padded four at a time: each group draws a 4D Sobol point at the
+// sample index shuffled by an Owen scramble of its own, which keeps the groups decorrelated while the first 2^m samples
+// of a pixel still stratify every dimension (and the first pair of a group jointly). All pixels walk the same sequence,
+// each dimension shifted toroidally by a blue noise texel at an offset of its own [Georgiev and Fajardo 2016]: the
+// error of neighbouring pixels is anticorrelated and what is left of the noise moves to high frequencies.
+float terra_sampler_sobol_next ( TerraSamplerCounter* sampler ) {
+    // First four dimensions of the sequence [Joe and Kuo 2008], direction number of each bit of the index
+    static const uint32_t directions[4][32] = {
+        {
+            0x80000000, 0x40000000, 0x20000000, 0x10000000, 0x08000000, 0x04000000, 0x02000000, 0x01000000,
+            0x00800000, 0x00400000, 0x00200000, 0x00100000, 0x00080000, 0x00040000, 0x00020000, 0x00010000,
+            0x00008000, 0x00004000, 0x00002000, 0x00001000, 0x00000800, 0x00000400, 0x00000200, 0x00000100,
+            0x00000080, 0x00000040, 0x00000020, 0x00000010, 0x00000008, 0x00000004, 0x00000002, 0x00000001
+        },
+        {
+            0x80000000, 0xc0000000, 0xa0000000, 0xf0000000, 0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+            0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000, 0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+            0x80008000, 0xc000c000, 0xa000a000, 0xf000f000, 0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+            0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0, 0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff
+        },
+        {
+            0x80000000, 0xc0000000, 0x60000000, 0x90000000, 0xe8000000, 0x5c000000, 0x8e000000, 0xc5000000,
+            0x68800000, 0x9cc00000, 0xee600000, 0x55900000, 0x80680000, 0xc09c0000, 0x60ee0000, 0x90550000,
+            0xe8808000, 0x5cc0c000, 0x8e606000, 0xc5909000, 0x6868e800, 0x9c9c5c00, 0xeeee8e00, 0x5555c500,
+            0x8000e880, 0xc0005cc0, 0x60008e60, 0x9000c590, 0xe8006868, 0x5c009c9c, 0x8e00eeee, 0xc5005555
+        },
+        {
+            0x80000000, 0xc0000000, 0x20000000, 0x50000000, 0xf8000000, 0x74000000, 0xa2000000, 0x93000000,
+            0xd8800000, 0x25400000, 0x59e00000, 0xe6d00000, 0x78080000, 0xb40c0000, 0x82020000, 0xc3050000,
+            0x208f8000, 0x51474000, 0xfbea2000, 0x75d93000, 0xa0858800, 0x914e5400, 0xdbe79e00, 0x25db6d00,
+            0x58800080, 0xe54000c0, 0x79e00020, 0xb6d00050, 0x800800f8, 0xc00c0074, 0x200200a2, 0x50050093
+        }
+    };
+    uint32_t dimension = sampler->dimension++;
+    uint32_t group_seed = terra_hash32 ( terra_hash32 ( TERRA_SAMPLER_SEED ) ^ ( dimension >> 2 ) );
+    uint32_t index = terra_owen_scramble ( sampler->sample, group_seed );
+    uint32_t x = 0;
+
+    for ( int bit = 0; index != 0; index >>= 1, ++bit ) {
+        x ^= ( index & 1 ) * directions[dimension & 3][bit];
+    }
+
+    uint32_t dimension_seed = terra_hash32 ( group_seed ^ ( dimension + 1 ) );
+    x = terra_owen_scramble ( x, dimension_seed );
+    // Texel at the offset of the dimension, the sum wraps around [0, 1)
+    uint32_t mask = TERRA_SAMPLER_BLUE_NOISE_SIZE - 1;
+    uint32_t texel_x = ( sampler->x + dimension_seed ) & mask;
+    uint32_t texel_y = ( sampler->y + ( dimension_seed >> 16 ) ) & mask;
+    x += sampler->blue_noise[texel_y * TERRA_SAMPLER_BLUE_NOISE_SIZE + texel_x];
+    return ( x >> 8 ) * ( 1.f / 16777216.f );
+}
+
+// [Wellons 2018, lowbias32]
+uint32_t terra_hash32 ( uint32_t x ) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+uint32_t terra_reverse_bits32 ( uint32_t x ) {
+    x = ( x << 16 ) | ( x >> 16 );
+    x = ( ( x & 0x00ff00ffu ) << 8 ) | ( ( x & 0xff00ff00u ) >> 8 );
+    x = ( ( x & 0x0f0f0f0fu ) << 4 ) | ( ( x & 0xf0f0f0f0u ) >> 4 );
+    x = ( ( x & 0x33333333u ) << 2 ) | ( ( x & 0xccccccccu ) >> 2 );
+    x = ( ( x & 0x55555555u ) << 1 ) | ( ( x & 0xaaaaaaaau ) >> 1 );
+    return x;
+}
+
+// Nested uniform scramble of the bits of x, most significant first [Laine and Karras 2011, Burley 2020]. Each bit is
+// flipped depending on the seed and the bits above it only, the elementary intervals of a net are kept.
+uint32_t terra_owen_scramble ( uint32_t x, uint32_t seed ) {
+    x = terra_reverse_bits32 ( x );
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return terra_reverse_bits32 ( x );
+}
+
+// Adds or removes ( sign ) the point at p to the energy of the pattern, a gaussian wrapping around the texture.
+// kernel holds its weights up to TERRA_BLUE_NOISE_RADIUS texels away, where they become negligible.
+void terra_blue_noise_splat ( float* energy, const float* kernel, int p, float sign ) {
+    int size = TERRA_SAMPLER_BLUE_NOISE_SIZE;
+    int side = 2 * TERRA_BLUE_NOISE_RADIUS + 1;
+    int px = p % size;
+    int py = p / size;
+
+    for ( int dy = -TERRA_BLUE_NOISE_RADIUS; dy <= TERRA_BLUE_NOISE_RADIUS; ++dy ) {
+        float* energy_row = energy + ( ( py + dy ) & ( size - 1 ) ) * size;
+        const float* kernel_row = kernel + ( dy + TERRA_BLUE_NOISE_RADIUS ) * side + TERRA_BLUE_NOISE_RADIUS;
+
+        for ( int dx = -TERRA_BLUE_NOISE_RADIUS; dx <= TERRA_BLUE_NOISE_RADIUS; ++dx ) {
+            energy_row[( px + dx ) & ( size - 1 )] += sign * kernel_row[dx];
+        }
+    }
+}
+
+// Tightest cluster (highest energy among the points of the pattern) or largest void (lowest energy among the holes)
+int terra_blue_noise_find ( const float* energy, const uint8_t* pattern, bool cluster ) {
+    int count = TERRA_SAMPLER_BLUE_NOISE_SIZE * TERRA_SAMPLER_BLUE_NOISE_SIZE;
+    int best = -1;
+
+    for ( int i = 0; i < count; ++i ) {
+        if ( pattern[i] == cluster && ( best == -1 || ( cluster ? energy[i] > energy[best] : energy[i] < energy[best] ) ) ) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+void terra_sampler_blue_noise_create ( uint32_t* shifts_out ) {
+    int size = TERRA_SAMPLER_BLUE_NOISE_SIZE;
+    int count = size * size;
+    int side = 2 * TERRA_BLUE_NOISE_RADIUS + 1;
+    float* kernel = ( float* ) terra_malloc ( sizeof ( float ) * side * side );
+    float* energy = ( float* ) terra_malloc ( sizeof ( float ) * count );
+    float* prototype_energy = ( float* ) terra_malloc ( sizeof ( float ) * count );
+    uint8_t* pattern = ( uint8_t* ) terra_malloc ( count );
+    uint8_t* prototype = ( uint8_t* ) terra_malloc ( count );
+    uint32_t* ranks = shifts_out;
+    const float sigma = 1.5f;
+
+    for ( int dy = -TERRA_BLUE_NOISE_RADIUS; dy <= TERRA_BLUE_NOISE_RADIUS; ++dy ) {
+        for ( int dx = -TERRA_BLUE_NOISE_RADIUS; dx <= TERRA_BLUE_NOISE_RADIUS; ++dx ) {
+            float r2 = ( float ) ( dx * dx + dy * dy );
+            kernel[( dy + TERRA_BLUE_NOISE_RADIUS ) * side + dx + TERRA_BLUE_NOISE_RADIUS] = expf ( -r2 / ( 2 * sigma * sigma ) );
+        }
+    }
+
+    memset ( energy, 0, sizeof ( float ) * count );
+    memset ( pattern, 0, count );
+
+    // Initial binary pattern, a tenth of the texels picked at random
+    int ones = 0;
+    uint32_t h = terra_hash32 ( TERRA_SAMPLER_SEED );
+
+    while ( ones < count / 10 ) {
+        h = terra_hash32 ( h + 1 );
+        int p = ( int ) ( h % ( uint32_t ) count );
+
+        if ( !pattern[p] ) {
+            pattern[p] = 1;
+            terra_blue_noise_splat ( energy, kernel, p, 1.f );
+            ++ones;
+        }
+    }
+
+    // Move the point of the tightest cluster to the largest void until it lands where it was
+    for ( ;; ) {
+        int cluster = terra_blue_noise_find ( energy, pattern, true );
+        pattern[cluster] = 0;
+        terra_blue_noise_splat ( energy, kernel, cluster, -1.f );
+        int hole = terra_blue_noise_find ( energy, pattern, false );
+        pattern[hole] = 1;
+        terra_blue_noise_splat ( energy, kernel, hole, 1.f );
+
+        if ( hole == cluster ) {
+            break;
+        }
+    }
+
+    memcpy ( prototype, pattern, count );
+    memcpy ( prototype_energy, energy, sizeof ( float ) * count );
+
+    // The points of the initial pattern are ranked removing the tightest clusters first
+    for ( int rank = ones - 1; rank >= 0; --rank ) {
+        int cluster = terra_blue_noise_find ( energy, pattern, true );
+        pattern[cluster] = 0;
+        terra_blue_noise_splat ( energy, kernel, cluster, -1.f );
+        ranks[cluster] = ( uint32_t ) rank;
+    }
+
+    // The holes filling the largest voids. Past half of the texels the tightest cluster of holes is still the hole
+    // with the lowest energy, the last two phases of the original algorithm are the same loop.
+    memcpy ( pattern, prototype, count );
+    memcpy ( energy, prototype_energy, sizeof ( float ) * count );
+
+    for ( int rank = ones; rank < count; ++rank ) {
+        int hole = terra_blue_noise_find ( energy, pattern, false );
+        pattern[hole] = 1;
+        terra_blue_noise_splat ( energy, kernel, hole, 1.f );
+        ranks[hole] = ( uint32_t ) rank;
+    }
+
+    // Ranks are uniform over [0, count), as 0.32 fixed point shifts
+    for ( int i = 0; i < count; ++i ) {
+        shifts_out[i] = ( uint32_t ) ( ( ( uint64_t ) ranks[i] << 32 ) / ( uint64_t ) count );
+    }
+
+    terra_free ( kernel );
+    terra_free ( energy );
+    terra_free ( prototype_energy );
+    terra_free ( pattern );
+    terra_free ( prototype );
+}
+
 void terra_sampler_stratified_init ( TerraSamplerStratified* sampler, TerraSamplerRandom* random_sampler, int strata_per_dimension, int samples_per_stratum ) {
     sampler->random_sampler = random_sampler;
     sampler->strata = strata_per_dimension;
@@ -848,35 +1743,6 @@ TerraFloat2 terra_distribution_2d_sample ( TerraDistributon2D* dist, float e1, f
 //--------------------------------------------------------------------------------------------------
 // @Geometry
 //--------------------------------------------------------------------------------------------------
-bool terra_ray_aabb_intersection ( const TerraRay* ray, const TerraAABB* aabb, float* tmin_out, float* tmax_out ) {
-    float t1 = ( aabb->min.x - ray->origin.x ) * ray->inv_direction.x;
-    float t2 = ( aabb->max.x - ray->origin.x ) * ray->inv_direction.x;
-    float tmin = terra_minf ( t1, t2 );
-    float tmax = terra_maxf ( t1, t2 );
-    t1 = ( aabb->min.y - ray->origin.y ) * ray->inv_direction.y;
-    t2 = ( aabb->max.y - ray->origin.y ) * ray->inv_direction.y;
-    tmin = terra_maxf ( tmin, terra_minf ( t1, t2 ) );
-    tmax = terra_minf ( tmax, terra_maxf ( t1, t2 ) );
-    t1 = ( aabb->min.z - ray->origin.z ) * ray->inv_direction.z;
-    t2 = ( aabb->max.z - ray->origin.z ) * ray->inv_direction.z;
-    tmin = terra_maxf ( tmin, terra_minf ( t1, t2 ) );
-    tmax = terra_minf ( tmax, terra_maxf ( t1, t2 ) );
-
-    if ( tmax > terra_maxf ( tmin, 0.f ) ) {
-        if ( tmin_out != NULL ) {
-            *tmin_out = tmin;
-        }
-
-        if ( tmax_out != NULL ) {
-            *tmax_out = tmax;
-        }
-
-        return true;
-    }
-
-    return false;
-}
-
 bool terra_ray_triangle_intersection ( const TerraRay* ray, const TerraTriangle* triangle, TerraFloat3* point_out, float* t_out ) {
     const TerraTriangle* tri = triangle;
 #if 1
@@ -1036,19 +1902,26 @@ float terra_luminance ( const TerraFloat3* color ) {
     return ( float ) ( 0.212671 * color->x + 0.715160 * color->y + 0.072169 * color->z );
 }
 
-TerraFloat3 terra_trace ( TerraScene* scene, const TerraRay* primary_ray ) {
+TerraFloat3 terra_trace ( TerraScene* scene, const TerraRay* primary_ray, const TerraSceneHit* primary_hit, TerraSamplerCounter* sampler ) {
     TerraFloat3 Lo = terra_f3_zero;
     TerraFloat3 throughput = terra_f3_one;
     TerraRay ray = *primary_ray;
     TerraRayState ray_state;
 
     for ( size_t bounce = 0; bounce <= scene->opts.bounces; ++bounce ) {
-        terra_ray_state_init ( &ray, &ray_state );
         // Raycast
         TerraShadingSurface surface;
         TerraFloat3 intersection_point;
         TerraObject* object;
-        object = terra_scene_raycast ( scene, &ray, &ray_state, &surface, &intersection_point, NULL );
+
+        if ( bounce == 0 && primary_hit != NULL ) {
+            object = primary_hit->object;
+            surface = primary_hit->surface;
+            intersection_point = primary_hit->point;
+        } else {
+            terra_ray_state_init ( &ray, &ray_state );
+            object = terra_scene_raycast ( scene, &ray, &ray_state, &surface, &intersection_point, NULL );
+        }
 
         if ( object == NULL ) {
             TerraFloat3 env_color = terra_attribute_eval ( &scene->opts.environment_map, &ray.direction, &intersection_point );
@@ -1059,15 +1932,15 @@ TerraFloat3 terra_trace ( TerraScene* scene, const TerraRay* primary_ray ) {
 
         // Integrate radiance
         TerraFloat3 wo = terra_negf3 ( &ray.direction );
-        TerraFloat3 radiance = terra_integrate ( scene, &ray, object, &surface, &intersection_point, &wo, &throughput, bounce );
+        TerraFloat3 radiance = terra_integrate ( scene, &ray, object, &surface, &intersection_point, &wo, &throughput, bounce, sampler, NULL );
         Lo = terra_addf3 ( &Lo, &radiance );
         // Continue path
         TerraFloat3 wi;
         float pdf;
         {
-            float e0 = _randf();
-            float e1 = _randf();
-            float e2 = _randf();
+            float e0 = terra_sampler_counter_next ( sampler );
+            float e1 = terra_sampler_counter_next ( sampler );
+            float e2 = terra_sampler_counter_next ( sampler );
             wi = object->material.bsdf.sample ( &surface, e0, e1, e2, &wo );
             pdf = terra_maxf ( object->material.bsdf.pdf ( &surface, &wi, &wo ), terra_Epsilon );
         }
@@ -1080,8 +1953,7 @@ TerraFloat3 terra_trace ( TerraScene* scene, const TerraRay* primary_ray ) {
         // Russian roulette
         {
             float p = terra_maxf ( throughput.x, terra_maxf ( throughput.y, throughput.z ) );
-            float e3 = 0.5f;
-            e3 = ( float ) rand() / RAND_MAX;
+            float e3 = terra_sampler_counter_next ( sampler );
 
             if ( e3 > p ) {
                 break;
@@ -1104,17 +1976,23 @@ TerraFloat3 terra_integrate (
     const TerraFloat3* point,
     const TerraFloat3* wo,
     const TerraFloat3* throughput,
-    size_t bounce
+    size_t bounce,
+    TerraSamplerCounter* sampler,
+    TerraShadowRay* shadow_out
 ) {
+    if ( shadow_out != NULL ) {
+        shadow_out->t_max = 0.f;
+    }
+
     switch ( scene->opts.integrator ) {
         case kTerraIntegratorSimple:
             return terra_integrate_simple ( throughput, surface, wo );
 
         case kTerraIntegratorDirect:
-            return terra_integrate_direct ( scene, object, surface, point, wo, throughput, bounce );
+            return terra_integrate_direct ( scene, object, surface, point, wo, throughput, bounce, sampler, shadow_out );
 
         case kTerraIntegratorDirectMis:
-            return terra_integrate_direct_mis ( scene, object, surface, point, wo, throughput, bounce );
+            return terra_integrate_direct_mis ( scene, object, surface, point, wo, throughput, bounce, sampler, shadow_out );
 
         // Debug integrators
 
@@ -1128,7 +2006,7 @@ TerraFloat3 terra_integrate (
             return terra_integrate_debug_normals ( surface, bounce );
 
         case kTerraIntegratorDebugMisWeights:
-            return terra_integrate_debug_mis_weight ( scene, object, surface, point, wo, throughput, bounce );
+            return terra_integrate_debug_mis_weight ( scene, object, surface, point, wo, throughput, bounce, sampler );
 
         default:
             assert ( false );
@@ -1203,7 +2081,8 @@ TerraFloat3 terra_integrate_debug_mis_weight (
     const TerraFloat3* ray_point,
     const TerraFloat3* wo,
     const TerraFloat3* throughput,
-    size_t bounce
+    size_t bounce,
+    TerraSamplerCounter* sampler
 ) {
     TerraFloat3 Lo = terra_f3_zero;
 
@@ -1214,9 +2093,9 @@ TerraFloat3 terra_integrate_debug_mis_weight (
     // Sample BSDF first
     TerraFloat3 bsdf_sample;
     {
-        float e1 = _randf();
-        float e2 = _randf();
-        float e3 = _randf();
+        float e1 = terra_sampler_counter_next ( sampler );
+        float e2 = terra_sampler_counter_next ( sampler );
+        float e3 = terra_sampler_counter_next ( sampler );
         bsdf_sample = ray_object->material.bsdf.sample ( ray_surface, e1, e2, e3, wo );
     }
     // Sample light
@@ -1226,41 +2105,32 @@ TerraFloat3 terra_integrate_debug_mis_weight (
         // Sample
         TerraFloat3 sample_pos;
         TerraFloat3 sample_norm;
+        TerraFloat2 sample_uv;
         size_t tri_idx;
         {
             {
-                float e = _randf() - terra_Epsilon;
-                light = terra_scene_pick_light ( scene, e, &light_pick_pdf );
-            }
-            // Pick triangle to sample
-            float tri_pdf;
-            {
-                float e = _randf();
-                tri_idx = terra_light_pick_triangle ( light, e, &tri_pdf );
+                float e = terra_sampler_counter_next ( sampler );
+                light = terra_scene_pick_light ( scene, ray_point, &ray_surface->normal, e, &tri_idx, &light_pick_pdf );
+
+                if ( light == NULL ) {
+                    goto bsdf;
+                }
             }
             // Sample triangle
-            TerraFloat2 sample_uv;
             float sample_pdf;
             {
-                float e1 = _randf();
-                float e2 = _randf();
+                float e1 = terra_sampler_counter_next ( sampler );
+                float e2 = terra_sampler_counter_next ( sampler );
                 terra_light_sample_triangle ( light, tri_idx, e1, e2, &sample_pos, &sample_uv, &sample_norm, &sample_pdf );
             }
         }
         TerraFloat3 p_to_light = terra_subf3 ( &sample_pos, ray_point );
         TerraFloat3 wi = terra_normf3 ( &p_to_light );
-        // Raycast
-        TerraShadingSurface light_surface;
-        TerraObject* object;
-        size_t light_triangle;
-        TerraFloat3 intersection_point;
+        // Shadow ray, the light sample is visible if nothing is hit before reaching it
         {
             TerraRay ray = terra_surface_ray ( ray_surface, ray_point, &wi, 1 );
-            TerraRayState ray_state;
-            terra_ray_state_init ( &ray, &ray_state );
-            object = terra_scene_raycast ( scene, &ray, &ray_state, &light_surface, &intersection_point, &light_triangle );
 
-            if ( object != light->object || light_triangle != tri_idx ) {
+            if ( terra_scene_occluded ( scene, &ray, terra_distf3 ( &ray.origin, &sample_pos ) ) ) {
                 goto bsdf;
             }
         }
@@ -1273,7 +2143,7 @@ TerraFloat3 terra_integrate_debug_mis_weight (
         }
 
         float bsdf_pdf = ray_object->material.bsdf.pdf ( ray_surface, &wi, wo );
-        float light_pdf = terra_sqlenf3 ( &p_to_light ) / fabsf ( cos * light->triangle_area[light_triangle] );
+        float light_pdf = light_pick_pdf * terra_sqlenf3 ( &p_to_light ) / fabsf ( cos * light->triangle_area[tri_idx] );
         float weight = ( bsdf_pdf * bsdf_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
         TerraFloat3 L = terra_f3_set ( 0, 0, weight );
         Lo = terra_addf3 ( &Lo, &L );
@@ -1305,26 +2175,23 @@ bsdf:
         }
 
         // Exit on miss
-        if ( object != light->object ) {
+        if ( object == NULL ) {
+            // TODO env light pdf
             goto exit;
         }
 
-        // If we hit a light, compute the pdf of such event
+        // If we hit a light, compute the pdf of sampling it from the light side
         float light_pdf;
         {
-            if ( object == NULL ) {
-                // TODO env light pdf
-                goto exit;
-            } else {
-                float NoW = terra_dotf3 ( &light_surface.normal, &light_wo );
-
-                if ( NoW <= 0 ) {
-                    goto exit;
-                }
+            float NoW = terra_dotf3 ( &light_surface.normal, &light_wo );
 
-                float dist = terra_sqdistf3 ( &intersection_point, ray_point );
-                light_pdf = dist / ( NoW * terra_triangle_area ( &object->triangles[light_triangle] ) );
+            if ( NoW <= 0 || terra_f3_is_zero ( &light_surface.emissive ) ) {
+                goto exit;
             }
+
+            float dist = terra_sqdistf3 ( &intersection_point, ray_point );
+            light_pdf = terra_scene_light_pdf ( scene, ray_point, &ray_surface->normal, object, light_triangle );
+            light_pdf *= dist / ( NoW * terra_triangle_area ( &object->triangles[light_triangle] ) );
         }
         // Compute weight
         float weight = ( bsdf_pdf * bsdf_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
@@ -1353,7 +2220,9 @@ TerraFloat3 terra_integrate_direct (
     const TerraFloat3* ray_point,
     const TerraFloat3* wo,
     const TerraFloat3* throughput,
-    size_t bounce
+    size_t bounce,
+    TerraSamplerCounter* sampler,
+    TerraShadowRay* shadow_out
 ) {
     TerraFloat3 Lo = terra_f3_zero;
 
@@ -1362,20 +2231,46 @@ TerraFloat3 terra_integrate_direct (
         Lo = terra_addf3 ( &Lo, &ray_surface->emissive );
     }
 
-    // TODO make sure the light triangle pick method follows the light pick pdf in all cases
-    // Pick light to sample
-    TerraLight* light;
-    float light_pick_pdf;
-    {
-        float e = _randf() - terra_Epsilon;
-        light = terra_scene_pick_light ( scene, e, &light_pick_pdf );
+    TerraShadowRay shadow;
+
+    if ( terra_integrate_light_sample ( scene, ray_object, ray_surface, ray_point, wo, false, sampler, &shadow ) ) {
+        if ( shadow_out != NULL ) {
+            *shadow_out = shadow;
+            shadow_out->radiance = terra_pointf3 ( &shadow.radiance, throughput );
+        } else {
+            if ( !terra_scene_occluded ( scene, &shadow.ray, shadow.t_max ) ) {
+                Lo = terra_addf3 ( &Lo, &shadow.radiance );
+            }
+        }
     }
-    // Pick triangle to sample
+
+    Lo = terra_pointf3 ( &Lo, throughput );
+    return Lo;
+}
+
+// Samples a point on a light and computes the radiance it reflects towards wo, weighted against BSDF sampling if mis
+// is set. Returns false if the sample can't contribute, otherwise shadow_out is the visibility test it depends on.
+bool terra_integrate_light_sample (
+    const TerraScene* scene,
+    const TerraObject* ray_object,
+    const TerraShadingSurface* ray_surface,
+    const TerraFloat3* ray_point,
+    const TerraFloat3* wo,
+    bool mis,
+    TerraSamplerCounter* sampler,
+    TerraShadowRay* shadow_out
+) {
+    // Pick light triangle to sample
+    TerraLight* light;
     size_t tri_idx;
-    float tri_pdf;
+    float light_pick_pdf;
     {
-        float e = _randf();
-        tri_idx = terra_light_pick_triangle ( light, e, &tri_pdf );
+        float e = terra_sampler_counter_next ( sampler );
+        light = terra_scene_pick_light ( scene, ray_point, &ray_surface->normal, e, &tri_idx, &light_pick_pdf );
+
+        if ( light == NULL ) {
+            return false;
+        }
     }
     // Sample triangle
     TerraFloat3 sample_pos;
@@ -1383,46 +2278,40 @@ TerraFloat3 terra_integrate_direct (
     TerraFloat3 sample_norm;
     float sample_pdf;
     {
-        float e1 = _randf();
-        float e2 = _randf();
+        float e1 = terra_sampler_counter_next ( sampler );
+        float e2 = terra_sampler_counter_next ( sampler );
         terra_light_sample_triangle ( light, tri_idx, e1, e2, &sample_pos, &sample_uv, &sample_norm, &sample_pdf );
     }
     TerraFloat3 p_to_light = terra_subf3 ( &sample_pos, ray_point );
     TerraFloat3 wi = terra_normf3 ( &p_to_light );
-    // Raycast
-    TerraShadingSurface light_surface;
-    TerraObject* object;
-    size_t light_triangle;
-    {
-        TerraFloat3 intersection_point;
-        TerraRay ray = terra_surface_ray ( ray_surface, ray_point, &wi, 1 );
-        TerraRayState ray_state;
-        terra_ray_state_init ( &ray, &ray_state );
-        object = terra_scene_raycast ( scene, &ray, &ray_state, &light_surface, &intersection_point, &light_triangle );
+    // Shadow ray, the light sample is visible if nothing is hit before reaching it
+    shadow_out->ray = terra_surface_ray ( ray_surface, ray_point, &wi, 1 );
+    shadow_out->t_max = terra_distf3 ( &shadow_out->ray.origin, &sample_pos );
+    // Compute reflected radiance
+    TerraFloat3 light_wo = terra_negf3 ( &wi );
+    float cos = terra_dotf3 ( &light_wo, &sample_norm );
 
-        if ( object != light->object || light_triangle != tri_idx ) {
-            goto exit;
-        }
+    if ( cos <= 0 ) {
+        return false;
     }
-    // Compute reflected radiance
-    TerraFloat3 Ld;
-    {
-        TerraFloat3 light_wo = terra_negf3 ( &wi );
-        float cos = terra_dotf3 ( &light_wo, &sample_norm );
 
-        if ( cos <= 0 ) {
-            goto exit;
-        }
+    float light_pdf = light_pick_pdf * terra_sqlenf3 ( &p_to_light ) / fabsf ( cos * light->triangle_area[tri_idx] );
+    float weight = 1.f;
+
+    if ( mis ) {
+        float bsdf_pdf = ray_object->material.bsdf.pdf ( ray_surface, &wi, wo );
+        weight = ( light_pdf * light_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
 
-        TerraFloat3 f = ray_object->material.bsdf.eval ( ray_surface, &wi, wo );
-        float pdf = terra_sqlenf3 ( &p_to_light ) / fabsf ( cos * light->triangle_area[light_triangle] );
-        Ld = terra_pointf3 ( &light_surface.emissive, &f );
-        Ld = terra_mulf3 ( &Ld, terra_dotf3 ( &wi, &ray_surface->normal ) / ( pdf * light_pick_pdf ) );
+        if ( light_pdf == 0 ) {
+            return false;
+        }
     }
-    Lo = terra_addf3 ( &Lo, &Ld );
-exit:
-    Lo = terra_pointf3 ( &Lo, throughput );
-    return Lo;
+
+    TerraFloat3 f = ray_object->material.bsdf.eval ( ray_surface, &wi, wo );
+    TerraFloat3 Le = terra_attribute_eval ( &light->object->material.emissive, &sample_uv, &sample_pos );
+    shadow_out->radiance = terra_pointf3 ( &Le, &f );
+    shadow_out->radiance = terra_mulf3 ( &shadow_out->radiance, terra_dotf3 ( &wi, &ray_surface->normal ) * weight / light_pdf );
+    return true;
 }
 
 TerraFloat3 terra_integrate_direct_mis (
@@ -1432,7 +2321,9 @@ TerraFloat3 terra_integrate_direct_mis (
     const TerraFloat3* ray_point,
     const TerraFloat3* wo,
     const TerraFloat3* throughput,
-    size_t bounce
+    size_t bounce,
+    TerraSamplerCounter* sampler,
+    TerraShadowRay* shadow_out
 ) {
     TerraFloat3 Lo = terra_f3_zero;
 
@@ -1444,76 +2335,25 @@ TerraFloat3 terra_integrate_direct_mis (
     // Sample BSDF first
     TerraFloat3 bsdf_sample;
     {
-        float e1 = _randf();
-        float e2 = _randf();
-        float e3 = _randf();
+        float e1 = terra_sampler_counter_next ( sampler );
+        float e2 = terra_sampler_counter_next ( sampler );
+        float e3 = terra_sampler_counter_next ( sampler );
         bsdf_sample = ray_object->material.bsdf.sample ( ray_surface, e1, e2, e3, wo );
     }
     // Sample light
-    TerraLight* light;
-    float light_pick_pdf;
-    {
-        // Sample
-        TerraFloat3 sample_pos;
-        TerraFloat3 sample_norm;
-        size_t tri_idx;
-        {
-            {
-                float e = _randf() - terra_Epsilon;
-                light = terra_scene_pick_light ( scene, e, &light_pick_pdf );
-            }
-            // Pick triangle to sample
-            float tri_pdf;
-            {
-                float e = _randf();
-                tri_idx = terra_light_pick_triangle ( light, e, &tri_pdf );
-            }
-            // Sample triangle
-            TerraFloat2 sample_uv;
-            float sample_pdf;
-            {
-                float e1 = _randf();
-                float e2 = _randf();
-                terra_light_sample_triangle ( light, tri_idx, e1, e2, &sample_pos, &sample_uv, &sample_norm, &sample_pdf );
-            }
-        }
-        TerraFloat3 p_to_light = terra_subf3 ( &sample_pos, ray_point );
-        TerraFloat3 wi = terra_normf3 ( &p_to_light );
-        // Raycast
-        TerraShadingSurface light_surface;
-        TerraObject* object;
-        size_t light_triangle;
-        TerraFloat3 intersection_point;
-        {
-            TerraRay ray = terra_surface_ray ( ray_surface, ray_point, &wi, 1 );
-            TerraRayState ray_state;
-            terra_ray_state_init ( &ray, &ray_state );
-            object = terra_scene_raycast ( scene, &ray, &ray_state, &light_surface, &intersection_point, &light_triangle );
+    TerraShadowRay shadow;
 
-            if ( object != light->object || light_triangle != tri_idx ) {
-                goto bsdf;
+    if ( terra_integrate_light_sample ( scene, ray_object, ray_surface, ray_point, wo, true, sampler, &shadow ) ) {
+        if ( shadow_out != NULL ) {
+            *shadow_out = shadow;
+            shadow_out->radiance = terra_pointf3 ( &shadow.radiance, throughput );
+        } else {
+            if ( !terra_scene_occluded ( scene, &shadow.ray, shadow.t_max ) ) {
+                Lo = terra_addf3 ( &Lo, &shadow.radiance );
             }
         }
-        // Compute reflected radiance
-        TerraFloat3 light_wo = terra_negf3 ( &wi );
-        float cos = terra_dotf3 ( &sample_norm, &light_wo );
-
-        if ( cos <= 0 ) {
-            goto bsdf;
-        }
-
-        float bsdf_pdf = ray_object->material.bsdf.pdf ( ray_surface, &wi, wo );
-        float light_pdf = terra_sqlenf3 ( &p_to_light ) / fabsf ( cos * light->triangle_area[light_triangle] );
-        float weight = ( light_pdf * light_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
-
-        if ( light_pdf != 0 ) {
-            TerraFloat3 f = ray_object->material.bsdf.eval ( ray_surface, &wi, wo );
-            TerraFloat3 L = terra_pointf3 ( &light_surface.emissive, &f );
-            L = terra_mulf3 ( &L, terra_dotf3 ( &wi, &ray_surface->normal ) * weight / ( light_pdf * light_pick_pdf ) );
-            Lo = terra_addf3 ( &Lo, &L );
-        }
     }
-bsdf:
+
     // Sample bsdf
     {
         // Sample bsdf lobe, eval, compute sample pdf
@@ -1540,39 +2380,28 @@ bsdf:
         }
 
         // Exit on miss
-        if ( object != light->object ) {
+        if ( object == NULL ) {
+            // TODO env light pdf
             goto exit;
         }
 
-        // If we hit a light, compute the pdf of such event
+        // If we hit a light, compute the pdf of sampling it from the light side
         float light_pdf;
         {
-            if ( object == NULL ) {
-                // TODO env light pdf
-                goto exit;
-            } else {
-                float NoW = terra_dotf3 ( &light_surface.normal, &light_wo );
-
-                if ( NoW <= 0 ) {
-                    goto exit;
-                }
+            float NoW = terra_dotf3 ( &light_surface.normal, &light_wo );
 
-                float dist = terra_sqdistf3 ( &intersection_point, ray_point );
-                light_pdf = dist / ( NoW * terra_triangle_area ( &object->triangles[light_triangle] ) );
+            if ( NoW <= 0 || terra_f3_is_zero ( &light_surface.emissive ) ) {
+                goto exit;
             }
+
+            float dist = terra_sqdistf3 ( &intersection_point, ray_point );
+            light_pdf = terra_scene_light_pdf ( scene, ray_point, &ray_surface->normal, object, light_triangle );
+            light_pdf *= dist / ( NoW * terra_triangle_area ( &object->triangles[light_triangle] ) );
         }
         // Compute weight
         float weight = ( bsdf_pdf * bsdf_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
         // Fetch received radiance
-        TerraFloat3 L = terra_f3_zero;
-        {
-            if ( object == light->object ) {
-                L = light_surface.emissive;
-            } else {
-                // TODO env light eval
-                //L = terra_attribute_eval ( &scene->opts.environment_map, &ray.direction, &intersection_point );
-            }
-        }
+        TerraFloat3 L = light_surface.emissive;
 
         // Compute reflected radiance
         if ( bsdf_pdf != 0 ) {
@@ -1589,35 +2418,26 @@ exit:
 //--------------------------------------------------------------------------------------------------
 // @TerraScene
 //--------------------------------------------------------------------------------------------------
-TerraLight* terra_scene_pick_light ( TerraScene* scene, float e, float* pdf ) {
-    // e1 is a random float between 0 and 1
-    /*float alpha_acc = *e1;
-    size_t light_idx = SIZE_MAX;
-    // TODO is this ok?
-    float total_power = scene->total_light_power.x + scene->total_light_power.y + scene->total_light_power.z;
+TerraLight* terra_scene_pick_light ( const TerraScene* scene, const TerraFloat3* point, const TerraFloat3* normal, float e, size_t* triangle_out, float* pdf ) {
+    int idx = terra_light_bvh_sample ( &scene->light_bvh, point, normal, e, pdf );
 
-    for ( size_t i = 0; i < scene->lights_pop; ++i ) {
-        float light_power = scene->lights[i].power.x + scene->lights[i].power.y + scene->lights[i].power.z;
-        float alpha = light_power / total_power;
-        alpha_acc -= alpha;
-
-        if ( alpha_acc <= 0 ) {
-            // We pick this light, save its index
-            light_idx = i;
-            // Recompute e1
-            alpha_acc += alpha;
-            *e1 = alpha_acc / alpha;
-            break;
-        }
+    if ( idx == -1 ) {
+        return NULL;
+    }
+
+    const TerraLightTriangle* triangle = &scene->light_bvh.triangles[idx];
+    *triangle_out = triangle->triangle;
+    return &scene->lights[triangle->light];
+}
+
+float terra_scene_light_pdf ( const TerraScene* scene, const TerraFloat3* point, const TerraFloat3* normal, const TerraObject* object, size_t triangle ) {
+    uint32_t light = scene->object_lights[object - scene->objects];
+
+    if ( light == UINT32_MAX ) {
+        return 0;
     }
 
-    assert ( light_idx != SIZE_MAX );
-    return &scene->lights[light_idx];*/
-    // TODO
-    assert ( scene->lights_pop > 0 );
-    size_t i = ( size_t ) ( e * ( double ) scene->lights_pop );
-    *pdf = 1.f / scene->lights_triangles_count;
-    return &scene->lights[i];
+    return terra_light_bvh_pmf ( &scene->light_bvh, point, normal, ( int ) ( scene->lights[light].triangles_offset + triangle ) );
 }
 
 TerraObject* terra_scene_raycast ( TerraScene* scene, const TerraRay* _ray, const TerraRayState* _ray_state, TerraShadingSurface* surface_out, TerraFloat3* intersection_point, size_t* triangle ) {
@@ -1630,9 +2450,22 @@ TerraObject* terra_scene_raycast ( TerraScene* scene, const TerraRay* _ray, cons
     ray.origin = terra_addf3 ( &ray.origin, &surface_offset );
     TerraRayState ray_state;
     terra_ray_state_init ( &ray, &ray_state );
+    int instance = -1;
 
-    if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
-        if ( !terra_bvh_traverse ( &scene->bvh, scene->objects, &ray, &ray_state, intersection_point, &primitive ) ) {
+    if ( scene->two_level ) {
+        if ( !terra_bvh_two_level_traverse ( &scene->two_level_bvh, &ray, FLT_MAX, intersection_point, &primitive, &instance ) ) {
+            miss = true;
+        }
+    } else if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
+        if ( !terra_bvh_traverse ( &scene->bvh, &ray, &ray_state, FLT_MAX, intersection_point, &primitive ) ) {
+            miss = true;
+        }
+    } else if ( terra_accelerator_is_wide ( scene->opts.accelerator ) ) {
+        if ( !terra_bvh_wide_traverse ( &scene->bvh_wide, &ray, &ray_state, FLT_MAX, intersection_point, &primitive ) ) {
+            miss = true;
+        }
+    } else if ( scene->opts.accelerator == kTerraAcceleratorKDTree ) {
+        if ( !terra_kdtree_traverse ( &scene->kdtree, &ray, &ray_state, FLT_MAX, intersection_point, &primitive ) ) {
             miss = true;
         }
     } else {
@@ -1646,25 +2479,244 @@ TerraObject* terra_scene_raycast ( TerraScene* scene, const TerraRay* _ray, cons
         return NULL;
     }
 
-    TerraObject* object = &scene->objects[primitive.object_idx];
-
     if ( triangle ) {
         *triangle = primitive.triangle_idx;
     }
 
-    terra_surface_init ( surface_out, &object->triangles[primitive.triangle_idx], &object->material, &object->properties[primitive.triangle_idx], intersection_point );
+    return terra_scene_hit_surface ( scene, &primitive, instance, intersection_point, surface_out );
+}
+
+// Only the binary BVH is traversed by packets, the rays are cast one at a time through the other accelerators
+void terra_scene_raycast_packet ( TerraScene* scene, const TerraRay* rays, int rays_count, TerraSceneHit* hits_out ) {
+    if ( scene->two_level || scene->opts.accelerator != kTerraAcceleratorBVH ) {
+        for ( int k = 0; k < rays_count; ++k ) {
+            hits_out[k].object = terra_scene_raycast ( scene, &rays[k], NULL, &hits_out[k].surface, &hits_out[k].point, NULL );
+        }
+
+        return;
+    }
+
+    TerraRay packet[TERRA_BVH_PACKET_MAX_RAYS] = { 0 };
+    TerraRayState states[TERRA_BVH_PACKET_MAX_RAYS] = { 0 };
+    TerraFloat3 points[TERRA_BVH_PACKET_MAX_RAYS];
+    TerraPrimitiveRef primitives[TERRA_BVH_PACKET_MAX_RAYS];
+    bool found[TERRA_BVH_PACKET_MAX_RAYS];
+
+    // Same surface offset as terra_scene_raycast
+    for ( int k = 0; k < rays_count; ++k ) {
+        const TerraFloat3 surface_offset = terra_mulf3 ( &rays[k].direction, 0.001f );
+        packet[k] = rays[k];
+        packet[k].origin = terra_addf3 ( &packet[k].origin, &surface_offset );
+        terra_ray_state_init ( &packet[k], &states[k] );
+    }
+
+    terra_bvh_traverse_packet ( &scene->bvh, packet, states, rays_count, found, points, primitives );
+
+    for ( int k = 0; k < rays_count; ++k ) {
+        hits_out[k].point = points[k];
+        hits_out[k].object = found[k] ? terra_scene_hit_surface ( scene, &primitives[k], -1, &hits_out[k].point, &hits_out[k].surface ) : NULL;
+    }
+}
+
+// Shades the surface of the primitive hit at intersection_point, which is moved to world space for instances
+TerraObject* terra_scene_hit_surface ( TerraScene* scene, const TerraPrimitiveRef* primitive, int instance, TerraFloat3* intersection_point,
+                                       TerraShadingSurface* surface_out ) {
+    TerraObject* object = &scene->objects[primitive->object_idx];
+    terra_surface_init ( surface_out, &object->triangles[primitive->triangle_idx], &object->material, &object->properties[primitive->triangle_idx], intersection_point );
+
+    // The surface has been shaded in object space
+    if ( instance >= 0 ) {
+        const TerraInstance* placement = &scene->two_level_bvh.instances[instance];
+        *intersection_point = terra_instance_point_to_world ( placement, intersection_point );
+        surface_out->normal = terra_instance_normal_to_world ( placement, &surface_out->normal );
+        surface_out->transform = terra_f4x4_from_y ( &surface_out->normal );
+    }
+
     return object;
 }
 
+// Any-hit query for shadow rays. Returns true as soon as something is found along the ray closer than t_max,
+// the surface hit is not shaded. Whatever lies at t_max (e.g. the light being sampled) is not considered a blocker.
+bool terra_scene_occluded ( const TerraScene* scene, const TerraRay* _ray, float t_max ) {
+    bool occluded;
+    // Tracing the ray an epsilon above/below the surface, same as terra_scene_raycast
+    TerraRay ray = *_ray;
+    const TerraFloat3 surface_offset = terra_mulf3 ( &ray.direction, 0.001f );
+    ray.origin = terra_addf3 ( &ray.origin, &surface_offset );
+    TerraRayState ray_state;
+    terra_ray_state_init ( &ray, &ray_state );
+    t_max = t_max * 0.999f - 0.001f;
+
+    if ( t_max <= 0.f ) {
+        return false;
+    }
+
+    if ( scene->two_level ) {
+        occluded = terra_bvh_two_level_occluded ( &scene->two_level_bvh, &ray, t_max );
+    } else if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
+        occluded = terra_bvh_occluded ( &scene->bvh, &ray, &ray_state, t_max );
+    } else if ( terra_accelerator_is_wide ( scene->opts.accelerator ) ) {
+        occluded = terra_bvh_wide_occluded ( &scene->bvh_wide, &ray, &ray_state, t_max );
+    } else if ( scene->opts.accelerator == kTerraAcceleratorKDTree ) {
+        occluded = terra_kdtree_occluded ( &scene->kdtree, &ray, &ray_state, t_max );
+    } else {
+        assert ( false );
+        return false;
+    }
+
+    return occluded;
+}
+
+// Reports the memory taken by the acceleration structure. Wide nodes are compared against the binary node
+// layout they replace, quantized nodes against the full precision ones.
+void terra_scene_log_accelerator_memory ( const TerraScene* scene ) {
+    const float kb = 1.f / 1024;
+
+    if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
+        const TerraBVH* bvh = &scene->bvh;
+        terra_log ( "BVH: %d nodes %.1f KB (%zu bytes per node), primitives %.1f KB, leaf triangles %.1f KB\n",
+                    bvh->nodes_count, bvh->nodes_count * sizeof ( TerraBVHNode ) * kb, sizeof ( TerraBVHNode ),
+                    bvh->primitives_count * sizeof ( uint32_t ) * kb, TERRA_TRIANGLE_PACKETS_COUNT ( bvh->primitives_count ) * sizeof ( TerraTrianglePacket ) * kb );
+    } else if ( terra_accelerator_is_wide ( scene->opts.accelerator ) ) {
+        const TerraBVHWide* bvh = &scene->bvh_wide;
+        size_t node_size = terra_bvh_wide_node_size ( bvh );
+        size_t full_size = bvh->width == 4 ? sizeof ( TerraBVH4Node ) : sizeof ( TerraBVH8Node );
+        size_t binary_size = bvh->binary_nodes_count * sizeof ( TerraBVHNode );
+        terra_log ( "BVH%d%s: %d nodes %.1f KB (%zu bytes per node), primitives %.1f KB, leaf triangles %.1f KB\n", bvh->width,
+                    bvh->quantized ? " quantized" : "", bvh->nodes_count, bvh->nodes_count * node_size * kb, node_size,
+                    bvh->primitives_count * sizeof ( uint32_t ) * kb, TERRA_TRIANGLE_PACKETS_COUNT ( bvh->primitives_count ) * sizeof ( TerraTrianglePacket ) * kb );
+
+        if ( bvh->quantized ) {
+            terra_log ( "    full precision nodes %.1f KB (%.2fx)\n", bvh->nodes_count * full_size * kb, ( float ) full_size / node_size );
+        }
+
+        terra_log ( "    binary nodes %.1f KB (%.2fx)\n", binary_size * kb, ( float ) binary_size / ( bvh->nodes_count * node_size ) );
+    } else if ( scene->opts.accelerator == kTerraAcceleratorKDTree ) {
+        const TerraKDTree* kdtree = &scene->kdtree;
+        terra_log ( "KD-tree: %d nodes %.1f KB (%zu bytes per node), primitive references %d %.1f KB, leaf triangles %.1f KB\n",
+                    kdtree->nodes_count, kdtree->nodes_count * sizeof ( TerraKDNode ) * kb, sizeof ( TerraKDNode ), kdtree->primitives_count,
+                    kdtree->primitives_count * sizeof ( uint32_t ) * kb, TERRA_TRIANGLE_PACKETS_COUNT ( kdtree->primitives_count ) * sizeof ( TerraTrianglePacket ) * kb );
+    }
+}
+
+// Returns false if the refit tree should be rebuilt instead
+bool terra_scene_refit_accelerator ( TerraScene* scene ) {
+    bool refit;
+
+    if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
+        refit = terra_bvh_refit ( &scene->bvh, scene->objects, &scene->new_opts.jobs );
+    } else if ( terra_accelerator_is_wide ( scene->opts.accelerator ) ) {
+        refit = terra_bvh_wide_refit ( &scene->bvh_wide, scene->objects, &scene->new_opts.jobs );
+    } else if ( scene->opts.accelerator == kTerraAcceleratorKDTree ) {
+        // Split planes can't follow the geometry, triangles could move out of the leaves referencing them
+        terra_log ( "KD-tree can't be refit, rebuilding\n" );
+        return false;
+    } else {
+        assert ( false );
+        return false;
+    }
+
+    if ( !refit ) {
+        terra_log ( "Refit accelerator SAH cost degraded too much, rebuilding\n" );
+    }
+
+    return refit;
+}
+
+void terra_scene_destroy_accelerator ( TerraScene* scene ) {
+    if ( scene->two_level ) {
+        terra_bvh_two_level_destroy ( &scene->two_level_bvh );
+    } else if ( scene->accelerator_mapping.data != NULL ) {
+        terra_bvh_cache_unmap ( &scene->accelerator_mapping );
+    } else if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
+        terra_bvh_destroy ( &scene->bvh );
+    } else if ( terra_accelerator_is_wide ( scene->opts.accelerator ) ) {
+        terra_bvh_wide_destroy ( &scene->bvh_wide );
+    } else if ( scene->opts.accelerator == kTerraAcceleratorKDTree ) {
+        terra_kdtree_destroy ( &scene->kdtree );
+    } else {
+        assert ( false );
+    }
+}
+
+void terra_scene_create_accelerator ( TerraScene* scene ) {
+    if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
+        terra_bvh_create ( &scene->bvh, scene->objects, ( int ) scene->objects_pop, scene->opts.bvh_builder, &scene->opts.jobs );
+    } else if ( scene->opts.accelerator == kTerraAcceleratorBVH4 ) {
+        terra_bvh_wide_create ( &scene->bvh_wide, 4, false, scene->objects, ( int ) scene->objects_pop, scene->opts.bvh_builder, &scene->opts.jobs );
+    } else if ( scene->opts.accelerator == kTerraAcceleratorBVH4Quantized ) {
+        terra_bvh_wide_create ( &scene->bvh_wide, 4, true, scene->objects, ( int ) scene->objects_pop, scene->opts.bvh_builder, &scene->opts.jobs );
+    } else if ( scene->opts.accelerator == kTerraAcceleratorBVH8 ) {
+        terra_bvh_wide_create ( &scene->bvh_wide, 8, false, scene->objects, ( int ) scene->objects_pop, scene->opts.bvh_builder, &scene->opts.jobs );
+    } else if ( scene->opts.accelerator == kTerraAcceleratorKDTree ) {
+        terra_kdtree_create ( &scene->kdtree, scene->objects, ( int ) scene->objects_pop );
+    } else {
+        assert ( false );
+    }
+}
+
+bool terra_scene_load_accelerator ( TerraScene* scene, const char* path, uint64_t hash ) {
+    bool loaded;
+
+    if ( terra_accelerator_is_wide ( scene->opts.accelerator ) ) {
+        loaded = terra_bvh_cache_load ( path, hash, NULL, &scene->bvh_wide, &scene->accelerator_mapping );
+    } else {
+        loaded = terra_bvh_cache_load ( path, hash, &scene->bvh, NULL, &scene->accelerator_mapping );
+    }
+
+    if ( loaded ) {
+        terra_log ( "Accelerator loaded from %s\n", path );
+    }
+
+    return loaded;
+}
+
+// The top level is built over the live instances plus an identity instance for every object without any
+void terra_scene_create_top_level ( TerraScene* scene ) {
+    size_t count = 0;
+    TerraInstance* instances = ( TerraInstance* ) terra_malloc ( sizeof ( TerraInstance ) * ( scene->instances_active + scene->objects_pop + 1 ) );
+    bool* instanced = ( bool* ) terra_malloc ( sizeof ( bool ) * ( scene->objects_pop + 1 ) );
+    memset ( instanced, 0, sizeof ( bool ) * ( scene->objects_pop + 1 ) );
+
+    for ( size_t i = 0; i < scene->instances_pop; ++i ) {
+        if ( scene->instances[i].object_idx != UINT32_MAX ) {
+            instances[count++] = scene->instances[i];
+            instanced[scene->instances[i].object_idx] = true;
+        }
+    }
+
+    TerraFloat4x4 identity;
+    memset ( &identity, 0, sizeof ( TerraFloat4x4 ) );
+    identity.rows[0].x = identity.rows[1].y = identity.rows[2].z = identity.rows[3].w = 1.f;
+
+    for ( size_t i = 0; i < scene->objects_pop; ++i ) {
+        if ( !instanced[i] ) {
+            terra_instance_init ( &instances[count++], ( uint32_t ) i, &identity );
+        }
+    }
+
+    terra_bvh_two_level_create_top ( &scene->two_level_bvh, instances, ( int ) count, &scene->opts.jobs );
+    terra_free ( instanced );
+    terra_free ( instances );
+}
+
+bool terra_scene_object_instanced ( const TerraScene* scene, size_t object_idx ) {
+    for ( size_t i = 0; i < scene->instances_pop; ++i ) {
+        if ( scene->instances[i].object_idx == object_idx ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool terra_accelerator_is_wide ( TerraAccelerator accelerator ) {
+    return accelerator == kTerraAcceleratorBVH4 || accelerator == kTerraAcceleratorBVH4Quantized || accelerator == kTerraAcceleratorBVH8;
+}
+
 //--------------------------------------------------------------------------------------------------
 // @TerraLight
 //--------------------------------------------------------------------------------------------------
-size_t terra_light_pick_triangle ( const TerraLight* light, float e, float* pdf ) {
-    size_t i = ( size_t ) ( e * light->object->triangles_count );
-    *pdf = 1.f / light->object->triangles_count;
-    return i;
-}
-
 void terra_light_sample_triangle ( const TerraLight* light, size_t triangle_idx, float e1, float e2,
                                    TerraFloat3* pos, TerraFloat2* uv, TerraFloat3* norm, float* pdf ) {
     TerraTriangle* tri = &light->object->triangles[triangle_idx];
@@ -1709,6 +2761,11 @@ TerraRay terra_ray ( const TerraFloat3* origin, const TerraFloat3* direction ) {
     return ray;
 }
 
+// Bit i is set if the direction is negative along axis i
+int terra_ray_octant ( const TerraRay* ray ) {
+    return ( ray->direction.x < 0.f ) | ( ray->direction.y < 0.f ) << 1 | ( ray->direction.z < 0.f ) << 2;
+}
+
 //--------------------------------------------------------------------------------------------------
 // @TerraSurface
 //--------------------------------------------------------------------------------------------------
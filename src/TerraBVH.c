@@ -7,19 +7,214 @@
 // libc
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <xmmintrin.h>
 
 typedef struct {
-	TerraAABB aabb;
-	unsigned int index;
-	int type;
+    TerraAABB aabb;
+    TerraFloat3 center;
+    unsigned int index;
 } TerraBVHVolume;
 
+// Number of buckets the centroid extent of a node is partitioned into on each axis when
+// looking for the best SAH split. More bins approach the quality of the full sweep at a higher build cost.
+#ifndef TERRA_BVH_SAH_BINS
+#define TERRA_BVH_SAH_BINS 16
+#endif
+
+// SAH cost of visiting a node (two box tests) and of testing a single triangle. A node is turned into
+// a leaf whenever testing all of its triangles is cheaper than the best split.
+#ifndef TERRA_BVH_SAH_TRAVERSAL_COST
+#define TERRA_BVH_SAH_TRAVERSAL_COST 2.f
+#endif
+
+#ifndef TERRA_BVH_SAH_INTERSECTION_COST
+#define TERRA_BVH_SAH_INTERSECTION_COST 1.f
+#endif
+
+// Nodes holding more triangles than this are always split, regardless of the SAH cost.
+#ifndef TERRA_BVH_LEAF_MAX_PRIMITIVES
+#define TERRA_BVH_LEAF_MAX_PRIMITIVES 8
+#endif
+
+// Marks the node slots left unused by subtrees collapsed into a leaf, removed once the build is done.
+#define TERRA_BVH_NODE_UNUSED -2
+
+// Nodes holding at least this many volumes have their binning and partitioning split across
+// the client workers. Below it the overhead of dispatching outweighs the work.
+#ifndef TERRA_BVH_PARALLEL_SPLIT_MIN
+#define TERRA_BVH_PARALLEL_SPLIT_MIN ( 1 << 14 )
+#endif
+
+// Once the top levels are split, the remaining subtrees are built independently. Aiming at a few
+// subtrees per worker keeps the threads busy when the subtrees end up unbalanced.
+#ifndef TERRA_BVH_SUBTREES_PER_WORKER
+#define TERRA_BVH_SUBTREES_PER_WORKER 8
+#endif
+
+// LBVH ranges holding up to this many volumes are turned into leaves. There's no SAH to decide,
+// small leaves make up for the looser bounds of the Morton splits.
+#ifndef TERRA_BVH_LBVH_LEAF_PRIMITIVES
+#define TERRA_BVH_LBVH_LEAF_PRIMITIVES 4
+#endif
+
+// Centers are quantized on 10 bits per axis, interleaved into 30 bits Morton codes which are
+// sorted 8 bits at a time.
+#define TERRA_BVH_MORTON_AXIS_BITS 10
+#define TERRA_BVH_RADIX_BITS 8
+#define TERRA_BVH_RADIX_SIZE ( 1 << TERRA_BVH_RADIX_BITS )
+#define TERRA_BVH_RADIX_PASSES 4
+
+// SBVH [Stich et al. 2009]. Spatial splits are only evaluated when the two sides of the best object split
+// overlap by more than this fraction of the root surface area.
+#ifndef TERRA_BVH_SBVH_MIN_OVERLAP
+#define TERRA_BVH_SBVH_MIN_OVERLAP 1e-5f
+#endif
+
+// Spatial splits duplicate the references to the triangles straddling the split plane. Once the references
+// outgrow the triangles by this fraction, only object splits are considered.
+#ifndef TERRA_BVH_SBVH_DUPLICATION_BUDGET
+#define TERRA_BVH_SBVH_DUPLICATION_BUDGET 1.f
+#endif
+
+// Number of slabs the node bounds are cut in on each axis when looking for the best spatial split
+#ifndef TERRA_BVH_SBVH_BINS
+#define TERRA_BVH_SBVH_BINS 16
+#endif
+
+// A refit tree whose SAH cost grew past this many times the one it was built with is rebuilt instead
+#ifndef TERRA_BVH_REFIT_MAX_DEGRADATION
+#define TERRA_BVH_REFIT_MAX_DEGRADATION 1.5f
+#endif
+
+// Tree levels with at least this many nodes are refit in parallel
+#ifndef TERRA_BVH_REFIT_PARALLEL_MIN
+#define TERRA_BVH_REFIT_PARALLEL_MIN 1024
+#endif
+
+typedef struct {
+    TerraAABB aabb;
+    int       count;
+} TerraBVHBin;
+
+// Centroid bins of a range of volumes on all three axis
+typedef struct {
+    TerraBVHBin bins[3][TERRA_BVH_SAH_BINS];
+} TerraBVHBinning;
+
+// Split plane found by the SAH sweep, volumes whose centroid falls in bins [0, bin] go to the left
+typedef struct {
+    int       axis; // -1 if there's no valid split plane
+    int       bin;
+    float     cost;
+    float     axis_min;
+    float     axis_scale;
+    TerraAABB left_aabb;
+    TerraAABB right_aabb;
+} TerraBVHSplit;
+
+// Slab of the node bounds holding the clipped references, entries/exits count the references starting/ending in it
+typedef struct {
+    TerraAABB aabb;
+    int       entries;
+    int       exits;
+} TerraBVHSpatialBin;
+
+// Spatial split plane, references entirely below it go to the left
+typedef struct {
+    int   axis;     // -1 if there's no valid split plane
+    float plane;
+    float cost;
+} TerraBVHSpatialSplit;
+
+// SBVH node to be created. Spatial splits duplicate references, each task owns a copy of the volumes it holds.
+typedef struct {
+    TerraBVHVolume* volumes;
+    int             volumes_count;
+    int             parent_idx;
+    int             parent_side;
+} TerraBVHSpatialTask;
+
+typedef struct {
+    TerraBVH*             bvh;
+    const TerraTriangle** triangles;    // Triangle of each global primitive index, saves a lookup per clipped reference
+    int                   nodes_cap;
+    int                   primitives_cap;
+    int                   references_count;
+    int                   references_max;
+    float                 root_area;
+} TerraBVHSpatialBuild;
+
+// Rays of a packet split by axis for the SIMD slab tests, padded to a multiple of 4 with rays that never hit.
+// The interval bounds of the origins and inverse directions cull boxes for the whole packet, the distances along
+// an axis are only bounded if all the directions have the same (non zero) sign on it.
+typedef struct {
+    __m128 origin[3][TERRA_BVH_PACKET_MAX_RAYS / 4];
+    __m128 inv_direction[3][TERRA_BVH_PACKET_MAX_RAYS / 4];
+    __m128 min_d[TERRA_BVH_PACKET_MAX_RAYS / 4];       // Closest hit of each ray, -1 for the padding
+    int    groups_count;
+    float  origin_min[3];
+    float  origin_max[3];
+    float  inv_min[3];
+    float  inv_max[3];
+    bool   bounded[3];
+    bool   positive[3];
+} TerraBVHPacket;
+
+// Node to be created along with the volumes it holds and the aabb it's contained in.
+// The parent side is rewritten if the node ends up being a leaf.
+typedef struct {
+    int              volumes_start;
+    int              volumes_end;
+    int              node_idx;
+    int              parent_idx;
+    int              parent_side;
+    const TerraAABB* aabb;
+} TerraBVHBuildTask;
+
 static float       terra_aabb_surface_area ( const TerraAABB* aabb );
 static TerraFloat3 terra_aabb_center ( const TerraAABB* aabb );
-static int         terra_bvh_volume_compare_x ( const void* left, const void* right );
-static int         terra_bvh_volume_compare_y ( const void* left, const void* right );
-static int         terra_bvh_volume_compare_z ( const void* left, const void* right );
-static int         terra_bvh_sah_split_volumes ( TerraBVHVolume* volumes, int volumes_count, const TerraAABB* container );
+static void        terra_aabb_init_empty ( TerraAABB* aabb );
+static void        terra_aabb_fit_aabb ( TerraAABB* aabb, const TerraAABB* other );
+static void        terra_aabb_fit_point ( TerraAABB* aabb, const TerraFloat3* point );
+static float       terra_f3_axis ( const TerraFloat3* vec, int axis );
+static void        terra_bvh_binning_init ( TerraBVHBinning* binning );
+static void        terra_bvh_binning_add ( TerraBVHBinning* binning, const TerraBVHVolume* volumes, int volumes_count, const TerraAABB* centroid_aabb );
+static void        terra_bvh_binning_merge ( TerraBVHBinning* binning, const TerraBVHBinning* other );
+static void        terra_bvh_sah_find_split ( const TerraBVHBinning* binning, const TerraAABB* centroid_aabb, const TerraAABB* container, TerraBVHSplit* split );
+static int         terra_bvh_split_side ( const TerraBVHSplit* split, const TerraBVHVolume* volume );
+static int         terra_bvh_sah_split_volumes ( TerraBVHVolume* volumes, int volumes_count, const TerraAABB* container, TerraAABB* left_aabb, TerraAABB* right_aabb,
+        float* cost_out );
+static int         terra_bvh_sah_split_volumes_parallel ( const TerraJobSystem* jobs, TerraBVHVolume* volumes, TerraBVHVolume* scratch, int volumes_count,
+        const TerraAABB* container, TerraAABB* left_aabb, TerraAABB* right_aabb, float* cost_out );
+static bool        terra_bvh_emit_leaf ( TerraBVH* bvh, const TerraBVHBuildTask* task, float split_cost );
+static int         terra_bvh_emit_node ( TerraBVH* bvh, const TerraBVHBuildTask* task, int split_idx,
+                                         const TerraAABB* left_aabb, const TerraAABB* right_aabb, TerraBVHBuildTask* children_out );
+static void        terra_bvh_build_subtree ( TerraBVH* bvh, TerraBVHVolume* volumes, const TerraBVHBuildTask* task );
+static void        terra_bvh_build_parallel ( TerraBVH* bvh, TerraBVHVolume* volumes, const TerraBVHBuildTask* root, const TerraJobSystem* jobs );
+static void        terra_bvh_sbvh_find_split ( const TerraBVHSpatialBuild* build, const TerraBVHVolume* volumes, int volumes_count, const TerraAABB* aabb,
+        TerraBVHSpatialSplit* split );
+static int         terra_bvh_sbvh_partition_spatial ( TerraBVHSpatialBuild* build, const TerraBVHVolume* volumes, int volumes_count, const TerraBVHSpatialSplit* split,
+        TerraBVHVolume* left, TerraBVHVolume* right, int* right_count_out );
+static int         terra_bvh_sbvh_partition_object ( TerraBVHVolume* volumes, int volumes_count, const TerraBVHSplit* split );
+static void        terra_bvh_sbvh_emit_leaf ( TerraBVHSpatialBuild* build, const TerraBVHSpatialTask* task );
+static void        terra_bvh_sbvh_build ( TerraBVH* bvh, const TerraObject* objects, TerraBVHVolume* volumes, int volumes_count );
+static TerraBVHVolume* terra_bvh_morton_sort ( TerraBVHVolume* volumes, int volumes_count, const TerraAABB* aabb, const TerraJobSystem* jobs, int chunks_count,
+        uint32_t* codes_out );
+static int         terra_bvh_lbvh_split ( const uint32_t* codes, int volumes_start, int volumes_end );
+static void        terra_bvh_lbvh_build_subtree ( TerraBVH* bvh, const uint32_t* codes, const TerraBVHBuildTask* task );
+static void        terra_bvh_lbvh_refit ( TerraBVH* bvh, const TerraBVHVolume* volumes, int node_idx );
+static void        terra_bvh_lbvh_build ( TerraBVH* bvh, const TerraBVHVolume* volumes, const uint32_t* codes, const TerraBVHBuildTask* root,
+                                          const TerraJobSystem* jobs, bool parallel );
+static void        terra_bvh_build ( TerraBVH* bvh, const TerraObject* objects, TerraBVHVolume* volumes, int volumes_count, const TerraAABB* scene_aabb,
+                                      TerraBVHBuilder builder, const TerraJobSystem* jobs, int chunks_count, bool parallel );
+static void        terra_bvh_layout ( TerraBVH* bvh );
+static float       terra_bvh_sah_cost ( const TerraBVH* bvh );
+static void        terra_bvh_refit_node ( void* bvh, int node_idx );
+static void        terra_bvh_packet_init ( const TerraRay* rays, int rays_count, TerraBVHPacket* packet );
+static bool        terra_bvh_packet_may_hit ( const TerraBVHPacket* packet, const TerraAABB* aabb, float t_max, float* t_out );
+static int         terra_bvh_packet_slab4 ( const TerraBVHPacket* packet, int group, const TerraAABB* aabb );
+static int         terra_bvh_packet_first_hit ( const TerraBVHPacket* packet, int first, int rays_count, const TerraAABB* aabb );
 
 float terra_aabb_surface_area ( const TerraAABB* aabb ) {
     float w = aabb->max.x - aabb->min.x;
@@ -34,51 +229,78 @@ TerraFloat3 terra_aabb_center ( const TerraAABB* aabb ) {
     return center;
 }
 
-int terra_bvh_volume_compare_x ( const void* left, const void* right ) {
-    const TerraAABB* left_aabb = & ( ( const TerraBVHVolume* ) left )->aabb;
-    const TerraAABB* right_aabb = & ( ( const TerraBVHVolume* ) right )->aabb;
+void terra_aabb_init_empty ( TerraAABB* aabb ) {
+    aabb->min = terra_f3_set1 ( FLT_MAX );
+    aabb->max = terra_f3_set1 ( -FLT_MAX );
+}
 
-    if ( terra_aabb_center ( left_aabb ).x < terra_aabb_center ( right_aabb ).x ) {
-        return true;
-    }
+// Volumes are already padded by terra_aabb_fit_triangle, no epsilon is added here as it would
+// accumulate for every volume merged into the same box.
+void terra_aabb_fit_aabb ( TerraAABB* aabb, const TerraAABB* other ) {
+    aabb->min.x = terra_minf ( aabb->min.x, other->min.x );
+    aabb->min.y = terra_minf ( aabb->min.y, other->min.y );
+    aabb->min.z = terra_minf ( aabb->min.z, other->min.z );
+    aabb->max.x = terra_maxf ( aabb->max.x, other->max.x );
+    aabb->max.y = terra_maxf ( aabb->max.y, other->max.y );
+    aabb->max.z = terra_maxf ( aabb->max.z, other->max.z );
+}
 
-    return false;
+void terra_aabb_fit_point ( TerraAABB* aabb, const TerraFloat3* point ) {
+    aabb->min.x = terra_minf ( aabb->min.x, point->x );
+    aabb->min.y = terra_minf ( aabb->min.y, point->y );
+    aabb->min.z = terra_minf ( aabb->min.z, point->z );
+    aabb->max.x = terra_maxf ( aabb->max.x, point->x );
+    aabb->max.y = terra_maxf ( aabb->max.y, point->y );
+    aabb->max.z = terra_maxf ( aabb->max.z, point->z );
 }
 
-int terra_bvh_volume_compare_y ( const void* left, const void* right ) {
-    const TerraAABB* left_aabb = & ( ( const TerraBVHVolume* ) left )->aabb;
-    const TerraAABB* right_aabb = & ( ( const TerraBVHVolume* ) right )->aabb;
+float terra_f3_axis ( const TerraFloat3* vec, int axis ) {
+    return ( ( const float* ) vec ) [axis];
+}
 
-    if ( terra_aabb_center ( left_aabb ).y < terra_aabb_center ( right_aabb ).y ) {
-        return true;
+void terra_bvh_binning_init ( TerraBVHBinning* binning ) {
+    for ( int axis = 0; axis < 3; ++axis ) {
+        for ( int b = 0; b < TERRA_BVH_SAH_BINS; ++b ) {
+            terra_aabb_init_empty ( &binning->bins[axis][b].aabb );
+            binning->bins[axis][b].count = 0;
+        }
     }
-
-    return false;
 }
 
-int terra_bvh_volume_compare_z ( const void* left, const void* right ) {
-    const TerraAABB* left_aabb = & ( ( const TerraBVHVolume* ) left )->aabb;
-    const TerraAABB* right_aabb = & ( ( const TerraBVHVolume* ) right )->aabb;
+// The bins are laid out along the extent of the centroids, not of the volumes
+void terra_bvh_binning_add ( TerraBVHBinning* binning, const TerraBVHVolume* volumes, int volumes_count, const TerraAABB* centroid_aabb ) {
+    for ( int axis = 0; axis < 3; ++axis ) {
+        float axis_min = terra_f3_axis ( &centroid_aabb->min, axis );
+        float axis_extent = terra_f3_axis ( &centroid_aabb->max, axis ) - axis_min;
 
-    if ( terra_aabb_center ( left_aabb ).z < terra_aabb_center ( right_aabb ).z ) {
-        return true;
-    }
+        if ( axis_extent <= 0.f ) {
+            continue;
+        }
 
-    return false;
+        float axis_scale = TERRA_BVH_SAH_BINS / axis_extent;
+        TerraBVHBin* bins = binning->bins[axis];
+
+        for ( int i = 0; i < volumes_count; ++i ) {
+            int b = ( int ) ( ( terra_f3_axis ( &volumes[i].center, axis ) - axis_min ) * axis_scale );
+            b = b < TERRA_BVH_SAH_BINS ? b : TERRA_BVH_SAH_BINS - 1;
+            terra_aabb_fit_aabb ( &bins[b].aabb, &volumes[i].aabb );
+            ++bins[b].count;
+        }
+    }
 }
 
-void terra_aabb_fit_aabb ( TerraAABB* aabb, const TerraAABB* other ) {
-    aabb->min.x = terra_minf ( aabb->min.x, other->min.x );
-    aabb->min.y = terra_minf ( aabb->min.y, other->min.y );
-    aabb->min.z = terra_minf ( aabb->min.z, other->min.z );
-    aabb->max.x = terra_maxf ( aabb->max.x, other->max.x ) + terra_Epsilon;
-    aabb->max.y = terra_maxf ( aabb->max.y, other->max.y ) + terra_Epsilon;
-    aabb->max.z = terra_maxf ( aabb->max.z, other->max.z ) + terra_Epsilon;
+void terra_bvh_binning_merge ( TerraBVHBinning* binning, const TerraBVHBinning* other ) {
+    for ( int axis = 0; axis < 3; ++axis ) {
+        for ( int b = 0; b < TERRA_BVH_SAH_BINS; ++b ) {
+            terra_aabb_fit_aabb ( &binning->bins[axis][b].aabb, &other->bins[axis][b].aabb );
+            binning->bins[axis][b].count += other->bins[axis][b].count;
+        }
+    }
 }
 
-int terra_bvh_sah_split_volumes ( TerraBVHVolume* volumes, int volumes_count, const TerraAABB* container ) {
-    float* left_area = ( float* ) terra_malloc ( sizeof ( float ) * ( volumes_count ) );
-    float* right_area = ( float* ) terra_malloc ( sizeof ( float ) * ( volumes_count ) );
+// Binned SAH [Wald 2007]. The split planes between the bins are evaluated in two linear sweeps
+// on each of the three axis.
+void terra_bvh_sah_find_split ( const TerraBVHBinning* binning, const TerraAABB* centroid_aabb, const TerraAABB* container, TerraBVHSplit* split ) {
     float container_area;
 
     if ( container != NULL ) {
@@ -88,223 +310,1970 @@ int terra_bvh_sah_split_volumes ( TerraBVHVolume* volumes, int volumes_count, co
     }
 
     float min_cost = FLT_MAX;
-    int min_cost_idx = -1;
-    // TODO for other axis
-    qsort ( volumes, volumes_count, sizeof ( *volumes ), terra_bvh_volume_compare_x );
-    TerraAABB aabb;
-    aabb.min = terra_f3_set1 ( FLT_MAX );
-    aabb.max = terra_f3_set1 ( -FLT_MAX );
+    split->axis = -1;
+    split->bin = -1;
+    split->cost = FLT_MAX;
+
+    for ( int axis = 0; axis < 3; ++axis ) {
+        float axis_min = terra_f3_axis ( &centroid_aabb->min, axis );
+        float axis_extent = terra_f3_axis ( &centroid_aabb->max, axis ) - axis_min;
+
+        if ( axis_extent <= 0.f ) {
+            continue;
+        }
+
+        const TerraBVHBin* bins = binning->bins[axis];
+
+        // right_aabb[b] and right_count[b] describe the volumes in bins (b, TERRA_BVH_SAH_BINS)
+        TerraAABB right_aabb[TERRA_BVH_SAH_BINS - 1];
+        int right_count[TERRA_BVH_SAH_BINS - 1];
+        TerraAABB aabb;
+        terra_aabb_init_empty ( &aabb );
+        int count = 0;
+
+        for ( int b = TERRA_BVH_SAH_BINS - 1; b > 0; --b ) {
+            terra_aabb_fit_aabb ( &aabb, &bins[b].aabb );
+            count += bins[b].count;
+            right_aabb[b - 1] = aabb;
+            right_count[b - 1] = count;
+        }
+
+        terra_aabb_init_empty ( &aabb );
+        count = 0;
+
+        for ( int b = 0; b < TERRA_BVH_SAH_BINS - 1; ++b ) {
+            terra_aabb_fit_aabb ( &aabb, &bins[b].aabb );
+            count += bins[b].count;
+
+            if ( count == 0 || right_count[b] == 0 ) {
+                continue;
+            }
+
+            float cost = TERRA_BVH_SAH_TRAVERSAL_COST + TERRA_BVH_SAH_INTERSECTION_COST *
+                         ( count * terra_aabb_surface_area ( &aabb ) + right_count[b] * terra_aabb_surface_area ( &right_aabb[b] ) ) / container_area;
+
+            if ( cost < min_cost ) {
+                min_cost = cost;
+                split->cost = cost;
+                split->axis = axis;
+                split->bin = b;
+                split->axis_min = axis_min;
+                split->axis_scale = TERRA_BVH_SAH_BINS / axis_extent;
+                split->left_aabb = aabb;
+                split->right_aabb = right_aabb[b];
+            }
+        }
+    }
+}
+
+// 0 if the volume goes to the left of the split plane, 1 otherwise. Matches the binning in terra_bvh_binning_add
+int terra_bvh_split_side ( const TerraBVHSplit* split, const TerraBVHVolume* volume ) {
+    int b = ( int ) ( ( terra_f3_axis ( &volume->center, split->axis ) - split->axis_min ) * split->axis_scale );
+    b = b < TERRA_BVH_SAH_BINS ? b : TERRA_BVH_SAH_BINS - 1;
+    return b <= split->bin ? 0 : 1;
+}
+
+// The volumes are binned and partitioned in place around the cheapest SAH plane.
+// Returns the index of the last volume belonging to the left side. (volumes_count >= 2)
+// left_aabb and right_aabb are set to the bounds of the two sides, cost_out to the SAH cost of the split
+// (FLT_MAX if the volumes could not be told apart and have been split in half).
+int terra_bvh_sah_split_volumes ( TerraBVHVolume* volumes, int volumes_count, const TerraAABB* container, TerraAABB* left_aabb, TerraAABB* right_aabb,
+                                  float* cost_out ) {
+    TerraAABB centroid_aabb;
+    terra_aabb_init_empty ( &centroid_aabb );
 
     for ( int i = 0; i < volumes_count; ++i ) {
-        terra_aabb_fit_aabb ( &aabb, &volumes[i].aabb );
-        left_area[i] = terra_aabb_surface_area ( &aabb );
+        terra_aabb_fit_point ( &centroid_aabb, &volumes[i].center );
     }
 
-    aabb.min = terra_f3_set1 ( FLT_MAX );
-    aabb.max = terra_f3_set1 ( -FLT_MAX );
+    TerraBVHBinning binning;
+    terra_bvh_binning_init ( &binning );
+    terra_bvh_binning_add ( &binning, volumes, volumes_count, &centroid_aabb );
 
-    for ( int i = volumes_count - 1; i >= 0; --i ) {
-        terra_aabb_fit_aabb ( &aabb, &volumes[i].aabb );
-        right_area[i] = terra_aabb_surface_area ( &aabb );
+    TerraBVHSplit split;
+    terra_bvh_sah_find_split ( &binning, &centroid_aabb, container, &split );
+
+    int left = 0;
+
+    if ( split.axis != -1 ) {
+        int right = volumes_count - 1;
+
+        while ( left <= right ) {
+            if ( terra_bvh_split_side ( &split, &volumes[left] ) == 0 ) {
+                ++left;
+            } else {
+                TerraBVHVolume tmp = volumes[left];
+                volumes[left] = volumes[right];
+                volumes[right] = tmp;
+                --right;
+            }
+        }
     }
 
-    for ( int i = 0; i < volumes_count; ++i ) {
-        int left_count = i + 1;
-        int right_count = volumes_count - left_count;
-        // we assume traversal_step_cost is 0 and intersection_test_cost is 1
-        float cost = left_count * left_area[i] / container_area + right_count * right_area[i] / container_area;
+    // All the centroids are coincident, any split is as good as the other
+    if ( left == 0 || left == volumes_count ) {
+        left = volumes_count / 2;
+        terra_aabb_init_empty ( left_aabb );
+        terra_aabb_init_empty ( right_aabb );
 
-        if ( cost < min_cost ) {
-            min_cost = cost;
-            min_cost_idx = i;
+        for ( int i = 0; i < volumes_count; ++i ) {
+            terra_aabb_fit_aabb ( i < left ? left_aabb : right_aabb, &volumes[i].aabb );
         }
+
+        *cost_out = FLT_MAX;
+        return left - 1;
     }
 
-    free ( left_area );
-    free ( right_area );
-    return min_cost_idx;
+    *left_aabb = split.left_aabb;
+    *right_aabb = split.right_aabb;
+    *cost_out = split.cost;
+    return left - 1;
 }
 
-void terra_bvh_create ( TerraBVH* bvh, const TerraObject* objects, int objects_count ) {
-    // init the scene aabb and the list of volumes
-    // a volume is a scene primitive (triangle) wrapped in an aabb
-    TerraAABB scene_aabb;
-    scene_aabb.min = terra_f3_set1 ( FLT_MAX );
-    scene_aabb.max = terra_f3_set1 ( -FLT_MAX );
-    int volumes_count = 0;
+//--------------------------------------------------------------------------------------------------
+// Parallel split. The range is cut in one chunk per worker, each job works on its own chunk and
+// the partial results are merged on the calling thread between the passes.
+//--------------------------------------------------------------------------------------------------
+typedef struct {
+    TerraBVHVolume*  volumes;
+    TerraBVHVolume*  scratch;
+    int              volumes_count;
+    int              chunks_count;
+    TerraAABB*       chunk_centroid_aabbs;
+    TerraBVHBinning* chunk_binnings;
+    int*             chunk_left_counts;
+    int*             chunk_left_offsets;
+    int*             chunk_right_offsets;
+    TerraAABB        centroid_aabb;
+    TerraBVHSplit    split;
+} TerraBVHParallelSplit;
 
-    for ( int i = 0; i < objects_count; ++i ) {
-        volumes_count += objects[i].triangles_count;
+static void terra_bvh_chunk_range ( const TerraBVHParallelSplit* ps, size_t chunk, int* begin, int* end ) {
+    *begin = ( int ) ( ( int64_t ) ps->volumes_count * chunk / ps->chunks_count );
+    *end = ( int ) ( ( int64_t ) ps->volumes_count * ( chunk + 1 ) / ps->chunks_count );
+}
+
+static void terra_bvh_centroid_bounds_job ( void* args, size_t chunk ) {
+    TerraBVHParallelSplit* ps = ( TerraBVHParallelSplit* ) args;
+    int begin, end;
+    terra_bvh_chunk_range ( ps, chunk, &begin, &end );
+    TerraAABB* aabb = &ps->chunk_centroid_aabbs[chunk];
+    terra_aabb_init_empty ( aabb );
+
+    for ( int i = begin; i < end; ++i ) {
+        terra_aabb_fit_point ( aabb, &ps->volumes[i].center );
     }
+}
 
-    TerraBVHVolume* volumes = ( TerraBVHVolume* ) terra_malloc ( sizeof ( TerraBVHVolume ) * volumes_count );
+static void terra_bvh_binning_job ( void* args, size_t chunk ) {
+    TerraBVHParallelSplit* ps = ( TerraBVHParallelSplit* ) args;
+    int begin, end;
+    terra_bvh_chunk_range ( ps, chunk, &begin, &end );
+    terra_bvh_binning_init ( &ps->chunk_binnings[chunk] );
+    terra_bvh_binning_add ( &ps->chunk_binnings[chunk], ps->volumes + begin, end - begin, &ps->centroid_aabb );
+}
 
-    for ( int i = 0; i < volumes_count; ++i ) {
-        volumes[i].aabb.min = terra_f3_set1 ( FLT_MAX );
-        volumes[i].aabb.max = terra_f3_set1 ( -FLT_MAX );
-    }
-
-    int p = 0;
-
-    // build the scene aabb and the volumes aabb
-    for ( int j = 0; j < objects_count; ++j ) {
-        for ( int i = 0; i < objects[j].triangles_count; ++i, ++p ) {
-            terra_aabb_fit_triangle ( &scene_aabb, &objects[j].triangles[i] );
-            terra_aabb_fit_triangle ( &volumes[p].aabb, &objects[j].triangles[i] );
-            volumes[p].type = 1;
-            volumes[p].index = j | ( i << 8 );
-        }
-    }
-
-    // build the bvh. we do iterative building using a stack
-    bvh->nodes = ( TerraBVHNode* ) terra_malloc ( sizeof ( TerraBVHNode ) * volumes_count * 2 );
-    bvh->nodes_count = 1;
-    // a stack task holds the idx of the node to be created along with its aabb
-    // and the volumes it holds
-    typedef struct {
-        int volumes_start;
-        int volumes_end;
-        int node_idx;
-        TerraAABB* aabb;
-    } StackTask;
-    StackTask* stack = ( StackTask* ) terra_malloc ( sizeof ( StackTask ) * volumes_count * 2 );
-    int stack_idx = 0;
-    stack[stack_idx].volumes_start = 0;
-    stack[stack_idx].volumes_end = volumes_count;
-    stack[stack_idx].node_idx = 0;
-    stack[stack_idx].aabb = &scene_aabb;
-    ++stack_idx;
+static void terra_bvh_count_left_job ( void* args, size_t chunk ) {
+    TerraBVHParallelSplit* ps = ( TerraBVHParallelSplit* ) args;
+    int begin, end;
+    terra_bvh_chunk_range ( ps, chunk, &begin, &end );
+    int count = 0;
 
-    while ( stack_idx > 0 ) {
-        // split the volumes in two
-        StackTask t = stack[--stack_idx];
-        int split_idx = terra_bvh_sah_split_volumes ( volumes + t.volumes_start, t.volumes_end - t.volumes_start, t.aabb ) + t.volumes_start;
-        // left child
-        TerraBVHNode* node = &bvh->nodes[t.node_idx];
+    for ( int i = begin; i < end; ++i ) {
+        count += 1 - terra_bvh_split_side ( &ps->split, &ps->volumes[i] );
+    }
 
-        if ( split_idx == t.volumes_start ) {
-            // only one volume in this branch, therefore it's a leaf and we're done here
-            node->type[0] = volumes[t.volumes_start].type;
-            node->aabb[0] = volumes[t.volumes_start].aabb;
-            node->index[0] = volumes[t.volumes_start].index;
+    ps->chunk_left_counts[chunk] = count;
+}
+
+static void terra_bvh_scatter_job ( void* args, size_t chunk ) {
+    TerraBVHParallelSplit* ps = ( TerraBVHParallelSplit* ) args;
+    int begin, end;
+    terra_bvh_chunk_range ( ps, chunk, &begin, &end );
+    int left = ps->chunk_left_offsets[chunk];
+    int right = ps->chunk_right_offsets[chunk];
+
+    for ( int i = begin; i < end; ++i ) {
+        if ( terra_bvh_split_side ( &ps->split, &ps->volumes[i] ) == 0 ) {
+            ps->scratch[left++] = ps->volumes[i];
         } else {
-            // more than one volumes, therefore more splitting is needed
-            node->type[0] = -1;
-            TerraAABB aabb;
-            aabb.min = terra_f3_set1 ( FLT_MAX );
-            aabb.max = terra_f3_set1 ( -FLT_MAX );
+            ps->scratch[right++] = ps->volumes[i];
+        }
+    }
+}
 
-            for ( int i = t.volumes_start; i < split_idx + 1; ++i ) {
-                terra_aabb_fit_aabb ( &aabb, &volumes[i].aabb );
-            }
+static void terra_bvh_gather_job ( void* args, size_t chunk ) {
+    TerraBVHParallelSplit* ps = ( TerraBVHParallelSplit* ) args;
+    int begin, end;
+    terra_bvh_chunk_range ( ps, chunk, &begin, &end );
+    memcpy ( ps->volumes + begin, ps->scratch + begin, sizeof ( TerraBVHVolume ) * ( end - begin ) );
+}
+
+// Same as terra_bvh_sah_split_volumes. scratch has to hold at least volumes_count volumes.
+int terra_bvh_sah_split_volumes_parallel ( const TerraJobSystem* jobs, TerraBVHVolume* volumes, TerraBVHVolume* scratch, int volumes_count,
+        const TerraAABB* container, TerraAABB* left_aabb, TerraAABB* right_aabb, float* cost_out ) {
+    TerraBVHParallelSplit ps;
+    ps.volumes = volumes;
+    ps.scratch = scratch;
+    ps.volumes_count = volumes_count;
+    ps.chunks_count = ( int ) jobs->workers;
+    ps.chunk_centroid_aabbs = ( TerraAABB* ) terra_malloc ( sizeof ( TerraAABB ) * ps.chunks_count );
+    ps.chunk_binnings = ( TerraBVHBinning* ) terra_malloc ( sizeof ( TerraBVHBinning ) * ps.chunks_count );
+    ps.chunk_left_counts = ( int* ) terra_malloc ( sizeof ( int ) * ps.chunks_count * 3 );
+    ps.chunk_left_offsets = ps.chunk_left_counts + ps.chunks_count;
+    ps.chunk_right_offsets = ps.chunk_left_offsets + ps.chunks_count;
+
+    terra_jobs_run ( jobs, terra_bvh_centroid_bounds_job, &ps, ps.chunks_count );
+    terra_aabb_init_empty ( &ps.centroid_aabb );
+
+    for ( int c = 0; c < ps.chunks_count; ++c ) {
+        terra_aabb_fit_aabb ( &ps.centroid_aabb, &ps.chunk_centroid_aabbs[c] );
+    }
+
+    terra_jobs_run ( jobs, terra_bvh_binning_job, &ps, ps.chunks_count );
+    TerraBVHBinning binning = ps.chunk_binnings[0];
+
+    for ( int c = 1; c < ps.chunks_count; ++c ) {
+        terra_bvh_binning_merge ( &binning, &ps.chunk_binnings[c] );
+    }
+
+    terra_bvh_sah_find_split ( &binning, &ps.centroid_aabb, container, &ps.split );
+    int left_count = 0;
+
+    if ( ps.split.axis != -1 ) {
+        // The partition is stable: each chunk scatters its volumes to the offsets given by the prefix
+        // sum of the left/right counts of the chunks before it.
+        terra_jobs_run ( jobs, terra_bvh_count_left_job, &ps, ps.chunks_count );
+
+        for ( int c = 0; c < ps.chunks_count; ++c ) {
+            left_count += ps.chunk_left_counts[c];
+        }
+
+        int left_offset = 0;
+        int right_offset = left_count;
+
+        for ( int c = 0; c < ps.chunks_count; ++c ) {
+            int begin, end;
+            terra_bvh_chunk_range ( &ps, c, &begin, &end );
+            ps.chunk_left_offsets[c] = left_offset;
+            ps.chunk_right_offsets[c] = right_offset;
+            left_offset += ps.chunk_left_counts[c];
+            right_offset += end - begin - ps.chunk_left_counts[c];
+        }
+
+        if ( left_count != 0 && left_count != volumes_count ) {
+            terra_jobs_run ( jobs, terra_bvh_scatter_job, &ps, ps.chunks_count );
+            terra_jobs_run ( jobs, terra_bvh_gather_job, &ps, ps.chunks_count );
+        }
+    }
+
+    terra_free ( ps.chunk_left_counts );
+    terra_free ( ps.chunk_binnings );
+    terra_free ( ps.chunk_centroid_aabbs );
+
+    // All the centroids are coincident, any split is as good as the other
+    if ( left_count == 0 || left_count == volumes_count ) {
+        left_count = volumes_count / 2;
+        terra_aabb_init_empty ( left_aabb );
+        terra_aabb_init_empty ( right_aabb );
 
-            node->aabb[0] = aabb;
-            node->index[0] = bvh->nodes_count;
-            // create a new stack task
-            stack[stack_idx].volumes_start = t.volumes_start;
-            stack[stack_idx].volumes_end = split_idx + 1;
-            stack[stack_idx].aabb = &node->aabb[0];
-            stack[stack_idx].node_idx = bvh->nodes_count;
-            ++stack_idx;
-            ++bvh->nodes_count;
+        for ( int i = 0; i < volumes_count; ++i ) {
+            terra_aabb_fit_aabb ( i < left_count ? left_aabb : right_aabb, &volumes[i].aabb );
         }
 
-        // right child
-        node = &bvh->nodes[t.node_idx];
+        *cost_out = FLT_MAX;
+        return left_count - 1;
+    }
+
+    *left_aabb = ps.split.left_aabb;
+    *right_aabb = ps.split.right_aabb;
+    *cost_out = ps.split.cost;
+    return left_count - 1;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Nodes are laid out depth first: the subtree of a node holding n volumes takes exactly n - 1 nodes,
+// its left child follows it immediately and its right child comes after the whole left subtree.
+// The position of every node is known as soon as its parent is split, which lets independent
+// subtrees be written to the same pre-sized array from different threads.
+// Subtrees collapsed into a leaf leave holes behind, which are removed by terra_bvh_compact.
+//--------------------------------------------------------------------------------------------------
+// Turns task into a leaf holding all of its volumes if that's cheaper than split_cost.
+// The root is never a leaf, as traversal always starts by visiting node 0.
+bool terra_bvh_emit_leaf ( TerraBVH* bvh, const TerraBVHBuildTask* task, float split_cost ) {
+    int count = task->volumes_end - task->volumes_start;
+
+    if ( task->parent_idx == -1 || count > TERRA_BVH_LEAF_MAX_PRIMITIVES || split_cost < count * TERRA_BVH_SAH_INTERSECTION_COST ) {
+        return false;
+    }
+
+    TerraBVHNode* parent = &bvh->nodes[task->parent_idx];
+    parent->type[task->parent_side] = count;
+    parent->index[task->parent_side] = task->volumes_start;
+
+    // The count - 1 nodes reserved for the subtree are not needed anymore
+    for ( int i = task->node_idx; i < task->node_idx + count - 1; ++i ) {
+        bvh->nodes[i].type[0] = TERRA_BVH_NODE_UNUSED;
+    }
+
+    return true;
+}
+
+// Writes the node for task and returns the children that need further splitting. (0, 1 or 2)
+int terra_bvh_emit_node ( TerraBVH* bvh, const TerraBVHBuildTask* task, int split_idx,
+                          const TerraAABB* left_aabb, const TerraAABB* right_aabb, TerraBVHBuildTask* children_out ) {
+    TerraBVHNode* node = &bvh->nodes[task->node_idx];
+    int starts[2] = { task->volumes_start, split_idx + 1 };
+    int ends[2] = { split_idx + 1, task->volumes_end };
+    int nodes[2] = { task->node_idx + 1, task->node_idx + split_idx + 1 - task->volumes_start };
+    node->aabb[0] = *left_aabb;
+    node->aabb[1] = *right_aabb;
+    int children_count = 0;
 
-        if ( split_idx == t.volumes_end - 2 ) {
+    for ( int i = 0; i < 2; ++i ) {
+        if ( ends[i] - starts[i] == 1 ) {
             // only one volume in this branch, therefore it's a leaf and we're done here
-            node->type[1] = volumes[t.volumes_end - 1].type;
-            node->aabb[1] = volumes[t.volumes_end - 1].aabb;
-            node->index[1] = volumes[t.volumes_end - 1].index;
+            node->type[i] = 1;
+            node->index[i] = starts[i];
         } else {
             // more than one volumes, therefore more splitting is needed
-            node->type[1] = -1;
-            TerraAABB aabb;
-            aabb.min = terra_f3_set1 ( FLT_MAX );
-            aabb.max = terra_f3_set1 ( -FLT_MAX );
+            node->type[i] = -1;
+            node->index[i] = nodes[i];
+            children_out[children_count].volumes_start = starts[i];
+            children_out[children_count].volumes_end = ends[i];
+            children_out[children_count].node_idx = nodes[i];
+            children_out[children_count].parent_idx = task->node_idx;
+            children_out[children_count].parent_side = i;
+            children_out[children_count].aabb = &node->aabb[i];
+            ++children_count;
+        }
+    }
 
-            for ( int i = split_idx + 1; i < t.volumes_end; ++i ) {
-                terra_aabb_fit_aabb ( &aabb, &volumes[i].aabb );
-            }
+    return children_count;
+}
+
+// Builds the whole subtree of task on the calling thread, iteratively using a stack
+void terra_bvh_build_subtree ( TerraBVH* bvh, TerraBVHVolume* volumes, const TerraBVHBuildTask* task ) {
+    // every node pushes at most two children after popping itself, the stack never outgrows the subtree depth
+    TerraBVHBuildTask* stack = ( TerraBVHBuildTask* ) terra_malloc ( sizeof ( TerraBVHBuildTask ) * ( task->volumes_end - task->volumes_start ) );
+    int stack_idx = 0;
+    stack[stack_idx++] = *task;
+
+    while ( stack_idx > 0 ) {
+        TerraBVHBuildTask t = stack[--stack_idx];
+        TerraAABB left_aabb, right_aabb;
+        float cost;
+        int split_idx = terra_bvh_sah_split_volumes ( volumes + t.volumes_start, t.volumes_end - t.volumes_start, t.aabb, &left_aabb, &right_aabb, &cost ) + t.volumes_start;
 
-            node->aabb[1] = aabb;
-            node->index[1] = bvh->nodes_count;
-            // create a new stack task
-            stack[stack_idx].volumes_start = split_idx + 1;
-            stack[stack_idx].volumes_end = t.volumes_end;
-            stack[stack_idx].aabb = &node->aabb[1];
-            stack[stack_idx].node_idx = bvh->nodes_count;
-            ++stack_idx;
-            ++bvh->nodes_count;
+        if ( terra_bvh_emit_leaf ( bvh, &t, cost ) ) {
+            continue;
         }
+
+        stack_idx += terra_bvh_emit_node ( bvh, &t, split_idx, &left_aabb, &right_aabb, stack + stack_idx );
     }
 
-	terra_free( stack );
+    terra_free ( stack );
 }
 
-void terra_bvh_destroy ( TerraBVH* bvh ) {
-    terra_free ( bvh->nodes );
+typedef struct {
+    TerraBVH*                bvh;
+    TerraBVHVolume*          volumes;
+    const TerraBVHBuildTask* tasks;
+} TerraBVHSubtreeJobs;
+
+static void terra_bvh_build_subtree_job ( void* args, size_t idx ) {
+    TerraBVHSubtreeJobs* jobs = ( TerraBVHSubtreeJobs* ) args;
+    terra_bvh_build_subtree ( jobs->bvh, jobs->volumes, &jobs->tasks[idx] );
 }
 
-bool terra_bvh_traverse ( TerraBVH* bvh, const TerraObject* objects, const TerraRay* ray, const TerraRayState* ray_state,
-                          TerraFloat3* point_out, TerraPrimitiveRef* primitive_out ) {
-    int queue[64];
-    queue[0] = 0;
-    int queue_count = 1;
-    int node = 0;
-    float min_d = FLT_MAX;
-    TerraFloat3 min_p = terra_f3_set1 ( FLT_MAX );
-    bool found = false;
+typedef struct {
+    const TerraObject* objects;
+    int                objects_count;
+    TerraBVHVolume*    volumes;
+    int                volumes_count;
+    int                chunks_count;
+    TerraAABB*         chunk_aabbs;
+} TerraBVHVolumeJobs;
 
-    // Intersection queries (already initialized)
-    TerraRayIntersectionResult iset_result;
-    TerraRayIntersectionQuery  iset_query;
-    iset_query.ray = ray;
-    iset_query.state = ray_state;
+// a volume is a scene primitive (triangle) wrapped in an aabb
+static void terra_bvh_init_volumes_job ( void* args, size_t chunk ) {
+    TerraBVHVolumeJobs* jobs = ( TerraBVHVolumeJobs* ) args;
+    int begin = ( int ) ( ( int64_t ) jobs->volumes_count * chunk / jobs->chunks_count );
+    int end = ( int ) ( ( int64_t ) jobs->volumes_count * ( chunk + 1 ) / jobs->chunks_count );
+    TerraAABB* chunk_aabb = &jobs->chunk_aabbs[chunk];
+    terra_aabb_init_empty ( chunk_aabb );
 
-    while ( queue_count > 0 ) {
-        node = queue[--queue_count];
+    // volumes are laid out object after object, find where the chunk starts
+    int j = 0;
+    size_t i = ( size_t ) begin;
 
-        for ( int i = 0; i < 2; ++i ) {
-            switch ( bvh->nodes[node].type[i] ) {
-                case -1:
+    while ( i >= jobs->objects[j].triangles_count ) {
+        i -= jobs->objects[j].triangles_count;
+        ++j;
+    }
 
-                    // not leaf
-                    if ( terra_ray_aabb_intersection ( ray, &bvh->nodes[node].aabb[i], NULL, NULL ) ) {
-                        queue[queue_count++] = bvh->nodes[node].index[i];
-                    }
+    for ( int p = begin; p < end; ++p, ++i ) {
+        while ( i >= jobs->objects[j].triangles_count ) {
+            i = 0;
+            ++j;
+        }
 
-                    break;
-
-                case 1:
-                    // triangle
-                {
-                    int model_idx = bvh->nodes[node].index[i] & 0xff;
-                    int tri_idx = bvh->nodes[node].index[i] >> 8;
-
-                    iset_query.primitive.triangle = objects[model_idx].triangles + tri_idx;
-
-                    if ( terra_ray_triangle_intersection_query ( &iset_query, &iset_result ) ) {
-                        // Is it within the bounds ?
-                        if ( iset_result.ray_depth < min_d ) {
-                            min_d = iset_result.ray_depth;
-                            min_p = iset_result.point;
-                            primitive_out->object_idx = model_idx;
-                            primitive_out->triangle_idx = tri_idx;
-                            found = true;
-                        }
-                    }
-                }
-                break;
+        TerraBVHVolume* volume = &jobs->volumes[p];
+        terra_aabb_init_empty ( &volume->aabb );
+        terra_aabb_fit_triangle ( &volume->aabb, &jobs->objects[j].triangles[i] );
+        terra_aabb_fit_aabb ( chunk_aabb, &volume->aabb );
+        volume->center = terra_aabb_center ( &volume->aabb );
+        volume->index = ( unsigned int ) p;
+    }
+}
+
+void terra_bvh_create ( TerraBVH* bvh, const TerraObject* objects, int objects_count, TerraBVHBuilder builder, const TerraJobSystem* jobs ) {
+    int volumes_count = 0;
+
+    for ( int i = 0; i < objects_count; ++i ) {
+        volumes_count += objects[i].triangles_count;
+    }
+
+    bool parallel = jobs != NULL && jobs->dispatch != NULL && jobs->workers > 1 && volumes_count >= TERRA_BVH_PARALLEL_SPLIT_MIN;
+
+    // init the scene aabb and the list of volumes
+    TerraBVHVolumeJobs volume_jobs;
+    volume_jobs.objects = objects;
+    volume_jobs.objects_count = objects_count;
+    volume_jobs.volumes = ( TerraBVHVolume* ) terra_malloc ( sizeof ( TerraBVHVolume ) * volumes_count );
+    volume_jobs.volumes_count = volumes_count;
+    volume_jobs.chunks_count = parallel ? ( int ) jobs->workers : 1;
+    volume_jobs.chunk_aabbs = ( TerraAABB* ) terra_malloc ( sizeof ( TerraAABB ) * volume_jobs.chunks_count );
+    terra_jobs_run ( jobs, terra_bvh_init_volumes_job, &volume_jobs, volumes_count > 0 ? volume_jobs.chunks_count : 0 );
+
+    TerraBVHVolume* volumes = volume_jobs.volumes;
+    TerraAABB scene_aabb;
+    terra_aabb_init_empty ( &scene_aabb );
+
+    for ( int c = 0; c < volume_jobs.chunks_count && volumes_count > 0; ++c ) {
+        terra_aabb_fit_aabb ( &scene_aabb, &volume_jobs.chunk_aabbs[c] );
+    }
+
+    terra_free ( volume_jobs.chunk_aabbs );
+    terra_primitive_map_init ( &bvh->primitive_map, objects, objects_count );
+    terra_bvh_build ( bvh, objects, volumes, volumes_count, &scene_aabb, builder, jobs, volume_jobs.chunks_count, parallel );
+    bvh->triangles = terra_bvh_gather_triangles ( bvh->primitives, bvh->primitives_count, objects, &bvh->primitive_map, NULL );
+}
+
+// Leaves reference the boxes by index
+void terra_bvh_create_from_aabbs ( TerraBVH* bvh, const TerraAABB* aabbs, int aabbs_count, const TerraJobSystem* jobs ) {
+    TerraBVHVolume* volumes = ( TerraBVHVolume* ) terra_malloc ( sizeof ( TerraBVHVolume ) * ( aabbs_count > 0 ? aabbs_count : 1 ) );
+    TerraAABB scene_aabb;
+    terra_aabb_init_empty ( &scene_aabb );
+
+    for ( int i = 0; i < aabbs_count; ++i ) {
+        volumes[i].aabb = aabbs[i];
+        volumes[i].center = terra_aabb_center ( &aabbs[i] );
+        volumes[i].index = ( unsigned int ) i;
+        terra_aabb_fit_aabb ( &scene_aabb, &aabbs[i] );
+    }
+
+    bool parallel = jobs != NULL && jobs->dispatch != NULL && jobs->workers > 1 && aabbs_count >= TERRA_BVH_PARALLEL_SPLIT_MIN;
+    bvh->primitive_map.object_offsets = NULL;
+    bvh->primitive_map.objects_count = 0;
+    terra_bvh_build ( bvh, NULL, volumes, aabbs_count, &scene_aabb, kTerraBVHBuilderSAH, jobs, parallel ? ( int ) jobs->workers : 1, parallel );
+    bvh->triangles = NULL;
+}
+
+// Builds the tree over the volumes contained in scene_aabb and releases them. chunks_count is the number of jobs
+// data-parallel passes are split in. objects can be NULL unless the SBVH builder is used.
+void terra_bvh_build ( TerraBVH* bvh, const TerraObject* objects, TerraBVHVolume* volumes, int volumes_count, const TerraAABB* scene_aabb,
+                       TerraBVHBuilder builder, const TerraJobSystem* jobs, int chunks_count, bool parallel ) {
+    // nothing to split, the root holds the whole scene
+    if ( volumes_count <= 1 ) {
+        bvh->nodes = ( TerraBVHNode* ) terra_malloc ( sizeof ( TerraBVHNode ) );
+        bvh->nodes_count = volumes_count;
+        bvh->primitives = NULL;
+        bvh->primitives_count = volumes_count;
+
+        if ( volumes_count == 1 ) {
+            bvh->nodes[0].type[0] = 1;
+            bvh->nodes[0].aabb[0] = volumes[0].aabb;
+            bvh->nodes[0].index[0] = 0;
+            bvh->primitives = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) );
+            bvh->primitives[0] = volumes[0].index;
+            bvh->nodes[0].type[1] = 0;
+            bvh->nodes[0].aabb[1] = volumes[0].aabb;
+            bvh->nodes[0].index[1] = 0;
+        }
+
+        terra_free ( volumes );
+        terra_bvh_layout ( bvh );
+        bvh->sah_cost = terra_bvh_sah_cost ( bvh );
+        return;
+    }
+
+    // Spatial splits need the triangles and don't fit the pre-sized layout, the tree is grown as it's built
+    if ( builder == kTerraBVHBuilderSBVH ) {
+        assert ( objects != NULL );
+        terra_bvh_sbvh_build ( bvh, objects, volumes, volumes_count );
+        terra_bvh_layout ( bvh );
+        bvh->sah_cost = terra_bvh_sah_cost ( bvh );
+        return;
+    }
+
+    bvh->nodes = ( TerraBVHNode* ) terra_malloc ( sizeof ( TerraBVHNode ) * ( volumes_count - 1 ) );
+    bvh->nodes_count = volumes_count - 1;
+
+    TerraBVHBuildTask root;
+    root.volumes_start = 0;
+    root.volumes_end = volumes_count;
+    root.node_idx = 0;
+    root.parent_idx = -1;
+    root.parent_side = 0;
+    root.aabb = scene_aabb;
+
+    if ( builder == kTerraBVHBuilderLBVH ) {
+        uint32_t* codes = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * volumes_count );
+        volumes = terra_bvh_morton_sort ( volumes, volumes_count, scene_aabb, jobs, chunks_count, codes );
+        terra_bvh_lbvh_build ( bvh, volumes, codes, &root, jobs, parallel );
+        terra_free ( codes );
+    } else if ( !parallel ) {
+        terra_bvh_build_subtree ( bvh, volumes, &root );
+    } else {
+        terra_bvh_build_parallel ( bvh, volumes, &root, jobs );
+    }
+
+    // leaves reference ranges of the volumes as they have been sorted by the build
+    bvh->primitives = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * volumes_count );
+    bvh->primitives_count = volumes_count;
+
+    for ( int i = 0; i < volumes_count; ++i ) {
+        bvh->primitives[i] = volumes[i].index;
+    }
+
+    terra_free ( volumes );
+    terra_bvh_layout ( bvh );
+    bvh->sah_cost = terra_bvh_sah_cost ( bvh );
+}
+
+void terra_bvh_build_parallel ( TerraBVH* bvh, TerraBVHVolume* volumes, const TerraBVHBuildTask* root, const TerraJobSystem* jobs ) {
+    int volumes_count = root->volumes_end - root->volumes_start;
+
+    // Top levels are split one node at a time, parallelizing the work inside each split. Nodes small enough
+    // are collected as independent subtrees and built concurrently afterwards.
+    int subtree_max_volumes = volumes_count / ( int ) ( jobs->workers * TERRA_BVH_SUBTREES_PER_WORKER );
+    TerraBVHVolume* scratch = ( TerraBVHVolume* ) terra_malloc ( sizeof ( TerraBVHVolume ) * volumes_count );
+    int subtrees_count = 0;
+    int subtrees_cap = ( int ) jobs->workers * TERRA_BVH_SUBTREES_PER_WORKER * 2;
+    TerraBVHBuildTask* subtrees = ( TerraBVHBuildTask* ) terra_malloc ( sizeof ( TerraBVHBuildTask ) * subtrees_cap );
+    int stack_cap = 64;
+    TerraBVHBuildTask* stack = ( TerraBVHBuildTask* ) terra_malloc ( sizeof ( TerraBVHBuildTask ) * stack_cap );
+    int stack_idx = 0;
+    stack[stack_idx++] = *root;
+
+    while ( stack_idx > 0 ) {
+        TerraBVHBuildTask t = stack[--stack_idx];
+        int count = t.volumes_end - t.volumes_start;
+
+        if ( count <= subtree_max_volumes ) {
+            if ( subtrees_count == subtrees_cap ) {
+                subtrees_cap *= 2;
+                subtrees = ( TerraBVHBuildTask* ) terra_realloc ( subtrees, sizeof ( TerraBVHBuildTask ) * subtrees_cap );
+            }
 
-                default:
-                    assert ( false );
-                    break;
+            subtrees[subtrees_count++] = t;
+            continue;
+        }
+
+        TerraAABB left_aabb, right_aabb;
+        float cost;
+        int split_idx;
+
+        if ( count >= TERRA_BVH_PARALLEL_SPLIT_MIN ) {
+            split_idx = terra_bvh_sah_split_volumes_parallel ( jobs, volumes + t.volumes_start, scratch + t.volumes_start, count, t.aabb, &left_aabb, &right_aabb, &cost );
+        } else {
+            split_idx = terra_bvh_sah_split_volumes ( volumes + t.volumes_start, count, t.aabb, &left_aabb, &right_aabb, &cost );
+        }
+
+        if ( terra_bvh_emit_leaf ( bvh, &t, cost ) ) {
+            continue;
+        }
+
+        if ( stack_idx + 2 > stack_cap ) {
+            stack_cap *= 2;
+            stack = ( TerraBVHBuildTask* ) terra_realloc ( stack, sizeof ( TerraBVHBuildTask ) * stack_cap );
+        }
+
+        stack_idx += terra_bvh_emit_node ( bvh, &t, split_idx + t.volumes_start, &left_aabb, &right_aabb, stack + stack_idx );
+    }
+
+    TerraBVHSubtreeJobs subtree_jobs;
+    subtree_jobs.bvh = bvh;
+    subtree_jobs.volumes = volumes;
+    subtree_jobs.tasks = subtrees;
+    terra_jobs_run ( jobs, terra_bvh_build_subtree_job, &subtree_jobs, subtrees_count );
+
+    terra_free ( stack );
+    terra_free ( subtrees );
+    terra_free ( scratch );
+}
+
+//--------------------------------------------------------------------------------------------------
+// SBVH [Stich et al. 2009]. Besides the binned object splits, each node also evaluates splitting space
+// with an axis aligned plane: the triangles straddling the plane are referenced by both children, each
+// with its bounds clipped to its side. This tightens the boxes of long and thin triangles at the cost
+// of duplicated references, which are capped by TERRA_BVH_SBVH_DUPLICATION_BUDGET.
+// References keep being volumes, only their bounds are clipped. Nodes are allocated in the order they
+// are split, so that children still come after their parent.
+//--------------------------------------------------------------------------------------------------
+// Bounds of the part of triangle lying in the slab [min, max] along axis, restricted to bounds.
+// aabb_out is left empty if there's no such part.
+void terra_bvh_clip_triangle ( const TerraTriangle* triangle, int axis, float min, float max, const TerraAABB* bounds, TerraAABB* aabb_out ) {
+    const TerraFloat3* vertices[3] = { &triangle->a, &triangle->b, &triangle->c };
+    const float planes[2] = { min, max };
+    terra_aabb_init_empty ( aabb_out );
+
+    // The clipped polygon is made of the vertices inside the slab and of the edges crossing its planes
+    for ( int i = 0; i < 3; ++i ) {
+        const TerraFloat3* v0 = vertices[i];
+        const TerraFloat3* v1 = vertices[ ( i + 1 ) % 3];
+        float d0 = terra_f3_axis ( v0, axis );
+        float d1 = terra_f3_axis ( v1, axis );
+
+        if ( d0 >= min && d0 <= max ) {
+            terra_aabb_fit_point ( aabb_out, v0 );
+        }
+
+        for ( int j = 0; j < 2; ++j ) {
+            if ( ( d0 < planes[j] && d1 > planes[j] ) || ( d0 > planes[j] && d1 < planes[j] ) ) {
+                TerraFloat3 p = terra_lerpf3 ( v0, v1, ( planes[j] - d0 ) / ( d1 - d0 ) );
+                ( ( float* ) &p ) [axis] = planes[j];
+                terra_aabb_fit_point ( aabb_out, &p );
             }
         }
     }
 
-    *point_out = min_p;
-    return found;
+    if ( aabb_out->min.x > aabb_out->max.x ) {
+        return;
+    }
+
+    // Same padding as terra_aabb_fit_triangle, flat boxes would be missed by the slab test
+    aabb_out->min = terra_f3_set ( terra_maxf ( aabb_out->min.x - terra_Epsilon, bounds->min.x ), terra_maxf ( aabb_out->min.y - terra_Epsilon, bounds->min.y ),
+                                   terra_maxf ( aabb_out->min.z - terra_Epsilon, bounds->min.z ) );
+    aabb_out->max = terra_f3_set ( terra_minf ( aabb_out->max.x + terra_Epsilon, bounds->max.x ), terra_minf ( aabb_out->max.y + terra_Epsilon, bounds->max.y ),
+                                   terra_minf ( aabb_out->max.z + terra_Epsilon, bounds->max.z ) );
+
+    if ( aabb_out->min.x > aabb_out->max.x || aabb_out->min.y > aabb_out->max.y || aabb_out->min.z > aabb_out->max.z ) {
+        terra_aabb_init_empty ( aabb_out );
+    }
+}
+
+// Same sweep as terra_bvh_sah_find_split, over slabs of the node bounds instead of centroid bins. A reference
+// enters the slab its bounds start in and exits the one they end in, it's clipped to all the slabs in between.
+void terra_bvh_sbvh_find_split ( const TerraBVHSpatialBuild* build, const TerraBVHVolume* volumes, int volumes_count, const TerraAABB* aabb,
+                                 TerraBVHSpatialSplit* split ) {
+    float container_area = terra_aabb_surface_area ( aabb );
+    split->axis = -1;
+    split->cost = FLT_MAX;
+
+    for ( int axis = 0; axis < 3; ++axis ) {
+        float axis_min = terra_f3_axis ( &aabb->min, axis );
+        float axis_extent = terra_f3_axis ( &aabb->max, axis ) - axis_min;
+
+        if ( axis_extent <= 0.f ) {
+            continue;
+        }
+
+        float bin_size = axis_extent / TERRA_BVH_SBVH_BINS;
+        float axis_scale = TERRA_BVH_SBVH_BINS / axis_extent;
+        TerraBVHSpatialBin bins[TERRA_BVH_SBVH_BINS];
+
+        for ( int b = 0; b < TERRA_BVH_SBVH_BINS; ++b ) {
+            terra_aabb_init_empty ( &bins[b].aabb );
+            bins[b].entries = 0;
+            bins[b].exits = 0;
+        }
+
+        for ( int i = 0; i < volumes_count; ++i ) {
+            const TerraBVHVolume* volume = &volumes[i];
+            int first = ( int ) ( ( terra_f3_axis ( &volume->aabb.min, axis ) - axis_min ) * axis_scale );
+            int last = ( int ) ( ( terra_f3_axis ( &volume->aabb.max, axis ) - axis_min ) * axis_scale );
+            first = first < 0 ? 0 : ( first < TERRA_BVH_SBVH_BINS ? first : TERRA_BVH_SBVH_BINS - 1 );
+            last = last < first ? first : ( last < TERRA_BVH_SBVH_BINS ? last : TERRA_BVH_SBVH_BINS - 1 );
+
+            if ( first == last ) {
+                terra_aabb_fit_aabb ( &bins[first].aabb, &volume->aabb );
+            } else {
+                const TerraTriangle* triangle = build->triangles[volume->index];
+
+                for ( int b = first; b <= last; ++b ) {
+                    TerraAABB clipped;
+                    terra_bvh_clip_triangle ( triangle, axis, axis_min + b * bin_size, axis_min + ( b + 1 ) * bin_size, &volume->aabb, &clipped );
+                    terra_aabb_fit_aabb ( &bins[b].aabb, &clipped );
+                }
+            }
+
+            ++bins[first].entries;
+            ++bins[last].exits;
+        }
+
+        // right_aabb[b] and right_count[b] describe the references ending in slabs (b, TERRA_BVH_SBVH_BINS)
+        TerraAABB right_aabb[TERRA_BVH_SBVH_BINS - 1];
+        int right_count[TERRA_BVH_SBVH_BINS - 1];
+        TerraAABB bounds;
+        terra_aabb_init_empty ( &bounds );
+        int count = 0;
+
+        for ( int b = TERRA_BVH_SBVH_BINS - 1; b > 0; --b ) {
+            terra_aabb_fit_aabb ( &bounds, &bins[b].aabb );
+            count += bins[b].exits;
+            right_aabb[b - 1] = bounds;
+            right_count[b - 1] = count;
+        }
+
+        terra_aabb_init_empty ( &bounds );
+        count = 0;
+
+        for ( int b = 0; b < TERRA_BVH_SBVH_BINS - 1; ++b ) {
+            terra_aabb_fit_aabb ( &bounds, &bins[b].aabb );
+            count += bins[b].entries;
+
+            if ( count == 0 || right_count[b] == 0 ) {
+                continue;
+            }
+
+            float cost = TERRA_BVH_SAH_TRAVERSAL_COST + TERRA_BVH_SAH_INTERSECTION_COST *
+                         ( count * terra_aabb_surface_area ( &bounds ) + right_count[b] * terra_aabb_surface_area ( &right_aabb[b] ) ) / container_area;
+
+            if ( cost < split->cost ) {
+                split->cost = cost;
+                split->axis = axis;
+                split->plane = axis_min + ( b + 1 ) * bin_size;
+            }
+        }
+    }
+}
+
+// Distributes the volumes on the two sides of the spatial split plane, left and right have room for volumes_count
+// volumes each. Straddling references are either split in two or moved entirely to one side, whichever is cheaper
+// ("reference unsplitting"). Returns the number of volumes on the left.
+int terra_bvh_sbvh_partition_spatial ( TerraBVHSpatialBuild* build, const TerraBVHVolume* volumes, int volumes_count, const TerraBVHSpatialSplit* split,
+                                       TerraBVHVolume* left, TerraBVHVolume* right, int* right_count_out ) {
+    int left_count = 0;
+    int right_count = 0;
+    TerraAABB left_aabb, right_aabb;
+    terra_aabb_init_empty ( &left_aabb );
+    terra_aabb_init_empty ( &right_aabb );
+
+    // The references entirely on one side go first, straddling ones are decided against the resulting bounds
+    for ( int i = 0; i < volumes_count; ++i ) {
+        if ( terra_f3_axis ( &volumes[i].aabb.max, split->axis ) <= split->plane ) {
+            left[left_count++] = volumes[i];
+            terra_aabb_fit_aabb ( &left_aabb, &volumes[i].aabb );
+        } else if ( terra_f3_axis ( &volumes[i].aabb.min, split->axis ) >= split->plane ) {
+            right[right_count++] = volumes[i];
+            terra_aabb_fit_aabb ( &right_aabb, &volumes[i].aabb );
+        }
+    }
+
+    for ( int i = 0; i < volumes_count; ++i ) {
+        const TerraBVHVolume* volume = &volumes[i];
+
+        if ( terra_f3_axis ( &volume->aabb.max, split->axis ) <= split->plane || terra_f3_axis ( &volume->aabb.min, split->axis ) >= split->plane ) {
+            continue;
+        }
+
+        const TerraTriangle* triangle = build->triangles[volume->index];
+        TerraAABB left_part, right_part;
+        terra_bvh_clip_triangle ( triangle, split->axis, -FLT_MAX, split->plane, &volume->aabb, &left_part );
+        terra_bvh_clip_triangle ( triangle, split->axis, split->plane, FLT_MAX, &volume->aabb, &right_part );
+
+        // Only the padding crossed the plane
+        bool left_empty = left_part.min.x > left_part.max.x;
+        bool right_empty = right_part.min.x > right_part.max.x;
+
+        if ( left_empty || right_empty ) {
+            TerraBVHVolume* side = left_empty ? &right[right_count++] : &left[left_count++];
+            *side = *volume;
+            terra_aabb_fit_aabb ( left_empty ? &right_aabb : &left_aabb, &volume->aabb );
+            continue;
+        }
+
+        TerraAABB left_all = left_aabb;
+        TerraAABB right_all = right_aabb;
+        TerraAABB left_split = left_aabb;
+        TerraAABB right_split = right_aabb;
+        terra_aabb_fit_aabb ( &left_all, &volume->aabb );
+        terra_aabb_fit_aabb ( &right_all, &volume->aabb );
+        terra_aabb_fit_aabb ( &left_split, &left_part );
+        terra_aabb_fit_aabb ( &right_split, &right_part );
+        float left_area = terra_aabb_surface_area ( &left_aabb );
+        float right_area = terra_aabb_surface_area ( &right_aabb );
+        float cost_left = terra_aabb_surface_area ( &left_all ) * ( left_count + 1 ) + ( right_count > 0 ? right_area * right_count : 0.f );
+        float cost_right = ( left_count > 0 ? left_area * left_count : 0.f ) + terra_aabb_surface_area ( &right_all ) * ( right_count + 1 );
+        float cost_split = terra_aabb_surface_area ( &left_split ) * ( left_count + 1 ) + terra_aabb_surface_area ( &right_split ) * ( right_count + 1 );
+
+        if ( build->references_count < build->references_max && cost_split < cost_left && cost_split < cost_right ) {
+            left[left_count] = *volume;
+            left[left_count].aabb = left_part;
+            left[left_count].center = terra_aabb_center ( &left_part );
+            right[right_count] = *volume;
+            right[right_count].aabb = right_part;
+            right[right_count].center = terra_aabb_center ( &right_part );
+            left_aabb = left_split;
+            right_aabb = right_split;
+            ++left_count;
+            ++right_count;
+            ++build->references_count;
+        } else if ( cost_left <= cost_right ) {
+            left[left_count++] = *volume;
+            left_aabb = left_all;
+        } else {
+            right[right_count++] = *volume;
+            right_aabb = right_all;
+        }
+    }
+
+    *right_count_out = right_count;
+    return left_count;
+}
+
+// Partitions the volumes in place around the object split, in half if there's no valid one. Returns the left count.
+int terra_bvh_sbvh_partition_object ( TerraBVHVolume* volumes, int volumes_count, const TerraBVHSplit* split ) {
+    int left = 0;
+
+    if ( split->axis != -1 ) {
+        int right = volumes_count - 1;
+
+        while ( left <= right ) {
+            if ( terra_bvh_split_side ( split, &volumes[left] ) == 0 ) {
+                ++left;
+            } else {
+                TerraBVHVolume tmp = volumes[left];
+                volumes[left] = volumes[right];
+                volumes[right] = tmp;
+                --right;
+            }
+        }
+    }
+
+    if ( left == 0 || left == volumes_count ) {
+        left = volumes_count / 2;
+    }
+
+    return left;
+}
+
+void terra_bvh_sbvh_emit_leaf ( TerraBVHSpatialBuild* build, const TerraBVHSpatialTask* task ) {
+    TerraBVH* bvh = build->bvh;
+
+    if ( bvh->primitives_count + task->volumes_count > build->primitives_cap ) {
+        build->primitives_cap = build->primitives_cap * 2 + task->volumes_count;
+        bvh->primitives = ( uint32_t* ) terra_realloc ( bvh->primitives, sizeof ( uint32_t ) * build->primitives_cap );
+    }
+
+    TerraBVHNode* parent = &bvh->nodes[task->parent_idx];
+    parent->type[task->parent_side] = task->volumes_count;
+    parent->index[task->parent_side] = bvh->primitives_count;
+
+    for ( int i = 0; i < task->volumes_count; ++i ) {
+        bvh->primitives[bvh->primitives_count++] = task->volumes[i].index;
+    }
+}
+
+void terra_bvh_sbvh_build ( TerraBVH* bvh, const TerraObject* objects, TerraBVHVolume* volumes, int volumes_count ) {
+    TerraBVHSpatialBuild build;
+    build.bvh = bvh;
+    build.triangles = ( const TerraTriangle** ) terra_malloc ( sizeof ( TerraTriangle* ) * volumes_count );
+
+    // Volumes are still in primitive order
+    for ( int i = 0, p = 0; i < bvh->primitive_map.objects_count; ++i ) {
+        for ( size_t j = 0; j < objects[i].triangles_count; ++j, ++p ) {
+            build.triangles[p] = &objects[i].triangles[j];
+        }
+    }
+
+    build.nodes_cap = volumes_count;
+    build.primitives_cap = volumes_count;
+    build.references_count = volumes_count;
+    build.references_max = volumes_count + ( int ) ( volumes_count * TERRA_BVH_SBVH_DUPLICATION_BUDGET );
+    bvh->nodes = ( TerraBVHNode* ) terra_malloc ( sizeof ( TerraBVHNode ) * build.nodes_cap );
+    bvh->nodes_count = 0;
+    bvh->primitives = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * build.primitives_cap );
+    bvh->primitives_count = 0;
+
+    // Every popped task pushes at most two, the stack is grown as references get duplicated
+    int stack_cap = 64;
+    TerraBVHSpatialTask* stack = ( TerraBVHSpatialTask* ) terra_malloc ( sizeof ( TerraBVHSpatialTask ) * stack_cap );
+    int stack_idx = 0;
+    stack[stack_idx].volumes = volumes;
+    stack[stack_idx].volumes_count = volumes_count;
+    stack[stack_idx].parent_idx = -1;
+    stack[stack_idx].parent_side = 0;
+    ++stack_idx;
+    bool root = true;
+
+    while ( stack_idx > 0 ) {
+        TerraBVHSpatialTask t = stack[--stack_idx];
+
+        if ( t.volumes_count == 1 ) {
+            terra_bvh_sbvh_emit_leaf ( &build, &t );
+            terra_free ( t.volumes );
+            continue;
+        }
+
+        TerraAABB aabb, centroid_aabb;
+        terra_aabb_init_empty ( &aabb );
+        terra_aabb_init_empty ( &centroid_aabb );
+
+        for ( int i = 0; i < t.volumes_count; ++i ) {
+            terra_aabb_fit_aabb ( &aabb, &t.volumes[i].aabb );
+            terra_aabb_fit_point ( &centroid_aabb, &t.volumes[i].center );
+        }
+
+        if ( root ) {
+            build.root_area = terra_aabb_surface_area ( &aabb );
+        }
+
+        TerraBVHBinning binning;
+        terra_bvh_binning_init ( &binning );
+        terra_bvh_binning_add ( &binning, t.volumes, t.volumes_count, &centroid_aabb );
+        TerraBVHSplit object_split;
+        terra_bvh_sah_find_split ( &binning, &centroid_aabb, &aabb, &object_split );
+
+        // Spatial splits only pay off where the object split leaves the children overlapping
+        TerraBVHSpatialSplit spatial_split;
+        spatial_split.axis = -1;
+        spatial_split.cost = FLT_MAX;
+        bool try_spatial = build.references_count < build.references_max;
+
+        if ( try_spatial && object_split.axis != -1 ) {
+            TerraAABB overlap;
+            overlap.min = terra_f3_set ( terra_maxf ( object_split.left_aabb.min.x, object_split.right_aabb.min.x ),
+                                         terra_maxf ( object_split.left_aabb.min.y, object_split.right_aabb.min.y ),
+                                         terra_maxf ( object_split.left_aabb.min.z, object_split.right_aabb.min.z ) );
+            overlap.max = terra_f3_set ( terra_minf ( object_split.left_aabb.max.x, object_split.right_aabb.max.x ),
+                                         terra_minf ( object_split.left_aabb.max.y, object_split.right_aabb.max.y ),
+                                         terra_minf ( object_split.left_aabb.max.z, object_split.right_aabb.max.z ) );
+            try_spatial = overlap.min.x < overlap.max.x && overlap.min.y < overlap.max.y && overlap.min.z < overlap.max.z &&
+                          terra_aabb_surface_area ( &overlap ) > TERRA_BVH_SBVH_MIN_OVERLAP * build.root_area;
+        }
+
+        if ( try_spatial ) {
+            terra_bvh_sbvh_find_split ( &build, t.volumes, t.volumes_count, &aabb, &spatial_split );
+        }
+
+        float cost = terra_minf ( object_split.cost, spatial_split.cost );
+
+        // Same criteria as terra_bvh_emit_leaf
+        if ( !root && t.volumes_count <= TERRA_BVH_LEAF_MAX_PRIMITIVES && cost >= t.volumes_count * TERRA_BVH_SAH_INTERSECTION_COST ) {
+            terra_bvh_sbvh_emit_leaf ( &build, &t );
+            terra_free ( t.volumes );
+            continue;
+        }
+
+        TerraBVHSpatialTask children[2];
+        children[0].volumes = NULL;
+
+        if ( spatial_split.axis != -1 && spatial_split.cost < object_split.cost ) {
+            children[0].volumes = ( TerraBVHVolume* ) terra_malloc ( sizeof ( TerraBVHVolume ) * t.volumes_count );
+            children[1].volumes = ( TerraBVHVolume* ) terra_malloc ( sizeof ( TerraBVHVolume ) * t.volumes_count );
+            children[0].volumes_count = terra_bvh_sbvh_partition_spatial ( &build, t.volumes, t.volumes_count, &spatial_split, children[0].volumes,
+                                        children[1].volumes, &children[1].volumes_count );
+
+            // Unsplitting moved everything to one side
+            if ( children[0].volumes_count == 0 || children[1].volumes_count == 0 ) {
+                terra_free ( children[0].volumes );
+                terra_free ( children[1].volumes );
+                children[0].volumes = NULL;
+            }
+        }
+
+        if ( children[0].volumes == NULL ) {
+            int left_count = terra_bvh_sbvh_partition_object ( t.volumes, t.volumes_count, &object_split );
+            children[0].volumes = ( TerraBVHVolume* ) terra_malloc ( sizeof ( TerraBVHVolume ) * left_count );
+            children[0].volumes_count = left_count;
+            children[1].volumes = ( TerraBVHVolume* ) terra_malloc ( sizeof ( TerraBVHVolume ) * ( t.volumes_count - left_count ) );
+            children[1].volumes_count = t.volumes_count - left_count;
+            memcpy ( children[0].volumes, t.volumes, sizeof ( TerraBVHVolume ) * left_count );
+            memcpy ( children[1].volumes, t.volumes + left_count, sizeof ( TerraBVHVolume ) * ( t.volumes_count - left_count ) );
+        }
+
+        terra_free ( t.volumes );
+
+        if ( bvh->nodes_count == build.nodes_cap ) {
+            build.nodes_cap *= 2;
+            bvh->nodes = ( TerraBVHNode* ) terra_realloc ( bvh->nodes, sizeof ( TerraBVHNode ) * build.nodes_cap );
+        }
+
+        int node_idx = bvh->nodes_count++;
+        TerraBVHNode* node = &bvh->nodes[node_idx];
+
+        if ( !root ) {
+            bvh->nodes[t.parent_idx].type[t.parent_side] = -1;
+            bvh->nodes[t.parent_idx].index[t.parent_side] = node_idx;
+        }
+
+        root = false;
+
+        if ( stack_idx + 2 > stack_cap ) {
+            stack_cap *= 2;
+            stack = ( TerraBVHSpatialTask* ) terra_realloc ( stack, sizeof ( TerraBVHSpatialTask ) * stack_cap );
+        }
+
+        // The right child goes first on the stack, so that the left one gets the next node
+        for ( int i = 1; i >= 0; --i ) {
+            terra_aabb_init_empty ( &node->aabb[i] );
+
+            for ( int j = 0; j < children[i].volumes_count; ++j ) {
+                terra_aabb_fit_aabb ( &node->aabb[i], &children[i].volumes[j].aabb );
+            }
+
+            node->type[i] = 0;
+            node->index[i] = 0;
+            children[i].parent_idx = node_idx;
+            children[i].parent_side = i;
+            stack[stack_idx++] = children[i];
+        }
+    }
+
+    terra_free ( stack );
+    terra_free ( ( void* ) build.triangles );
+    bvh->primitives = ( uint32_t* ) terra_realloc ( bvh->primitives, sizeof ( uint32_t ) * bvh->primitives_count );
+}
+
+//--------------------------------------------------------------------------------------------------
+// LBVH. Volumes are sorted along the Morton curve of their centers with a parallel radix sort, each
+// node is then split where the highest bit differing in its range of codes flips. The topology goes
+// through the same depth first layout as the SAH builder, bounds are computed bottom up once
+// it's done.
+//--------------------------------------------------------------------------------------------------
+typedef struct {
+    uint32_t code;
+    uint32_t volume;
+} TerraBVHMortonKey;
+
+typedef struct {
+    TerraBVHVolume*    volumes;
+    TerraBVHVolume*    sorted_volumes;
+    uint32_t*          codes;
+    TerraBVHMortonKey* keys;
+    TerraBVHMortonKey* scratch;
+    int                volumes_count;
+    int                chunks_count;
+    int                shift;
+    int*               chunk_offsets;   // TERRA_BVH_RADIX_SIZE digits per chunk, counts then offsets
+    TerraFloat3        origin;
+    TerraFloat3        scale;
+} TerraBVHMortonSort;
+
+static void terra_bvh_morton_chunk_range ( const TerraBVHMortonSort* sort, size_t chunk, int* begin, int* end ) {
+    *begin = ( int ) ( ( int64_t ) sort->volumes_count * chunk / sort->chunks_count );
+    *end = ( int ) ( ( int64_t ) sort->volumes_count * ( chunk + 1 ) / sort->chunks_count );
+}
+
+// Spreads the 10 low bits of v two bits apart
+static uint32_t terra_bvh_morton_expand ( uint32_t v ) {
+    v = ( v * 0x00010001u ) & 0xFF0000FFu;
+    v = ( v * 0x00000101u ) & 0x0F00F00Fu;
+    v = ( v * 0x00000011u ) & 0xC30C30C3u;
+    v = ( v * 0x00000005u ) & 0x49249249u;
+    return v;
+}
+
+static uint32_t terra_bvh_morton_quantize ( float v, float origin, float scale ) {
+    const float max = ( float ) ( ( 1 << TERRA_BVH_MORTON_AXIS_BITS ) - 1 );
+    float q = ( v - origin ) * scale;
+    return ( uint32_t ) ( q < 0.f ? 0.f : ( q > max ? max : q ) );
+}
+
+static void terra_bvh_morton_codes_job ( void* args, size_t chunk ) {
+    TerraBVHMortonSort* sort = ( TerraBVHMortonSort* ) args;
+    int begin, end;
+    terra_bvh_morton_chunk_range ( sort, chunk, &begin, &end );
+
+    for ( int i = begin; i < end; ++i ) {
+        const TerraFloat3* center = &sort->volumes[i].center;
+        uint32_t x = terra_bvh_morton_quantize ( center->x, sort->origin.x, sort->scale.x );
+        uint32_t y = terra_bvh_morton_quantize ( center->y, sort->origin.y, sort->scale.y );
+        uint32_t z = terra_bvh_morton_quantize ( center->z, sort->origin.z, sort->scale.z );
+        sort->keys[i].code = ( terra_bvh_morton_expand ( x ) << 2 ) | ( terra_bvh_morton_expand ( y ) << 1 ) | terra_bvh_morton_expand ( z );
+        sort->keys[i].volume = ( uint32_t ) i;
+    }
+}
+
+static void terra_bvh_radix_histogram_job ( void* args, size_t chunk ) {
+    TerraBVHMortonSort* sort = ( TerraBVHMortonSort* ) args;
+    int* counts = sort->chunk_offsets + chunk * TERRA_BVH_RADIX_SIZE;
+    int begin, end;
+    terra_bvh_morton_chunk_range ( sort, chunk, &begin, &end );
+    memset ( counts, 0, sizeof ( int ) * TERRA_BVH_RADIX_SIZE );
+
+    for ( int i = begin; i < end; ++i ) {
+        ++counts[ ( sort->keys[i].code >> sort->shift ) & ( TERRA_BVH_RADIX_SIZE - 1 )];
+    }
+}
+
+// Chunks are scattered in order and keep the order of their keys, which keeps the sort stable
+static void terra_bvh_radix_scatter_job ( void* args, size_t chunk ) {
+    TerraBVHMortonSort* sort = ( TerraBVHMortonSort* ) args;
+    int* offsets = sort->chunk_offsets + chunk * TERRA_BVH_RADIX_SIZE;
+    int begin, end;
+    terra_bvh_morton_chunk_range ( sort, chunk, &begin, &end );
+
+    for ( int i = begin; i < end; ++i ) {
+        int digit = ( sort->keys[i].code >> sort->shift ) & ( TERRA_BVH_RADIX_SIZE - 1 );
+        sort->scratch[offsets[digit]++] = sort->keys[i];
+    }
+}
+
+static void terra_bvh_morton_gather_job ( void* args, size_t chunk ) {
+    TerraBVHMortonSort* sort = ( TerraBVHMortonSort* ) args;
+    int begin, end;
+    terra_bvh_morton_chunk_range ( sort, chunk, &begin, &end );
+
+    for ( int i = begin; i < end; ++i ) {
+        sort->sorted_volumes[i] = sort->volumes[sort->keys[i].volume];
+        sort->codes[i] = sort->keys[i].code;
+    }
+}
+
+// Returns the volumes sorted by the Morton code of their center inside aabb, volumes is released.
+// Every pass runs one job per chunk, digit offsets are summed up on the calling thread in between.
+TerraBVHVolume* terra_bvh_morton_sort ( TerraBVHVolume* volumes, int volumes_count, const TerraAABB* aabb, const TerraJobSystem* jobs, int chunks_count,
+                                        uint32_t* codes_out ) {
+    const float axis_cells = ( float ) ( 1 << TERRA_BVH_MORTON_AXIS_BITS );
+    TerraBVHMortonSort sort;
+    sort.volumes = volumes;
+    sort.sorted_volumes = ( TerraBVHVolume* ) terra_malloc ( sizeof ( TerraBVHVolume ) * volumes_count );
+    sort.codes = codes_out;
+    sort.keys = ( TerraBVHMortonKey* ) terra_malloc ( sizeof ( TerraBVHMortonKey ) * volumes_count );
+    sort.scratch = ( TerraBVHMortonKey* ) terra_malloc ( sizeof ( TerraBVHMortonKey ) * volumes_count );
+    sort.volumes_count = volumes_count;
+    sort.chunks_count = chunks_count;
+    sort.chunk_offsets = ( int* ) terra_malloc ( sizeof ( int ) * TERRA_BVH_RADIX_SIZE * chunks_count );
+    sort.origin = aabb->min;
+
+    for ( int axis = 0; axis < 3; ++axis ) {
+        float extent = terra_f3_axis ( &aabb->max, axis ) - terra_f3_axis ( &aabb->min, axis );
+        ( ( float* ) &sort.scale ) [axis] = extent > 0.f ? axis_cells / extent : 0.f;
+    }
+
+    terra_jobs_run ( jobs, terra_bvh_morton_codes_job, &sort, chunks_count );
+
+    for ( int pass = 0; pass < TERRA_BVH_RADIX_PASSES; ++pass ) {
+        sort.shift = pass * TERRA_BVH_RADIX_BITS;
+        terra_jobs_run ( jobs, terra_bvh_radix_histogram_job, &sort, chunks_count );
+
+        // Digit after digit, chunk after chunk
+        int offset = 0;
+
+        for ( int d = 0; d < TERRA_BVH_RADIX_SIZE; ++d ) {
+            for ( int c = 0; c < chunks_count; ++c ) {
+                int count = sort.chunk_offsets[c * TERRA_BVH_RADIX_SIZE + d];
+                sort.chunk_offsets[c * TERRA_BVH_RADIX_SIZE + d] = offset;
+                offset += count;
+            }
+        }
+
+        terra_jobs_run ( jobs, terra_bvh_radix_scatter_job, &sort, chunks_count );
+        TerraBVHMortonKey* keys = sort.keys;
+        sort.keys = sort.scratch;
+        sort.scratch = keys;
+    }
+
+    terra_jobs_run ( jobs, terra_bvh_morton_gather_job, &sort, chunks_count );
+
+    terra_free ( sort.chunk_offsets );
+    terra_free ( sort.scratch );
+    terra_free ( sort.keys );
+    terra_free ( volumes );
+    return sort.sorted_volumes;
+}
+
+// Returns the last volume of the left child. Codes in the range share all the bits above the highest
+// one differing between the first and the last, the split is where that bit flips.
+int terra_bvh_lbvh_split ( const uint32_t* codes, int volumes_start, int volumes_end ) {
+    uint32_t diff = codes[volumes_start] ^ codes[volumes_end - 1];
+
+    // Duplicate codes, halving the range is as good as anything
+    if ( diff == 0 ) {
+        return ( volumes_start + volumes_end ) / 2 - 1;
+    }
+
+    diff |= diff >> 1;
+    diff |= diff >> 2;
+    diff |= diff >> 4;
+    diff |= diff >> 8;
+    diff |= diff >> 16;
+    uint32_t bit = diff ^ ( diff >> 1 );
+
+    // codes[lo] has the bit cleared, codes[hi] has it set
+    int lo = volumes_start;
+    int hi = volumes_end - 1;
+
+    while ( hi - lo > 1 ) {
+        int mid = ( lo + hi ) / 2;
+
+        if ( codes[mid] & bit ) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+
+    return lo;
+}
+
+// Same as terra_bvh_build_subtree, only the topology is written, bounds are left to terra_bvh_lbvh_refit
+void terra_bvh_lbvh_build_subtree ( TerraBVH* bvh, const uint32_t* codes, const TerraBVHBuildTask* task ) {
+    TerraBVHBuildTask* stack = ( TerraBVHBuildTask* ) terra_malloc ( sizeof ( TerraBVHBuildTask ) * ( task->volumes_end - task->volumes_start ) );
+    int stack_idx = 0;
+    stack[stack_idx++] = *task;
+    TerraAABB empty;
+    terra_aabb_init_empty ( &empty );
+
+    while ( stack_idx > 0 ) {
+        TerraBVHBuildTask t = stack[--stack_idx];
+        int count = t.volumes_end - t.volumes_start;
+
+        // Leaves are decided on size alone, passing an infinite or null split cost
+        if ( terra_bvh_emit_leaf ( bvh, &t, count <= TERRA_BVH_LBVH_LEAF_PRIMITIVES ? FLT_MAX : 0.f ) ) {
+            continue;
+        }
+
+        int split_idx = terra_bvh_lbvh_split ( codes, t.volumes_start, t.volumes_end );
+        stack_idx += terra_bvh_emit_node ( bvh, &t, split_idx, &empty, &empty, stack + stack_idx );
+    }
+
+    terra_free ( stack );
+}
+
+// Computes the bounds of node_idx from its children, which have to be up to date
+void terra_bvh_lbvh_refit ( TerraBVH* bvh, const TerraBVHVolume* volumes, int node_idx ) {
+    TerraBVHNode* node = &bvh->nodes[node_idx];
+
+    for ( int i = 0; i < 2; ++i ) {
+        TerraAABB* aabb = &node->aabb[i];
+
+        if ( node->type[i] == -1 ) {
+            const TerraBVHNode* child = &bvh->nodes[node->index[i]];
+            *aabb = child->aabb[0];
+            terra_aabb_fit_aabb ( aabb, &child->aabb[1] );
+        } else {
+            terra_aabb_init_empty ( aabb );
+
+            for ( int v = node->index[i]; v < node->index[i] + node->type[i]; ++v ) {
+                terra_aabb_fit_aabb ( aabb, &volumes[v].aabb );
+            }
+        }
+    }
+}
+
+typedef struct {
+    TerraBVH*                bvh;
+    const TerraBVHVolume*    volumes;
+    const uint32_t*          codes;
+    const TerraBVHBuildTask* tasks;
+} TerraBVHLBVHJobs;
+
+// Children come after their parent in the depth first layout, walking the nodes of the subtree
+// backwards refits every node after its children.
+static void terra_bvh_lbvh_subtree_job ( void* args, size_t idx ) {
+    TerraBVHLBVHJobs* jobs = ( TerraBVHLBVHJobs* ) args;
+    const TerraBVHBuildTask* task = &jobs->tasks[idx];
+    terra_bvh_lbvh_build_subtree ( jobs->bvh, jobs->codes, task );
+
+    for ( int i = task->node_idx + task->volumes_end - task->volumes_start - 2; i >= task->node_idx; --i ) {
+        if ( jobs->bvh->nodes[i].type[0] != TERRA_BVH_NODE_UNUSED ) {
+            terra_bvh_lbvh_refit ( jobs->bvh, jobs->volumes, i );
+        }
+    }
+}
+
+// Splitting is a binary search per node, the top levels are split on the calling thread until there are enough
+// subtrees to keep the workers busy. The top nodes are refit last, once all the subtrees are done.
+void terra_bvh_lbvh_build ( TerraBVH* bvh, const TerraBVHVolume* volumes, const uint32_t* codes, const TerraBVHBuildTask* root,
+                            const TerraJobSystem* jobs, bool parallel ) {
+    int volumes_count = root->volumes_end - root->volumes_start;
+    int subtree_max_volumes = parallel ? volumes_count / ( int ) ( jobs->workers * TERRA_BVH_SUBTREES_PER_WORKER ) : volumes_count;
+    int subtrees_count = 0;
+    int subtrees_cap = parallel ? ( int ) jobs->workers * TERRA_BVH_SUBTREES_PER_WORKER * 2 : 1;
+    TerraBVHBuildTask* subtrees = ( TerraBVHBuildTask* ) terra_malloc ( sizeof ( TerraBVHBuildTask ) * subtrees_cap );
+    int top_count = 0;
+    int top_cap = subtrees_cap;
+    int* top = ( int* ) terra_malloc ( sizeof ( int ) * top_cap );
+    int stack_cap = 64;
+    TerraBVHBuildTask* stack = ( TerraBVHBuildTask* ) terra_malloc ( sizeof ( TerraBVHBuildTask ) * stack_cap );
+    int stack_idx = 0;
+    stack[stack_idx++] = *root;
+    TerraAABB empty;
+    terra_aabb_init_empty ( &empty );
+
+    while ( stack_idx > 0 ) {
+        TerraBVHBuildTask t = stack[--stack_idx];
+        int count = t.volumes_end - t.volumes_start;
+
+        if ( count <= subtree_max_volumes ) {
+            if ( subtrees_count == subtrees_cap ) {
+                subtrees_cap *= 2;
+                subtrees = ( TerraBVHBuildTask* ) terra_realloc ( subtrees, sizeof ( TerraBVHBuildTask ) * subtrees_cap );
+            }
+
+            subtrees[subtrees_count++] = t;
+            continue;
+        }
+
+        if ( top_count == top_cap ) {
+            top_cap *= 2;
+            top = ( int* ) terra_realloc ( top, sizeof ( int ) * top_cap );
+        }
+
+        if ( stack_idx + 2 > stack_cap ) {
+            stack_cap *= 2;
+            stack = ( TerraBVHBuildTask* ) terra_realloc ( stack, sizeof ( TerraBVHBuildTask ) * stack_cap );
+        }
+
+        // Top level nodes are way above the leaf size
+        top[top_count++] = t.node_idx;
+        int split_idx = terra_bvh_lbvh_split ( codes, t.volumes_start, t.volumes_end );
+        stack_idx += terra_bvh_emit_node ( bvh, &t, split_idx, &empty, &empty, stack + stack_idx );
+    }
+
+    TerraBVHLBVHJobs lbvh_jobs;
+    lbvh_jobs.bvh = bvh;
+    lbvh_jobs.volumes = volumes;
+    lbvh_jobs.codes = codes;
+    lbvh_jobs.tasks = subtrees;
+    terra_jobs_run ( jobs, terra_bvh_lbvh_subtree_job, &lbvh_jobs, subtrees_count );
+
+    // Parents were split before their children
+    for ( int i = top_count - 1; i >= 0; --i ) {
+        terra_bvh_lbvh_refit ( bvh, volumes, top[i] );
+    }
+
+    terra_free ( stack );
+    terra_free ( top );
+    terra_free ( subtrees );
+}
+
+// Moves the nodes the builders produced (terra_malloc'd, possibly with unused slots) to cache line aligned memory,
+// one node per line. Nodes are written depth first, the child with the larger surface area, the one more rays
+// enter, right after its parent. The other child follows the whole subtree of its sibling.
+// Slots left unused by the leaves are unreachable from the root and are dropped.
+void terra_bvh_layout ( TerraBVH* bvh ) {
+    TerraBVHNode* nodes = ( TerraBVHNode* ) terra_malloc_aligned ( sizeof ( TerraBVHNode ) * ( bvh->nodes_count > 0 ? bvh->nodes_count : 1 ),
+                          TERRA_CACHE_LINE_SIZE );
+    int nodes_count = 0;
+
+    if ( bvh->nodes_count > 0 ) {
+        // (node, parent in the new layout, side) triplets, every node pushes at most two after popping itself
+        int* stack = ( int* ) terra_malloc ( sizeof ( int ) * 3 * ( bvh->nodes_count + 1 ) );
+        int stack_idx = 0;
+        stack[stack_idx++] = 0;
+        stack[stack_idx++] = -1;
+        stack[stack_idx++] = 0;
+
+        while ( stack_idx > 0 ) {
+            int side = stack[--stack_idx];
+            int parent = stack[--stack_idx];
+            const TerraBVHNode* node = &bvh->nodes[stack[--stack_idx]];
+            int node_idx = nodes_count++;
+            nodes[node_idx] = *node;
+
+            if ( parent != -1 ) {
+                nodes[parent].index[side] = node_idx;
+            }
+
+            // The larger child is pushed last so that it's popped next
+            int larger = terra_aabb_surface_area ( &node->aabb[1] ) > terra_aabb_surface_area ( &node->aabb[0] ) ? 1 : 0;
+            int order[2] = { 1 - larger, larger };
+
+            for ( int k = 0; k < 2; ++k ) {
+                if ( node->type[order[k]] == -1 ) {
+                    stack[stack_idx++] = node->index[order[k]];
+                    stack[stack_idx++] = node_idx;
+                    stack[stack_idx++] = order[k];
+                }
+            }
+        }
+
+        terra_free ( stack );
+    }
+
+    terra_free ( bvh->nodes );
+    bvh->nodes = nodes;
+    bvh->nodes_count = nodes_count;
+}
+
+void terra_bvh_destroy ( TerraBVH* bvh ) {
+    terra_free_aligned ( bvh->nodes );
+    terra_free ( bvh->primitives );
+    terra_free_aligned ( bvh->triangles );
+    terra_primitive_map_destroy ( &bvh->primitive_map );
+}
+
+TerraTrianglePacket* terra_bvh_gather_triangles ( const uint32_t* primitives, int primitives_count, const TerraObject* objects,
+        const TerraPrimitiveMap* map, TerraTrianglePacket* triangles_out ) {
+    if ( triangles_out == NULL ) {
+        // Unused lanes of the last packet stay zeroed
+        size_t size = sizeof ( TerraTrianglePacket ) * ( primitives_count > 0 ? TERRA_TRIANGLE_PACKETS_COUNT ( primitives_count ) : 1 );
+        triangles_out = ( TerraTrianglePacket* ) terra_malloc_aligned ( size, TERRA_CACHE_LINE_SIZE );
+        memset ( triangles_out, 0, size );
+    }
+
+    for ( int i = 0; i < primitives_count; ++i ) {
+        terra_triangle_packet_set ( triangles_out, i, terra_primitive_map_triangle ( map, objects, primitives[i] ) );
+    }
+
+    return triangles_out;
+}
+
+void terra_primitive_map_init ( TerraPrimitiveMap* map, const TerraObject* objects, int objects_count ) {
+    map->object_offsets = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * ( objects_count + 1 ) );
+    map->objects_count = objects_count;
+    uint64_t offset = 0;
+
+    for ( int i = 0; i < objects_count; ++i ) {
+        map->object_offsets[i] = ( uint32_t ) offset;
+        offset += objects[i].triangles_count;
+    }
+
+    assert ( offset <= UINT32_MAX );
+    map->object_offsets[objects_count] = ( uint32_t ) offset;
+}
+
+void terra_primitive_map_destroy ( TerraPrimitiveMap* map ) {
+    terra_free ( map->object_offsets );
+}
+
+// Last object starting at or before primitive. Empty objects share their offset with the next one and are skipped.
+TerraPrimitiveRef terra_primitive_map_find ( const TerraPrimitiveMap* map, uint32_t primitive ) {
+    int lo = 0;
+    int hi = map->objects_count - 1;
+
+    while ( lo < hi ) {
+        int mid = ( lo + hi + 1 ) / 2;
+
+        if ( map->object_offsets[mid] <= primitive ) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    TerraPrimitiveRef ref;
+    ref.object_idx = ( uint32_t ) lo;
+    ref.triangle_idx = primitive - map->object_offsets[lo];
+    return ref;
+}
+
+const TerraTriangle* terra_primitive_map_triangle ( const TerraPrimitiveMap* map, const TerraObject* objects, uint32_t primitive ) {
+    TerraPrimitiveRef ref = terra_primitive_map_find ( map, primitive );
+    return &objects[ref.object_idx].triangles[ref.triangle_idx];
+}
+
+//--------------------------------------------------------------------------------------------------
+// Refit. Bounds are recomputed bottom up, one level of the tree at a time, the topology and the
+// primitive ranges are left untouched.
+//--------------------------------------------------------------------------------------------------
+// The leaf-ordered triangles are gathered first, leaves are refitted from them without going through the objects
+void terra_bvh_leaf_aabb ( const TerraTrianglePacket* triangles, int first, int count, TerraAABB* aabb_out ) {
+    terra_aabb_init_empty ( aabb_out );
+
+    for ( int i = first; i < first + count; ++i ) {
+        TerraTriangle triangle;
+        terra_triangle_packet_get ( triangles, i, &triangle );
+        terra_aabb_fit_triangle ( aabb_out, &triangle );
+    }
+}
+
+// Cost of a child weighted by its surface area, the tree cost is the sum over all children divided by the root area
+float terra_bvh_sah_child_cost ( const TerraAABB* aabb, int32_t type ) {
+    if ( type == -1 ) {
+        return TERRA_BVH_SAH_TRAVERSAL_COST * terra_aabb_surface_area ( aabb );
+    }
+
+    return TERRA_BVH_SAH_INTERSECTION_COST * type * terra_aabb_surface_area ( aabb );
+}
+
+bool terra_bvh_refit_degraded ( float sah_cost, float built_sah_cost ) {
+    return sah_cost > built_sah_cost * TERRA_BVH_REFIT_MAX_DEGRADATION;
+}
+
+float terra_bvh_sah_cost ( const TerraBVH* bvh ) {
+    if ( bvh->nodes_count == 0 ) {
+        return 0.f;
+    }
+
+    TerraAABB root;
+    terra_aabb_init_empty ( &root );
+    float cost = 0.f;
+
+    for ( int i = 0; i < 2; ++i ) {
+        if ( bvh->nodes[0].type[i] != 0 ) {
+            terra_aabb_fit_aabb ( &root, &bvh->nodes[0].aabb[i] );
+        }
+    }
+
+    for ( int n = 0; n < bvh->nodes_count; ++n ) {
+        for ( int i = 0; i < 2; ++i ) {
+            if ( bvh->nodes[n].type[i] != 0 ) {
+                cost += terra_bvh_sah_child_cost ( &bvh->nodes[n].aabb[i], bvh->nodes[n].type[i] );
+            }
+        }
+    }
+
+    float root_area = terra_aabb_surface_area ( &root );
+    return root_area > 0.f ? cost / root_area : 0.f;
+}
+
+typedef struct {
+    void*                 bvh;
+    TerraBVHRefitRoutine* routine;
+    const int*            nodes;
+    int                   nodes_count;
+    int                   chunks_count;
+} TerraBVHRefitJobs;
+
+static void terra_bvh_refit_job ( void* args, size_t chunk ) {
+    TerraBVHRefitJobs* jobs = ( TerraBVHRefitJobs* ) args;
+    int begin = ( int ) ( ( int64_t ) jobs->nodes_count * chunk / jobs->chunks_count );
+    int end = ( int ) ( ( int64_t ) jobs->nodes_count * ( chunk + 1 ) / jobs->chunks_count );
+
+    for ( int i = begin; i < end; ++i ) {
+        jobs->routine ( jobs->bvh, jobs->nodes[i] );
+    }
+}
+
+void terra_bvh_refit_levels ( void* bvh, int nodes_count, const int* depth, TerraBVHRefitRoutine* routine, const TerraJobSystem* jobs ) {
+    int levels_count = 0;
+
+    for ( int i = 0; i < nodes_count; ++i ) {
+        levels_count = depth[i] + 1 > levels_count ? depth[i] + 1 : levels_count;
+    }
+
+    // Nodes bucketed by depth
+    int* level_start = ( int* ) terra_malloc ( sizeof ( int ) * ( levels_count + 1 ) );
+    int* nodes = ( int* ) terra_malloc ( sizeof ( int ) * ( nodes_count > 0 ? nodes_count : 1 ) );
+    memset ( level_start, 0, sizeof ( int ) * ( levels_count + 1 ) );
+
+    for ( int i = 0; i < nodes_count; ++i ) {
+        ++level_start[depth[i] + 1];
+    }
+
+    for ( int l = 0; l < levels_count; ++l ) {
+        level_start[l + 1] += level_start[l];
+    }
+
+    for ( int i = 0; i < nodes_count; ++i ) {
+        nodes[level_start[depth[i]]++] = i;
+    }
+
+    // level_start has been shifted by one level while filling
+    for ( int l = levels_count; l > 0; --l ) {
+        level_start[l] = level_start[l - 1];
+    }
+
+    level_start[0] = 0;
+    bool parallel = jobs != NULL && jobs->dispatch != NULL && jobs->workers > 1;
+
+    for ( int l = levels_count - 1; l >= 0; --l ) {
+        TerraBVHRefitJobs refit_jobs;
+        refit_jobs.bvh = bvh;
+        refit_jobs.routine = routine;
+        refit_jobs.nodes = nodes + level_start[l];
+        refit_jobs.nodes_count = level_start[l + 1] - level_start[l];
+        refit_jobs.chunks_count = parallel && refit_jobs.nodes_count >= TERRA_BVH_REFIT_PARALLEL_MIN ? ( int ) jobs->workers : 1;
+        terra_jobs_run ( jobs, terra_bvh_refit_job, &refit_jobs, refit_jobs.chunks_count );
+    }
+
+    terra_free ( nodes );
+    terra_free ( level_start );
+}
+
+void terra_bvh_refit_node ( void* _bvh, int node_idx ) {
+    TerraBVH* bvh = ( TerraBVH* ) _bvh;
+    TerraBVHNode* node = &bvh->nodes[node_idx];
+
+    for ( int i = 0; i < 2; ++i ) {
+        if ( node->type[i] == -1 ) {
+            const TerraBVHNode* child = &bvh->nodes[node->index[i]];
+            node->aabb[i] = child->aabb[0];
+            terra_aabb_fit_aabb ( &node->aabb[i], &child->aabb[1] );
+        } else if ( node->type[i] > 0 ) {
+            terra_bvh_leaf_aabb ( bvh->triangles, node->index[i], node->type[i], &node->aabb[i] );
+        }
+    }
+}
+
+bool terra_bvh_refit ( TerraBVH* bvh, const TerraObject* objects, const TerraJobSystem* jobs ) {
+    terra_bvh_gather_triangles ( bvh->primitives, bvh->primitives_count, objects, &bvh->primitive_map, bvh->triangles );
+
+    // Children always come after their parent
+    int* depth = ( int* ) terra_malloc ( sizeof ( int ) * ( bvh->nodes_count > 0 ? bvh->nodes_count : 1 ) );
+    depth[0] = 0;
+
+    for ( int n = 0; n < bvh->nodes_count; ++n ) {
+        for ( int i = 0; i < 2; ++i ) {
+            if ( bvh->nodes[n].type[i] == -1 ) {
+                depth[bvh->nodes[n].index[i]] = depth[n] + 1;
+            }
+        }
+    }
+
+    terra_bvh_refit_levels ( bvh, bvh->nodes_count, depth, terra_bvh_refit_node, jobs );
+    terra_free ( depth );
+    return !terra_bvh_refit_degraded ( terra_bvh_sah_cost ( bvh ), bvh->sah_cost );
+}
+
+// The references are only decoded for the closest hit
+bool terra_bvh_leaf_intersect ( const uint32_t* primitives, const TerraTrianglePacket* triangles, int first, int primitives_count,
+                                TerraRayIntersectionQuery* query, float* min_d, TerraFloat3* min_p, uint32_t* primitive_out ) {
+    TerraRayIntersectionResult result;
+    int p = terra_ray_triangle_packet_intersection ( query->ray, query->state, triangles, first, primitives_count, *min_d, &result );
+
+    if ( p < 0 ) {
+        return false;
+    }
+
+    *min_d = result.ray_depth;
+    *min_p = result.point;
+    *primitive_out = primitives[p];
+    return true;
+}
+
+bool terra_bvh_leaf_occluded ( const TerraTrianglePacket* triangles, int first, int primitives_count, TerraRayIntersectionQuery* query, float t_max ) {
+    return terra_ray_triangle_packet_occluded ( query->ray, query->state, triangles, first, primitives_count, t_max );
+}
+
+bool terra_bvh_traverse ( const TerraBVH* bvh, const TerraRay* ray, const TerraRayState* ray_state, float t_max,
+                          TerraFloat3* point_out, TerraPrimitiveRef* primitive_out ) {
+    // Nodes are pushed along with the distance the ray enters them at
+    int queue[64];
+    float queue_t[64];
+    queue[0] = 0;
+    queue_t[0] = 0.f;
+    int queue_count = 1;
+    int node = 0;
+    float min_d = t_max;
+    TerraFloat3 min_p = terra_f3_set1 ( FLT_MAX );
+    uint32_t primitive = 0;
+    bool found = false;
+
+    // Intersection queries (already initialized)
+    TerraRayIntersectionQuery  iset_query;
+    iset_query.ray = ray;
+    iset_query.state = ray_state;
+
+    if ( bvh->nodes_count == 0 ) {
+        return false;
+    }
+
+    while ( queue_count > 0 ) {
+        --queue_count;
+
+        // A closer hit might have been found since the node was pushed
+        if ( queue_t[queue_count] > min_d ) {
+            continue;
+        }
+
+        node = queue[queue_count];
+
+        // Children are visited front to back, boxes entered past the closest hit are skipped
+        float t[2];
+        bool hit[2];
+
+        for ( int i = 0; i < 2; ++i ) {
+            hit[i] = bvh->nodes[node].type[i] != 0 && terra_ray_aabb_intersection ( ray_state, &bvh->nodes[node].aabb[i], &t[i], NULL ) && t[i] <= min_d;
+        }
+
+        int near = hit[1] && ( !hit[0] || t[1] < t[0] ) ? 1 : 0;
+        int order[2] = { near, 1 - near };
+
+        // Leaves are intersected right away, which can cull the far child before it's pushed
+        for ( int k = 0; k < 2; ++k ) {
+            int i = order[k];
+
+            if ( hit[i] && bvh->nodes[node].type[i] > 0 && t[i] <= min_d ) {
+                int32_t first = bvh->nodes[node].index[i];
+                found |= terra_bvh_leaf_intersect ( bvh->primitives, bvh->triangles, first, bvh->nodes[node].type[i], &iset_query,
+                                                    &min_d, &min_p, &primitive );
+            }
+        }
+
+        // The far child goes first on the stack so that the near one is popped next
+        for ( int k = 1; k >= 0; --k ) {
+            int i = order[k];
+
+            if ( hit[i] && bvh->nodes[node].type[i] == -1 && t[i] <= min_d ) {
+                queue[queue_count] = bvh->nodes[node].index[i];
+                queue_t[queue_count] = t[i];
+                ++queue_count;
+            }
+        }
+
+        // The top of the stack is popped right away, too soon for a prefetch to help. The node under it (usually the far
+        // child) is only popped once the near subtree is done, its line is requested now. One node is one line.
+        if ( queue_count > 1 ) {
+            TERRA_PREFETCH ( &bvh->nodes[queue[queue_count - 2]] );
+        }
+    }
+
+    if ( found ) {
+        *primitive_out = terra_primitive_map_find ( &bvh->primitive_map, primitive );
+    }
+
+    *point_out = min_p;
+    return found;
+}
+
+void terra_bvh_packet_init ( const TerraRay* rays, int rays_count, TerraBVHPacket* packet ) {
+    float* origin[3] = { ( float* ) packet->origin[0], ( float* ) packet->origin[1], ( float* ) packet->origin[2] };
+    float* inv_direction[3] = { ( float* ) packet->inv_direction[0], ( float* ) packet->inv_direction[1], ( float* ) packet->inv_direction[2] };
+    float* min_d = ( float* ) packet->min_d;
+    packet->groups_count = ( rays_count + 3 ) / 4;
+
+    for ( int k = 0; k < packet->groups_count * 4; ++k ) {
+        min_d[k] = k < rays_count ? FLT_MAX : -1.f;
+    }
+
+    for ( int axis = 0; axis < 3; ++axis ) {
+        packet->origin_min[axis] = packet->origin_max[axis] = terra_f3_axis ( &rays[0].origin, axis );
+        packet->inv_min[axis] = packet->inv_max[axis] = terra_f3_axis ( &rays[0].inv_direction, axis );
+        packet->positive[axis] = terra_f3_axis ( &rays[0].direction, axis ) > 0.f;
+        packet->bounded[axis] = true;
+
+        for ( int k = 0; k < packet->groups_count * 4; ++k ) {
+            if ( k >= rays_count ) {
+                origin[axis][k] = inv_direction[axis][k] = 0.f;
+                continue;
+            }
+
+            float o = terra_f3_axis ( &rays[k].origin, axis );
+            float inv = terra_f3_axis ( &rays[k].inv_direction, axis );
+            origin[axis][k] = o;
+            inv_direction[axis][k] = inv;
+            packet->origin_min[axis] = terra_minf ( packet->origin_min[axis], o );
+            packet->origin_max[axis] = terra_maxf ( packet->origin_max[axis], o );
+            packet->inv_min[axis] = terra_minf ( packet->inv_min[axis], inv );
+            packet->inv_max[axis] = terra_maxf ( packet->inv_max[axis], inv );
+            // Rejects infinite and NaN inverses as well
+            packet->bounded[axis] &= ( terra_f3_axis ( &rays[k].direction, axis ) > 0.f ) == packet->positive[axis] && inv > -FLT_MAX && inv < FLT_MAX;
+        }
+    }
+}
+
+// False only if no ray of the packet can hit the box before t_max. The entry distance of every ray is bounded from
+// below (and the exit one from above) by the products of the interval endpoints, rounding keeps the bounds
+// conservative as it is monotonic. t_out is the lower bound of the entry distance.
+bool terra_bvh_packet_may_hit ( const TerraBVHPacket* packet, const TerraAABB* aabb, float t_max, float* t_out ) {
+    float entry = 0.f;
+    float exit = FLT_MAX;
+
+    for ( int axis = 0; axis < 3; ++axis ) {
+        if ( !packet->bounded[axis] ) {
+            continue;
+        }
+
+        float near = terra_f3_axis ( packet->positive[axis] ? &aabb->min : &aabb->max, axis );
+        float far = terra_f3_axis ( packet->positive[axis] ? &aabb->max : &aabb->min, axis );
+        float d_min = near - packet->origin_max[axis];
+        float d_max = near - packet->origin_min[axis];
+        entry = terra_maxf ( entry, terra_minf ( terra_minf ( d_min * packet->inv_min[axis], d_min * packet->inv_max[axis] ),
+                                                 terra_minf ( d_max * packet->inv_min[axis], d_max * packet->inv_max[axis] ) ) );
+        d_min = far - packet->origin_max[axis];
+        d_max = far - packet->origin_min[axis];
+        exit = terra_minf ( exit, terra_maxf ( terra_maxf ( d_min * packet->inv_min[axis], d_min * packet->inv_max[axis] ),
+                                               terra_maxf ( d_max * packet->inv_min[axis], d_max * packet->inv_max[axis] ) ) );
+    }
+
+    *t_out = entry;
+    return entry < exit && entry <= t_max;
+}
+
+// Slab test of terra_ray_aabb_intersection for the four rays of a group, which also have to enter the box before
+// their closest hit. Returns the mask of the rays hitting it.
+int terra_bvh_packet_slab4 ( const TerraBVHPacket* packet, int group, const TerraAABB* aabb ) {
+    __m128 t0x = _mm_mul_ps ( _mm_sub_ps ( _mm_set1_ps ( aabb->min.x ), packet->origin[0][group] ), packet->inv_direction[0][group] );
+    __m128 t1x = _mm_mul_ps ( _mm_sub_ps ( _mm_set1_ps ( aabb->max.x ), packet->origin[0][group] ), packet->inv_direction[0][group] );
+    __m128 t0y = _mm_mul_ps ( _mm_sub_ps ( _mm_set1_ps ( aabb->min.y ), packet->origin[1][group] ), packet->inv_direction[1][group] );
+    __m128 t1y = _mm_mul_ps ( _mm_sub_ps ( _mm_set1_ps ( aabb->max.y ), packet->origin[1][group] ), packet->inv_direction[1][group] );
+    __m128 t0z = _mm_mul_ps ( _mm_sub_ps ( _mm_set1_ps ( aabb->min.z ), packet->origin[2][group] ), packet->inv_direction[2][group] );
+    __m128 t1z = _mm_mul_ps ( _mm_sub_ps ( _mm_set1_ps ( aabb->max.z ), packet->origin[2][group] ), packet->inv_direction[2][group] );
+    __m128 tmin = _mm_max_ps ( _mm_max_ps ( _mm_min_ps ( t0x, t1x ), _mm_min_ps ( t0y, t1y ) ), _mm_min_ps ( t0z, t1z ) );
+    __m128 tmax = _mm_min_ps ( _mm_min_ps ( _mm_max_ps ( t0x, t1x ), _mm_max_ps ( t0y, t1y ) ), _mm_max_ps ( t0z, t1z ) );
+    __m128 hit = _mm_and_ps ( _mm_cmpgt_ps ( tmax, _mm_max_ps ( tmin, _mm_setzero_ps() ) ), _mm_cmple_ps ( tmin, packet->min_d[group] ) );
+    return _mm_movemask_ps ( hit );
+}
+
+// First ray in [first, rays_count) hitting the box, rays_count if there's none
+int terra_bvh_packet_first_hit ( const TerraBVHPacket* packet, int first, int rays_count, const TerraAABB* aabb ) {
+    // The rays before first are masked out of their group
+    int mask = terra_bvh_packet_slab4 ( packet, first / 4, aabb ) & ( 0xf << ( first % 4 ) );
+
+    for ( int group = first / 4; ; ) {
+        for ( int lane = 0; lane < 4; ++lane ) {
+            if ( ( mask >> lane ) & 1 ) {
+                return group * 4 + lane;
+            }
+        }
+
+        if ( ++group == packet->groups_count ) {
+            return rays_count;
+        }
+
+        mask = terra_bvh_packet_slab4 ( packet, group, aabb );
+    }
+}
+
+// Ranged traversal [Wald et al. 2001, Overbeck et al. 2008]. The packet shares a single stack, nodes are pushed along
+// with the first ray hitting them: the ones before it miss the node and are not tested again anywhere in its subtree.
+// Boxes no ray can hit are culled for the whole packet by interval arithmetic, otherwise rays are tested four at a
+// time until a hit is found, which for coherent rays is usually in the first group.
+void terra_bvh_traverse_packet ( const TerraBVH* bvh, const TerraRay* rays, const TerraRayState* ray_states, int rays_count,
+                                 bool* found_out, TerraFloat3* points_out, TerraPrimitiveRef* primitives_out ) {
+    int stack[64];
+    int stack_first[64];
+    float stack_t[64];
+    int stack_count = 1;
+    stack[0] = 0;
+    stack_first[0] = 0;
+    stack_t[0] = 0.f;
+    TerraFloat3 min_p[TERRA_BVH_PACKET_MAX_RAYS];
+    uint32_t primitive[TERRA_BVH_PACKET_MAX_RAYS];
+    TerraBVHPacket packet;
+    float* min_d = ( float* ) packet.min_d;
+    // Farthest closest hit of the packet, boxes entered past it are culled
+    float packet_d = FLT_MAX;
+
+    assert ( rays_count <= TERRA_BVH_PACKET_MAX_RAYS );
+
+    for ( int k = 0; k < rays_count; ++k ) {
+        min_p[k] = terra_f3_set1 ( FLT_MAX );
+        found_out[k] = false;
+    }
+
+    if ( bvh->nodes_count == 0 || rays_count == 0 ) {
+        stack_count = 0;
+    } else {
+        terra_bvh_packet_init ( rays, rays_count, &packet );
+    }
+
+    TerraRayIntersectionQuery iset_query;
+
+    while ( stack_count > 0 ) {
+        --stack_count;
+
+        if ( stack_t[stack_count] > packet_d ) {
+            continue;
+        }
+
+        const TerraBVHNode* node = &bvh->nodes[stack[stack_count]];
+        int first = stack_first[stack_count];
+
+        // Children are ordered by the bound of their entry distance
+        float t[2];
+        int hit_first[2];
+
+        for ( int i = 0; i < 2; ++i ) {
+            hit_first[i] = rays_count;
+
+            if ( node->type[i] != 0 && terra_bvh_packet_may_hit ( &packet, &node->aabb[i], packet_d, &t[i] ) ) {
+                hit_first[i] = terra_bvh_packet_first_hit ( &packet, first, rays_count, &node->aabb[i] );
+            }
+        }
+
+        int near = hit_first[1] < rays_count && ( hit_first[0] == rays_count || t[1] < t[0] ) ? 1 : 0;
+        int order[2] = { near, 1 - near };
+
+        // Leaves are intersected right away by the rays hitting them
+        for ( int k = 0; k < 2; ++k ) {
+            int i = order[k];
+
+            if ( hit_first[i] == rays_count || node->type[i] <= 0 ) {
+                continue;
+            }
+
+            for ( int group = hit_first[i] / 4; group < packet.groups_count; ++group ) {
+                int mask = terra_bvh_packet_slab4 ( &packet, group, &node->aabb[i] );
+
+                for ( int lane = 0; lane < 4; ++lane ) {
+                    int r = group * 4 + lane;
+
+                    if ( ( ( mask >> lane ) & 1 ) == 0 || r < hit_first[i] ) {
+                        continue;
+                    }
+
+                    iset_query.ray = &rays[r];
+                    iset_query.state = &ray_states[r];
+                    found_out[r] |= terra_bvh_leaf_intersect ( bvh->primitives, bvh->triangles, node->index[i], node->type[i], &iset_query,
+                                                               &min_d[r], &min_p[r], &primitive[r] );
+                }
+            }
+
+            packet_d = 0.f;
+
+            for ( int r = 0; r < rays_count; ++r ) {
+                packet_d = terra_maxf ( packet_d, min_d[r] );
+            }
+        }
+
+        // The far child goes first on the stack so that the near one is popped next
+        for ( int k = 1; k >= 0; --k ) {
+            int i = order[k];
+
+            if ( hit_first[i] < rays_count && node->type[i] == -1 ) {
+                assert ( stack_count < 64 );
+                stack[stack_count] = node->index[i];
+                stack_first[stack_count] = hit_first[i];
+                stack_t[stack_count] = t[i];
+                ++stack_count;
+            }
+        }
+
+        // Same as terra_bvh_traverse, the node under the top of the stack is the one with some lead time
+        if ( stack_count > 1 ) {
+            TERRA_PREFETCH ( &bvh->nodes[stack[stack_count - 2]] );
+        }
+    }
+
+    for ( int k = 0; k < rays_count; ++k ) {
+        if ( found_out[k] ) {
+            primitives_out[k] = terra_primitive_map_find ( &bvh->primitive_map, primitive[k] );
+        }
+
+        points_out[k] = min_p[k];
+    }
+}
+
+// Same as terra_bvh_traverse without any ordering, returns as soon as a primitive is found in [0, t_max)
+bool terra_bvh_occluded ( const TerraBVH* bvh, const TerraRay* ray, const TerraRayState* ray_state, float t_max ) {
+    int queue[64];
+    queue[0] = 0;
+    int queue_count = 1;
+
+    TerraRayIntersectionQuery  iset_query;
+    iset_query.ray = ray;
+    iset_query.state = ray_state;
+
+    if ( bvh->nodes_count == 0 ) {
+        return false;
+    }
+
+    while ( queue_count > 0 ) {
+        const TerraBVHNode* node = &bvh->nodes[queue[--queue_count]];
+
+        for ( int i = 0; i < 2; ++i ) {
+            float t;
+
+            if ( node->type[i] == 0 || !terra_ray_aabb_intersection ( ray_state, &node->aabb[i], &t, NULL ) || t >= t_max ) {
+                continue;
+            }
+
+            if ( node->type[i] == -1 ) {
+                queue[queue_count++] = node->index[i];
+            } else if ( terra_bvh_leaf_occluded ( bvh->triangles, node->index[i], node->type[i], &iset_query, t_max ) ) {
+                return true;
+            }
+        }
+    }
+
+    return false;
 }
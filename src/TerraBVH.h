@@ -9,24 +9,85 @@
 // libc
 #include <stdint.h>
 
+// Largest packet of rays traversed at once by terra_bvh_traverse_packet, the camera rays of 8x8 pixels
+#ifndef TERRA_BVH_PACKET_MAX_RAYS
+#define TERRA_BVH_PACKET_MAX_RAYS 64
+#endif
+
 // Node of the BVH tree. Fits in a 64 byte cache line.
 typedef struct {
     TerraAABB aabb[2]; // Left and right AABBs, one for each sub-volume
-    int32_t index[2];  // Index of the BVH node representing each sub-volume, or index of the model/triangle if sub-volume is leaf
-    int32_t type[2];   // -1 if sub-volume is not leaf, 1 if it's leaf and contains a single triangle
+    int32_t index[2];  // Index of the BVH node representing each sub-volume, or of the first leaf primitive if sub-volume is leaf
+    int32_t type[2];   // -1 if sub-volume is not leaf, number of primitives if it's leaf, 0 if empty
 } TerraBVHNode;
 
+// Primitives are referenced by a global index, the triangles of all the objects numbered one object after the
+// other. The object of a primitive is found by binary search over the offsets, which is only done for the
+// closest hit of a ray (leaves are tested on their own copy of the triangles).
+typedef struct {
+    uint32_t* object_offsets;       // objects_count + 1 entries, the triangles of object i start at object_offsets[i]
+    int       objects_count;
+} TerraPrimitiveMap;
+
 typedef struct {
-    TerraBVHNode* nodes;
-    int           nodes_count;
+    TerraBVHNode*        nodes;
+    int                  nodes_count;
+    uint32_t*            primitives;        // Leaves reference contiguous ranges of primitives, by global index
+    TerraTrianglePacket* triangles;         // Triangle of each primitive in the same order, NULL for trees built over boxes
+    int                  primitives_count;
+    TerraPrimitiveMap    primitive_map;     // Empty for trees built over boxes
+    float                sah_cost;          // SAH cost of the tree when it was built, refits are compared against it
 } TerraBVH;
 
+// Refits a single node from its children, which are already up to date. bvh is either a TerraBVH or a TerraBVHWide.
+typedef void ( TerraBVHRefitRoutine ) ( void* bvh, int node_idx );
+
 //--------------------------------------------------------------------------------------------------
 // Terra BVH Internal routines
 //--------------------------------------------------------------------------------------------------
-void        terra_bvh_create ( TerraBVH* bvh, const TerraObject* objects, int objects_count );
+void        terra_bvh_create ( TerraBVH* bvh, const TerraObject* objects, int objects_count, TerraBVHBuilder builder, const TerraJobSystem* jobs );
 void        terra_bvh_destroy ( TerraBVH* bvh );
-bool        terra_bvh_traverse ( TerraBVH* bvh, const TerraObject* objects, const TerraRay* ray, const TerraRayState* ray_state,
+// Updates the node bounds to the current triangle positions, keeping the topology. Returns false if the SAH cost
+// of the refit tree degraded past TERRA_BVH_REFIT_MAX_DEGRADATION times the one it was built with.
+bool        terra_bvh_refit ( TerraBVH* bvh, const TerraObject* objects, const TerraJobSystem* jobs );
+// Builds a tree over boxes instead of triangles, leaves reference ranges of box indices
+void        terra_bvh_create_from_aabbs ( TerraBVH* bvh, const TerraAABB* aabbs, int aabbs_count, const TerraJobSystem* jobs );
+// Closest hit along the ray before t_max (FLT_MAX for an unbounded ray)
+bool        terra_bvh_traverse ( const TerraBVH* bvh, const TerraRay* ray, const TerraRayState* ray_state, float t_max,
                                  TerraFloat3* point_out, TerraPrimitiveRef* primitive_out );
+// Closest hits of rays_count (at most TERRA_BVH_PACKET_MAX_RAYS) coherent rays traversing the tree together, e.g. the
+// camera rays of a block of pixels. found_out, points_out and primitives_out have one entry per ray.
+void        terra_bvh_traverse_packet ( const TerraBVH* bvh, const TerraRay* rays, const TerraRayState* ray_states, int rays_count,
+                                        bool* found_out, TerraFloat3* points_out, TerraPrimitiveRef* primitives_out );
+// True if any primitive is hit along the ray before t_max
+bool        terra_bvh_occluded ( const TerraBVH* bvh, const TerraRay* ray, const TerraRayState* ray_state, float t_max );
+
+// Tests the primitives [first, first + primitives_count) of a leaf, updating min_d, min_p and primitive_out (global
+// index) with any closer hit. Returns true if any has been found. triangles are the leaf-ordered copies of the primitives.
+bool        terra_bvh_leaf_intersect ( const uint32_t* primitives, const TerraTrianglePacket* triangles, int first, int primitives_count,
+                                       TerraRayIntersectionQuery* query, float* min_d, TerraFloat3* min_p, uint32_t* primitive_out );
+bool        terra_bvh_leaf_occluded ( const TerraTrianglePacket* triangles, int first, int primitives_count, TerraRayIntersectionQuery* query, float t_max );
+// Copies the triangle of each primitive in the same order, the leaves are then tested reading memory sequentially
+// instead of jumping between the object triangle arrays. The copies are packed for the SIMD tests, a leaf can start
+// in the middle of a packet. triangles_out is allocated (zeroed) if NULL.
+TerraTrianglePacket* terra_bvh_gather_triangles ( const uint32_t* primitives, int primitives_count, const TerraObject* objects,
+        const TerraPrimitiveMap* map, TerraTrianglePacket* triangles_out );
+
+// The global primitive indices have to fit in 32 bits
+void        terra_primitive_map_init ( TerraPrimitiveMap* map, const TerraObject* objects, int objects_count );
+void        terra_primitive_map_destroy ( TerraPrimitiveMap* map );
+TerraPrimitiveRef terra_primitive_map_find ( const TerraPrimitiveMap* map, uint32_t primitive );
+const TerraTriangle* terra_primitive_map_triangle ( const TerraPrimitiveMap* map, const TerraObject* objects, uint32_t primitive );
+
+// Shared with the wide BVH. Bounds of the leaf-ordered triangles [first, first + count).
+void        terra_bvh_leaf_aabb ( const TerraTrianglePacket* triangles, int first, int count, TerraAABB* aabb_out );
+float       terra_bvh_sah_child_cost ( const TerraAABB* aabb, int32_t type );
+bool        terra_bvh_refit_degraded ( float sah_cost, float built_sah_cost );
+// Bounds of the part of triangle lying in the slab [min, max] along axis, restricted to bounds. aabb_out is left
+// empty if there's no such part. Shared with the kd-tree.
+void        terra_bvh_clip_triangle ( const TerraTriangle* triangle, int axis, float min, float max, const TerraAABB* bounds, TerraAABB* aabb_out );
+// Calls routine on every node, deepest level first. Nodes of the same level are independent and are split
+// across the workers. depth[i] is the depth of node i.
+void        terra_bvh_refit_levels ( void* bvh, int nodes_count, const int* depth, TerraBVHRefitRoutine* routine, const TerraJobSystem* jobs );
 
 #endif // _TERRA_BVH_H_
\ No newline at end of file
@@ -0,0 +1,358 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// TerraBVHCache
+#include "TerraBVHCache.h"
+
+// Terra
+#include "TerraPrivate.h"
+
+// libc
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// Bumped whenever the file layout or the node layouts change, older files are then rebuilt
+#define TERRA_BVH_CACHE_MAGIC 0x48564254    // "TBVH"
+#define TERRA_BVH_CACHE_VERSION 6
+
+// Sections start at multiples of this, mapped nodes keep the alignment they have in memory
+#define TERRA_BVH_CACHE_ALIGNMENT 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;
+    int32_t  width;                 // 2 for TerraBVH, 4 or 8 for TerraBVHWide
+    int32_t  quantized;
+    int32_t  node_size;
+    int32_t  nodes_count;
+    int32_t  primitives_count;
+    int32_t  binary_nodes_count;
+    int32_t  stack_size;            // TerraBVHWide only
+    float    sah_cost;
+    int32_t  objects_count;
+    uint64_t nodes_offset;
+    uint64_t primitives_offset;
+    uint64_t triangles_offset;      // Leaf-ordered triangles, primitives_count of them
+    uint64_t object_offsets_offset; // TerraPrimitiveMap, objects_count + 1 entries
+} TerraBVHCacheHeader;
+
+static uint64_t terra_hash_mix ( uint64_t h, uint64_t k );
+static uint64_t terra_hash_bytes ( uint64_t h, const void* data, size_t size );
+static uint64_t terra_hash_finalize ( uint64_t h );
+static uint64_t terra_bvh_cache_align ( uint64_t offset );
+static bool     terra_bvh_cache_pad ( FILE* file, uint64_t offset );
+static bool     terra_file_map ( const char* path, TerraFileMapping* mapping );
+
+//--------------------------------------------------------------------------------------------------
+// Hashing, one 64 bit lane of MurmurHash3
+//--------------------------------------------------------------------------------------------------
+uint64_t terra_hash_mix ( uint64_t h, uint64_t k ) {
+    k *= 0x87c37b91114253d5ull;
+    k = ( k << 31 ) | ( k >> 33 );
+    k *= 0x4cf5ad432745937full;
+    h ^= k;
+    h = ( h << 27 ) | ( h >> 37 );
+    return h * 5 + 0x52dce729;
+}
+
+uint64_t terra_hash_bytes ( uint64_t h, const void* data, size_t size ) {
+    const uint8_t* bytes = ( const uint8_t* ) data;
+    size_t words = size / sizeof ( uint64_t );
+
+    for ( size_t i = 0; i < words; ++i ) {
+        uint64_t k;
+        memcpy ( &k, bytes + i * sizeof ( uint64_t ), sizeof ( uint64_t ) );
+        h = terra_hash_mix ( h, k );
+    }
+
+    uint64_t tail = 0;
+    memcpy ( &tail, bytes + words * sizeof ( uint64_t ), size - words * sizeof ( uint64_t ) );
+    return terra_hash_mix ( h, tail ^ size );
+}
+
+uint64_t terra_hash_finalize ( uint64_t h ) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// Only the positions are hashed, materials and vertex attributes don't change the tree
+uint64_t terra_bvh_cache_hash ( const TerraObject* objects, int objects_count, TerraAccelerator accelerator, TerraBVHBuilder builder ) {
+    uint64_t h = TERRA_BVH_CACHE_VERSION;
+    int32_t options[5] = { ( int32_t ) accelerator, ( int32_t ) builder, objects_count, ( int32_t ) sizeof ( TerraBVHNode ), ( int32_t ) sizeof ( TerraBVH4QNode ) };
+    h = terra_hash_bytes ( h, options, sizeof ( options ) );
+
+    for ( int i = 0; i < objects_count; ++i ) {
+        uint64_t triangles_count = objects[i].triangles_count;
+        h = terra_hash_mix ( h, triangles_count );
+        h = terra_hash_bytes ( h, objects[i].triangles, sizeof ( TerraTriangle ) * objects[i].triangles_count );
+    }
+
+    return terra_hash_finalize ( h );
+}
+
+bool terra_bvh_cache_path ( const char* dir, uint64_t hash, char* path, size_t path_size ) {
+    int len = snprintf ( path, path_size, "%s/%016llx.tbvh", dir, ( unsigned long long ) hash );
+    return len > 0 && ( size_t ) len < path_size;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Files
+//--------------------------------------------------------------------------------------------------
+uint64_t terra_bvh_cache_align ( uint64_t offset ) {
+    return ( offset + TERRA_BVH_CACHE_ALIGNMENT - 1 ) & ~ ( uint64_t ) ( TERRA_BVH_CACHE_ALIGNMENT - 1 );
+}
+
+// Zero fills the file up to offset
+bool terra_bvh_cache_pad ( FILE* file, uint64_t offset ) {
+    static const uint8_t zeros[TERRA_BVH_CACHE_ALIGNMENT] = { 0 };
+    long pos = ftell ( file );
+
+    if ( pos < 0 || ( uint64_t ) pos > offset ) {
+        return false;
+    }
+
+    size_t padding = ( size_t ) ( offset - ( uint64_t ) pos );
+    return padding == 0 || fwrite ( zeros, 1, padding, file ) == padding;
+}
+
+// Written to a temporary file first, a crash while saving never leaves a truncated cache behind
+bool terra_bvh_cache_save ( const char* path, uint64_t hash, const TerraBVH* bvh, const TerraBVHWide* bvh_wide ) {
+    assert ( ( bvh == NULL ) != ( bvh_wide == NULL ) );
+    TerraBVHCacheHeader header;
+    memset ( &header, 0, sizeof ( header ) );
+    header.magic = TERRA_BVH_CACHE_MAGIC;
+    header.version = TERRA_BVH_CACHE_VERSION;
+    header.hash = hash;
+    const void* nodes;
+    const uint32_t* primitives;
+    const TerraTrianglePacket* triangles;
+    const TerraPrimitiveMap* map;
+
+    if ( bvh != NULL ) {
+        header.width = 2;
+        header.node_size = sizeof ( TerraBVHNode );
+        header.nodes_count = bvh->nodes_count;
+        header.primitives_count = bvh->primitives_count;
+        header.binary_nodes_count = bvh->nodes_count;
+        header.sah_cost = bvh->sah_cost;
+        nodes = bvh->nodes;
+        primitives = bvh->primitives;
+        triangles = bvh->triangles;
+        map = &bvh->primitive_map;
+    } else {
+        header.width = bvh_wide->width;
+        header.quantized = bvh_wide->quantized;
+        header.node_size = ( int32_t ) terra_bvh_wide_node_size ( bvh_wide );
+        header.nodes_count = bvh_wide->nodes_count;
+        header.primitives_count = bvh_wide->primitives_count;
+        header.binary_nodes_count = bvh_wide->binary_nodes_count;
+        header.stack_size = bvh_wide->stack_size;
+        header.sah_cost = bvh_wide->sah_cost;
+        nodes = bvh_wide->nodes;
+        primitives = bvh_wide->primitives;
+        triangles = bvh_wide->triangles;
+        map = &bvh_wide->primitive_map;
+    }
+
+    header.objects_count = map->objects_count;
+
+    size_t nodes_size = ( size_t ) header.node_size * header.nodes_count;
+    size_t primitives_size = sizeof ( uint32_t ) * header.primitives_count;
+    size_t triangles_size = sizeof ( TerraTrianglePacket ) * TERRA_TRIANGLE_PACKETS_COUNT ( header.primitives_count );
+    header.nodes_offset = terra_bvh_cache_align ( sizeof ( TerraBVHCacheHeader ) );
+    header.primitives_offset = terra_bvh_cache_align ( header.nodes_offset + nodes_size );
+    size_t object_offsets_size = sizeof ( uint32_t ) * ( header.objects_count + 1 );
+    header.triangles_offset = terra_bvh_cache_align ( header.primitives_offset + primitives_size );
+    header.object_offsets_offset = terra_bvh_cache_align ( header.triangles_offset + triangles_size );
+
+    char tmp_path[1024];
+    int len = snprintf ( tmp_path, sizeof ( tmp_path ), "%s.tmp", path );
+
+    if ( len <= 0 || ( size_t ) len >= sizeof ( tmp_path ) ) {
+        return false;
+    }
+
+    FILE* file = fopen ( tmp_path, "wb" );
+
+    if ( file == NULL ) {
+        return false;
+    }
+
+    bool written = fwrite ( &header, sizeof ( header ), 1, file ) == 1
+                   && terra_bvh_cache_pad ( file, header.nodes_offset )
+                   && ( nodes_size == 0 || fwrite ( nodes, 1, nodes_size, file ) == nodes_size )
+                   && terra_bvh_cache_pad ( file, header.primitives_offset )
+                   && ( primitives_size == 0 || fwrite ( primitives, 1, primitives_size, file ) == primitives_size )
+                   && terra_bvh_cache_pad ( file, header.triangles_offset )
+                   && ( triangles_size == 0 || fwrite ( triangles, 1, triangles_size, file ) == triangles_size )
+                   && terra_bvh_cache_pad ( file, header.object_offsets_offset )
+                   && fwrite ( map->object_offsets, 1, object_offsets_size, file ) == object_offsets_size;
+    written = fclose ( file ) == 0 && written;
+
+    if ( !written ) {
+        remove ( tmp_path );
+        return false;
+    }
+
+    remove ( path );
+
+    if ( rename ( tmp_path, path ) != 0 ) {
+        remove ( tmp_path );
+        return false;
+    }
+
+    return true;
+}
+
+// Private writable mapping, refitting a loaded tree never touches the file
+bool terra_file_map ( const char* path, TerraFileMapping* mapping ) {
+    memset ( mapping, 0, sizeof ( TerraFileMapping ) );
+#ifdef _WIN32
+    HANDLE file = CreateFileA ( path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+
+    if ( file == INVALID_HANDLE_VALUE ) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+
+    if ( !GetFileSizeEx ( file, &size ) || size.QuadPart == 0 ) {
+        CloseHandle ( file );
+        return false;
+    }
+
+    HANDLE file_mapping = CreateFileMappingA ( file, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+
+    if ( file_mapping == NULL ) {
+        CloseHandle ( file );
+        return false;
+    }
+
+    void* data = MapViewOfFile ( file_mapping, FILE_MAP_COPY, 0, 0, 0 );
+
+    if ( data == NULL ) {
+        CloseHandle ( file_mapping );
+        CloseHandle ( file );
+        return false;
+    }
+
+    mapping->data = data;
+    mapping->size = ( size_t ) size.QuadPart;
+    mapping->file = file;
+    mapping->mapping = file_mapping;
+#else
+    int fd = open ( path, O_RDONLY );
+
+    if ( fd == -1 ) {
+        return false;
+    }
+
+    struct stat st;
+
+    if ( fstat ( fd, &st ) != 0 || st.st_size == 0 ) {
+        close ( fd );
+        return false;
+    }
+
+    void* data = mmap ( NULL, ( size_t ) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+    close ( fd );
+
+    if ( data == MAP_FAILED ) {
+        return false;
+    }
+
+    mapping->data = data;
+    mapping->size = ( size_t ) st.st_size;
+#endif
+    return true;
+}
+
+void terra_bvh_cache_unmap ( TerraFileMapping* mapping ) {
+    if ( mapping->data == NULL ) {
+        return;
+    }
+
+#ifdef _WIN32
+    UnmapViewOfFile ( mapping->data );
+    CloseHandle ( ( HANDLE ) mapping->mapping );
+    CloseHandle ( ( HANDLE ) mapping->file );
+#else
+    munmap ( mapping->data, mapping->size );
+#endif
+    memset ( mapping, 0, sizeof ( TerraFileMapping ) );
+}
+
+bool terra_bvh_cache_load ( const char* path, uint64_t hash, TerraBVH* bvh, TerraBVHWide* bvh_wide, TerraFileMapping* mapping_out ) {
+    assert ( ( bvh == NULL ) != ( bvh_wide == NULL ) );
+    TerraFileMapping mapping;
+
+    if ( !terra_file_map ( path, &mapping ) ) {
+        return false;
+    }
+
+    const TerraBVHCacheHeader* header = ( const TerraBVHCacheHeader* ) mapping.data;
+    bool valid = mapping.size >= sizeof ( TerraBVHCacheHeader )
+                 && header->magic == TERRA_BVH_CACHE_MAGIC
+                 && header->version == TERRA_BVH_CACHE_VERSION
+                 && header->hash == hash
+                 && header->nodes_count >= 0 && header->primitives_count >= 0 && header->objects_count >= 0
+                 && header->nodes_offset + ( uint64_t ) header->node_size * header->nodes_count <= mapping.size
+                 && header->primitives_offset + sizeof ( uint32_t ) * ( uint64_t ) header->primitives_count <= mapping.size
+                 && header->triangles_offset + sizeof ( TerraTrianglePacket ) * ( uint64_t ) TERRA_TRIANGLE_PACKETS_COUNT ( header->primitives_count ) <= mapping.size
+                 && header->object_offsets_offset + sizeof ( uint32_t ) * ( uint64_t ) ( header->objects_count + 1 ) <= mapping.size;
+
+    if ( valid && bvh != NULL ) {
+        valid = header->width == 2 && header->node_size == sizeof ( TerraBVHNode );
+    } else if ( valid ) {
+        bvh_wide->width = header->width;
+        bvh_wide->quantized = header->quantized != 0;
+        valid = ( header->width == 4 || header->width == 8 ) && header->node_size == ( int32_t ) terra_bvh_wide_node_size ( bvh_wide )
+                && header->stack_size > 0;
+    }
+
+    if ( !valid ) {
+        terra_bvh_cache_unmap ( &mapping );
+        return false;
+    }
+
+    uint8_t* data = ( uint8_t* ) mapping.data;
+
+    if ( bvh != NULL ) {
+        bvh->nodes = ( TerraBVHNode* ) ( data + header->nodes_offset );
+        bvh->nodes_count = header->nodes_count;
+        bvh->primitives = ( uint32_t* ) ( data + header->primitives_offset );
+        bvh->triangles = ( TerraTrianglePacket* ) ( data + header->triangles_offset );
+        bvh->primitives_count = header->primitives_count;
+        bvh->primitive_map.object_offsets = ( uint32_t* ) ( data + header->object_offsets_offset );
+        bvh->primitive_map.objects_count = header->objects_count;
+        bvh->sah_cost = header->sah_cost;
+    } else {
+        bvh_wide->nodes = data + header->nodes_offset;
+        bvh_wide->nodes_count = header->nodes_count;
+        bvh_wide->primitives = ( uint32_t* ) ( data + header->primitives_offset );
+        bvh_wide->triangles = ( TerraTrianglePacket* ) ( data + header->triangles_offset );
+        bvh_wide->primitives_count = header->primitives_count;
+        bvh_wide->primitive_map.object_offsets = ( uint32_t* ) ( data + header->object_offsets_offset );
+        bvh_wide->primitive_map.objects_count = header->objects_count;
+        bvh_wide->binary_nodes_count = header->binary_nodes_count;
+        bvh_wide->stack_size = header->stack_size;
+        bvh_wide->sah_cost = header->sah_cost;
+    }
+
+    *mapping_out = mapping;
+    return true;
+}
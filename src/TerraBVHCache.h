@@ -0,0 +1,35 @@
+#ifndef _TERRA_BVH_CACHE_H_
+#define _TERRA_BVH_CACHE_H_
+
+// Terra
+#include <Terra.h>
+#include "TerraBVH.h"
+#include "TerraBVHWide.h"
+
+// libc
+#include <stdint.h>
+
+// Built acceleration structures are written to <dir>/<hash>.tbvh, the hash covers the triangles and the build
+// options. Files are mapped copy-on-write when loaded: the nodes, primitives and triangles point into the mapping,
+// which has to be released with terra_bvh_cache_unmap instead of terra_bvh_destroy/terra_bvh_wide_destroy.
+typedef struct {
+    void*  data;        // NULL if nothing is mapped
+    size_t size;
+#ifdef _WIN32
+    void*  file;
+    void*  mapping;
+#endif
+} TerraFileMapping;
+
+//--------------------------------------------------------------------------------------------------
+// Terra BVH cache Internal routines
+//--------------------------------------------------------------------------------------------------
+uint64_t    terra_bvh_cache_hash ( const TerraObject* objects, int objects_count, TerraAccelerator accelerator, TerraBVHBuilder builder );
+bool        terra_bvh_cache_path ( const char* dir, uint64_t hash, char* path, size_t path_size );
+// Exactly one of bvh and bvh_wide is not NULL
+bool        terra_bvh_cache_save ( const char* path, uint64_t hash, const TerraBVH* bvh, const TerraBVHWide* bvh_wide );
+// Fails if the file is missing or has been written for a different hash, version or layout
+bool        terra_bvh_cache_load ( const char* path, uint64_t hash, TerraBVH* bvh, TerraBVHWide* bvh_wide, TerraFileMapping* mapping_out );
+void        terra_bvh_cache_unmap ( TerraFileMapping* mapping );
+
+#endif // _TERRA_BVH_CACHE_H_
@@ -0,0 +1,403 @@
+// TerraBVHTwoLevel
+#include "TerraBVHTwoLevel.h"
+
+// Terra
+#include "TerraPrivate.h"
+
+// libc
+#include <assert.h>
+#include <float.h>
+#include <string.h>
+
+// Top level nodes pushed during traversal, same depth bound as the binary tree
+#ifndef TERRA_BVH_TWO_LEVEL_STACK_SIZE
+#define TERRA_BVH_TWO_LEVEL_STACK_SIZE 64
+#endif
+
+static TerraFloat3 terra_instance_point_to_object ( const TerraInstance* instance, const TerraFloat3* point );
+static TerraFloat3 terra_instance_vector ( const TerraFloat4x4* transform, const TerraFloat3* vec );
+static TerraRay    terra_instance_ray ( const TerraInstance* instance, const TerraRay* ray );
+static void        terra_bvh_two_level_object_aabb ( const TerraObject* object, TerraAABB* aabb_out );
+static void        terra_bvh_two_level_create_object ( TerraBVHTwoLevel* bvh, const TerraObject* objects, int object_idx, TerraBVHBuilder builder,
+                                                       const TerraJobSystem* jobs );
+static void        terra_bvh_two_level_destroy_object ( TerraBVHTwoLevel* bvh, int object_idx );
+static bool        terra_bvh_two_level_intersect_instance ( const TerraBVHTwoLevel* bvh, int instance_idx, const TerraRay* ray,
+                                                            float* min_d, TerraFloat3* min_p, TerraPrimitiveRef* primitive_out );
+static bool        terra_bvh_two_level_occluded_instance ( const TerraBVHTwoLevel* bvh, int instance_idx, const TerraRay* ray,
+                                                           float t_max );
+
+//--------------------------------------------------------------------------------------------------
+// Instances
+//--------------------------------------------------------------------------------------------------
+void terra_instance_init ( TerraInstance* instance, uint32_t object_idx, const TerraFloat4x4* transform ) {
+    const TerraFloat4* r = transform->rows;
+    instance->object_idx = object_idx;
+    instance->transform = *transform;
+
+    // Inverse of the upper 3x3 through its adjugate
+    float c00 = r[1].y * r[2].z - r[1].z * r[2].y;
+    float c01 = r[1].z * r[2].x - r[1].x * r[2].z;
+    float c02 = r[1].x * r[2].y - r[1].y * r[2].x;
+    float det = r[0].x * c00 + r[0].y * c01 + r[0].z * c02;
+    assert ( det != 0.f );
+    float inv_det = 1.f / det;
+
+    TerraFloat4* inv = instance->inverse_transform.rows;
+    inv[0].x = c00 * inv_det;
+    inv[0].y = ( r[0].z * r[2].y - r[0].y * r[2].z ) * inv_det;
+    inv[0].z = ( r[0].y * r[1].z - r[0].z * r[1].y ) * inv_det;
+    inv[1].x = c01 * inv_det;
+    inv[1].y = ( r[0].x * r[2].z - r[0].z * r[2].x ) * inv_det;
+    inv[1].z = ( r[0].z * r[1].x - r[0].x * r[1].z ) * inv_det;
+    inv[2].x = c02 * inv_det;
+    inv[2].y = ( r[0].y * r[2].x - r[0].x * r[2].y ) * inv_det;
+    inv[2].z = ( r[0].x * r[1].y - r[0].y * r[1].x ) * inv_det;
+
+    // Translation is undone after the rotation/scale
+    TerraFloat3 t = terra_f3_set ( r[0].w, r[1].w, r[2].w );
+
+    for ( int i = 0; i < 3; ++i ) {
+        inv[i].w = - ( inv[i].x * t.x + inv[i].y * t.y + inv[i].z * t.z );
+    }
+
+    inv[3].x = inv[3].y = inv[3].z = 0.f;
+    inv[3].w = 1.f;
+}
+
+TerraFloat3 terra_instance_vector ( const TerraFloat4x4* transform, const TerraFloat3* vec ) {
+    const TerraFloat4* r = transform->rows;
+    return terra_f3_set ( r[0].x * vec->x + r[0].y * vec->y + r[0].z * vec->z,
+                          r[1].x * vec->x + r[1].y * vec->y + r[1].z * vec->z,
+                          r[2].x * vec->x + r[2].y * vec->y + r[2].z * vec->z );
+}
+
+TerraFloat3 terra_instance_point_to_world ( const TerraInstance* instance, const TerraFloat3* point ) {
+    const TerraFloat4* r = instance->transform.rows;
+    TerraFloat3 p = terra_instance_vector ( &instance->transform, point );
+    return terra_f3_set ( p.x + r[0].w, p.y + r[1].w, p.z + r[2].w );
+}
+
+TerraFloat3 terra_instance_point_to_object ( const TerraInstance* instance, const TerraFloat3* point ) {
+    const TerraFloat4* r = instance->inverse_transform.rows;
+    TerraFloat3 p = terra_instance_vector ( &instance->inverse_transform, point );
+    return terra_f3_set ( p.x + r[0].w, p.y + r[1].w, p.z + r[2].w );
+}
+
+// Normals go through the inverse transpose to stay perpendicular under non uniform scaling
+TerraFloat3 terra_instance_normal_to_world ( const TerraInstance* instance, const TerraFloat3* normal ) {
+    const TerraFloat4* r = instance->inverse_transform.rows;
+    TerraFloat3 n = terra_f3_set ( r[0].x * normal->x + r[1].x * normal->y + r[2].x * normal->z,
+                                   r[0].y * normal->x + r[1].y * normal->y + r[2].y * normal->z,
+                                   r[0].z * normal->x + r[1].z * normal->y + r[2].z * normal->z );
+    return terra_normf3 ( &n );
+}
+
+// The direction is not normalized, so that distances along the ray match the world ones
+TerraRay terra_instance_ray ( const TerraInstance* instance, const TerraRay* ray ) {
+    TerraRay local;
+    local.origin = terra_instance_point_to_object ( instance, &ray->origin );
+    local.direction = terra_instance_vector ( &instance->inverse_transform, &ray->direction );
+    local.inv_direction = terra_f3_set ( 1.f / local.direction.x, 1.f / local.direction.y, 1.f / local.direction.z );
+    return local;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Bottom level
+//--------------------------------------------------------------------------------------------------
+void terra_bvh_two_level_object_aabb ( const TerraObject* object, TerraAABB* aabb_out ) {
+    aabb_out->min = terra_f3_set1 ( FLT_MAX );
+    aabb_out->max = terra_f3_set1 ( -FLT_MAX );
+
+    for ( size_t i = 0; i < object->triangles_count; ++i ) {
+        terra_aabb_fit_triangle ( aabb_out, &object->triangles[i] );
+    }
+}
+
+void terra_bvh_two_level_create_object ( TerraBVHTwoLevel* bvh, const TerraObject* objects, int object_idx, TerraBVHBuilder builder,
+                                         const TerraJobSystem* jobs ) {
+    const TerraObject* object = &objects[object_idx];
+
+    switch ( bvh->accelerator ) {
+        case kTerraAcceleratorBVH:
+            terra_bvh_create ( &bvh->bottom[object_idx], object, 1, builder, jobs );
+            break;
+
+        case kTerraAcceleratorBVH4:
+            terra_bvh_wide_create ( &bvh->bottom_wide[object_idx], 4, false, object, 1, builder, jobs );
+            break;
+
+        case kTerraAcceleratorBVH4Quantized:
+            terra_bvh_wide_create ( &bvh->bottom_wide[object_idx], 4, true, object, 1, builder, jobs );
+            break;
+
+        case kTerraAcceleratorBVH8:
+            terra_bvh_wide_create ( &bvh->bottom_wide[object_idx], 8, false, object, 1, builder, jobs );
+            break;
+
+        default:
+            assert ( false );
+    }
+
+    terra_bvh_two_level_object_aabb ( object, &bvh->bottom_aabbs[object_idx] );
+}
+
+void terra_bvh_two_level_destroy_object ( TerraBVHTwoLevel* bvh, int object_idx ) {
+    if ( bvh->bottom != NULL ) {
+        terra_bvh_destroy ( &bvh->bottom[object_idx] );
+    } else {
+        terra_bvh_wide_destroy ( &bvh->bottom_wide[object_idx] );
+    }
+}
+
+void terra_bvh_two_level_create_bottom ( TerraBVHTwoLevel* bvh, TerraAccelerator accelerator, const TerraObject* objects, int objects_count,
+                                         TerraBVHBuilder builder, const TerraJobSystem* jobs ) {
+    memset ( bvh, 0, sizeof ( TerraBVHTwoLevel ) );
+    bvh->accelerator = accelerator;
+    bvh->objects_count = objects_count;
+    bvh->bottom_aabbs = ( TerraAABB* ) terra_malloc ( sizeof ( TerraAABB ) * ( objects_count > 0 ? objects_count : 1 ) );
+
+    if ( accelerator == kTerraAcceleratorBVH ) {
+        bvh->bottom = ( TerraBVH* ) terra_malloc ( sizeof ( TerraBVH ) * ( objects_count > 0 ? objects_count : 1 ) );
+    } else {
+        bvh->bottom_wide = ( TerraBVHWide* ) terra_malloc ( sizeof ( TerraBVHWide ) * ( objects_count > 0 ? objects_count : 1 ) );
+    }
+
+    // Each build is parallel on its own, objects are usually few and large
+    for ( int i = 0; i < objects_count; ++i ) {
+        terra_bvh_two_level_create_object ( bvh, objects, i, builder, jobs );
+    }
+}
+
+void terra_bvh_two_level_refit_bottom ( TerraBVHTwoLevel* bvh, const TerraObject* objects, const bool* moved, TerraBVHBuilder builder,
+                                        const TerraJobSystem* jobs ) {
+    for ( int i = 0; i < bvh->objects_count; ++i ) {
+        if ( !moved[i] ) {
+            continue;
+        }
+
+        bool refit = bvh->bottom != NULL ? terra_bvh_refit ( &bvh->bottom[i], &objects[i], jobs ) : terra_bvh_wide_refit ( &bvh->bottom_wide[i], &objects[i], jobs );
+
+        if ( !refit ) {
+            terra_bvh_two_level_destroy_object ( bvh, i );
+            terra_bvh_two_level_create_object ( bvh, objects, i, builder, jobs );
+        } else {
+            terra_bvh_two_level_object_aabb ( &objects[i], &bvh->bottom_aabbs[i] );
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Top level
+//--------------------------------------------------------------------------------------------------
+void terra_bvh_two_level_create_top ( TerraBVHTwoLevel* bvh, const TerraInstance* instances, int instances_count, const TerraJobSystem* jobs ) {
+    if ( bvh->instances != NULL ) {
+        terra_bvh_destroy ( &bvh->top );
+        terra_free ( bvh->instances );
+    }
+
+    bvh->instances = ( TerraInstance* ) terra_malloc ( sizeof ( TerraInstance ) * ( instances_count > 0 ? instances_count : 1 ) );
+    bvh->instances_count = 0;
+    TerraAABB* aabbs = ( TerraAABB* ) terra_malloc ( sizeof ( TerraAABB ) * ( instances_count > 0 ? instances_count : 1 ) );
+
+    for ( int i = 0; i < instances_count; ++i ) {
+        assert ( instances[i].object_idx < ( uint32_t ) bvh->objects_count );
+        const TerraAABB* object_aabb = &bvh->bottom_aabbs[instances[i].object_idx];
+
+        if ( object_aabb->min.x > object_aabb->max.x ) {
+            continue;
+        }
+
+        // World bounds of the 8 transformed corners
+        TerraAABB* aabb = &aabbs[bvh->instances_count];
+        aabb->min = terra_f3_set1 ( FLT_MAX );
+        aabb->max = terra_f3_set1 ( -FLT_MAX );
+
+        for ( int c = 0; c < 8; ++c ) {
+            TerraFloat3 corner = terra_f3_set ( c & 1 ? object_aabb->max.x : object_aabb->min.x,
+                                                c & 2 ? object_aabb->max.y : object_aabb->min.y,
+                                                c & 4 ? object_aabb->max.z : object_aabb->min.z );
+            corner = terra_instance_point_to_world ( &instances[i], &corner );
+            aabb->min = terra_f3_set ( terra_minf ( aabb->min.x, corner.x ), terra_minf ( aabb->min.y, corner.y ), terra_minf ( aabb->min.z, corner.z ) );
+            aabb->max = terra_f3_set ( terra_maxf ( aabb->max.x, corner.x ), terra_maxf ( aabb->max.y, corner.y ), terra_maxf ( aabb->max.z, corner.z ) );
+        }
+
+        bvh->instances[bvh->instances_count++] = instances[i];
+    }
+
+    terra_bvh_create_from_aabbs ( &bvh->top, aabbs, bvh->instances_count, jobs );
+    terra_free ( aabbs );
+}
+
+void terra_bvh_two_level_destroy ( TerraBVHTwoLevel* bvh ) {
+    for ( int i = 0; i < bvh->objects_count; ++i ) {
+        terra_bvh_two_level_destroy_object ( bvh, i );
+    }
+
+    if ( bvh->instances != NULL ) {
+        terra_bvh_destroy ( &bvh->top );
+        terra_free ( bvh->instances );
+    }
+
+    terra_free ( bvh->bottom );
+    terra_free ( bvh->bottom_wide );
+    terra_free ( bvh->bottom_aabbs );
+    memset ( bvh, 0, sizeof ( TerraBVHTwoLevel ) );
+}
+
+//--------------------------------------------------------------------------------------------------
+// Traversal
+//--------------------------------------------------------------------------------------------------
+bool terra_bvh_two_level_intersect_instance ( const TerraBVHTwoLevel* bvh, int instance_idx, const TerraRay* ray,
+                                              float* min_d, TerraFloat3* min_p, TerraPrimitiveRef* primitive_out ) {
+    const TerraInstance* instance = &bvh->instances[instance_idx];
+    TerraRay local = terra_instance_ray ( instance, ray );
+    TerraRayState local_state;
+    terra_ray_state_init ( &local, &local_state );
+    TerraFloat3 point;
+    TerraPrimitiveRef primitive;
+    bool hit;
+
+    // Only hits closer than min_d are reported
+    if ( bvh->bottom != NULL ) {
+        hit = terra_bvh_traverse ( &bvh->bottom[instance->object_idx], &local, &local_state, *min_d, &point, &primitive );
+    } else {
+        hit = terra_bvh_wide_traverse ( &bvh->bottom_wide[instance->object_idx], &local, &local_state, *min_d, &point, &primitive );
+    }
+
+    if ( !hit ) {
+        return false;
+    }
+
+    TerraFloat3 offset = terra_subf3 ( &point, &local.origin );
+    *min_d = terra_dotf3 ( &offset, &local.direction ) / terra_dotf3 ( &local.direction, &local.direction );
+    *min_p = point;
+    primitive_out->object_idx = instance->object_idx;
+    primitive_out->triangle_idx = primitive.triangle_idx;
+    return true;
+}
+
+bool terra_bvh_two_level_occluded_instance ( const TerraBVHTwoLevel* bvh, int instance_idx, const TerraRay* ray,
+                                             float t_max ) {
+    const TerraInstance* instance = &bvh->instances[instance_idx];
+    TerraRay local = terra_instance_ray ( instance, ray );
+    TerraRayState local_state;
+    terra_ray_state_init ( &local, &local_state );
+
+    if ( bvh->bottom != NULL ) {
+        return terra_bvh_occluded ( &bvh->bottom[instance->object_idx], &local, &local_state, t_max );
+    }
+
+    return terra_bvh_wide_occluded ( &bvh->bottom_wide[instance->object_idx], &local, &local_state, t_max );
+}
+
+// Same front to back traversal as terra_bvh_traverse, leaves descend into the bottom level trees
+bool terra_bvh_two_level_traverse ( const TerraBVHTwoLevel* bvh, const TerraRay* ray, float t_max,
+                                    TerraFloat3* point_out, TerraPrimitiveRef* primitive_out, int* instance_out ) {
+    const TerraBVH* top = &bvh->top;
+    int queue[TERRA_BVH_TWO_LEVEL_STACK_SIZE];
+    float queue_t[TERRA_BVH_TWO_LEVEL_STACK_SIZE];
+    queue[0] = 0;
+    queue_t[0] = 0.f;
+    int queue_count = 1;
+    float min_d = t_max;
+    TerraFloat3 min_p = terra_f3_set1 ( FLT_MAX );
+    bool found = false;
+
+    if ( top->nodes_count == 0 ) {
+        return false;
+    }
+
+    // The top level only needs the box test state, the instances transform the ray and initialize their own
+    TerraRayState ray_state;
+    terra_ray_box_intersection_init ( ray, &ray_state );
+
+    while ( queue_count > 0 ) {
+        --queue_count;
+
+        if ( queue_t[queue_count] > min_d ) {
+            continue;
+        }
+
+        const TerraBVHNode* node = &top->nodes[queue[queue_count]];
+        float t[2];
+        bool hit[2];
+
+        for ( int i = 0; i < 2; ++i ) {
+            hit[i] = node->type[i] != 0 && terra_ray_aabb_intersection ( &ray_state, &node->aabb[i], &t[i], NULL ) && t[i] <= min_d;
+        }
+
+        int near = hit[1] && ( !hit[0] || t[1] < t[0] ) ? 1 : 0;
+        int order[2] = { near, 1 - near };
+
+        for ( int k = 0; k < 2; ++k ) {
+            int i = order[k];
+
+            if ( !hit[i] || node->type[i] <= 0 || t[i] > min_d ) {
+                continue;
+            }
+
+            for ( int j = 0; j < node->type[i]; ++j ) {
+                int instance_idx = ( int ) top->primitives[node->index[i] + j];
+
+                if ( terra_bvh_two_level_intersect_instance ( bvh, instance_idx, ray, &min_d, &min_p, primitive_out ) ) {
+                    *instance_out = instance_idx;
+                    found = true;
+                }
+            }
+        }
+
+        for ( int k = 1; k >= 0; --k ) {
+            int i = order[k];
+
+            if ( hit[i] && node->type[i] == -1 && t[i] <= min_d ) {
+                assert ( queue_count < TERRA_BVH_TWO_LEVEL_STACK_SIZE );
+                queue[queue_count] = node->index[i];
+                queue_t[queue_count] = t[i];
+                ++queue_count;
+            }
+        }
+    }
+
+    *point_out = min_p;
+    return found;
+}
+
+bool terra_bvh_two_level_occluded ( const TerraBVHTwoLevel* bvh, const TerraRay* ray, float t_max ) {
+    const TerraBVH* top = &bvh->top;
+    int queue[TERRA_BVH_TWO_LEVEL_STACK_SIZE];
+    queue[0] = 0;
+    int queue_count = 1;
+
+    if ( top->nodes_count == 0 ) {
+        return false;
+    }
+
+    TerraRayState ray_state;
+    terra_ray_box_intersection_init ( ray, &ray_state );
+
+    while ( queue_count > 0 ) {
+        const TerraBVHNode* node = &top->nodes[queue[--queue_count]];
+
+        for ( int i = 0; i < 2; ++i ) {
+            float t;
+
+            if ( node->type[i] == 0 || !terra_ray_aabb_intersection ( &ray_state, &node->aabb[i], &t, NULL ) || t >= t_max ) {
+                continue;
+            }
+
+            if ( node->type[i] == -1 ) {
+                assert ( queue_count < TERRA_BVH_TWO_LEVEL_STACK_SIZE );
+                queue[queue_count++] = node->index[i];
+                continue;
+            }
+
+            for ( int j = 0; j < node->type[i]; ++j ) {
+                if ( terra_bvh_two_level_occluded_instance ( bvh, ( int ) top->primitives[node->index[i] + j], ray, t_max ) ) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    return false;
+}
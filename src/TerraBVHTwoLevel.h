@@ -0,0 +1,58 @@
+#ifndef _TERRA_BVH_TWO_LEVEL_H_
+#define _TERRA_BVH_TWO_LEVEL_H_
+
+// Terra
+#include <Terra.h>
+#include <TerraMath.h>
+#include "TerraPrivate.h"
+#include "TerraBVH.h"
+#include "TerraBVHWide.h"
+
+// libc
+#include <stdint.h>
+
+// Placement of an object in the world. Transforms are affine (last row is 0 0 0 1), vectors are transformed
+// as columns: world = transform * object.
+typedef struct {
+    uint32_t      object_idx;
+    TerraFloat4x4 transform;            // Object to world
+    TerraFloat4x4 inverse_transform;    // World to object
+} TerraInstance;
+
+// Each object gets its own bottom level tree built in object space, the top level tree is built over the world
+// bounds of the instances. Adding, moving or removing instances only rebuilds the top level.
+// Rays are moved into object space without normalizing the direction, the ray parameter t is the same in both spaces.
+typedef struct {
+    TerraAccelerator accelerator;       // Layout of the bottom level trees
+    TerraBVH*        bottom;            // One tree per object for kTerraAcceleratorBVH
+    TerraBVHWide*    bottom_wide;       // One tree per object for the wide accelerators
+    TerraAABB*       bottom_aabbs;      // Object space bounds of each object
+    int              objects_count;
+    TerraBVH         top;               // Leaves reference instances
+    TerraInstance*   instances;
+    int              instances_count;
+} TerraBVHTwoLevel;
+
+//--------------------------------------------------------------------------------------------------
+// Terra Two Level BVH Internal routines
+//--------------------------------------------------------------------------------------------------
+void        terra_instance_init ( TerraInstance* instance, uint32_t object_idx, const TerraFloat4x4* transform );
+TerraFloat3 terra_instance_point_to_world ( const TerraInstance* instance, const TerraFloat3* point );
+TerraFloat3 terra_instance_normal_to_world ( const TerraInstance* instance, const TerraFloat3* normal );
+
+// Builds the bottom level trees, the top level is empty until terra_bvh_two_level_create_top is called
+void        terra_bvh_two_level_create_bottom ( TerraBVHTwoLevel* bvh, TerraAccelerator accelerator, const TerraObject* objects, int objects_count,
+                                                TerraBVHBuilder builder, const TerraJobSystem* jobs );
+// Refits the bottom level trees of the objects flagged in moved (objects_count entries), degraded ones are rebuilt.
+// The top level has to be rebuilt afterwards.
+void        terra_bvh_two_level_refit_bottom ( TerraBVHTwoLevel* bvh, const TerraObject* objects, const bool* moved, TerraBVHBuilder builder,
+                                               const TerraJobSystem* jobs );
+// Replaces the top level tree, instances are copied. Instances of empty objects are skipped.
+void        terra_bvh_two_level_create_top ( TerraBVHTwoLevel* bvh, const TerraInstance* instances, int instances_count, const TerraJobSystem* jobs );
+void        terra_bvh_two_level_destroy ( TerraBVHTwoLevel* bvh );
+// point_out is in the object space of the instance hit, instance_out indexes bvh->instances
+bool        terra_bvh_two_level_traverse ( const TerraBVHTwoLevel* bvh, const TerraRay* ray, float t_max,
+                                           TerraFloat3* point_out, TerraPrimitiveRef* primitive_out, int* instance_out );
+bool        terra_bvh_two_level_occluded ( const TerraBVHTwoLevel* bvh, const TerraRay* ray, float t_max );
+
+#endif // _TERRA_BVH_TWO_LEVEL_H_
@@ -0,0 +1,687 @@
+// TerraBVHWide
+#include "TerraBVHWide.h"
+
+// Terra
+#include "TerraPrivate.h"
+
+// libc
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <immintrin.h>
+
+// Depth first traversal pushes up to width - 1 nodes per level. Trees needing more (see TerraBVHWide.stack_size) get a
+// traversal stack allocated for them.
+#ifndef TERRA_BVH_WIDE_STACK_SIZE
+#define TERRA_BVH_WIDE_STACK_SIZE 256
+#endif
+
+// Ray broadcasted on all the lanes, computed once per traversal. The inverse direction is the clamped one of the binary
+// box test (see terra_ray_box_intersection_init), an axis parallel ray starting on a plane would otherwise get 0 * inf.
+typedef struct {
+    __m128 origin[3];
+    __m128 inv_direction[3];
+#ifdef __AVX__
+    __m256 origin8[3];
+    __m256 inv_direction8[3];
+#endif
+} TerraBVHWideRay;
+
+// Child of a wide node before being written out
+typedef struct {
+    TerraAABB aabb;
+    int32_t   index;
+    int32_t   type;
+} TerraBVHWideChild;
+
+static float terra_bvh_wide_surface_area ( const TerraAABB* aabb );
+static int   terra_bvh_wide_collapse ( const TerraBVH* binary, int node_idx, int width, TerraBVHWideChild* children );
+static void  terra_bvh_wide_write ( float* planes, int width, const TerraBVHWideChild* children, int count );
+static float terra_bvh_wide_quantize_frame ( float min, float max, int8_t* exponent_out );
+static void  terra_bvh_wide_quantize ( float min, float max, float origin, float step, uint8_t* q_min, uint8_t* q_max );
+static void  terra_bvh_wide_write_quantized ( TerraBVH4QNode* node, const TerraBVHWideChild* children, int count );
+static int   terra_bvh_wide_read ( const TerraBVHWide* bvh, int node_idx, TerraBVHWideChild* children );
+static float terra_bvh_wide_sah_cost ( const TerraBVHWide* bvh );
+static void  terra_bvh_wide_refit_node ( void* bvh, int node_idx );
+static void  terra_bvh_wide_ray_init ( const TerraRay* ray, const TerraRayState* ray_state, TerraBVHWideRay* wide_ray );
+static int   terra_bvh_wide_slab4 ( const __m128* planes, const TerraBVHWideRay* ray, float t_max, float* t_out );
+static int   terra_bvh_wide_intersect4 ( const float* planes, int width, const TerraBVHWideRay* ray, float t_max, float* t_out );
+static int   terra_bvh_wide_intersect4q ( const TerraBVH4QNode* node, const TerraBVHWideRay* ray, float t_max, float* t_out );
+static int   terra_bvh_wide_intersect8 ( const TerraBVH8Node* node, const TerraBVHWideRay* ray, float t_max, float* t_out );
+
+float terra_bvh_wide_surface_area ( const TerraAABB* aabb ) {
+    float w = aabb->max.x - aabb->min.x;
+    float h = aabb->max.y - aabb->min.y;
+    float d = aabb->max.z - aabb->min.z;
+    return 2 * ( w * d + w * h + d * h );
+}
+
+// Gathers up to width children for the wide node replacing the binary node at node_idx, by opening
+// the internal child with the largest surface area until there's no more room. Returns the number of children.
+int terra_bvh_wide_collapse ( const TerraBVH* binary, int node_idx, int width, TerraBVHWideChild* children ) {
+    const TerraBVHNode* node = &binary->nodes[node_idx];
+    int count = 0;
+
+    for ( int i = 0; i < 2; ++i ) {
+        if ( node->type[i] != 0 ) {
+            children[count].aabb = node->aabb[i];
+            children[count].index = node->index[i];
+            children[count].type = node->type[i];
+            ++count;
+        }
+    }
+
+    while ( count < width ) {
+        int open = -1;
+        float open_area = -1.f;
+
+        for ( int c = 0; c < count; ++c ) {
+            float area = terra_bvh_wide_surface_area ( &children[c].aabb );
+
+            if ( children[c].type == -1 && area > open_area ) {
+                open = c;
+                open_area = area;
+            }
+        }
+
+        if ( open == -1 ) {
+            break;
+        }
+
+        // internal nodes always have both children
+        node = &binary->nodes[children[open].index];
+        children[open].aabb = node->aabb[0];
+        children[open].index = node->index[0];
+        children[open].type = node->type[0];
+        children[count].aabb = node->aabb[1];
+        children[count].index = node->index[1];
+        children[count].type = node->type[1];
+        ++count;
+    }
+
+    return count;
+}
+
+// Full precision SoA planes, planes points to min_x. Unused slots get an empty box
+void terra_bvh_wide_write ( float* planes, int width, const TerraBVHWideChild* children, int count ) {
+    int32_t* index = ( int32_t* ) ( planes + 6 * width );
+    int32_t* type = index + width;
+
+    for ( int c = 0; c < width; ++c ) {
+        TerraAABB aabb;
+
+        if ( c < count ) {
+            aabb = children[c].aabb;
+            index[c] = children[c].index;
+            type[c] = children[c].type;
+        } else {
+            aabb.min = terra_f3_set1 ( FLT_MAX );
+            aabb.max = terra_f3_set1 ( -FLT_MAX );
+            index[c] = 0;
+            type[c] = 0;
+        }
+
+        planes[0 * width + c] = aabb.min.x;
+        planes[1 * width + c] = aabb.max.x;
+        planes[2 * width + c] = aabb.min.y;
+        planes[3 * width + c] = aabb.max.y;
+        planes[4 * width + c] = aabb.min.z;
+        planes[5 * width + c] = aabb.max.z;
+    }
+}
+
+// Frame of one axis: the origin is the minimum of all the children and the step is the smallest power
+// of two that lets 255 steps cover the whole extent. Steps being powers of two, q * step is exact and the
+// decoded plane is rounded only once, the same way at build and at traversal time.
+float terra_bvh_wide_quantize_frame ( float min, float max, int8_t* exponent_out ) {
+    float extent = max - min;
+    int e = extent > 0.f ? ( int ) ceilf ( log2f ( extent / 255.f ) ) : -126;
+    e = e < -126 ? -126 : e;
+
+    while ( e < 127 && min + 255.f * ldexpf ( 1.f, e ) < max ) {
+        ++e;
+    }
+
+    *exponent_out = ( int8_t ) e;
+    return ldexpf ( 1.f, e );
+}
+
+void terra_bvh_wide_quantize ( float min, float max, float origin, float step, uint8_t* q_min, uint8_t* q_max ) {
+    float lo = floorf ( ( min - origin ) / step );
+    float hi = ceilf ( ( max - origin ) / step );
+    lo = lo < 0.f ? 0.f : ( lo > 255.f ? 255.f : lo );
+    hi = hi < 0.f ? 0.f : ( hi > 255.f ? 255.f : hi );
+
+    // Division rounding can leave the plane one step inside the box
+    while ( lo > 0.f && origin + lo * step > min ) {
+        lo -= 1.f;
+    }
+
+    while ( hi < 255.f && origin + hi * step < max ) {
+        hi += 1.f;
+    }
+
+    *q_min = ( uint8_t ) lo;
+    *q_max = ( uint8_t ) hi;
+}
+
+void terra_bvh_wide_write_quantized ( TerraBVH4QNode* node, const TerraBVHWideChild* children, int count ) {
+    memset ( node, 0, sizeof ( TerraBVH4QNode ) );
+    TerraAABB frame = children[0].aabb;
+
+    for ( int c = 1; c < count; ++c ) {
+        frame.min.x = terra_minf ( frame.min.x, children[c].aabb.min.x );
+        frame.min.y = terra_minf ( frame.min.y, children[c].aabb.min.y );
+        frame.min.z = terra_minf ( frame.min.z, children[c].aabb.min.z );
+        frame.max.x = terra_maxf ( frame.max.x, children[c].aabb.max.x );
+        frame.max.y = terra_maxf ( frame.max.y, children[c].aabb.max.y );
+        frame.max.z = terra_maxf ( frame.max.z, children[c].aabb.max.z );
+    }
+
+    float step[3];
+    node->origin[0] = frame.min.x;
+    node->origin[1] = frame.min.y;
+    node->origin[2] = frame.min.z;
+    step[0] = terra_bvh_wide_quantize_frame ( frame.min.x, frame.max.x, &node->exponent[0] );
+    step[1] = terra_bvh_wide_quantize_frame ( frame.min.y, frame.max.y, &node->exponent[1] );
+    step[2] = terra_bvh_wide_quantize_frame ( frame.min.z, frame.max.z, &node->exponent[2] );
+
+    for ( int c = 0; c < count; ++c ) {
+        const TerraAABB* aabb = &children[c].aabb;
+        terra_bvh_wide_quantize ( aabb->min.x, aabb->max.x, node->origin[0], step[0], &node->min_x[c], &node->max_x[c] );
+        terra_bvh_wide_quantize ( aabb->min.y, aabb->max.y, node->origin[1], step[1], &node->min_y[c], &node->max_y[c] );
+        terra_bvh_wide_quantize ( aabb->min.z, aabb->max.z, node->origin[2], step[2], &node->min_z[c], &node->max_z[c] );
+        node->index[c] = children[c].index;
+        node->type[c] = ( int8_t ) children[c].type;
+    }
+}
+
+void terra_bvh_wide_create ( TerraBVHWide* bvh, int width, bool quantized, const TerraObject* objects, int objects_count, TerraBVHBuilder builder,
+                             const TerraJobSystem* jobs ) {
+    assert ( width == 4 || width == 8 );
+    assert ( !quantized || width == 4 );
+
+    TerraBVH binary;
+    terra_bvh_create ( &binary, objects, objects_count, builder, jobs );
+
+    bvh->width = width;
+    bvh->quantized = quantized;
+    size_t node_size = terra_bvh_wide_node_size ( bvh );
+    bvh->primitives = binary.primitives;
+    bvh->triangles = binary.triangles;
+    bvh->primitive_map = binary.primitive_map;
+    bvh->primitives_count = binary.primitives_count;
+    bvh->binary_nodes_count = binary.nodes_count;
+
+    // Every wide node replaces at least one binary node
+    void* nodes = terra_malloc ( node_size * ( binary.nodes_count > 0 ? binary.nodes_count : 1 ) );
+    bvh->nodes_count = binary.nodes_count > 0 ? 1 : 0;
+
+    // (binary node, wide node) pairs still to be collapsed
+    int* stack = ( int* ) terra_malloc ( sizeof ( int ) * 2 * ( binary.nodes_count + 1 ) );
+    int stack_idx = 0;
+    // Depth of each wide node, the deepest one bounds the traversal stack
+    int* depth = ( int* ) terra_malloc ( sizeof ( int ) * ( binary.nodes_count > 0 ? binary.nodes_count : 1 ) );
+    int max_depth = 0;
+    depth[0] = 0;
+
+    if ( binary.nodes_count > 0 ) {
+        stack[stack_idx++] = 0;
+        stack[stack_idx++] = 0;
+    }
+
+    while ( stack_idx > 0 ) {
+        int wide_idx = stack[--stack_idx];
+        int binary_idx = stack[--stack_idx];
+        TerraBVHWideChild children[8];
+        int count = terra_bvh_wide_collapse ( &binary, binary_idx, width, children );
+
+        // Internal children are given their wide node index, leaves keep pointing to the primitives
+        for ( int c = 0; c < count; ++c ) {
+            if ( children[c].type == -1 ) {
+                stack[stack_idx++] = children[c].index;
+                stack[stack_idx++] = bvh->nodes_count;
+                depth[bvh->nodes_count] = depth[wide_idx] + 1;
+                max_depth = depth[bvh->nodes_count] > max_depth ? depth[bvh->nodes_count] : max_depth;
+                children[c].index = bvh->nodes_count++;
+            }
+        }
+
+        void* node = ( char* ) nodes + node_size * wide_idx;
+
+        // Both full precision node types share the same layout, only the lane count changes
+        if ( quantized ) {
+            terra_bvh_wide_write_quantized ( ( TerraBVH4QNode* ) node, children, count );
+        } else {
+            terra_bvh_wide_write ( ( float* ) node, width, children, count );
+        }
+    }
+
+    terra_free ( stack );
+    terra_free ( depth );
+    terra_free_aligned ( binary.nodes );
+    // Each level on the path to the deepest node leaves up to width - 1 siblings on the stack
+    bvh->stack_size = ( width - 1 ) * ( max_depth + 1 ) + 1;
+
+    // Trimmed into cache line aligned memory, nodes are multiples of the line size
+    bvh->nodes = terra_malloc_aligned ( node_size * ( bvh->nodes_count > 0 ? bvh->nodes_count : 1 ), TERRA_CACHE_LINE_SIZE );
+    memcpy ( bvh->nodes, nodes, node_size * bvh->nodes_count );
+    terra_free ( nodes );
+
+    bvh->sah_cost = terra_bvh_wide_sah_cost ( bvh );
+}
+
+void terra_bvh_wide_destroy ( TerraBVHWide* bvh ) {
+    terra_free_aligned ( bvh->nodes );
+    terra_free ( bvh->primitives );
+    terra_free_aligned ( bvh->triangles );
+    terra_primitive_map_destroy ( &bvh->primitive_map );
+}
+
+size_t terra_bvh_wide_node_size ( const TerraBVHWide* bvh ) {
+    if ( bvh->quantized ) {
+        return sizeof ( TerraBVH4QNode );
+    }
+
+    return bvh->width == 4 ? sizeof ( TerraBVH4Node ) : sizeof ( TerraBVH8Node );
+}
+
+// Reads back the children of a node, quantized bounds are decoded the same way traversal does. Returns the number of children.
+int terra_bvh_wide_read ( const TerraBVHWide* bvh, int node_idx, TerraBVHWideChild* children ) {
+    int count = 0;
+
+    if ( bvh->quantized ) {
+        const TerraBVH4QNode* node = ( const TerraBVH4QNode* ) bvh->nodes + node_idx;
+        float step[3];
+
+        for ( int axis = 0; axis < 3; ++axis ) {
+            step[axis] = ldexpf ( 1.f, node->exponent[axis] );
+        }
+
+        for ( ; count < 4 && node->type[count] != 0; ++count ) {
+            TerraAABB* aabb = &children[count].aabb;
+            aabb->min = terra_f3_set ( node->origin[0] + node->min_x[count] * step[0], node->origin[1] + node->min_y[count] * step[1],
+                                       node->origin[2] + node->min_z[count] * step[2] );
+            aabb->max = terra_f3_set ( node->origin[0] + node->max_x[count] * step[0], node->origin[1] + node->max_y[count] * step[1],
+                                       node->origin[2] + node->max_z[count] * step[2] );
+            children[count].index = node->index[count];
+            children[count].type = node->type[count];
+        }
+
+        return count;
+    }
+
+    const size_t width = bvh->width;
+    const float* planes = ( const float* ) ( ( const char* ) bvh->nodes + terra_bvh_wide_node_size ( bvh ) * node_idx );
+    const int32_t* index = ( const int32_t* ) ( planes + 6 * width );
+    const int32_t* type = index + width;
+
+    for ( ; count < bvh->width && type[count] != 0; ++count ) {
+        TerraAABB* aabb = &children[count].aabb;
+        aabb->min = terra_f3_set ( planes[0 * width + count], planes[2 * width + count], planes[4 * width + count] );
+        aabb->max = terra_f3_set ( planes[1 * width + count], planes[3 * width + count], planes[5 * width + count] );
+        children[count].index = index[count];
+        children[count].type = type[count];
+    }
+
+    return count;
+}
+
+float terra_bvh_wide_sah_cost ( const TerraBVHWide* bvh ) {
+    TerraBVHWideChild children[8];
+    float cost = 0.f;
+
+    if ( bvh->nodes_count == 0 ) {
+        return 0.f;
+    }
+
+    for ( int n = 0; n < bvh->nodes_count; ++n ) {
+        int count = terra_bvh_wide_read ( bvh, n, children );
+
+        for ( int c = 0; c < count; ++c ) {
+            cost += terra_bvh_sah_child_cost ( &children[c].aabb, children[c].type );
+        }
+    }
+
+    // Root bounds
+    int count = terra_bvh_wide_read ( bvh, 0, children );
+    TerraAABB root = children[0].aabb;
+
+    for ( int c = 1; c < count; ++c ) {
+        root.min = terra_f3_set ( terra_minf ( root.min.x, children[c].aabb.min.x ), terra_minf ( root.min.y, children[c].aabb.min.y ),
+                                  terra_minf ( root.min.z, children[c].aabb.min.z ) );
+        root.max = terra_f3_set ( terra_maxf ( root.max.x, children[c].aabb.max.x ), terra_maxf ( root.max.y, children[c].aabb.max.y ),
+                                  terra_maxf ( root.max.z, children[c].aabb.max.z ) );
+    }
+
+    float root_area = terra_bvh_wide_surface_area ( &root );
+    return root_area > 0.f ? cost / root_area : 0.f;
+}
+
+// Internal children take the union of their own children, which sit one level deeper and are already refit
+void terra_bvh_wide_refit_node ( void* _bvh, int node_idx ) {
+    TerraBVHWide* bvh = ( TerraBVHWide* ) _bvh;
+    TerraBVHWideChild children[8];
+    TerraBVHWideChild grandchildren[8];
+    int count = terra_bvh_wide_read ( bvh, node_idx, children );
+
+    for ( int c = 0; c < count; ++c ) {
+        TerraAABB* aabb = &children[c].aabb;
+
+        if ( children[c].type > 0 ) {
+            terra_bvh_leaf_aabb ( bvh->triangles, children[c].index, children[c].type, aabb );
+            continue;
+        }
+
+        int grandchildren_count = terra_bvh_wide_read ( bvh, children[c].index, grandchildren );
+        *aabb = grandchildren[0].aabb;
+
+        for ( int g = 1; g < grandchildren_count; ++g ) {
+            aabb->min = terra_f3_set ( terra_minf ( aabb->min.x, grandchildren[g].aabb.min.x ), terra_minf ( aabb->min.y, grandchildren[g].aabb.min.y ),
+                                       terra_minf ( aabb->min.z, grandchildren[g].aabb.min.z ) );
+            aabb->max = terra_f3_set ( terra_maxf ( aabb->max.x, grandchildren[g].aabb.max.x ), terra_maxf ( aabb->max.y, grandchildren[g].aabb.max.y ),
+                                       terra_maxf ( aabb->max.z, grandchildren[g].aabb.max.z ) );
+        }
+    }
+
+    void* node = ( char* ) bvh->nodes + terra_bvh_wide_node_size ( bvh ) * node_idx;
+
+    if ( bvh->quantized ) {
+        terra_bvh_wide_write_quantized ( ( TerraBVH4QNode* ) node, children, count );
+    } else {
+        terra_bvh_wide_write ( ( float* ) node, bvh->width, children, count );
+    }
+}
+
+bool terra_bvh_wide_refit ( TerraBVHWide* bvh, const TerraObject* objects, const TerraJobSystem* jobs ) {
+    TerraBVHWideChild children[8];
+    terra_bvh_gather_triangles ( bvh->primitives, bvh->primitives_count, objects, &bvh->primitive_map, bvh->triangles );
+    int* depth = ( int* ) terra_malloc ( sizeof ( int ) * ( bvh->nodes_count > 0 ? bvh->nodes_count : 1 ) );
+    depth[0] = 0;
+
+    // Children always come after their parent
+    for ( int n = 0; n < bvh->nodes_count; ++n ) {
+        int count = terra_bvh_wide_read ( bvh, n, children );
+
+        for ( int c = 0; c < count; ++c ) {
+            if ( children[c].type == -1 ) {
+                depth[children[c].index] = depth[n] + 1;
+            }
+        }
+    }
+
+    terra_bvh_refit_levels ( bvh, bvh->nodes_count, depth, terra_bvh_wide_refit_node, jobs );
+    terra_free ( depth );
+    return !terra_bvh_refit_degraded ( terra_bvh_wide_sah_cost ( bvh ), bvh->sah_cost );
+}
+
+void terra_bvh_wide_ray_init ( const TerraRay* ray, const TerraRayState* ray_state, TerraBVHWideRay* wide_ray ) {
+    wide_ray->origin[0] = _mm_set1_ps ( ray->origin.x );
+    wide_ray->origin[1] = _mm_set1_ps ( ray->origin.y );
+    wide_ray->origin[2] = _mm_set1_ps ( ray->origin.z );
+    wide_ray->inv_direction[0] = _mm_set1_ps ( ray_state->box_inv_direction.x );
+    wide_ray->inv_direction[1] = _mm_set1_ps ( ray_state->box_inv_direction.y );
+    wide_ray->inv_direction[2] = _mm_set1_ps ( ray_state->box_inv_direction.z );
+#ifdef __AVX__
+    wide_ray->origin8[0] = _mm256_set1_ps ( ray->origin.x );
+    wide_ray->origin8[1] = _mm256_set1_ps ( ray->origin.y );
+    wide_ray->origin8[2] = _mm256_set1_ps ( ray->origin.z );
+    wide_ray->inv_direction8[0] = _mm256_set1_ps ( ray_state->box_inv_direction.x );
+    wide_ray->inv_direction8[1] = _mm256_set1_ps ( ray_state->box_inv_direction.y );
+    wide_ray->inv_direction8[2] = _mm256_set1_ps ( ray_state->box_inv_direction.z );
+#endif
+}
+
+// Slab test of four children against the ray, clipped to [0, t_max]. planes are min_x, max_x, min_y, .. max_z.
+// Returns the mask of the children hit, t_out is set to the entry distance of each child.
+int terra_bvh_wide_slab4 ( const __m128* planes, const TerraBVHWideRay* ray, float t_max, float* t_out ) {
+    __m128 t0x = _mm_mul_ps ( _mm_sub_ps ( planes[0], ray->origin[0] ), ray->inv_direction[0] );
+    __m128 t1x = _mm_mul_ps ( _mm_sub_ps ( planes[1], ray->origin[0] ), ray->inv_direction[0] );
+    __m128 t0y = _mm_mul_ps ( _mm_sub_ps ( planes[2], ray->origin[1] ), ray->inv_direction[1] );
+    __m128 t1y = _mm_mul_ps ( _mm_sub_ps ( planes[3], ray->origin[1] ), ray->inv_direction[1] );
+    __m128 t0z = _mm_mul_ps ( _mm_sub_ps ( planes[4], ray->origin[2] ), ray->inv_direction[2] );
+    __m128 t1z = _mm_mul_ps ( _mm_sub_ps ( planes[5], ray->origin[2] ), ray->inv_direction[2] );
+    __m128 tmin = _mm_max_ps ( _mm_max_ps ( _mm_min_ps ( t0x, t1x ), _mm_min_ps ( t0y, t1y ) ), _mm_max_ps ( _mm_min_ps ( t0z, t1z ), _mm_setzero_ps() ) );
+    __m128 tmax = _mm_min_ps ( _mm_min_ps ( _mm_max_ps ( t0x, t1x ), _mm_max_ps ( t0y, t1y ) ), _mm_min_ps ( _mm_max_ps ( t0z, t1z ), _mm_set1_ps ( t_max ) ) );
+    _mm_storeu_ps ( t_out, tmin );
+    return _mm_movemask_ps ( _mm_cmple_ps ( tmin, tmax ) );
+}
+
+// planes points to the first min_x, consecutive planes are width floats apart
+int terra_bvh_wide_intersect4 ( const float* planes, int width, const TerraBVHWideRay* ray, float t_max, float* t_out ) {
+    __m128 p[6];
+
+    for ( int i = 0; i < 6; ++i ) {
+        p[i] = _mm_loadu_ps ( planes + i * width );
+    }
+
+    return terra_bvh_wide_slab4 ( p, ray, t_max, t_out );
+}
+
+// Decodes the quantized planes back to world space and runs the same slab test
+int terra_bvh_wide_intersect4q ( const TerraBVH4QNode* node, const TerraBVHWideRay* ray, float t_max, float* t_out ) {
+    const uint8_t* q[6] = { node->min_x, node->max_x, node->min_y, node->max_y, node->min_z, node->max_z };
+    const __m128i zero = _mm_setzero_si128();
+    __m128 p[6];
+
+    for ( int i = 0; i < 6; ++i ) {
+        int axis = i / 2;
+        int32_t packed;
+        memcpy ( &packed, q[i], sizeof ( packed ) );
+        __m128i q32 = _mm_unpacklo_epi16 ( _mm_unpacklo_epi8 ( _mm_cvtsi32_si128 ( packed ), zero ), zero );
+        // 2^exponent built straight from the float exponent bits
+        __m128 step = _mm_castsi128_ps ( _mm_set1_epi32 ( ( node->exponent[axis] + 127 ) << 23 ) );
+        p[i] = _mm_add_ps ( _mm_set1_ps ( node->origin[axis] ), _mm_mul_ps ( _mm_cvtepi32_ps ( q32 ), step ) );
+    }
+
+    return terra_bvh_wide_slab4 ( p, ray, t_max, t_out );
+}
+
+// Same as terra_bvh_wide_intersect4 on eight lanes, falls back to two SSE tests if AVX is not enabled.
+int terra_bvh_wide_intersect8 ( const TerraBVH8Node* node, const TerraBVHWideRay* ray, float t_max, float* t_out ) {
+#ifdef __AVX__
+    __m256 t0x = _mm256_mul_ps ( _mm256_sub_ps ( _mm256_loadu_ps ( node->min_x ), ray->origin8[0] ), ray->inv_direction8[0] );
+    __m256 t1x = _mm256_mul_ps ( _mm256_sub_ps ( _mm256_loadu_ps ( node->max_x ), ray->origin8[0] ), ray->inv_direction8[0] );
+    __m256 t0y = _mm256_mul_ps ( _mm256_sub_ps ( _mm256_loadu_ps ( node->min_y ), ray->origin8[1] ), ray->inv_direction8[1] );
+    __m256 t1y = _mm256_mul_ps ( _mm256_sub_ps ( _mm256_loadu_ps ( node->max_y ), ray->origin8[1] ), ray->inv_direction8[1] );
+    __m256 t0z = _mm256_mul_ps ( _mm256_sub_ps ( _mm256_loadu_ps ( node->min_z ), ray->origin8[2] ), ray->inv_direction8[2] );
+    __m256 t1z = _mm256_mul_ps ( _mm256_sub_ps ( _mm256_loadu_ps ( node->max_z ), ray->origin8[2] ), ray->inv_direction8[2] );
+    __m256 tmin = _mm256_max_ps ( _mm256_max_ps ( _mm256_min_ps ( t0x, t1x ), _mm256_min_ps ( t0y, t1y ) ), _mm256_max_ps ( _mm256_min_ps ( t0z, t1z ), _mm256_setzero_ps() ) );
+    __m256 tmax = _mm256_min_ps ( _mm256_min_ps ( _mm256_max_ps ( t0x, t1x ), _mm256_max_ps ( t0y, t1y ) ), _mm256_min_ps ( _mm256_max_ps ( t0z, t1z ), _mm256_set1_ps ( t_max ) ) );
+    _mm256_storeu_ps ( t_out, tmin );
+    return _mm256_movemask_ps ( _mm256_cmp_ps ( tmin, tmax, _CMP_LE_OQ ) );
+#else
+    return terra_bvh_wide_intersect4 ( node->min_x, 8, ray, t_max, t_out ) | ( terra_bvh_wide_intersect4 ( node->min_x + 4, 8, ray, t_max, t_out + 4 ) << 4 );
+#endif
+}
+
+bool terra_bvh_wide_traverse ( const TerraBVHWide* bvh, const TerraRay* ray, const TerraRayState* ray_state, float t_max,
+                               TerraFloat3* point_out, TerraPrimitiveRef* primitive_out ) {
+    // Nodes are pushed along with the distance the ray enters them at
+    int stack_local[TERRA_BVH_WIDE_STACK_SIZE];
+    float stack_t_local[TERRA_BVH_WIDE_STACK_SIZE];
+    int stack_count = 1;
+    float min_d = t_max;
+    TerraFloat3 min_p = terra_f3_set1 ( FLT_MAX );
+    uint32_t primitive = 0;
+    bool found = false;
+
+    // Intersection queries (already initialized)
+    TerraRayIntersectionQuery  iset_query;
+    iset_query.ray = ray;
+    iset_query.state = ray_state;
+
+    if ( bvh->nodes_count == 0 ) {
+        return false;
+    }
+
+    bool stack_heap = bvh->stack_size > TERRA_BVH_WIDE_STACK_SIZE;
+    int* stack = stack_heap ? ( int* ) terra_malloc ( sizeof ( int ) * bvh->stack_size ) : stack_local;
+    float* stack_t = stack_heap ? ( float* ) terra_malloc ( sizeof ( float ) * bvh->stack_size ) : stack_t_local;
+    stack[0] = 0;
+    stack_t[0] = 0.f;
+
+    TerraBVHWideRay wide_ray;
+    terra_bvh_wide_ray_init ( ray, ray_state, &wide_ray );
+
+    while ( stack_count > 0 ) {
+        --stack_count;
+
+        // A closer hit might have been found since the node was pushed
+        if ( stack_t[stack_count] > min_d ) {
+            continue;
+        }
+
+        int node = stack[stack_count];
+        const int32_t* index;
+        const int32_t* type;
+        int32_t type_q[4];
+        float t[8];
+        int mask;
+
+        // Children behind the closest hit found so far are culled by the box test
+        if ( bvh->width == 8 ) {
+            const TerraBVH8Node* node8 = ( const TerraBVH8Node* ) bvh->nodes + node;
+            mask = terra_bvh_wide_intersect8 ( node8, &wide_ray, min_d, t );
+            index = node8->index;
+            type = node8->type;
+        } else if ( bvh->quantized ) {
+            const TerraBVH4QNode* nodeq = ( const TerraBVH4QNode* ) bvh->nodes + node;
+            mask = terra_bvh_wide_intersect4q ( nodeq, &wide_ray, min_d, t );
+            index = nodeq->index;
+
+            for ( int c = 0; c < 4; ++c ) {
+                type_q[c] = nodeq->type[c];
+            }
+
+            type = type_q;
+        } else {
+            const TerraBVH4Node* node4 = ( const TerraBVH4Node* ) bvh->nodes + node;
+            mask = terra_bvh_wide_intersect4 ( node4->min_x, 4, &wide_ray, min_d, t );
+            index = node4->index;
+            type = node4->type;
+        }
+
+        // Children hit, sorted front to back. The remaining slots are empty after the first type 0
+        int order[8];
+        int order_count = 0;
+
+        for ( int c = 0; c < bvh->width && type[c] != 0; ++c ) {
+            if ( ( mask >> c ) & 1 ) {
+                int k = order_count++;
+
+                for ( ; k > 0 && t[order[k - 1]] > t[c]; --k ) {
+                    order[k] = order[k - 1];
+                }
+
+                order[k] = c;
+            }
+        }
+
+        // Leaves are intersected right away, which can cull the farther children before they're pushed
+        for ( int k = 0; k < order_count; ++k ) {
+            int c = order[k];
+
+            if ( type[c] > 0 && t[c] <= min_d ) {
+                found |= terra_bvh_leaf_intersect ( bvh->primitives, bvh->triangles, index[c], type[c], &iset_query, &min_d, &min_p, &primitive );
+            }
+        }
+
+        // Farthest children go first on the stack so that the nearest one is popped next
+        for ( int k = order_count - 1; k >= 0; --k ) {
+            int c = order[k];
+
+            if ( type[c] == -1 && t[c] <= min_d ) {
+                assert ( stack_count < bvh->stack_size );
+                stack[stack_count] = index[c];
+                stack_t[stack_count] = t[c];
+                ++stack_count;
+            }
+        }
+    }
+
+    if ( stack_heap ) {
+        terra_free ( stack );
+        terra_free ( stack_t );
+    }
+
+    if ( found ) {
+        *primitive_out = terra_primitive_map_find ( &bvh->primitive_map, primitive );
+    }
+
+    *point_out = min_p;
+    return found;
+}
+
+// Same as terra_bvh_wide_traverse without any ordering, returns as soon as a primitive is found in [0, t_max)
+bool terra_bvh_wide_occluded ( const TerraBVHWide* bvh, const TerraRay* ray, const TerraRayState* ray_state, float t_max ) {
+    int stack_local[TERRA_BVH_WIDE_STACK_SIZE];
+    int stack_count = 1;
+    bool occluded = false;
+
+    TerraRayIntersectionQuery  iset_query;
+    iset_query.ray = ray;
+    iset_query.state = ray_state;
+
+    if ( bvh->nodes_count == 0 ) {
+        return false;
+    }
+
+    bool stack_heap = bvh->stack_size > TERRA_BVH_WIDE_STACK_SIZE;
+    int* stack = stack_heap ? ( int* ) terra_malloc ( sizeof ( int ) * bvh->stack_size ) : stack_local;
+    stack[0] = 0;
+
+    TerraBVHWideRay wide_ray;
+    terra_bvh_wide_ray_init ( ray, ray_state, &wide_ray );
+
+    while ( stack_count > 0 && !occluded ) {
+        int node = stack[--stack_count];
+        const int32_t* index;
+        const int32_t* type;
+        int32_t type_q[4];
+        float t[8];
+        int mask;
+
+        if ( bvh->width == 8 ) {
+            const TerraBVH8Node* node8 = ( const TerraBVH8Node* ) bvh->nodes + node;
+            mask = terra_bvh_wide_intersect8 ( node8, &wide_ray, t_max, t );
+            index = node8->index;
+            type = node8->type;
+        } else if ( bvh->quantized ) {
+            const TerraBVH4QNode* nodeq = ( const TerraBVH4QNode* ) bvh->nodes + node;
+            mask = terra_bvh_wide_intersect4q ( nodeq, &wide_ray, t_max, t );
+            index = nodeq->index;
+
+            for ( int c = 0; c < 4; ++c ) {
+                type_q[c] = nodeq->type[c];
+            }
+
+            type = type_q;
+        } else {
+            const TerraBVH4Node* node4 = ( const TerraBVH4Node* ) bvh->nodes + node;
+            mask = terra_bvh_wide_intersect4 ( node4->min_x, 4, &wide_ray, t_max, t );
+            index = node4->index;
+            type = node4->type;
+        }
+
+        for ( int c = 0; c < bvh->width && type[c] != 0; ++c ) {
+            if ( ( ( mask >> c ) & 1 ) == 0 ) {
+                continue;
+            }
+
+            if ( type[c] == -1 ) {
+                assert ( stack_count < bvh->stack_size );
+                stack[stack_count++] = index[c];
+            } else if ( terra_bvh_leaf_occluded ( bvh->triangles, index[c], type[c], &iset_query, t_max ) ) {
+                occluded = true;
+                break;
+            }
+        }
+    }
+
+    if ( stack_heap ) {
+        terra_free ( stack );
+    }
+
+    return occluded;
+}
@@ -0,0 +1,83 @@
+#ifndef _TERRA_BVH_WIDE_H_
+#define _TERRA_BVH_WIDE_H_
+
+// Terra
+#include <Terra.h>
+#include <TerraMath.h>
+#include "TerraPrivate.h"
+#include "TerraBVH.h"
+
+// libc
+#include <stdint.h>
+
+// Wide BVH nodes are obtained by collapsing the binary BVH, each node holds up to 4 (or 8) children.
+// Child bounds are stored as SoA planes, the same axis of all the children is loaded in a single
+// SSE (or AVX) register and all the children are tested with one slab test.
+// index/type have the same meaning as in TerraBVHNode. Unused child slots are at the end with type 0.
+typedef struct {
+    float   min_x[4];
+    float   max_x[4];
+    float   min_y[4];
+    float   max_y[4];
+    float   min_z[4];
+    float   max_z[4];
+    int32_t index[4];
+    int32_t type[4];
+} TerraBVH4Node;
+
+typedef struct {
+    float   min_x[8];
+    float   max_x[8];
+    float   min_y[8];
+    float   max_y[8];
+    float   min_z[8];
+    float   max_z[8];
+    int32_t index[8];
+    int32_t type[8];
+} TerraBVH8Node;
+
+// Quantized 4-wide node, 64 bytes (half a TerraBVH4Node) so that one node is one cache line.
+// Child planes are 8-bit offsets in the node's own frame: plane = origin + q * 2^exponent. Quantization
+// rounds outwards, the decoded boxes always contain the full precision ones.
+typedef struct {
+    float   origin[3];
+    int32_t index[4];
+    uint8_t min_x[4];
+    uint8_t max_x[4];
+    uint8_t min_y[4];
+    uint8_t max_y[4];
+    uint8_t min_z[4];
+    uint8_t max_z[4];
+    int8_t  type[4];            // Fits as long as TERRA_BVH_LEAF_MAX_PRIMITIVES <= 127
+    int8_t  exponent[3];
+    uint8_t pad[5];
+} TerraBVH4QNode;
+
+typedef struct {
+    int                  width;             // 4 or 8, picks the node type
+    bool                 quantized;         // TerraBVH4QNode instead of TerraBVH4Node, only for width 4
+    void*                nodes;             // TerraBVH4Node, TerraBVH8Node or TerraBVH4QNode
+    int                  nodes_count;
+    uint32_t*            primitives;        // Same as TerraBVH, taken over from the binary tree
+    TerraTrianglePacket* triangles;         // Same as TerraBVH, taken over from the binary tree
+    int                  primitives_count;
+    TerraPrimitiveMap    primitive_map;     // Same as TerraBVH, taken over from the binary tree
+    int                  binary_nodes_count; // Size of the binary tree that was collapsed, for memory reports
+    int                  stack_size;        // Most nodes a traversal can have on its stack, ( width - 1 ) * levels + 1
+    float                sah_cost;          // SAH cost of the tree when it was built, refits are compared against it
+} TerraBVHWide;
+
+//--------------------------------------------------------------------------------------------------
+// Terra Wide BVH Internal routines
+//--------------------------------------------------------------------------------------------------
+void        terra_bvh_wide_create ( TerraBVHWide* bvh, int width, bool quantized, const TerraObject* objects, int objects_count, TerraBVHBuilder builder,
+                                    const TerraJobSystem* jobs );
+void        terra_bvh_wide_destroy ( TerraBVHWide* bvh );
+size_t      terra_bvh_wide_node_size ( const TerraBVHWide* bvh );
+// Same as terra_bvh_refit
+bool        terra_bvh_wide_refit ( TerraBVHWide* bvh, const TerraObject* objects, const TerraJobSystem* jobs );
+bool        terra_bvh_wide_traverse ( const TerraBVHWide* bvh, const TerraRay* ray, const TerraRayState* ray_state, float t_max,
+                                      TerraFloat3* point_out, TerraPrimitiveRef* primitive_out );
+bool        terra_bvh_wide_occluded ( const TerraBVHWide* bvh, const TerraRay* ray, const TerraRayState* ray_state, float t_max );
+
+#endif // _TERRA_BVH_WIDE_H_
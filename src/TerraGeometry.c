@@ -5,6 +5,32 @@
 #include <TerraProfile.h>
 #include <TerraPresets.h>
 
+// libc
+#include <string.h>
+#include <immintrin.h>
+
+// Per-lane results of the packet tests, up to two packets at once
+typedef struct {
+    float t[2 * TERRA_TRIANGLE_PACKET_WIDTH];
+    float u[2 * TERRA_TRIANGLE_PACKET_WIDTH];
+    float v[2 * TERRA_TRIANGLE_PACKET_WIDTH];
+    float w[2 * TERRA_TRIANGLE_PACKET_WIDTH];
+} TerraTriangleLanes;
+
+static int   terra_ray_triangle_intersection_moller_trumbore ( const TerraRayIntersectionQuery* query, TerraRayIntersectionResult* result );
+static int   terra_ray_triangle_intersection_wald2013 ( const TerraRayIntersectionQuery* query, TerraRayIntersectionResult* result );
+static void  terra_ray_triangle_edges_f64 ( const float xy[6][8], int lane, float* U, float* V, float* W );
+static int   terra_ray_triangle_intersection4 ( const TerraRay* ray, const TerraRayState* state, const TerraTrianglePacket* packet, int mask,
+                                                TerraTriangleLanes* lanes_out );
+static int   terra_ray_triangle_intersection8 ( const TerraRay* ray, const TerraRayState* state, const TerraTrianglePacket* packets, int mask,
+                                                TerraTriangleLanes* lanes_out );
+static int   terra_ray_triangle_packet_test ( const TerraRay* ray, const TerraRayState* state, const TerraTrianglePacket* packets, int base, int first,
+                                              int end, int* step, TerraTriangleLanes* lanes_out );
+static float terra_benchmark_randf ( uint32_t* state );
+#ifdef __AVX__
+static __m256 terra_triangle_packets_load8 ( const float* lo, const float* hi );
+#endif
+
 // Returns the point along the ray at the specified depth
 TerraFloat3 terra_ray_pos ( const TerraRay* ray, float depth ) {
     const TerraFloat3 d = terra_mulf3 ( &ray->direction, depth );
@@ -20,24 +46,43 @@ void terra_ray_state_init ( const TerraRay* ray, TerraRayState* state ) {
 //--------------------------------------------------------------------------------------------------
 // The Ray/Primitive intersections tests available are listed below. Note that only one should be enabled
 // for each type of primitive. From our tests, Wald's primitive intersection test is typically faster
-// by ~10-15% in the classical test scenes present in the git directory.
+// by ~10-15% in the classical test scenes present in the git directory. All of them are compiled for
+// terra_benchmark_triangle_intersection, the enabled one is what terra_ray_triangle_intersection_query runs.
 // Ray/Triangle
 #define ray_triangle_intersection_moller_trumbore 0 // Naive Moller-Trumbore test
 #define ray_triangle_intersection_wald2013 1        // Faster (vertex/edge) watertight intersection algorithm
-#define ray_triangle_intersection_wald2013_simd 0   // Simd version of the same algorithm
+// Leaves test their triangle packets with the SSE (4 lanes) or AVX (8 lanes) version of Wald's test,
+// otherwise one triangle at a time with the test above.
+#define ray_triangle_intersection_wald2013_simd 1
+
+// Ray/Box, used by every accelerator but the wide BVHs (which test all the children of a node at once).
+// In isolation the SSE test runs ~1.3x as many tests per second as the scalar min/max one it replaced, picking the
+// planes by sign is ~0.6x.
+#define ray_box_branchless 1        // SSE, the two planes of each axis are sorted with min/max
+#define ray_box_williams2005 0      // Scalar, the near and far planes are picked by the sign of the direction
+
+// Smallest absolute value of a direction component for the box test, see terra_ray_box_intersection_init
+#ifndef TERRA_RAY_BOX_MIN_DIRECTION
+#define TERRA_RAY_BOX_MIN_DIRECTION 1e-18f
+#endif
 
-// Ray/Box (todo: move from Terra.c)
-#define ray_box_branchless 1
-#define ray_box_wald2013 0
+#if ray_box_branchless
+static bool  terra_ray_box_intersection_branchless ( const TerraRayState* state, const TerraAABB* aabb, float* tmin_out, float* tmax_out );
+#elif ray_box_williams2005
+static bool  terra_ray_box_intersection_williams2005 ( const TerraRayState* state, const TerraAABB* aabb, float* tmin_out, float* tmax_out );
+#endif
 
 //--------------------------------------------------------------------------------------------------
+int terra_ray_triangle_intersection_query ( const TerraRayIntersectionQuery* query, TerraRayIntersectionResult* result ) {
 #if ray_triangle_intersection_moller_trumbore
-void terra_ray_triangle_intersection_init ( const TerraRay* ray, TerraRayState* state ) {
-    TERRA_UNUSED ( ray );
-    TERRA_UNUSED ( state );
+    return terra_ray_triangle_intersection_moller_trumbore ( query, result );
+#else
+    return terra_ray_triangle_intersection_wald2013 ( query, result );
+#endif
 }
 
-int terra_ray_triangle_intersection_query ( const TerraRayIntersectionQuery* query, TerraRayIntersectionResult* result ) {
+// Doesn't need any ray state
+int terra_ray_triangle_intersection_moller_trumbore ( const TerraRayIntersectionQuery* query, TerraRayIntersectionResult* result ) {
     int ret = 0;
 
     TerraClockTime profile_time_begin = TERRA_CLOCK();
@@ -84,11 +129,8 @@ exit:
     TERRA_PROFILE_ADD_SAMPLE ( time, TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RAY_TRIANGLE_INTERSECTION, ( TERRA_CLOCK() - profile_time_begin ) );
     return ret;
 }
-#endif
-
-// The init is shared between the two versions
-#if ray_triangle_intersection_wald2013 || ray_triangle_intersection_wald2013_simd
 
+// The init is shared between the scalar and SIMD versions
 // Precomputing ray transformation to origin and Z-pointing upwards for the intersection test
 // The transformation is such that the ray will have origin in (0, 0, 0) and direction in z (0, 0, 1)
 // The affine transformation is done through M = translation * shear * scale, which takes less operations
@@ -137,10 +179,6 @@ void terra_ray_triangle_intersection_init ( const TerraRay* ray, TerraRayState*
     return ret;
 }
 
-#endif
-
-#if ray_triangle_intersection_wald2013
-
 // Performs the ray/edge test in Pluecker coordinates after reducing the problem to 2D transforming the triangle
 // in a frame with origin matching the ray and z-aligned aligned with it. More details on the original version of
 // the algorithms are in [Wald 2004][Bentin 2006].
@@ -156,7 +194,7 @@ void terra_ray_triangle_intersection_init ( const TerraRay* ray, TerraRayState*
 //
 // The function returns 1 if the ray intersects the triangle, 0 otherwise
 // Note: it assumes that RayState::intersection_transform has been computed in the above init() function)
-int terra_ray_triangle_intersection_query ( const TerraRayIntersectionQuery* q, TerraRayIntersectionResult* result ) {
+int terra_ray_triangle_intersection_wald2013 ( const TerraRayIntersectionQuery* q, TerraRayIntersectionResult* result ) {
     int ret = 0;
     TerraClockTime profile_time_begin = TERRA_CLOCK();
 
@@ -209,13 +247,9 @@ int terra_ray_triangle_intersection_query ( const TerraRayIntersectionQuery* q,
 
     // Is the intersection point outside the triangle (no back-face culling) ?
     // (any negative barycentric coordinate) and (any positive barycentric coordinate)
-    uint32_t sign_mask = terra_signf_mask ( U );
-
-    if ( sign_mask != terra_signf_mask ( V ) ) {
-        goto exit;
-    }
-
-    if ( sign_mask != terra_signf_mask ( W ) ) {
+    // Zeros count as both signs, a ray through a shared vertex or edge has some of them exactly 0 and
+    // comparing sign bits (+0 / -0) would let it through every triangle around it.
+    if ( ( U < 0.f || V < 0.f || W < 0.f ) && ( U > 0.f || V > 0.f || W > 0.f ) ) {
         goto exit;
     }
 
@@ -227,6 +261,9 @@ int terra_ray_triangle_intersection_query ( const TerraRayIntersectionQuery* q,
         goto exit;
     }
 
+    // The determinant has the sign of the non-zero barycentric coordinates
+    uint32_t sign_mask = terra_signf_mask ( det );
+
     // Finally, calculating the scaled hit distance, leaving the normalization of the coordinates
     // (division by determinant) as the last operation to be performed.
     // The remaining tests in the algorithm are:
@@ -257,23 +294,521 @@ exit:
 
     return ret;
 }
+
+//--------------------------------------------------------------------------------------------------
+// Terra Ray/triangle packet tests
+//--------------------------------------------------------------------------------------------------
+void terra_triangle_packet_set ( TerraTrianglePacket* packets, int idx, const TerraTriangle* triangle ) {
+    TerraTrianglePacket* packet = &packets[idx / TERRA_TRIANGLE_PACKET_WIDTH];
+    const float* vertices[3] = { ( const float* ) &triangle->a, ( const float* ) &triangle->b, ( const float* ) &triangle->c };
+    int lane = idx % TERRA_TRIANGLE_PACKET_WIDTH;
+
+    for ( int axis = 0; axis < 3; ++axis ) {
+        packet->a[axis][lane] = vertices[0][axis];
+        packet->b[axis][lane] = vertices[1][axis];
+        packet->c[axis][lane] = vertices[2][axis];
+    }
+}
+
+void terra_triangle_packet_get ( const TerraTrianglePacket* packets, int idx, TerraTriangle* triangle_out ) {
+    const TerraTrianglePacket* packet = &packets[idx / TERRA_TRIANGLE_PACKET_WIDTH];
+    int lane = idx % TERRA_TRIANGLE_PACKET_WIDTH;
+    triangle_out->a = terra_f3_set ( packet->a[0][lane], packet->a[1][lane], packet->a[2][lane] );
+    triangle_out->b = terra_f3_set ( packet->b[0][lane], packet->b[1][lane], packet->b[2][lane] );
+    triangle_out->c = terra_f3_set ( packet->c[0][lane], packet->c[1][lane], packet->c[2][lane] );
+}
+
+// Same as the fallback of the scalar test, for the lane of the transformed vertices xy (Ax, Ay, Bx, By, Cx, Cy)
+void terra_ray_triangle_edges_f64 ( const float xy[6][8], int lane, float* U, float* V, float* W ) {
+    const double Ax = xy[0][lane], Ay = xy[1][lane];
+    const double Bx = xy[2][lane], By = xy[3][lane];
+    const double Cx = xy[4][lane], Cy = xy[5][lane];
+    U[lane] = ( float ) ( Cx * By - Cy * Bx );
+    V[lane] = ( float ) ( Ax * Cy - Ay * Cx );
+    W[lane] = ( float ) ( Bx * Ay - By * Ax );
+}
+
+// Wald's test on the lanes of packet set in mask. Returns the mask of the lanes hit, their distance and barycentric
+// coordinates are written to lanes_out. The operations are the same as the scalar test: two triangles sharing an edge
+// get exactly opposite edge functions and the test stays watertight. Multiplications and subtractions are kept
+// separate on purpose, fusing them would break that.
+int terra_ray_triangle_intersection4 ( const TerraRay* ray, const TerraRayState* state, const TerraTrianglePacket* packet, int mask,
+                                       TerraTriangleLanes* lanes_out ) {
+    const float* origin = ( const float* ) &ray->origin;
+    const int ix = state->ray_transform_i4.x;
+    const int iy = state->ray_transform_i4.y;
+    const int iz = state->ray_transform_i4.z;
+    const __m128 shearx = _mm_set1_ps ( state->ray_transform_f4.x );
+    const __m128 sheary = _mm_set1_ps ( state->ray_transform_f4.y );
+    const __m128 scalez = _mm_set1_ps ( state->ray_transform_f4.z );
+    const __m128 ox = _mm_set1_ps ( origin[ix] );
+    const __m128 oy = _mm_set1_ps ( origin[iy] );
+    const __m128 oz = _mm_set1_ps ( origin[iz] );
+    const __m128 zero = _mm_setzero_ps();
+
+    // Moving the triangles to the ray frame, then shear and scale
+    const __m128 Az = _mm_sub_ps ( _mm_loadu_ps ( packet->a[iz] ), oz );
+    const __m128 Bz = _mm_sub_ps ( _mm_loadu_ps ( packet->b[iz] ), oz );
+    const __m128 Cz = _mm_sub_ps ( _mm_loadu_ps ( packet->c[iz] ), oz );
+    const __m128 Ax = _mm_sub_ps ( _mm_sub_ps ( _mm_loadu_ps ( packet->a[ix] ), ox ), _mm_mul_ps ( shearx, Az ) );
+    const __m128 Ay = _mm_sub_ps ( _mm_sub_ps ( _mm_loadu_ps ( packet->a[iy] ), oy ), _mm_mul_ps ( sheary, Az ) );
+    const __m128 Bx = _mm_sub_ps ( _mm_sub_ps ( _mm_loadu_ps ( packet->b[ix] ), ox ), _mm_mul_ps ( shearx, Bz ) );
+    const __m128 By = _mm_sub_ps ( _mm_sub_ps ( _mm_loadu_ps ( packet->b[iy] ), oy ), _mm_mul_ps ( sheary, Bz ) );
+    const __m128 Cx = _mm_sub_ps ( _mm_sub_ps ( _mm_loadu_ps ( packet->c[ix] ), ox ), _mm_mul_ps ( shearx, Cz ) );
+    const __m128 Cy = _mm_sub_ps ( _mm_sub_ps ( _mm_loadu_ps ( packet->c[iy] ), oy ), _mm_mul_ps ( sheary, Cz ) );
+    __m128 U = _mm_sub_ps ( _mm_mul_ps ( Cx, By ), _mm_mul_ps ( Cy, Bx ) );
+    __m128 V = _mm_sub_ps ( _mm_mul_ps ( Ax, Cy ), _mm_mul_ps ( Ay, Cx ) );
+    __m128 W = _mm_sub_ps ( _mm_mul_ps ( Bx, Ay ), _mm_mul_ps ( By, Ax ) );
+
+    // Lanes with any edge function of 0 are retried in double precision, rare enough to be done one at a time
+    int edge = _mm_movemask_ps ( _mm_or_ps ( _mm_or_ps ( _mm_cmpeq_ps ( U, zero ), _mm_cmpeq_ps ( V, zero ) ), _mm_cmpeq_ps ( W, zero ) ) ) & mask;
+
+    if ( edge != 0 ) {
+        float xy[6][8];
+        _mm_storeu_ps ( xy[0], Ax );
+        _mm_storeu_ps ( xy[1], Ay );
+        _mm_storeu_ps ( xy[2], Bx );
+        _mm_storeu_ps ( xy[3], By );
+        _mm_storeu_ps ( xy[4], Cx );
+        _mm_storeu_ps ( xy[5], Cy );
+        _mm_storeu_ps ( lanes_out->u, U );
+        _mm_storeu_ps ( lanes_out->v, V );
+        _mm_storeu_ps ( lanes_out->w, W );
+
+        for ( int i = 0; i < 4; ++i ) {
+            if ( edge & ( 1 << i ) ) {
+                terra_ray_triangle_edges_f64 ( xy, i, lanes_out->u, lanes_out->v, lanes_out->w );
+            }
+        }
+
+        U = _mm_loadu_ps ( lanes_out->u );
+        V = _mm_loadu_ps ( lanes_out->v );
+        W = _mm_loadu_ps ( lanes_out->w );
+    }
+
+    // The edge functions can't have opposite signs (no back-face culling, zeros count as both) and the determinant
+    // can't be 0. The scaled depth has the sign of the determinant unless the hit is behind the origin.
+    const __m128 sign = _mm_set1_ps ( -0.f );
+    const __m128 det = _mm_add_ps ( _mm_add_ps ( U, V ), W );
+    const __m128 depth = _mm_add_ps ( _mm_add_ps ( _mm_mul_ps ( U, _mm_mul_ps ( scalez, Az ) ), _mm_mul_ps ( V, _mm_mul_ps ( scalez, Bz ) ) ),
+                                      _mm_mul_ps ( W, _mm_mul_ps ( scalez, Cz ) ) );
+    const __m128 negative = _mm_or_ps ( _mm_or_ps ( _mm_cmplt_ps ( U, zero ), _mm_cmplt_ps ( V, zero ) ), _mm_cmplt_ps ( W, zero ) );
+    const __m128 positive = _mm_or_ps ( _mm_or_ps ( _mm_cmpgt_ps ( U, zero ), _mm_cmpgt_ps ( V, zero ) ), _mm_cmpgt_ps ( W, zero ) );
+    int outside = _mm_movemask_ps ( _mm_and_ps ( negative, positive ) );
+    int coplanar = _mm_movemask_ps ( _mm_cmpeq_ps ( det, zero ) );
+    int behind = _mm_movemask_ps ( _mm_cmplt_ps ( _mm_xor_ps ( depth, _mm_and_ps ( det, sign ) ), zero ) );
+    int hit = mask & ~ ( outside | coplanar | behind );
+
+    if ( hit != 0 ) {
+        const __m128 inv_det = _mm_div_ps ( _mm_set1_ps ( 1.f ), det );
+        _mm_storeu_ps ( lanes_out->t, _mm_mul_ps ( depth, inv_det ) );
+        _mm_storeu_ps ( lanes_out->u, _mm_mul_ps ( U, inv_det ) );
+        _mm_storeu_ps ( lanes_out->v, _mm_mul_ps ( V, inv_det ) );
+        _mm_storeu_ps ( lanes_out->w, _mm_mul_ps ( W, inv_det ) );
+    }
+
+    return hit;
+}
+
+#ifdef __AVX__
+// Lanes of two consecutive packets
+__m256 terra_triangle_packets_load8 ( const float* lo, const float* hi ) {
+    return _mm256_insertf128_ps ( _mm256_castps128_ps256 ( _mm_loadu_ps ( lo ) ), _mm_loadu_ps ( hi ), 1 );
+}
 #endif
 
+// Same as terra_ray_triangle_intersection4 on the eight lanes of two consecutive packets, two SSE tests if AVX is not enabled
+int terra_ray_triangle_intersection8 ( const TerraRay* ray, const TerraRayState* state, const TerraTrianglePacket* packets, int mask,
+                                       TerraTriangleLanes* lanes_out ) {
+#ifdef __AVX__
+    const float* origin = ( const float* ) &ray->origin;
+    const int ix = state->ray_transform_i4.x;
+    const int iy = state->ray_transform_i4.y;
+    const int iz = state->ray_transform_i4.z;
+    const __m256 shearx = _mm256_set1_ps ( state->ray_transform_f4.x );
+    const __m256 sheary = _mm256_set1_ps ( state->ray_transform_f4.y );
+    const __m256 scalez = _mm256_set1_ps ( state->ray_transform_f4.z );
+    const __m256 ox = _mm256_set1_ps ( origin[ix] );
+    const __m256 oy = _mm256_set1_ps ( origin[iy] );
+    const __m256 oz = _mm256_set1_ps ( origin[iz] );
+    const __m256 zero = _mm256_setzero_ps();
+    const TerraTrianglePacket* lo = &packets[0];
+    const TerraTrianglePacket* hi = &packets[1];
+
+    const __m256 Az = _mm256_sub_ps ( terra_triangle_packets_load8 ( lo->a[iz], hi->a[iz] ), oz );
+    const __m256 Bz = _mm256_sub_ps ( terra_triangle_packets_load8 ( lo->b[iz], hi->b[iz] ), oz );
+    const __m256 Cz = _mm256_sub_ps ( terra_triangle_packets_load8 ( lo->c[iz], hi->c[iz] ), oz );
+    const __m256 Ax = _mm256_sub_ps ( _mm256_sub_ps ( terra_triangle_packets_load8 ( lo->a[ix], hi->a[ix] ), ox ), _mm256_mul_ps ( shearx, Az ) );
+    const __m256 Ay = _mm256_sub_ps ( _mm256_sub_ps ( terra_triangle_packets_load8 ( lo->a[iy], hi->a[iy] ), oy ), _mm256_mul_ps ( sheary, Az ) );
+    const __m256 Bx = _mm256_sub_ps ( _mm256_sub_ps ( terra_triangle_packets_load8 ( lo->b[ix], hi->b[ix] ), ox ), _mm256_mul_ps ( shearx, Bz ) );
+    const __m256 By = _mm256_sub_ps ( _mm256_sub_ps ( terra_triangle_packets_load8 ( lo->b[iy], hi->b[iy] ), oy ), _mm256_mul_ps ( sheary, Bz ) );
+    const __m256 Cx = _mm256_sub_ps ( _mm256_sub_ps ( terra_triangle_packets_load8 ( lo->c[ix], hi->c[ix] ), ox ), _mm256_mul_ps ( shearx, Cz ) );
+    const __m256 Cy = _mm256_sub_ps ( _mm256_sub_ps ( terra_triangle_packets_load8 ( lo->c[iy], hi->c[iy] ), oy ), _mm256_mul_ps ( sheary, Cz ) );
+    __m256 U = _mm256_sub_ps ( _mm256_mul_ps ( Cx, By ), _mm256_mul_ps ( Cy, Bx ) );
+    __m256 V = _mm256_sub_ps ( _mm256_mul_ps ( Ax, Cy ), _mm256_mul_ps ( Ay, Cx ) );
+    __m256 W = _mm256_sub_ps ( _mm256_mul_ps ( Bx, Ay ), _mm256_mul_ps ( By, Ax ) );
+
+    int edge = _mm256_movemask_ps ( _mm256_or_ps ( _mm256_or_ps ( _mm256_cmp_ps ( U, zero, _CMP_EQ_OQ ), _mm256_cmp_ps ( V, zero, _CMP_EQ_OQ ) ),
+                                    _mm256_cmp_ps ( W, zero, _CMP_EQ_OQ ) ) ) & mask;
+
+    if ( edge != 0 ) {
+        float xy[6][8];
+        _mm256_storeu_ps ( xy[0], Ax );
+        _mm256_storeu_ps ( xy[1], Ay );
+        _mm256_storeu_ps ( xy[2], Bx );
+        _mm256_storeu_ps ( xy[3], By );
+        _mm256_storeu_ps ( xy[4], Cx );
+        _mm256_storeu_ps ( xy[5], Cy );
+        _mm256_storeu_ps ( lanes_out->u, U );
+        _mm256_storeu_ps ( lanes_out->v, V );
+        _mm256_storeu_ps ( lanes_out->w, W );
+
+        for ( int i = 0; i < 8; ++i ) {
+            if ( edge & ( 1 << i ) ) {
+                terra_ray_triangle_edges_f64 ( xy, i, lanes_out->u, lanes_out->v, lanes_out->w );
+            }
+        }
+
+        U = _mm256_loadu_ps ( lanes_out->u );
+        V = _mm256_loadu_ps ( lanes_out->v );
+        W = _mm256_loadu_ps ( lanes_out->w );
+    }
+
+    const __m256 sign = _mm256_set1_ps ( -0.f );
+    const __m256 det = _mm256_add_ps ( _mm256_add_ps ( U, V ), W );
+    const __m256 depth = _mm256_add_ps ( _mm256_add_ps ( _mm256_mul_ps ( U, _mm256_mul_ps ( scalez, Az ) ), _mm256_mul_ps ( V, _mm256_mul_ps ( scalez, Bz ) ) ),
+                                         _mm256_mul_ps ( W, _mm256_mul_ps ( scalez, Cz ) ) );
+    const __m256 negative = _mm256_or_ps ( _mm256_or_ps ( _mm256_cmp_ps ( U, zero, _CMP_LT_OQ ), _mm256_cmp_ps ( V, zero, _CMP_LT_OQ ) ),
+                                           _mm256_cmp_ps ( W, zero, _CMP_LT_OQ ) );
+    const __m256 positive = _mm256_or_ps ( _mm256_or_ps ( _mm256_cmp_ps ( U, zero, _CMP_GT_OQ ), _mm256_cmp_ps ( V, zero, _CMP_GT_OQ ) ),
+                                           _mm256_cmp_ps ( W, zero, _CMP_GT_OQ ) );
+    int outside = _mm256_movemask_ps ( _mm256_and_ps ( negative, positive ) );
+    int coplanar = _mm256_movemask_ps ( _mm256_cmp_ps ( det, zero, _CMP_EQ_OQ ) );
+    int behind = _mm256_movemask_ps ( _mm256_cmp_ps ( _mm256_xor_ps ( depth, _mm256_and_ps ( det, sign ) ), zero, _CMP_LT_OQ ) );
+    int hit = mask & ~ ( outside | coplanar | behind );
+
+    if ( hit != 0 ) {
+        const __m256 inv_det = _mm256_div_ps ( _mm256_set1_ps ( 1.f ), det );
+        _mm256_storeu_ps ( lanes_out->t, _mm256_mul_ps ( depth, inv_det ) );
+        _mm256_storeu_ps ( lanes_out->u, _mm256_mul_ps ( U, inv_det ) );
+        _mm256_storeu_ps ( lanes_out->v, _mm256_mul_ps ( V, inv_det ) );
+        _mm256_storeu_ps ( lanes_out->w, _mm256_mul_ps ( W, inv_det ) );
+    }
+
+    return hit;
+#else
+    TerraTriangleLanes high;
+    int hit = terra_ray_triangle_intersection4 ( ray, state, &packets[0], mask & 0xF, lanes_out );
+    int hit_high = terra_ray_triangle_intersection4 ( ray, state, &packets[1], mask >> 4, &high );
+    memcpy ( lanes_out->t + 4, high.t, sizeof ( float ) * 4 );
+    memcpy ( lanes_out->u + 4, high.u, sizeof ( float ) * 4 );
+    memcpy ( lanes_out->v + 4, high.v, sizeof ( float ) * 4 );
+    memcpy ( lanes_out->w + 4, high.w, sizeof ( float ) * 4 );
+    return hit | ( hit_high << 4 );
+#endif
+}
+
+// Tests the triangles [first, end) falling in the lanes starting at base, a multiple of the packet width. Eight lanes
+// are tested at once with AVX when the range goes past the first packet. step is set to the number of lanes covered,
+// the returned mask of the lanes hit is relative to base.
+int terra_ray_triangle_packet_test ( const TerraRay* ray, const TerraRayState* state, const TerraTrianglePacket* packets, int base, int first, int end,
+                                     int* step, TerraTriangleLanes* lanes_out ) {
+#ifdef __AVX__
+    int width = end - base > TERRA_TRIANGLE_PACKET_WIDTH ? 2 * TERRA_TRIANGLE_PACKET_WIDTH : TERRA_TRIANGLE_PACKET_WIDTH;
+#else
+    int width = TERRA_TRIANGLE_PACKET_WIDTH;
+#endif
+    int lo = first > base ? first - base : 0;
+    int hi = end - base < width ? end - base : width;
+    int mask = ( ( 1 << hi ) - 1 ) & ~ ( ( 1 << lo ) - 1 );
+    int hit = 0;
+    *step = width;
+
 #if ray_triangle_intersection_wald2013_simd
 
-int terra_ray_triangle_intersection_query ( const TerraRayIntersectionQuery* q, TerraRayIntersectionResult* result ) {
+    if ( width == TERRA_TRIANGLE_PACKET_WIDTH ) {
+        hit = terra_ray_triangle_intersection4 ( ray, state, &packets[base / TERRA_TRIANGLE_PACKET_WIDTH], mask, lanes_out );
+    } else {
+        hit = terra_ray_triangle_intersection8 ( ray, state, &packets[base / TERRA_TRIANGLE_PACKET_WIDTH], mask, lanes_out );
+    }
+
+#else
+    TerraTriangle triangle;
+    TerraRayIntersectionQuery query;
+    TerraRayIntersectionResult result;
+    query.ray = ray;
+    query.state = state;
+    query.primitive.triangle = &triangle;
+
+    for ( int i = lo; i < hi; ++i ) {
+        terra_triangle_packet_get ( packets, base + i, &triangle );
+
+        if ( terra_ray_triangle_intersection_wald2013 ( &query, &result ) ) {
+            lanes_out->t[i] = result.ray_depth;
+            lanes_out->u[i] = result.u;
+            lanes_out->v[i] = result.v;
+            lanes_out->w[i] = result.w;
+            hit |= 1 << i;
+        }
+    }
+
+#endif
+    return hit;
+}
+
+int terra_ray_triangle_packet_intersection ( const TerraRay* ray, const TerraRayState* state, const TerraTrianglePacket* packets, int first, int count,
+        float t_max, TerraRayIntersectionResult* result ) {
+    TerraTriangleLanes lanes;
+    int end = first + count;
+    int closest = -1;
+    int step;
+
+    for ( int base = first - first % TERRA_TRIANGLE_PACKET_WIDTH; base < end; base += step ) {
+        int hit = terra_ray_triangle_packet_test ( ray, state, packets, base, first, end, &step, &lanes );
+
+        for ( int i = 0; hit != 0; ++i, hit >>= 1 ) {
+            if ( ( hit & 1 ) && lanes.t[i] < t_max ) {
+                t_max = lanes.t[i];
+                closest = base + i;
+                result->u = lanes.u[i];
+                result->v = lanes.v[i];
+                result->w = lanes.w[i];
+            }
+        }
+    }
+
+    if ( closest >= 0 ) {
+        result->ray_depth = t_max;
+        result->point = terra_ray_pos ( ray, t_max );
+    }
+
+    return closest;
+}
+
+bool terra_ray_triangle_packet_occluded ( const TerraRay* ray, const TerraRayState* state, const TerraTrianglePacket* packets, int first, int count,
+        float t_max ) {
+    TerraTriangleLanes lanes;
+    int end = first + count;
+    int step;
+
+    for ( int base = first - first % TERRA_TRIANGLE_PACKET_WIDTH; base < end; base += step ) {
+        int hit = terra_ray_triangle_packet_test ( ray, state, packets, base, first, end, &step, &lanes );
+
+        for ( int i = 0; hit != 0; ++i, hit >>= 1 ) {
+            if ( ( hit & 1 ) && lanes.t[i] < t_max ) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
 
+//--------------------------------------------------------------------------------------------------
+// Terra Ray/triangle microbenchmark
+//--------------------------------------------------------------------------------------------------
+// xorshift32, the benchmark has to be reproducible and independent of the sampler in use
+float terra_benchmark_randf ( uint32_t* state ) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return ( *state >> 8 ) * ( 1.f / 16777216.f );
 }
 
+// Random rays are shot through a unit box filled with small random triangles, a few percent of the
+// ray/triangle pairs hit. Each test runs over every pair, the hits are counted to check that the Wald
+// versions agree.
+void terra_benchmark_triangle_intersection ( size_t rays_count, size_t triangles_count, TerraTriangleBenchmark* benchmark_out ) {
+    uint32_t rng = 0x9e3779b9;
+    int packets_count = ( int ) ( ( triangles_count + 2 * TERRA_TRIANGLE_PACKET_WIDTH - 1 ) / ( 2 * TERRA_TRIANGLE_PACKET_WIDTH ) ) * 2;
+    int count = packets_count * TERRA_TRIANGLE_PACKET_WIDTH;
+    TerraTriangle* triangles = ( TerraTriangle* ) terra_malloc ( sizeof ( TerraTriangle ) * count );
+    TerraTrianglePacket* packets = ( TerraTrianglePacket* ) terra_malloc_aligned ( sizeof ( TerraTrianglePacket ) * packets_count, TERRA_CACHE_LINE_SIZE );
+    TerraRay* rays = ( TerraRay* ) terra_malloc ( sizeof ( TerraRay ) * rays_count );
+    TerraRayState* states = ( TerraRayState* ) terra_malloc ( sizeof ( TerraRayState ) * rays_count );
+    memset ( benchmark_out, 0, sizeof ( TerraTriangleBenchmark ) );
+
+    for ( int i = 0; i < count; ++i ) {
+        TerraFloat3 center = terra_f3_set ( terra_benchmark_randf ( &rng ), terra_benchmark_randf ( &rng ), terra_benchmark_randf ( &rng ) );
+        TerraFloat3* vertices = &triangles[i].a;
+
+        for ( int v = 0; v < 3; ++v ) {
+            TerraFloat3 offset = terra_f3_set ( terra_benchmark_randf ( &rng ) - 0.5f, terra_benchmark_randf ( &rng ) - 0.5f, terra_benchmark_randf ( &rng ) - 0.5f );
+            offset = terra_mulf3 ( &offset, 0.8f );
+            vertices[v] = terra_addf3 ( &center, &offset );
+        }
+
+        terra_triangle_packet_set ( packets, i, &triangles[i] );
+    }
+
+    for ( size_t i = 0; i < rays_count; ++i ) {
+        TerraFloat3 origin = terra_f3_set ( terra_benchmark_randf ( &rng ) * 4 - 1.5f, terra_benchmark_randf ( &rng ) * 4 - 1.5f, -2.f );
+        TerraFloat3 target = terra_f3_set ( terra_benchmark_randf ( &rng ), terra_benchmark_randf ( &rng ), terra_benchmark_randf ( &rng ) );
+        TerraFloat3 direction = terra_subf3 ( &target, &origin );
+        rays[i].origin = origin;
+        rays[i].direction = terra_normf3 ( &direction );
+        rays[i].inv_direction = terra_f3_set ( 1.f / rays[i].direction.x, 1.f / rays[i].direction.y, 1.f / rays[i].direction.z );
+        terra_ray_state_init ( &rays[i], &states[i] );
+    }
+
+    for ( int test = 0; test < kTerraTriangleTestCount; ++test ) {
+#ifndef __AVX__
+
+        if ( test == kTerraTriangleTestWaldAVX ) {
+            continue;
+        }
+
 #endif
+        TerraClockTime begin = terra_clock();
+        size_t hits = 0;
+
+        for ( size_t r = 0; r < rays_count; ++r ) {
+            TerraRayIntersectionQuery query;
+            TerraRayIntersectionResult result;
+            TerraTriangleLanes lanes;
+            query.ray = &rays[r];
+            query.state = &states[r];
+
+            if ( test == kTerraTriangleTestMollerTrumbore || test == kTerraTriangleTestWald ) {
+                for ( int i = 0; i < count; ++i ) {
+                    query.primitive.triangle = &triangles[i];
+                    hits += test == kTerraTriangleTestWald ? terra_ray_triangle_intersection_wald2013 ( &query, &result )
+                            : terra_ray_triangle_intersection_moller_trumbore ( &query, &result );
+                }
+            } else if ( test == kTerraTriangleTestWaldSSE ) {
+                for ( int p = 0; p < packets_count; ++p ) {
+                    for ( int hit = terra_ray_triangle_intersection4 ( &rays[r], &states[r], &packets[p], 0xF, &lanes ); hit != 0; hit &= hit - 1 ) {
+                        ++hits;
+                    }
+                }
+            } else {
+                for ( int p = 0; p < packets_count; p += 2 ) {
+                    for ( int hit = terra_ray_triangle_intersection8 ( &rays[r], &states[r], &packets[p], 0xFF, &lanes ); hit != 0; hit &= hit - 1 ) {
+                        ++hits;
+                    }
+                }
+            }
+        }
+
+        double ms = terra_clock_to_ms ( terra_clock() - begin );
+        benchmark_out->hits[test] = hits;
+        benchmark_out->mtests_per_second[test] = ms > 0. ? ( double ) rays_count * count / ( ms * 1000. ) : 0.;
+    }
+
+    terra_free ( states );
+    terra_free ( rays );
+    terra_free_aligned ( packets );
+    terra_free ( triangles );
+}
 
 //--------------------------------------------------------------------------------------------------
 // Terra Ray/box intersection tests
 //--------------------------------------------------------------------------------------------------
+// Plane distances are computed as plane * inv_direction - origin * inv_direction, a single multiply-subtract per plane.
+// Direction components closer to zero than TERRA_RAY_BOX_MIN_DIRECTION are clamped keeping their sign, a ray parallel
+// to a slab would otherwise get inf - inf (NaN) for it. It still misses the slab if it starts outside.
 void terra_ray_box_intersection_init ( const TerraRay* ray, TerraRayState* state ) {
+    const float* direction = ( const float* ) &ray->direction;
+    const float* origin = ( const float* ) &ray->origin;
+    float inv_direction[3];
+    float origin_inv_direction[3];
+    int sign[3];
+
+    for ( int i = 0; i < 3; ++i ) {
+        float d = fabsf ( direction[i] ) < TERRA_RAY_BOX_MIN_DIRECTION ? copysignf ( TERRA_RAY_BOX_MIN_DIRECTION, direction[i] ) : direction[i];
+        inv_direction[i] = 1.f / d;
+        origin_inv_direction[i] = origin[i] * inv_direction[i];
+        sign[i] = d < 0.f;
+    }
 
+    state->box_inv_direction = terra_f4_set ( inv_direction[0], inv_direction[1], inv_direction[2], inv_direction[2] );
+    state->box_origin_inv_direction = terra_f4_set ( origin_inv_direction[0], origin_inv_direction[1], origin_inv_direction[2], origin_inv_direction[2] );
+    state->box_sign = terra_i4_set ( sign[0], sign[1], sign[2], sign[2] );
 }
 
 int terra_ray_box_intersection_query ( const TerraRayIntersectionQuery* q, TerraRayIntersectionResult* result ) {
+    float tmin;
+
+    if ( !terra_ray_aabb_intersection ( q->state, &q->primitive.box, &tmin, NULL ) ) {
+        return 0;
+    }
+
+    result->ray_depth = tmin;
+    result->point = terra_ray_pos ( q->ray, tmin );
+    return 1;
+}
+
+bool terra_ray_aabb_intersection ( const TerraRayState* state, const TerraAABB* aabb, float* tmin_out, float* tmax_out ) {
+    float tmin, tmax;
+#if ray_box_branchless
+    bool hit = terra_ray_box_intersection_branchless ( state, aabb, &tmin, &tmax );
+#elif ray_box_williams2005
+    bool hit = terra_ray_box_intersection_williams2005 ( state, aabb, &tmin, &tmax );
+#endif
 
-}
\ No newline at end of file
+    if ( !hit ) {
+        return false;
+    }
+
+    if ( tmin_out != NULL ) {
+        *tmin_out = tmin;
+    }
+
+    if ( tmax_out != NULL ) {
+        *tmax_out = tmax;
+    }
+
+    return true;
+}
+
+#if ray_box_branchless
+// Both planes of the three axes at once, the lanes are x, y, z, z. The boxes can be unaligned and are loaded in two
+// overlapping halves (min.x min.y min.z max.x) and (min.z max.x max.y max.z) which don't read past their end.
+bool terra_ray_box_intersection_branchless ( const TerraRayState* state, const TerraAABB* aabb, float* tmin_out, float* tmax_out ) {
+    __m128 lo = _mm_loadu_ps ( &aabb->min.x );
+    __m128 hi = _mm_loadu_ps ( &aabb->min.z );
+    lo = _mm_shuffle_ps ( lo, lo, _MM_SHUFFLE ( 2, 2, 1, 0 ) );
+    hi = _mm_shuffle_ps ( hi, hi, _MM_SHUFFLE ( 3, 3, 2, 1 ) );
+    const __m128 inv_direction = _mm_loadu_ps ( &state->box_inv_direction.x );
+    const __m128 origin_inv_direction = _mm_loadu_ps ( &state->box_origin_inv_direction.x );
+#ifdef __FMA__
+    const __m128 t0 = _mm_fmsub_ps ( lo, inv_direction, origin_inv_direction );
+    const __m128 t1 = _mm_fmsub_ps ( hi, inv_direction, origin_inv_direction );
+#else
+    const __m128 t0 = _mm_sub_ps ( _mm_mul_ps ( lo, inv_direction ), origin_inv_direction );
+    const __m128 t1 = _mm_sub_ps ( _mm_mul_ps ( hi, inv_direction ), origin_inv_direction );
+#endif
+    __m128 tmin = _mm_min_ps ( t0, t1 );
+    __m128 tmax = _mm_max_ps ( t0, t1 );
+    tmin = _mm_max_ps ( tmin, _mm_shuffle_ps ( tmin, tmin, _MM_SHUFFLE ( 2, 3, 0, 1 ) ) );
+    tmax = _mm_min_ps ( tmax, _mm_shuffle_ps ( tmax, tmax, _MM_SHUFFLE ( 2, 3, 0, 1 ) ) );
+    tmin = _mm_max_ps ( tmin, _mm_shuffle_ps ( tmin, tmin, _MM_SHUFFLE ( 1, 0, 3, 2 ) ) );
+    tmax = _mm_min_ps ( tmax, _mm_shuffle_ps ( tmax, tmax, _MM_SHUFFLE ( 1, 0, 3, 2 ) ) );
+    tmin = _mm_max_ss ( tmin, _mm_setzero_ps() );
+    *tmin_out = _mm_cvtss_f32 ( tmin );
+    *tmax_out = _mm_cvtss_f32 ( tmax );
+    return _mm_comigt_ss ( tmax, tmin ) != 0;
+}
+
+#elif ray_box_williams2005
+// One axis at a time, the near and far plane are picked by the sign of the direction instead of sorted
+bool terra_ray_box_intersection_williams2005 ( const TerraRayState* state, const TerraAABB* aabb, float* tmin_out, float* tmax_out ) {
+    const float* planes = ( const float* ) aabb;
+    const float* inv_direction = ( const float* ) &state->box_inv_direction;
+    const float* origin_inv_direction = ( const float* ) &state->box_origin_inv_direction;
+    const int* sign = ( const int* ) &state->box_sign;
+    float tmin = 0.f;
+    float tmax = FLT_MAX;
+
+    for ( int i = 0; i < 3; ++i ) {
+        float t_near = planes[sign[i] * 3 + i] * inv_direction[i] - origin_inv_direction[i];
+        float t_far = planes[( 1 - sign[i] ) * 3 + i] * inv_direction[i] - origin_inv_direction[i];
+        tmin = terra_maxf ( tmin, t_near );
+        tmax = terra_minf ( tmax, t_far );
+    }
+
+    *tmin_out = tmin;
+    *tmax_out = tmax;
+    return tmax > tmin;
+}
+#endif
\ No newline at end of file
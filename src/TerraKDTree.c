@@ -1,424 +1,565 @@
-// KDTree
+// TerraKDTree
 #include "TerraKDTree.h"
 
 // Terra
 #include "TerraPrivate.h"
+#include "TerraBVH.h"
 
 // libc
-#include <string.h>
 #include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
-typedef struct TerraKDSplit {
-    float offset;
-    uint32_t left_count;
-    uint32_t right_count : 31;
-    uint32_t type : 1;
-    uint16_t t0c;
-    uint16_t t1c;
+// SAH costs of traversing a node and intersecting a triangle, only their ratio matters
+#ifndef TERRA_KDTREE_TRAVERSAL_COST
+#define TERRA_KDTREE_TRAVERSAL_COST 1.f
+#endif
+
+#ifndef TERRA_KDTREE_INTERSECTION_COST
+#define TERRA_KDTREE_INTERSECTION_COST 1.5f
+#endif
+
+// Splits cutting off empty space have their cost scaled by 1 - TERRA_KDTREE_EMPTY_BONUS
+#ifndef TERRA_KDTREE_EMPTY_BONUS
+#define TERRA_KDTREE_EMPTY_BONUS 0.2f
+#endif
+
+// Nodes with this many primitives or less are always leaves
+#ifndef TERRA_KDTREE_LEAF_MIN_PRIMITIVES
+#define TERRA_KDTREE_LEAF_MIN_PRIMITIVES 2
+#endif
+
+// Side of the split plane a primitive is referenced from
+enum {
+    kTerraKDSideBelow = 1,
+    kTerraKDSideAbove = 2,
+    kTerraKDSideBoth = kTerraKDSideBelow | kTerraKDSideAbove
+};
+
+// Bounds of a primitive along one axis are a pair of events. Events of the same position are ordered
+// start first, so that a sweep never counts a primitive on neither side.
+typedef struct {
+    float    position;
+    uint32_t primitive : 31;    // Index into TerraKDBuild.primitives
+    uint32_t start : 1;         // 1 where the bounds start, 0 where they end
+} TerraKDEvent;
+
+typedef struct {
+    TerraKDEvent* events;               // Owned, the sorted events of the three axes one after the other
+    int           events_count[3];
+    int           primitives_count;
+    TerraAABB     voxel;
+    int           depth;
+    int           parent_idx;           // Node this is the above child of, -1 for the root and below children
+} TerraKDBuildTask;
+
+typedef struct {
+    int   axis;                         // -1 if a leaf is cheaper
+    float position;
+    float cost;
 } TerraKDSplit;
 
-#define terra__comp(float3, axis) *((float*)&float3 + axis) // saving space
-#define TERRA_KDTREE_INTERSECTION_COST 1.5f // 0.32f
-#define TERRA_KDTREE_TRAVERSAL_COST 0.8f
-
-// Sorts the splits in ascending order
-int terra_splitlist_ascending_cmpfun ( const void* a, const void* b ) {
-    float af = ( ( TerraKDSplit* ) a )->offset;
-    float bf = ( ( TerraKDSplit* ) b )->offset;
-    return af == bf ? 0 : ( af < bf ) ? -1 : 1;
+typedef struct {
+    TerraKDTree*       tree;
+    const TerraObject* objects;
+    const uint32_t*    primitives;      // Global indices of all the triangles, events index them
+    uint8_t*           sides;           // Side of each primitive relative to the split being applied
+    TerraAABB*         bounds;          // Current bounds of the primitives straddling the split being applied
+    uint32_t*          straddling;
+    int                nodes_cap;
+    int                primitives_cap;
+    int                max_depth;
+} TerraKDBuild;
+
+typedef struct {
+    int   node;
+    float t_min;
+    float t_max;
+} TerraKDStackEntry;
+
+static float terra_kdtree_axis ( const TerraFloat3* vec, int axis );
+static int   terra_kdtree_event_cmp ( const void* a, const void* b );
+static void  terra_kdtree_find_split ( const TerraKDBuildTask* task, TerraKDSplit* split );
+static int   terra_kdtree_merge_events ( const TerraKDEvent* events, int events_count, const uint8_t* sides, int side, TerraKDEvent* inserted,
+                                         int inserted_count, TerraKDEvent* events_out );
+static void  terra_kdtree_split_events ( TerraKDBuild* build, const TerraKDBuildTask* task, const TerraKDSplit* split, TerraKDBuildTask* below,
+                                         TerraKDBuildTask* above );
+static int   terra_kdtree_add_node ( TerraKDBuild* build );
+static void  terra_kdtree_emit_leaf ( TerraKDBuild* build, const TerraKDBuildTask* task, int node_idx );
+
+float terra_kdtree_axis ( const TerraFloat3* vec, int axis ) {
+    return ( ( const float* ) vec ) [axis];
 }
 
-// Nodes are added in as a kd-tree always has either no children or both
-// and reduces nodes size
-int terra_kdtree_add_node_pair ( TerraKDTree* tree ) {
-    if ( tree->nodes_count + 2 > tree->nodes_capacity ) {
-        TerraKDNode* old_buffer = tree->nodes;
-        int new_capacity = terra_maxi ( 64, tree->nodes_capacity * tree->nodes_capacity );
-        tree->nodes = terra_malloc ( sizeof ( TerraKDNode ) * new_capacity );
-        memcpy ( tree->nodes, old_buffer, sizeof ( TerraKDNode ) * tree->nodes_count );
-        tree->nodes_capacity = new_capacity;
-        terra_free ( old_buffer );
+int terra_kdtree_event_cmp ( const void* _a, const void* _b ) {
+    const TerraKDEvent* a = ( const TerraKDEvent* ) _a;
+    const TerraKDEvent* b = ( const TerraKDEvent* ) _b;
+
+    if ( a->position != b->position ) {
+        return a->position < b->position ? -1 : 1;
     }
 
-    int ret = tree->nodes_count;
-    tree->nodes_count += 2;
-    return ret;
+    return ( int ) b->start - ( int ) a->start;
 }
 
-void terra_kdtree_destroy_object_buffer ( TerraKDObjectBuffer* buffer ) {
-    if ( buffer == NULL || buffer->objects == NULL ) {
-        return;
-    }
+//--------------------------------------------------------------------------------------------------
+// Build
+//--------------------------------------------------------------------------------------------------
+// Sweeps the candidate planes of each axis in order, counting the primitives on each side incrementally
+void terra_kdtree_find_split ( const TerraKDBuildTask* task, TerraKDSplit* split ) {
+    const TerraAABB* voxel = &task->voxel;
+    TerraFloat3 extents = terra_subf3 ( &voxel->max, &voxel->min );
+    float inv_area = 1.f / ( 2 * ( extents.x * extents.y + extents.x * extents.z + extents.y * extents.z ) );
+    const TerraKDEvent* events = task->events;
+    split->axis = -1;
+    split->position = 0.f;
+    split->cost = TERRA_KDTREE_INTERSECTION_COST * task->primitives_count;
+
+    for ( int axis = 0; axis < 3; ++axis ) {
+        float min = terra_kdtree_axis ( &voxel->min, axis );
+        float max = terra_kdtree_axis ( &voxel->max, axis );
+        float e1 = terra_kdtree_axis ( &extents, ( axis + 1 ) % 3 );
+        float e2 = terra_kdtree_axis ( &extents, ( axis + 2 ) % 3 );
+        int below = 0;
+        int above = task->primitives_count;
+
+        for ( int i = 0; i < task->events_count[axis]; ++i ) {
+            const TerraKDEvent* event = &events[i];
+
+            if ( !event->start ) {
+                --above;
+            }
 
-    terra_free ( buffer->objects );
-    buffer->objects = NULL;
-    buffer->objects_count = 0;
-}
+            // Planes on the voxel faces would leave an empty child with no volume
+            if ( event->position > min && event->position < max ) {
+                float below_area = 2 * ( e1 * e2 + ( e1 + e2 ) * ( event->position - min ) );
+                float above_area = 2 * ( e1 * e2 + ( e1 + e2 ) * ( max - event->position ) );
+                float bonus = below == 0 || above == 0 ? 1.f - TERRA_KDTREE_EMPTY_BONUS : 1.f;
+                float cost = TERRA_KDTREE_TRAVERSAL_COST + TERRA_KDTREE_INTERSECTION_COST * bonus * ( below_area * below + above_area * above ) * inv_area;
+
+                if ( cost < split->cost ) {
+                    split->axis = axis;
+                    split->position = event->position;
+                    split->cost = cost;
+                }
+            }
 
-void terra_kdtree_init_object_buffer ( TerraKDObjectBuffer* buffer, int num_objects ) {
-    terra_kdtree_destroy_object_buffer ( buffer );
-    buffer->objects = terra_malloc ( sizeof ( TerraKDObjectRef ) * num_objects );
-    buffer->objects_count = num_objects;
-}
+            if ( event->start ) {
+                ++below;
+            }
+        }
 
-int terra_kdtree_add_object_buffer ( TerraKDTree* tree ) {
-    if ( tree->object_buffers_count + 1 > tree->object_buffers_capacity ) {
-        TerraKDObjectBuffer* old_buffer = tree->object_buffers;
-        int new_capacity = terra_maxi ( 64, tree->object_buffers_capacity * tree->object_buffers_capacity );
-        tree->object_buffers = terra_malloc ( sizeof ( TerraKDObjectBuffer ) * new_capacity );
-        memcpy ( tree->object_buffers, old_buffer, sizeof ( TerraKDObjectBuffer ) * tree->object_buffers_count );
-        tree->object_buffers_capacity = new_capacity;
-        terra_free ( old_buffer );
+        events += task->events_count[axis];
     }
-
-    int ret = tree->object_buffers_count;
-    tree->object_buffers[ret].objects = NULL;
-    tree->object_buffers[ret].objects_count = 0;
-    tree->object_buffers_count += 1;
-    return ret;
 }
 
-bool terra_aabb_overlap ( const TerraAABB* left, const TerraAABB* right ) {
-    return ( left->min.x <= right->max.x && left->max.x >= right->min.x ) &&
-           ( left->min.y <= right->max.y && left->max.y >= right->min.y ) &&
-           ( left->min.z <= right->max.z && left->max.z >= right->min.z );
-}
+// Merges the events of primitives on side with the sorted inserted ones, returns the number written
+int terra_kdtree_merge_events ( const TerraKDEvent* events, int events_count, const uint8_t* sides, int side, TerraKDEvent* inserted,
+                                int inserted_count, TerraKDEvent* events_out ) {
+    int count = 0;
+    int j = 0;
+    qsort ( inserted, inserted_count, sizeof ( TerraKDEvent ), terra_kdtree_event_cmp );
 
-void terra_kdtree_add_splitbuffer ( TerraKDSplit* splitbuffer, int* counter, float val, int type ) {
-    for ( int i = 0; i < *counter; ++i ) {
-        if ( val == splitbuffer[i].offset ) {
-            if ( type == 0 ) {
-                ++splitbuffer[i].t0c;
-            } else {
-                ++splitbuffer[i].t1c;
-            }
+    for ( int i = 0; i < events_count; ++i ) {
+        if ( sides[events[i].primitive] != side ) {
+            continue;
+        }
 
-            return;
+        for ( ; j < inserted_count && terra_kdtree_event_cmp ( &inserted[j], &events[i] ) < 0; ++j ) {
+            events_out[count++] = inserted[j];
         }
+
+        events_out[count++] = events[i];
+    }
+
+    for ( ; j < inserted_count; ++j ) {
+        events_out[count++] = inserted[j];
     }
 
-    splitbuffer[*counter].offset = val;
-    splitbuffer[*counter].type = type;
-    splitbuffer[*counter].t0c = 1;
-    splitbuffer[*counter].t1c = 1;
-    ( *counter )++;
+    return count;
 }
 
-void terra_kdtree_create_rec ( TerraKDTree* tree, int node_idx, const TerraObject* objects, const TerraAABB* aabb, int depth, TerraKDSplit* splitbuffer, TerraAABB* aabb_cache ) {
-    if ( depth <= 0 ) {
-        return;
+// Primitives entirely on one side keep their events, already in order. Those straddling the plane are clipped
+// to each side and their new events merged in, only they need sorting.
+void terra_kdtree_split_events ( TerraKDBuild* build, const TerraKDBuildTask* task, const TerraKDSplit* split, TerraKDBuildTask* below,
+                                 TerraKDBuildTask* above ) {
+    const TerraKDEvent* axis_events[3] = { task->events, task->events + task->events_count[0], task->events + task->events_count[0] + task->events_count[1] };
+    uint8_t* sides = build->sides;
+
+    // The bounds along the split axis decide the side, flat primitives lying on the plane go below
+    for ( int i = 0; i < task->events_count[split->axis]; ++i ) {
+        const TerraKDEvent* event = &axis_events[split->axis][i];
+
+        if ( event->start ) {
+            sides[event->primitive] = event->position < split->position ? kTerraKDSideBoth : kTerraKDSideAbove;
+        } else if ( event->position <= split->position ) {
+            sides[event->primitive] = kTerraKDSideBelow;
+        }
     }
 
-    TerraKDNode* node = &tree->nodes[node_idx];
-    TerraFloat3 extents;
-    extents.x = aabb->max.x - aabb->min.x;
-    extents.y = aabb->max.y - aabb->min.y;
-    extents.z = aabb->max.z - aabb->min.z;
-    // Cycling through the axis
-    int axis = 2;
-
-    if ( ( extents.x >= extents.y ) && ( extents.x >= extents.z ) ) {
-        axis = 0;
-    } else if ( ( extents.y >= extents.x ) && ( extents.y >= extents.z ) ) {
-        axis = 1;
-    }
+    int straddling_count = 0;
 
-    // Finding all split positions
-    TerraKDObjectBuffer* buffer = &tree->object_buffers[node->leaf.objects];
-    int splitlist_next = 0;
-
-    for ( int i = 0; i < buffer->objects_count; ++i ) {
-        TerraKDObjectRef ref = buffer->objects[i];
-        TerraTriangle* triangle = &objects[ref.primitive.object_idx].triangles[ref.primitive.triangle_idx];
-        aabb_cache[i].min = terra_f3_set1 ( FLT_MAX );
-        aabb_cache[i].max = terra_f3_set1 ( -FLT_MAX );
-        terra_aabb_fit_triangle ( &aabb_cache[i], triangle );
-        TerraAABB* triangle_aabb = &aabb_cache[i];
-        float p1 = terra__comp ( triangle_aabb->min, axis );
-        terra_kdtree_add_splitbuffer ( splitbuffer, &splitlist_next, p1, 0 );
-        float p2 = terra__comp ( triangle_aabb->max, axis );
-        terra_kdtree_add_splitbuffer ( splitbuffer, &splitlist_next, p2, 1 );
-    }
+    for ( int axis = 0; axis < 3; ++axis ) {
+        for ( int i = 0; i < task->events_count[axis]; ++i ) {
+            const TerraKDEvent* event = &axis_events[axis][i];
+
+            if ( sides[event->primitive] != kTerraKDSideBoth ) {
+                continue;
+            }
 
-    qsort ( splitbuffer, splitlist_next, sizeof ( TerraKDSplit ), terra_splitlist_ascending_cmpfun );
-    int right_counter = buffer->objects_count;
-    int left_counter = 0;
+            TerraAABB* bounds = &build->bounds[event->primitive];
 
-    for ( int i = 0; i < splitlist_next; ++i ) {
-        TerraKDSplit* split = &splitbuffer[i];
+            if ( event->start ) {
+                ( ( float* ) &bounds->min ) [axis] = event->position;
 
-        if ( split->type == 0 ) {
-            left_counter += split->t0c;
+                if ( axis == split->axis ) {
+                    build->straddling[straddling_count++] = event->primitive;
+                }
+            } else {
+                ( ( float* ) &bounds->max ) [axis] = event->position;
+            }
         }
+    }
 
-        split->right_count = right_counter;
-        split->left_count = left_counter;
+    // Either part is empty if the triangle only grazes the plane within the padding of its bounds
+    TerraAABB* parts = ( TerraAABB* ) terra_malloc ( sizeof ( TerraAABB ) * 2 * ( straddling_count > 0 ? straddling_count : 1 ) );
 
-        if ( split->type == 1 ) {
-            right_counter -= split->t1c;
-        }
+    for ( int i = 0; i < straddling_count; ++i ) {
+        uint32_t primitive = build->primitives[build->straddling[i]];
+        const TerraTriangle* triangle = terra_primitive_map_triangle ( &build->tree->primitive_map, build->objects, primitive );
+        const TerraAABB* bounds = &build->bounds[build->straddling[i]];
+        terra_bvh_clip_triangle ( triangle, split->axis, -FLT_MAX, split->position, bounds, &parts[2 * i] );
+        terra_bvh_clip_triangle ( triangle, split->axis, split->position, FLT_MAX, bounds, &parts[2 * i + 1] );
     }
 
-    // Estimating costs
-    float SAV = 0.5f / ( extents.x * extents.z + extents.x * extents.y + extents.z * extents.y );
-    float cost_of_not_splitting = TERRA_KDTREE_INTERSECTION_COST * ( float ) buffer->objects_count;
-    float lowest_cost = FLT_MAX;
-    float best_split = 0.f;
-    int left_count = -1;
-    int right_count = -1;
-
-    for ( int i = 0; i < splitlist_next; ++i ) {
-        TerraKDSplit* split = &splitbuffer[i];
-        // Calculating extents
-        TerraAABB left = *aabb, right = *aabb;
-        terra__comp ( left.max, axis ) = split->offset;
-        terra__comp ( right.min, axis ) = split->offset;
-        TerraFloat3 le;
-        le.x = left.max.x - left.min.x;
-        le.y = left.max.y - left.min.y;
-        le.z = left.max.z - left.min.z;
-        TerraFloat3 re;
-        re.x = right.max.x - right.min.x;
-        re.y = right.max.y - right.min.y;
-        re.z = right.max.z - right.min.z;
-        float SA_left = 2 * ( le.x * le.z + le.x * le.y + le.z * le.y );
-        float SA_right = 2 * ( re.x * re.z + re.x * re.y + re.z * re.y );
-        float split_cost = TERRA_KDTREE_TRAVERSAL_COST + TERRA_KDTREE_INTERSECTION_COST * ( SA_left * SAV * split->left_count + SA_right * SAV * split->right_count );
-
-        if ( split_cost < lowest_cost ) {
-            lowest_cost = split_cost;
-            best_split = split->offset;
-            left_count = split->left_count;
-            right_count = split->right_count;
+    TerraKDBuildTask* children[2] = { below, above };
+    const int children_sides[2] = { kTerraKDSideBelow, kTerraKDSideAbove };
+    int events_count = task->events_count[0] + task->events_count[1] + task->events_count[2];
+    TerraKDEvent* inserted = ( TerraKDEvent* ) terra_malloc ( sizeof ( TerraKDEvent ) * 2 * ( straddling_count > 0 ? straddling_count : 1 ) );
+
+    for ( int c = 0; c < 2; ++c ) {
+        TerraKDBuildTask* child = children[c];
+        child->events = ( TerraKDEvent* ) terra_malloc ( sizeof ( TerraKDEvent ) * ( events_count + 6 * straddling_count ) );
+        child->voxel = task->voxel;
+        child->depth = task->depth + 1;
+        child->parent_idx = -1;
+        ( ( float* ) ( c == 0 ? &child->voxel.max : &child->voxel.min ) ) [split->axis] = split->position;
+        TerraKDEvent* child_events = child->events;
+
+        for ( int axis = 0; axis < 3; ++axis ) {
+            int inserted_count = 0;
+
+            for ( int i = 0; i < straddling_count; ++i ) {
+                const TerraAABB* part = &parts[2 * i + c];
+
+                if ( part->min.x > part->max.x ) {
+                    continue;
+                }
+
+                inserted[inserted_count].position = terra_kdtree_axis ( &part->min, axis );
+                inserted[inserted_count].primitive = build->straddling[i];
+                inserted[inserted_count++].start = 1;
+                inserted[inserted_count].position = terra_kdtree_axis ( &part->max, axis );
+                inserted[inserted_count].primitive = build->straddling[i];
+                inserted[inserted_count++].start = 0;
+            }
+
+            child->events_count[axis] = terra_kdtree_merge_events ( axis_events[axis], task->events_count[axis], sides, children_sides[c], inserted,
+                                        inserted_count, child_events );
+            child_events += child->events_count[axis];
         }
-    }
 
-    // Splitting is not worth
-    if ( lowest_cost > cost_of_not_splitting ) {
-        return;
+        // Every primitive has a start and an end event along each axis
+        child->primitives_count = child->events_count[0] / 2;
     }
 
-    // Saving the temporary buffer used by left
-    int old_buffer = node->leaf.objects;
-    // Time to split!
-    int children = ( uint32_t ) terra_kdtree_add_node_pair ( tree );
-    node = &tree->nodes[node_idx];
-    node->internal.children = children;
-    node->internal.is_leaf = 0;
-    node->internal.axis = axis;
-    node->split = best_split;
-    TerraKDNode* left_node = &tree->nodes[node->internal.children];
-    TerraKDNode* right_node = &tree->nodes[node->internal.children + 1];
-    left_node->leaf.objects = terra_kdtree_add_object_buffer ( tree );
-    right_node->leaf.objects = terra_kdtree_add_object_buffer ( tree );
-    left_node->internal.is_leaf = 1;
-    right_node->internal.is_leaf = 1;
-    buffer = &tree->object_buffers[old_buffer];
-    TerraKDObjectBuffer* left_buffer = &tree->object_buffers[left_node->leaf.objects];
-    TerraKDObjectBuffer* right_buffer = &tree->object_buffers[right_node->leaf.objects];
-    terra_kdtree_init_object_buffer ( left_buffer, left_count );
-    terra_kdtree_init_object_buffer ( right_buffer, right_count );
-    int lbc = 0;
-    int rbc = 0;
-    TerraAABB left_aabb = *aabb, right_aabb = *aabb;
-    terra__comp ( left_aabb.max, axis ) = best_split;
-    terra__comp ( right_aabb.min, axis ) = best_split;
-    float left_max = best_split;
-    float right_min = best_split;
-    float left_min = terra__comp ( left_aabb.min, axis );
-    float right_max = terra__comp ( right_aabb.max, axis );
-
-    for ( int i = 0; i < buffer->objects_count; ++i ) {
-        TerraKDObjectRef ref = buffer->objects[i];
-        // TerraTriangle* triangle = &scene->objects[ref.primitive.object_idx].triangles[ref.primitive.triangle_idx];
-        TerraAABB triangle_aabb = aabb_cache[i];
-        float triangle_min = terra__comp ( triangle_aabb.min, axis );
-        float triangle_max = terra__comp ( triangle_aabb.max, axis );
-
-        if ( ( triangle_min <= left_max ) && ( triangle_max >= left_min ) ) {
-            left_buffer->objects[lbc++] = ref;
-        }
+    terra_free ( inserted );
+    terra_free ( parts );
+}
 
-        if ( ( triangle_min <= right_max ) && ( triangle_max >= right_min ) ) {
-            right_buffer->objects[rbc++] = ref;
-        }
+int terra_kdtree_add_node ( TerraKDBuild* build ) {
+    TerraKDTree* tree = build->tree;
+
+    if ( tree->nodes_count == build->nodes_cap ) {
+        build->nodes_cap *= 2;
+        tree->nodes = ( TerraKDNode* ) terra_realloc ( tree->nodes, sizeof ( TerraKDNode ) * build->nodes_cap );
     }
 
-    assert ( lbc == left_buffer->objects_count );
-    assert ( rbc == right_buffer->objects_count );
-    terra_kdtree_destroy_object_buffer ( buffer );
+    return tree->nodes_count++;
+}
+
+void terra_kdtree_emit_leaf ( TerraKDBuild* build, const TerraKDBuildTask* task, int node_idx ) {
+    TerraKDTree* tree = build->tree;
+
+    if ( tree->primitives_count + task->primitives_count > build->primitives_cap ) {
+        while ( tree->primitives_count + task->primitives_count > build->primitives_cap ) {
+            build->primitives_cap *= 2;
+        }
 
-    // Not splitting for less than 3..
-    if ( left_count > 3 ) {
-        terra_kdtree_create_rec ( tree, children, objects, &left_aabb, depth - 1, splitbuffer, aabb_cache );
+        tree->primitives = ( uint32_t* ) terra_realloc ( tree->primitives, sizeof ( uint32_t ) * build->primitives_cap );
     }
 
-    if ( right_count > 3 ) {
-        terra_kdtree_create_rec ( tree, children + 1, objects, &right_aabb, depth - 1, splitbuffer, aabb_cache );
+    TerraKDNode* node = &tree->nodes[node_idx];
+    node->axis = TERRA_KDTREE_LEAF;
+    node->index = task->primitives_count;
+    node->data.primitives = tree->primitives_count;
+
+    // Every primitive starts exactly once along the first axis
+    for ( int i = 0; i < task->events_count[0]; ++i ) {
+        if ( task->events[i].start ) {
+            tree->primitives[tree->primitives_count++] = build->primitives[task->events[i].primitive];
+        }
     }
 }
 
 void terra_kdtree_create ( TerraKDTree* kdtree, const TerraObject* objects, int objects_count ) {
     int primitives_count = 0;
 
-    for ( int j = 0; j < objects_count; ++j ) {
-        primitives_count += objects[j].triangles_count;
+    for ( int i = 0; i < objects_count; ++i ) {
+        primitives_count += objects[i].triangles_count;
     }
 
-    kdtree->nodes = terra_malloc ( sizeof ( TerraKDNode ) );
-    kdtree->nodes_count = 1;
-    kdtree->nodes_capacity = 1;
-    kdtree->object_buffers = NULL;
-    kdtree->object_buffers_count = 0;
-    kdtree->object_buffers_capacity = 0;
-    kdtree->nodes[0].internal.is_leaf = 1;
-    kdtree->nodes[0].leaf.objects = terra_kdtree_add_object_buffer ( kdtree );
-    TerraKDObjectBuffer* buffer = &kdtree->object_buffers[kdtree->nodes[0].leaf.objects];
-    terra_kdtree_init_object_buffer ( buffer, primitives_count );
-    kdtree->scene_aabb.min = terra_f3_set1 ( FLT_MAX );
-    kdtree->scene_aabb.max = terra_f3_set1 ( -FLT_MAX );
-    // Copying all triangles to temporary buffer
-    int pidx = 0;
+    TerraKDBuild build;
+    terra_primitive_map_init ( &kdtree->primitive_map, objects, objects_count );
+    build.tree = kdtree;
+    build.objects = objects;
+    build.nodes_cap = 64;
+    build.primitives_cap = primitives_count > 0 ? primitives_count : 1;
+    build.max_depth = primitives_count > 0 ? ( int ) ( 8 + 1.3f * log2f ( ( float ) primitives_count ) ) : 0;
+    build.max_depth = build.max_depth < TERRA_KDTREE_MAX_DEPTH ? build.max_depth : TERRA_KDTREE_MAX_DEPTH;
+    kdtree->nodes = ( TerraKDNode* ) terra_malloc ( sizeof ( TerraKDNode ) * build.nodes_cap );
+    kdtree->nodes_count = 0;
+    kdtree->primitives = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * build.primitives_cap );
+    kdtree->primitives_count = 0;
+
+    // Events of the root, each axis sorted once. The bounds are padded, no primitive is flat.
+    uint32_t* primitives = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * build.primitives_cap );
+    TerraKDBuildTask root;
+    root.events = ( TerraKDEvent* ) terra_malloc ( sizeof ( TerraKDEvent ) * 6 * build.primitives_cap );
+    root.primitives_count = primitives_count;
+    root.depth = 0;
+    root.parent_idx = -1;
+    root.voxel.min = terra_f3_set1 ( FLT_MAX );
+    root.voxel.max = terra_f3_set1 ( -FLT_MAX );
+    TerraKDEvent* axis_events[3] = { root.events, root.events + 2 * primitives_count, root.events + 4 * primitives_count };
+    int p = 0;
 
     for ( int j = 0; j < objects_count; ++j ) {
-        for ( int i = 0; i < objects[j].triangles_count; ++i, ++pidx ) {
-            TerraTriangle* triangle = &objects[j].triangles[i];
-            terra_aabb_fit_triangle ( &kdtree->scene_aabb, triangle );
-            buffer->objects[pidx].primitive.object_idx = j;
-            buffer->objects[pidx].primitive.triangle_idx = i;
-            buffer->objects[pidx].triangle = *triangle;
+        for ( size_t i = 0; i < objects[j].triangles_count; ++i, ++p ) {
+            TerraAABB aabb;
+            aabb.min = terra_f3_set1 ( FLT_MAX );
+            aabb.max = terra_f3_set1 ( -FLT_MAX );
+            terra_aabb_fit_triangle ( &aabb, &objects[j].triangles[i] );
+            terra_aabb_fit_triangle ( &root.voxel, &objects[j].triangles[i] );
+            primitives[p] = ( uint32_t ) p;
+
+            for ( int axis = 0; axis < 3; ++axis ) {
+                axis_events[axis][2 * p].position = terra_kdtree_axis ( &aabb.min, axis );
+                axis_events[axis][2 * p].primitive = p;
+                axis_events[axis][2 * p].start = 1;
+                axis_events[axis][2 * p + 1].position = terra_kdtree_axis ( &aabb.max, axis );
+                axis_events[axis][2 * p + 1].primitive = p;
+                axis_events[axis][2 * p + 1].start = 0;
+            }
         }
     }
 
-    buffer->objects_count = pidx;
-    TerraKDSplit* splitbuffer = terra_malloc ( sizeof ( TerraKDSplit ) * primitives_count * 2 );
-    TerraAABB* aabb_cache = terra_malloc ( sizeof ( TerraAABB ) * primitives_count * 2 );
-    terra_kdtree_create_rec ( kdtree, 0, objects, &kdtree->scene_aabb, 20, splitbuffer, aabb_cache );
-    terra_free ( splitbuffer );
-    terra_free ( aabb_cache );
-}
+    for ( int axis = 0; axis < 3; ++axis ) {
+        root.events_count[axis] = 2 * primitives_count;
+        qsort ( axis_events[axis], root.events_count[axis], sizeof ( TerraKDEvent ), terra_kdtree_event_cmp );
+    }
 
-//--------------------------------------------------------------------------------------------------
-void terra_kdtree_destroy ( TerraKDTree* kdtree ) {
-    terra_free ( kdtree->nodes );
+    kdtree->aabb = root.voxel;
+    build.primitives = primitives;
+    build.sides = ( uint8_t* ) terra_malloc ( sizeof ( uint8_t ) * build.primitives_cap );
+    build.bounds = ( TerraAABB* ) terra_malloc ( sizeof ( TerraAABB ) * build.primitives_cap );
+    build.straddling = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * build.primitives_cap );
 
-    for ( int i = 0; i < kdtree->object_buffers_count; ++i ) {
-        terra_kdtree_destroy_object_buffer ( &kdtree->object_buffers[i] );
+    // Depth first, the below child is popped right after its parent and lands next to it
+    int stack_cap = 2 * TERRA_KDTREE_MAX_DEPTH + 2;
+    TerraKDBuildTask* stack = ( TerraKDBuildTask* ) terra_malloc ( sizeof ( TerraKDBuildTask ) * stack_cap );
+    int stack_idx = 0;
+    stack[stack_idx++] = root;
+
+    while ( stack_idx > 0 ) {
+        TerraKDBuildTask task = stack[--stack_idx];
+        int node_idx = terra_kdtree_add_node ( &build );
+
+        if ( task.parent_idx != -1 ) {
+            kdtree->nodes[task.parent_idx].index = node_idx;
+        }
+
+        TerraKDSplit split;
+        split.axis = -1;
+
+        if ( task.primitives_count > TERRA_KDTREE_LEAF_MIN_PRIMITIVES && task.depth < build.max_depth ) {
+            terra_kdtree_find_split ( &task, &split );
+        }
+
+        if ( split.axis == -1 ) {
+            terra_kdtree_emit_leaf ( &build, &task, node_idx );
+            terra_free ( task.events );
+            continue;
+        }
+
+        TerraKDNode* node = &kdtree->nodes[node_idx];
+        node->axis = split.axis;
+        node->index = 0;
+        node->data.split = split.position;
+        assert ( stack_idx + 2 <= stack_cap );
+        TerraKDBuildTask* below = &stack[stack_idx + 1];
+        TerraKDBuildTask* above = &stack[stack_idx];
+        terra_kdtree_split_events ( &build, &task, &split, below, above );
+        above->parent_idx = node_idx;
+        stack_idx += 2;
+        terra_free ( task.events );
     }
 
-    terra_free ( kdtree->object_buffers );
+    terra_free ( stack );
+    terra_free ( build.straddling );
+    terra_free ( build.bounds );
+    terra_free ( build.sides );
+    terra_free ( primitives );
+    kdtree->triangles = terra_bvh_gather_triangles ( kdtree->primitives, kdtree->primitives_count, objects, &kdtree->primitive_map, NULL );
 }
 
+void terra_kdtree_destroy ( TerraKDTree* kdtree ) {
+    terra_free ( kdtree->nodes );
+    terra_free ( kdtree->primitives );
+    terra_free_aligned ( kdtree->triangles );
+    terra_primitive_map_destroy ( &kdtree->primitive_map );
+}
+
+//--------------------------------------------------------------------------------------------------
+// Traversal. Leaves are visited front to back along the ray, each node with the range of the ray
+// inside its voxel. Leaves are tested with the same watertight kernel as the BVH, a hit can lie past the
+// leaf exit (the triangle straddles into a later leaf) and the traversal stops once the closest hit is
+// before the range of the next node.
 //--------------------------------------------------------------------------------------------------
-bool terra_kdtree_traverse ( TerraKDTree* kdtree, const TerraRay* ray, TerraFloat3* point_out, TerraPrimitiveRef* primitive_out ) {
-    float a, b;
-    float t;
+bool terra_kdtree_traverse ( const TerraKDTree* kdtree, const TerraRay* ray, const TerraRayState* ray_state, float t_max,
+                             TerraFloat3* point_out, TerraPrimitiveRef* primitive_out ) {
+    float t_min, t_node_max;
 
-    if ( !terra_ray_aabb_intersection ( ray, &kdtree->scene_aabb, &a, &b ) ) {
+    if ( kdtree->primitives_count == 0 || !terra_ray_aabb_intersection ( ray_state, &kdtree->aabb, &t_min, &t_node_max ) ) {
         return false;
     }
 
-    typedef struct StackEntry {
-        TerraKDNode* node;
-        float t;
-        TerraFloat3 pb;
-        int prev;
-    } StackEntry;
-    StackEntry stack[64];
-    TerraKDNode* far_child, *cur_node;
-    cur_node = &kdtree->nodes[0];
-    int enpt = 0;
-    stack[enpt].t = a;
-
-    if ( a >= 0.f ) {
-        TerraFloat3 d = terra_mulf3 ( &ray->direction, a );
-        stack[enpt].pb = terra_addf3 ( &ray->origin, &d );
-    } else {
-        stack[enpt].pb = ray->origin;
-    }
+    TerraRayIntersectionQuery iset_query;
+    iset_query.ray = ray;
+    iset_query.state = ray_state;
+    TerraKDStackEntry stack[TERRA_KDTREE_MAX_DEPTH];
+    int stack_count = 0;
+    int node_idx = 0;
+    float min_d = t_max;
+    TerraFloat3 min_p = terra_f3_set1 ( FLT_MAX );
+    uint32_t primitive = 0;
+    bool found = false;
+    t_min = terra_maxf ( t_min, 0.f );
+
+    while ( min_d >= t_min ) {
+        const TerraKDNode* node = &kdtree->nodes[node_idx];
+
+        if ( node->axis != TERRA_KDTREE_LEAF ) {
+            float origin = terra_kdtree_axis ( &ray->origin, node->axis );
+            float t_split = ( node->data.split - origin ) * terra_kdtree_axis ( &ray->inv_direction, node->axis );
+            bool below_first = origin < node->data.split || ( origin == node->data.split && terra_kdtree_axis ( &ray->direction, node->axis ) <= 0.f );
+            int first = below_first ? node_idx + 1 : ( int ) node->index;
+            int second = below_first ? ( int ) node->index : node_idx + 1;
+
+            // Also taken when the ray lies on the plane (t_split is NaN)
+            if ( ! ( t_split > 0.f ) || t_split > t_node_max ) {
+                node_idx = first;
+            } else if ( t_split < t_min ) {
+                node_idx = second;
+            } else {
+                stack[stack_count].node = second;
+                stack[stack_count].t_min = t_split;
+                stack[stack_count].t_max = t_node_max;
+                ++stack_count;
+                node_idx = first;
+                t_node_max = t_split;
+            }
 
-    int expt = 1;
-    stack[expt].t = b;
-    TerraFloat3 d = terra_mulf3 ( &ray->direction, b );
-    stack[expt].pb = terra_addf3 ( &ray->origin, &d );
-    stack[expt].node = NULL;
-
-    while ( cur_node != NULL ) {
-        while ( !cur_node->internal.is_leaf ) {
-            float splitval = cur_node->split;
-            int na_lu[3] = { 1, 2, 0 };
-            int pa_lu[3] = { 2, 0, 1 };
-            int axis = cur_node->internal.axis;
-            int next_axis = na_lu[axis];
-            int prev_axis = pa_lu[axis];
-            TerraKDNode* left_node = &kdtree->nodes[cur_node->internal.children];
-            TerraKDNode* right_node = left_node + 1;
-
-            if ( terra__comp ( stack[enpt].pb, axis ) <= splitval ) {
-                if ( terra__comp ( stack[expt].pb, axis ) <= splitval ) {
-                    cur_node = left_node;
-                    continue;
-                }
+            continue;
+        }
 
-                if ( terra__comp ( stack[expt].pb, axis ) == splitval ) {
-                    cur_node = right_node;
-                    continue;
-                }
+        found |= terra_bvh_leaf_intersect ( kdtree->primitives, kdtree->triangles, node->data.primitives, node->index, &iset_query,
+                                            &min_d, &min_p, &primitive );
 
-                far_child = right_node;
-                cur_node = left_node;
-            } else {
-                if ( splitval < terra__comp ( stack[expt].pb, axis ) ) {
-                    cur_node = right_node;
-                    continue;
-                }
+        if ( stack_count == 0 ) {
+            break;
+        }
 
-                far_child = left_node;
-                cur_node = right_node;
-            }
+        --stack_count;
+        node_idx = stack[stack_count].node;
+        t_min = stack[stack_count].t_min;
+        t_node_max = stack[stack_count].t_max;
+    }
 
-            t = ( splitval - terra__comp ( ray->origin, axis ) ) / terra__comp ( ray->direction, axis );
-            int tmp = expt++;
+    if ( found ) {
+        *primitive_out = terra_primitive_map_find ( &kdtree->primitive_map, primitive );
+    }
 
-            if ( expt == enpt ) {
-                ++expt;
-            }
+    *point_out = min_p;
+    return found;
+}
 
-            stack[expt].prev = tmp;
-            stack[expt].t = t;
-            stack[expt].node = far_child;
-            terra__comp ( stack[expt].pb, axis ) = splitval;
-            terra__comp ( stack[expt].pb, next_axis ) = terra__comp ( ray->origin, next_axis ) + t * terra__comp ( ray->direction, next_axis );
-            terra__comp ( stack[expt].pb, prev_axis ) = terra__comp ( ray->origin, prev_axis ) + t * terra__comp ( ray->direction, prev_axis );
-        }
+// Same traversal with the ray range clipped to t_max, stops at the first leaf with a hit
+bool terra_kdtree_occluded ( const TerraKDTree* kdtree, const TerraRay* ray, const TerraRayState* ray_state, float t_max ) {
+    float t_min, t_node_max;
 
-        TerraKDObjectBuffer* buffer = &kdtree->object_buffers[cur_node->leaf.objects];
-        bool hit = false;
-        float closest_t = FLT_MAX;
-
-        for ( int i = 0; i < buffer->objects_count; ++i ) {
-            TerraKDObjectRef ref = buffer->objects[i];
-            //            TerraTriangle* triangle = &scene->objects[ref.primitive.object_idx].triangles[ref.primitive.triangle_idx];
-            float t;
-            TerraFloat3 point;
-
-            if ( terra_geom_ray_triangle_intersection ( ray, &ref.triangle, &point, &t ) ) {
-                if ( t >= stack[enpt].t && t <= stack[expt].t && t < closest_t ) {
-                    closest_t = t;
-                    *primitive_out = ref.primitive;
-                    *point_out = point;
-                    hit = true;
-                }
+    if ( kdtree->primitives_count == 0 || !terra_ray_aabb_intersection ( ray_state, &kdtree->aabb, &t_min, &t_node_max ) ) {
+        return false;
+    }
+
+    TerraRayIntersectionQuery iset_query;
+    iset_query.ray = ray;
+    iset_query.state = ray_state;
+    TerraKDStackEntry stack[TERRA_KDTREE_MAX_DEPTH];
+    int stack_count = 0;
+    int node_idx = 0;
+    t_min = terra_maxf ( t_min, 0.f );
+    t_node_max = terra_minf ( t_node_max, t_max );
+
+    while ( t_min <= t_node_max ) {
+        const TerraKDNode* node = &kdtree->nodes[node_idx];
+
+        if ( node->axis != TERRA_KDTREE_LEAF ) {
+            float origin = terra_kdtree_axis ( &ray->origin, node->axis );
+            float t_split = ( node->data.split - origin ) * terra_kdtree_axis ( &ray->inv_direction, node->axis );
+            bool below_first = origin < node->data.split || ( origin == node->data.split && terra_kdtree_axis ( &ray->direction, node->axis ) <= 0.f );
+            int first = below_first ? node_idx + 1 : ( int ) node->index;
+            int second = below_first ? ( int ) node->index : node_idx + 1;
+
+            if ( ! ( t_split > 0.f ) || t_split > t_node_max ) {
+                node_idx = first;
+            } else if ( t_split < t_min ) {
+                node_idx = second;
+            } else {
+                stack[stack_count].node = second;
+                stack[stack_count].t_min = t_split;
+                stack[stack_count].t_max = t_node_max;
+                ++stack_count;
+                node_idx = first;
+                t_node_max = t_split;
             }
+
+            continue;
         }
 
-        if ( hit ) {
+        if ( terra_bvh_leaf_occluded ( kdtree->triangles, node->data.primitives, node->index, &iset_query, t_max ) ) {
             return true;
         }
 
-        enpt = expt;
-        cur_node = stack[expt].node;
-        expt = stack[enpt].prev;
+        if ( stack_count == 0 ) {
+            break;
+        }
+
+        --stack_count;
+        node_idx = stack[stack_count].node;
+        t_min = stack[stack_count].t_min;
+        t_node_max = stack[stack_count].t_max;
     }
 
     return false;
@@ -4,60 +4,57 @@
 // Terra
 #include <Terra.h>
 #include "TerraPrivate.h"
+#include "TerraBVH.h"
+
+// libc
+#include <stdint.h>
+
+// Value of TerraKDNode.axis for leaves
+#define TERRA_KDTREE_LEAF 3
+
+// Deepest level a node can be at, bounds the traversal stack
+#ifndef TERRA_KDTREE_MAX_DEPTH
+#define TERRA_KDTREE_MAX_DEPTH 48
+#endif
 
 //--------------------------------------------------------------------------------------------------
 // Terra K-D Tree Types
 //--------------------------------------------------------------------------------------------------
-typedef struct TerraKDObjectRef {
-    TerraTriangle    triangle;
-    TerraPrimitiveRef primitive;
-} TerraKDObjectRef;
-
-typedef struct TerraKDObjectBuffer {
-    TerraKDObjectRef* objects;
-    int             objects_count;
-} TerraKDObjectBuffer;
-
-typedef struct TerraKDNodeInternalData {
-    uint32_t is_leaf : 1;
-    uint32_t axis : 2;
-    uint32_t children;
-} TerraKDNodeInternalData;
-
-typedef struct TerraKDNodeLeafData {
-    uint32_t padding : 1;
-    uint32_t objects : 31; // idx to ObjectBuffer
-} TerraKDNodeLeafData;
-
+// 8 bytes. Nodes are stored depth first, the below child of an internal node directly follows it.
 typedef struct TerraKDNode {
-    float split;
-    TerraKDNodeInternalData internal;
-    TerraKDNodeLeafData leaf;
+    union {
+        float    split;             // Internal nodes, position of the split plane
+        uint32_t primitives;        // Leaves, offset of the first primitive in TerraKDTree.primitives
+    } data;
+    uint32_t axis : 2;              // Split axis or TERRA_KDTREE_LEAF
+    uint32_t index : 30;            // Internal nodes: above child. Leaves: number of primitives
 } TerraKDNode;
 
-// Container for different allocators. Root is nodes[0]
+// Root is nodes[0]
 typedef struct TerraKDTree {
-    TerraKDNode* nodes;
-    int nodes_count;
-    int nodes_capacity;
-    TerraKDObjectBuffer* object_buffers;
-    int object_buffers_count;
-    int object_buffers_capacity;
-    TerraAABB scene_aabb;
+    TerraKDNode*         nodes;
+    int                  nodes_count;
+    uint32_t*            primitives;        // Global indices as in TerraBVH, triangles straddling a split are referenced by every leaf they overlap
+    TerraTrianglePacket* triangles;         // Triangle of each primitive in the same order
+    int                  primitives_count;
+    TerraPrimitiveMap    primitive_map;
+    TerraAABB            aabb;
 } TerraKDTree;
 
 //--------------------------------------------------------------------------------------------------
 // Terra K-D Tree API
 //--------------------------------------------------------------------------------------------------
 //
-// KDTree
-// O(N log(N)^2)
-// Triangle is copied to avoid an additional redirection.
+// SAH kd-tree [Wald and Havran 2006], O(N log(N)).
+// Candidate planes are swept over event lists sorted once at the root, which are then split
+// between the children keeping their order. Triangles straddling a split are clipped to each side.
 //
 void terra_kdtree_create ( TerraKDTree* kdtree, const TerraObject* objects, int objects_count );
 void terra_kdtree_destroy ( TerraKDTree* kdtree );
-bool terra_kdtree_traverse ( TerraKDTree* kdtree, const TerraRay* ray,
+// Closest hit along the ray before t_max (FLT_MAX for an unbounded ray)
+bool terra_kdtree_traverse ( const TerraKDTree* kdtree, const TerraRay* ray, const TerraRayState* ray_state, float t_max,
                              TerraFloat3* point_out, TerraPrimitiveRef* primitive_out );
+// True if anything is hit along the ray before t_max
+bool terra_kdtree_occluded ( const TerraKDTree* kdtree, const TerraRay* ray, const TerraRayState* ray_state, float t_max );
 
-
-#endif // _TERRA_KDTREE_H_
\ No newline at end of file
+#endif // _TERRA_KDTREE_H_
@@ -0,0 +1,484 @@
+// TerraLightBVH
+#include "TerraLightBVH.h"
+
+// Terra
+#include "TerraPrivate.h"
+
+// libc
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of buckets the centroid extent of a node is partitioned into on each axis when looking for the best split
+#ifndef TERRA_LIGHT_BVH_BINS
+#define TERRA_LIGHT_BVH_BINS 12
+#endif
+
+// Nodes this deep are split at the median primitive instead, keeping the whole tree under TERRA_LIGHT_BVH_MAX_DEPTH
+// for any number of lights that fits in 32 bits
+#define TERRA_LIGHT_BVH_MEDIAN_DEPTH 32
+
+// Largest float below 1, the random number is rescaled at every level and has to stay in [0, 1)
+#define TERRA_LIGHT_BVH_ONE_MINUS_EPSILON 0.99999994f
+
+typedef struct {
+    TerraLightBounds bounds;
+    TerraFloat3      centroid;
+    uint32_t         index;         // Light triangle
+} TerraLightBVHPrimitive;
+
+static void  terra_light_bounds_union ( TerraLightBounds* bounds, const TerraLightBounds* other );
+static float terra_light_bounds_cost ( const TerraLightBounds* bounds, float axis_scale );
+static float terra_cos_sub_clamped ( float sin_a, float cos_a, float sin_b, float cos_b );
+static float terra_sin_sub_clamped ( float sin_a, float cos_a, float sin_b, float cos_b );
+static float terra_light_f3_axis ( const TerraFloat3* vec, int axis );
+static int   terra_light_bvh_compare_x ( const void* a, const void* b );
+static int   terra_light_bvh_compare_y ( const void* a, const void* b );
+static int   terra_light_bvh_compare_z ( const void* a, const void* b );
+static int   terra_light_bvh_split ( TerraLightBVHPrimitive* primitives, int primitives_count, int depth );
+static int   terra_light_bvh_build ( TerraLightBVH* bvh, TerraLightBVHPrimitive* primitives, int primitives_count, int depth, uint64_t trail );
+
+//--------------------------------------------------------------------------------------------------
+// Terra Light Bounds
+//--------------------------------------------------------------------------------------------------
+void terra_light_bounds_triangle ( TerraLightBounds* bounds, const TerraTriangle* triangle, const TerraTriangleProperties* properties, float power ) {
+    bounds->aabb.min = bounds->aabb.max = triangle->a;
+    const TerraFloat3* vertices[2] = { &triangle->b, &triangle->c };
+
+    for ( int i = 0; i < 2; ++i ) {
+        bounds->aabb.min.x = terra_minf ( bounds->aabb.min.x, vertices[i]->x );
+        bounds->aabb.min.y = terra_minf ( bounds->aabb.min.y, vertices[i]->y );
+        bounds->aabb.min.z = terra_minf ( bounds->aabb.min.z, vertices[i]->z );
+        bounds->aabb.max.x = terra_maxf ( bounds->aabb.max.x, vertices[i]->x );
+        bounds->aabb.max.y = terra_maxf ( bounds->aabb.max.y, vertices[i]->y );
+        bounds->aabb.max.z = terra_maxf ( bounds->aabb.max.z, vertices[i]->z );
+    }
+
+    // Samples are emitted along the interpolated normal, which stays within the cone of the vertex normals
+    TerraFloat3 axis = terra_addf3 ( &properties->normal_a, &properties->normal_b );
+    axis = terra_addf3 ( &axis, &properties->normal_c );
+    bounds->power = power;
+
+    if ( terra_sqlenf3 ( &axis ) == 0 ) {
+        bounds->axis = terra_f3_set ( 0, 1, 0 );
+        bounds->cos_theta_o = -1;
+        return;
+    }
+
+    bounds->axis = terra_normf3 ( &axis );
+    const TerraFloat3* normals[3] = { &properties->normal_a, &properties->normal_b, &properties->normal_c };
+    bounds->cos_theta_o = 1;
+
+    for ( int i = 0; i < 3; ++i ) {
+        TerraFloat3 normal = terra_normf3 ( normals[i] );
+        bounds->cos_theta_o = terra_minf ( bounds->cos_theta_o, terra_dotf3 ( &bounds->axis, &normal ) );
+    }
+}
+
+// The smallest cone containing both [Conty Estevez and Kulla 2018]. Bounds without power are ignored.
+void terra_light_bounds_union ( TerraLightBounds* bounds, const TerraLightBounds* other ) {
+    if ( other->power == 0 ) {
+        return;
+    }
+
+    if ( bounds->power == 0 ) {
+        *bounds = *other;
+        return;
+    }
+
+    bounds->aabb.min.x = terra_minf ( bounds->aabb.min.x, other->aabb.min.x );
+    bounds->aabb.min.y = terra_minf ( bounds->aabb.min.y, other->aabb.min.y );
+    bounds->aabb.min.z = terra_minf ( bounds->aabb.min.z, other->aabb.min.z );
+    bounds->aabb.max.x = terra_maxf ( bounds->aabb.max.x, other->aabb.max.x );
+    bounds->aabb.max.y = terra_maxf ( bounds->aabb.max.y, other->aabb.max.y );
+    bounds->aabb.max.z = terra_maxf ( bounds->aabb.max.z, other->aabb.max.z );
+    bounds->power += other->power;
+    float theta_a = acosf ( terra_maxf ( -1, terra_minf ( 1, bounds->cos_theta_o ) ) );
+    float theta_b = acosf ( terra_maxf ( -1, terra_minf ( 1, other->cos_theta_o ) ) );
+    float theta_d = acosf ( terra_maxf ( -1, terra_minf ( 1, terra_dotf3 ( &bounds->axis, &other->axis ) ) ) );
+
+    // One of the cones contains the other
+    if ( terra_minf ( theta_d + theta_b, terra_PI ) <= theta_a ) {
+        return;
+    }
+
+    if ( terra_minf ( theta_d + theta_a, terra_PI ) <= theta_b ) {
+        bounds->axis = other->axis;
+        bounds->cos_theta_o = other->cos_theta_o;
+        return;
+    }
+
+    float theta_o = ( theta_a + theta_d + theta_b ) / 2;
+    TerraFloat3 rotation_axis = terra_crossf3 ( &bounds->axis, &other->axis );
+
+    if ( theta_o >= terra_PI || terra_sqlenf3 ( &rotation_axis ) == 0 ) {
+        bounds->cos_theta_o = -1;
+        return;
+    }
+
+    // Rotates the axis of the first cone towards the second one by theta_o - theta_a (Rodrigues)
+    float theta_r = theta_o - theta_a;
+    rotation_axis = terra_normf3 ( &rotation_axis );
+    TerraFloat3 axis = terra_mulf3 ( &bounds->axis, cosf ( theta_r ) );
+    TerraFloat3 tangent = terra_crossf3 ( &rotation_axis, &bounds->axis );
+    tangent = terra_mulf3 ( &tangent, sinf ( theta_r ) );
+    axis = terra_addf3 ( &axis, &tangent );
+    bounds->axis = terra_normf3 ( &axis );
+    bounds->cos_theta_o = cosf ( theta_o );
+}
+
+// Surface area orientation heuristic, axis_scale favors splitting the longest side of the node
+float terra_light_bounds_cost ( const TerraLightBounds* bounds, float axis_scale ) {
+    if ( bounds->power == 0 ) {
+        return 0;
+    }
+
+    // Solid angle measure of the cone extended by the emission angle, which is pi / 2
+    float theta_o = acosf ( terra_maxf ( -1, terra_minf ( 1, bounds->cos_theta_o ) ) );
+    float theta_w = terra_minf ( theta_o + terra_PI / 2, terra_PI );
+    float sin_theta_o = sqrtf ( terra_maxf ( 0, 1 - bounds->cos_theta_o * bounds->cos_theta_o ) );
+    float m_omega = 2 * terra_PI * ( 1 - bounds->cos_theta_o ) +
+                    terra_PI / 2 * ( 2 * theta_w * sin_theta_o - cosf ( theta_o - 2 * theta_w ) - 2 * theta_o * sin_theta_o + bounds->cos_theta_o );
+    float w = bounds->aabb.max.x - bounds->aabb.min.x;
+    float h = bounds->aabb.max.y - bounds->aabb.min.y;
+    float d = bounds->aabb.max.z - bounds->aabb.min.z;
+    float area = 2 * ( w * d + w * h + d * h );
+    return bounds->power * m_omega * area * axis_scale;
+}
+
+// cos ( max ( 0, a - b ) )
+float terra_cos_sub_clamped ( float sin_a, float cos_a, float sin_b, float cos_b ) {
+    if ( cos_a > cos_b ) {
+        return 1;
+    }
+
+    return cos_a * cos_b + sin_a * sin_b;
+}
+
+// sin ( max ( 0, a - b ) )
+float terra_sin_sub_clamped ( float sin_a, float cos_a, float sin_b, float cos_b ) {
+    if ( cos_a > cos_b ) {
+        return 0;
+    }
+
+    return sin_a * cos_b - cos_a * sin_b;
+}
+
+// The angles between the axis and the point, and between the surface normal and the lights, are shrunk by the
+// angle the box subtends and by the spread of the cone. The squared distance is clamped to the squared radius of
+// the box so that points close to or inside it don't get an unbounded importance.
+float terra_light_bounds_importance ( const TerraLightBounds* bounds, const TerraFloat3* point, const TerraFloat3* normal ) {
+    if ( bounds->power == 0 ) {
+        return 0;
+    }
+
+    TerraFloat3 center = terra_addf3 ( &bounds->aabb.min, &bounds->aabb.max );
+    center = terra_mulf3 ( &center, 0.5f );
+    float radius2 = terra_sqdistf3 ( &center, &bounds->aabb.max );
+    float dist2 = terra_sqdistf3 ( point, &center );
+    TerraFloat3 wi = terra_subf3 ( point, &center );
+    wi = dist2 > 0 ? terra_divf3 ( &wi, sqrtf ( dist2 ) ) : bounds->axis;
+    // Cone of the directions from the point to the box
+    float cos_theta_b = -1;
+
+    if ( dist2 > radius2 ) {
+        cos_theta_b = sqrtf ( terra_maxf ( 0, 1 - radius2 / dist2 ) );
+    }
+
+    float sin_theta_b = sqrtf ( terra_maxf ( 0, 1 - cos_theta_b * cos_theta_b ) );
+    float cos_theta_w = terra_dotf3 ( &bounds->axis, &wi );
+    float sin_theta_w = sqrtf ( terra_maxf ( 0, 1 - cos_theta_w * cos_theta_w ) );
+    float sin_theta_o = sqrtf ( terra_maxf ( 0, 1 - bounds->cos_theta_o * bounds->cos_theta_o ) );
+    float cos_theta_x = terra_cos_sub_clamped ( sin_theta_w, cos_theta_w, sin_theta_o, bounds->cos_theta_o );
+    float sin_theta_x = terra_sin_sub_clamped ( sin_theta_w, cos_theta_w, sin_theta_o, bounds->cos_theta_o );
+    float cos_theta_p = terra_cos_sub_clamped ( sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b );
+
+    // Outside of the emission angle
+    if ( cos_theta_p <= 0 ) {
+        return 0;
+    }
+
+    dist2 = terra_maxf ( dist2, radius2 );
+    float importance = bounds->power * cos_theta_p / dist2;
+
+    if ( !terra_f3_is_zero ( normal ) ) {
+        float cos_theta_i = fabsf ( terra_dotf3 ( &wi, normal ) );
+        float sin_theta_i = sqrtf ( terra_maxf ( 0, 1 - cos_theta_i * cos_theta_i ) );
+        importance *= terra_cos_sub_clamped ( sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b );
+    }
+
+    return terra_maxf ( importance, 0 );
+}
+
+//--------------------------------------------------------------------------------------------------
+// Terra Light BVH
+//--------------------------------------------------------------------------------------------------
+float terra_light_f3_axis ( const TerraFloat3* vec, int axis ) {
+    return ( ( const float* ) vec ) [axis];
+}
+
+int terra_light_bvh_compare_x ( const void* a, const void* b ) {
+    float ca = ( ( const TerraLightBVHPrimitive* ) a )->centroid.x;
+    float cb = ( ( const TerraLightBVHPrimitive* ) b )->centroid.x;
+    return ( ca > cb ) - ( ca < cb );
+}
+
+int terra_light_bvh_compare_y ( const void* a, const void* b ) {
+    float ca = ( ( const TerraLightBVHPrimitive* ) a )->centroid.y;
+    float cb = ( ( const TerraLightBVHPrimitive* ) b )->centroid.y;
+    return ( ca > cb ) - ( ca < cb );
+}
+
+int terra_light_bvh_compare_z ( const void* a, const void* b ) {
+    float ca = ( ( const TerraLightBVHPrimitive* ) a )->centroid.z;
+    float cb = ( ( const TerraLightBVHPrimitive* ) b )->centroid.z;
+    return ( ca > cb ) - ( ca < cb );
+}
+
+// Partitions the primitives and returns the number of them going to the first child, which is in [1, primitives_count)
+int terra_light_bvh_split ( TerraLightBVHPrimitive* primitives, int primitives_count, int depth ) {
+    TerraAABB centroid_aabb;
+    TerraLightBounds node_bounds;
+    centroid_aabb.min = centroid_aabb.max = primitives[0].centroid;
+    node_bounds = primitives[0].bounds;
+
+    for ( int i = 1; i < primitives_count; ++i ) {
+        const TerraFloat3* c = &primitives[i].centroid;
+        centroid_aabb.min.x = terra_minf ( centroid_aabb.min.x, c->x );
+        centroid_aabb.min.y = terra_minf ( centroid_aabb.min.y, c->y );
+        centroid_aabb.min.z = terra_minf ( centroid_aabb.min.z, c->z );
+        centroid_aabb.max.x = terra_maxf ( centroid_aabb.max.x, c->x );
+        centroid_aabb.max.y = terra_maxf ( centroid_aabb.max.y, c->y );
+        centroid_aabb.max.z = terra_maxf ( centroid_aabb.max.z, c->z );
+        node_bounds.aabb.min.x = terra_minf ( node_bounds.aabb.min.x, primitives[i].bounds.aabb.min.x );
+        node_bounds.aabb.min.y = terra_minf ( node_bounds.aabb.min.y, primitives[i].bounds.aabb.min.y );
+        node_bounds.aabb.min.z = terra_minf ( node_bounds.aabb.min.z, primitives[i].bounds.aabb.min.z );
+        node_bounds.aabb.max.x = terra_maxf ( node_bounds.aabb.max.x, primitives[i].bounds.aabb.max.x );
+        node_bounds.aabb.max.y = terra_maxf ( node_bounds.aabb.max.y, primitives[i].bounds.aabb.max.y );
+        node_bounds.aabb.max.z = terra_maxf ( node_bounds.aabb.max.z, primitives[i].bounds.aabb.max.z );
+    }
+
+    TerraFloat3 extent = terra_subf3 ( &node_bounds.aabb.max, &node_bounds.aabb.min );
+    TerraFloat3 centroid_extent = terra_subf3 ( &centroid_aabb.max, &centroid_aabb.min );
+    float max_extent = terra_maxf3 ( &extent );
+    int best_axis = -1;
+    int best_bin = -1;
+    float best_cost = FLT_MAX;
+
+    for ( int axis = 0; axis < 3 && depth < TERRA_LIGHT_BVH_MEDIAN_DEPTH; ++axis ) {
+        float min = terra_light_f3_axis ( &centroid_aabb.min, axis );
+        float axis_extent = terra_light_f3_axis ( &centroid_extent, axis );
+
+        if ( axis_extent <= 0 ) {
+            continue;
+        }
+
+        TerraLightBounds bins[TERRA_LIGHT_BVH_BINS];
+        int counts[TERRA_LIGHT_BVH_BINS] = { 0 };
+
+        for ( int i = 0; i < TERRA_LIGHT_BVH_BINS; ++i ) {
+            bins[i].power = 0;
+        }
+
+        for ( int i = 0; i < primitives_count; ++i ) {
+            int bin = ( int ) ( TERRA_LIGHT_BVH_BINS * ( terra_light_f3_axis ( &primitives[i].centroid, axis ) - min ) / axis_extent );
+            bin = bin < TERRA_LIGHT_BVH_BINS - 1 ? bin : TERRA_LIGHT_BVH_BINS - 1;
+            terra_light_bounds_union ( &bins[bin], &primitives[i].bounds );
+            ++counts[bin];
+        }
+
+        // Cost of the bins on the right of each split, the left side is accumulated while sweeping
+        float right_cost[TERRA_LIGHT_BVH_BINS];
+        int right_count[TERRA_LIGHT_BVH_BINS];
+        float axis_scale = max_extent / terra_light_f3_axis ( &extent, axis );
+        TerraLightBounds acc = bins[TERRA_LIGHT_BVH_BINS - 1];
+        int acc_count = counts[TERRA_LIGHT_BVH_BINS - 1];
+
+        for ( int i = TERRA_LIGHT_BVH_BINS - 2; i >= 0; --i ) {
+            right_cost[i] = terra_light_bounds_cost ( &acc, axis_scale );
+            right_count[i] = acc_count;
+            terra_light_bounds_union ( &acc, &bins[i] );
+            acc_count += counts[i];
+        }
+
+        acc = bins[0];
+        acc_count = counts[0];
+
+        for ( int i = 0; i < TERRA_LIGHT_BVH_BINS - 1; ++i ) {
+            float cost = terra_light_bounds_cost ( &acc, axis_scale ) + right_cost[i];
+
+            if ( acc_count > 0 && right_count[i] > 0 && cost < best_cost ) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = i;
+            }
+
+            terra_light_bounds_union ( &acc, &bins[i + 1] );
+            acc_count += counts[i + 1];
+        }
+    }
+
+    if ( best_axis == -1 ) {
+        // Too deep or all the centroids are in the same place, halving the primitives along the longest side
+        int axis = terra_max_coefff3 ( &centroid_extent );
+        int ( *compare[3] ) ( const void*, const void* ) = { terra_light_bvh_compare_x, terra_light_bvh_compare_y, terra_light_bvh_compare_z };
+        qsort ( primitives, primitives_count, sizeof ( TerraLightBVHPrimitive ), compare[axis] );
+        return primitives_count / 2;
+    }
+
+    float min = terra_light_f3_axis ( &centroid_aabb.min, best_axis );
+    float axis_extent = terra_light_f3_axis ( &centroid_extent, best_axis );
+    int left = 0;
+
+    for ( int i = 0; i < primitives_count; ++i ) {
+        int bin = ( int ) ( TERRA_LIGHT_BVH_BINS * ( terra_light_f3_axis ( &primitives[i].centroid, best_axis ) - min ) / axis_extent );
+        bin = bin < TERRA_LIGHT_BVH_BINS - 1 ? bin : TERRA_LIGHT_BVH_BINS - 1;
+
+        if ( bin <= best_bin ) {
+            TerraLightBVHPrimitive tmp = primitives[left];
+            primitives[left++] = primitives[i];
+            primitives[i] = tmp;
+        }
+    }
+
+    assert ( left > 0 && left < primitives_count );
+    return left;
+}
+
+// Returns the index of the node
+int terra_light_bvh_build ( TerraLightBVH* bvh, TerraLightBVHPrimitive* primitives, int primitives_count, int depth, uint64_t trail ) {
+    assert ( depth < TERRA_LIGHT_BVH_MAX_DEPTH );
+    int node_idx = bvh->nodes_count++;
+
+    if ( primitives_count == 1 ) {
+        TerraLightBVHNode* node = &bvh->nodes[node_idx];
+        node->bounds = primitives[0].bounds;
+        node->leaf = 1;
+        node->index = primitives[0].index;
+        bvh->trails[primitives[0].index] = trail;
+        return node_idx;
+    }
+
+    int split = terra_light_bvh_split ( primitives, primitives_count, depth );
+    int left = terra_light_bvh_build ( bvh, primitives, split, depth + 1, trail );
+    int right = terra_light_bvh_build ( bvh, primitives + split, primitives_count - split, depth + 1, trail | ( 1ull << depth ) );
+    TerraLightBVHNode* node = &bvh->nodes[node_idx];
+    node->bounds = bvh->nodes[left].bounds;
+    terra_light_bounds_union ( &node->bounds, &bvh->nodes[right].bounds );
+    node->leaf = 0;
+    node->index = right;
+    return node_idx;
+}
+
+void terra_light_bvh_create ( TerraLightBVH* bvh, const TerraLightTriangle* triangles, const TerraLightBounds* bounds, int triangles_count ) {
+    bvh->nodes = NULL;
+    bvh->nodes_count = 0;
+    bvh->triangles = NULL;
+    bvh->trails = NULL;
+    bvh->triangles_count = triangles_count;
+
+    if ( triangles_count == 0 ) {
+        return;
+    }
+
+    bvh->triangles = ( TerraLightTriangle* ) terra_malloc ( sizeof ( TerraLightTriangle ) * triangles_count );
+    memcpy ( bvh->triangles, triangles, sizeof ( TerraLightTriangle ) * triangles_count );
+    bvh->trails = ( uint64_t* ) terra_malloc ( sizeof ( uint64_t ) * triangles_count );
+    bvh->nodes = ( TerraLightBVHNode* ) terra_malloc ( sizeof ( TerraLightBVHNode ) * ( 2 * triangles_count - 1 ) );
+    TerraLightBVHPrimitive* primitives = ( TerraLightBVHPrimitive* ) terra_malloc ( sizeof ( TerraLightBVHPrimitive ) * triangles_count );
+
+    for ( int i = 0; i < triangles_count; ++i ) {
+        primitives[i].bounds = bounds[i];
+        primitives[i].centroid = terra_addf3 ( &bounds[i].aabb.min, &bounds[i].aabb.max );
+        primitives[i].centroid = terra_mulf3 ( &primitives[i].centroid, 0.5f );
+        primitives[i].index = ( uint32_t ) i;
+    }
+
+    terra_light_bvh_build ( bvh, primitives, triangles_count, 0, 0 );
+    assert ( bvh->nodes_count == 2 * triangles_count - 1 );
+    terra_free ( primitives );
+}
+
+void terra_light_bvh_destroy ( TerraLightBVH* bvh ) {
+    terra_free ( bvh->nodes );
+    terra_free ( bvh->triangles );
+    terra_free ( bvh->trails );
+    bvh->nodes = NULL;
+    bvh->triangles = NULL;
+    bvh->trails = NULL;
+    bvh->nodes_count = 0;
+    bvh->triangles_count = 0;
+}
+
+int terra_light_bvh_sample ( const TerraLightBVH* bvh, const TerraFloat3* point, const TerraFloat3* normal, float e, float* pmf ) {
+    if ( bvh->nodes_count == 0 ) {
+        return -1;
+    }
+
+    const TerraLightBVHNode* node = bvh->nodes;
+    *pmf = 1;
+
+    if ( node->leaf ) {
+        return terra_light_bounds_importance ( &node->bounds, point, normal ) > 0 ? ( int ) node->index : -1;
+    }
+
+    while ( !node->leaf ) {
+        const TerraLightBVHNode* children[2] = { node + 1, &bvh->nodes[node->index] };
+        float importance[2] = {
+            terra_light_bounds_importance ( &children[0]->bounds, point, normal ),
+            terra_light_bounds_importance ( &children[1]->bounds, point, normal )
+        };
+
+        if ( importance[0] == 0 && importance[1] == 0 ) {
+            return -1;
+        }
+
+        // The random number is reused for the next level, rescaled to the range of the child picked
+        float p = importance[0] / ( importance[0] + importance[1] );
+
+        if ( e < p ) {
+            e = terra_minf ( e / p, TERRA_LIGHT_BVH_ONE_MINUS_EPSILON );
+            *pmf *= p;
+            node = children[0];
+        } else {
+            e = terra_minf ( ( e - p ) / ( 1 - p ), TERRA_LIGHT_BVH_ONE_MINUS_EPSILON );
+            *pmf *= 1 - p;
+            node = children[1];
+        }
+    }
+
+    return ( int ) node->index;
+}
+
+// Walks down to the leaf of the triangle following its trail, taking the probability of each branch
+float terra_light_bvh_pmf ( const TerraLightBVH* bvh, const TerraFloat3* point, const TerraFloat3* normal, int triangle ) {
+    const TerraLightBVHNode* node = bvh->nodes;
+    uint64_t trail = bvh->trails[triangle];
+    float pmf = 1;
+
+    if ( node->leaf ) {
+        return terra_light_bounds_importance ( &node->bounds, point, normal ) > 0 ? 1.f : 0.f;
+    }
+
+    while ( !node->leaf ) {
+        const TerraLightBVHNode* children[2] = { node + 1, &bvh->nodes[node->index] };
+        float importance[2] = {
+            terra_light_bounds_importance ( &children[0]->bounds, point, normal ),
+            terra_light_bounds_importance ( &children[1]->bounds, point, normal )
+        };
+
+        if ( importance[0] == 0 && importance[1] == 0 ) {
+            return 0;
+        }
+
+        // Same operations as terra_light_bvh_sample, the pdfs of a sample have to match exactly for MIS
+        float p = importance[0] / ( importance[0] + importance[1] );
+        int side = ( int ) ( trail & 1 );
+        pmf *= side == 0 ? p : 1 - p;
+        node = children[side];
+        trail >>= 1;
+    }
+
+    return pmf;
+}
@@ -0,0 +1,69 @@
+#ifndef _TERRA_LIGHT_BVH_H_
+#define _TERRA_LIGHT_BVH_H_
+
+// Terra
+#include <Terra.h>
+#include <TerraMath.h>
+#include "TerraPrivate.h"
+
+// libc
+#include <stdint.h>
+
+// The path from the root to each leaf is stored as one bit per level, bounding the depth of the tree
+#define TERRA_LIGHT_BVH_MAX_DEPTH 64
+
+//--------------------------------------------------------------------------------------------------
+// Terra Light BVH Types
+//--------------------------------------------------------------------------------------------------
+// Spatial and directional bounds of the light emitted by a set of triangles [Conty Estevez and Kulla 2018].
+// Triangles emit on the side of their normal, all the normals are within acos(cos_theta_o) of axis.
+typedef struct {
+    TerraAABB   aabb;
+    TerraFloat3 axis;
+    float       cos_theta_o;
+    float       power;              // Luminance of the emitted flux, 0 for empty bounds
+} TerraLightBounds;
+
+// 48 bytes. Nodes are stored depth first, the first child of an internal node directly follows it.
+typedef struct {
+    TerraLightBounds bounds;
+    uint32_t         leaf : 1;
+    uint32_t         index : 31;    // Internal nodes: second child. Leaves: light triangle
+} TerraLightBVHNode;
+
+// Emissive triangle, light indexes the scene lights and triangle the triangles of their object
+typedef struct {
+    uint32_t light;
+    uint32_t triangle;
+} TerraLightTriangle;
+
+// Root is nodes[0], there's one leaf per light triangle
+typedef struct {
+    TerraLightBVHNode*  nodes;
+    int                 nodes_count;
+    TerraLightTriangle* triangles;
+    uint64_t*           trails;             // Bit i is the child taken at depth i on the way to the leaf of each triangle
+    int                 triangles_count;
+} TerraLightBVH;
+
+//--------------------------------------------------------------------------------------------------
+// Terra Light BVH API
+//--------------------------------------------------------------------------------------------------
+//
+// Lights are picked walking down the tree, at each node the child is chosen with probability proportional to the
+// contribution its bounds can have at the shading point. Nodes are split with the surface area orientation
+// heuristic over binned centroids.
+//
+void  terra_light_bounds_triangle ( TerraLightBounds* bounds, const TerraTriangle* triangle, const TerraTriangleProperties* properties, float power );
+// Upper bound of the contribution of the light to a point on a surface, normal can be zero for points in a medium
+float terra_light_bounds_importance ( const TerraLightBounds* bounds, const TerraFloat3* point, const TerraFloat3* normal );
+
+// triangles and bounds are in the same order, which the trails follow
+void  terra_light_bvh_create ( TerraLightBVH* bvh, const TerraLightTriangle* triangles, const TerraLightBounds* bounds, int triangles_count );
+void  terra_light_bvh_destroy ( TerraLightBVH* bvh );
+// Returns the index of the picked triangle and its probability, -1 if no light can reach the point. e is in [0, 1).
+int   terra_light_bvh_sample ( const TerraLightBVH* bvh, const TerraFloat3* point, const TerraFloat3* normal, float e, float* pmf );
+// Probability of terra_light_bvh_sample picking the triangle at the same point
+float terra_light_bvh_pmf ( const TerraLightBVH* bvh, const TerraFloat3* point, const TerraFloat3* normal, int triangle );
+
+#endif // _TERRA_LIGHT_BVH_H_
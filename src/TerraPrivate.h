@@ -13,6 +13,21 @@
 #define TERRA_UNUSED(...) ((void)(__VA_ARGS__))
 #define TERRA_AS(x, t) (*((t*)&(x)))
 
+// Hot arrays (acceleration structure nodes) are aligned to it so that a node never straddles two lines
+#ifndef TERRA_CACHE_LINE_SIZE
+#define TERRA_CACHE_LINE_SIZE 64
+#endif
+
+// Hint that the cache line containing addr is going to be read soon
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define TERRA_PREFETCH(addr) _mm_prefetch ( ( const char* ) ( addr ), _MM_HINT_T0 )
+#elif defined(__GNUC__)
+#define TERRA_PREFETCH(addr) __builtin_prefetch ( ( addr ), 0, 3 )
+#else
+#define TERRA_PREFETCH(addr) TERRA_UNUSED ( addr )
+#endif
+
 //--------------------------------------------------------------------------------------------------
 // Terra internal types
 //--------------------------------------------------------------------------------------------------
@@ -26,6 +41,7 @@ typedef struct {
     float        area;
     TerraObject* object;
     float*       triangle_area;
+    uint32_t     triangles_offset;  // Index of the first triangle among the triangles of all the lights
 } TerraLight;
 
 // Uniform distribution sampling
@@ -52,6 +68,30 @@ typedef struct TerraSamplerHalton {
     int bases[2];
 } TerraSamplerHalton;
 
+// Key of the counter-based sampler, renders with the same seed are identical
+#ifndef TERRA_SAMPLER_SEED
+#define TERRA_SAMPLER_SEED 0
+#endif
+
+// Side of the blue noise texture shifting the Sobol samples of each pixel, power of two
+#ifndef TERRA_SAMPLER_BLUE_NOISE_SIZE
+#define TERRA_SAMPLER_BLUE_NOISE_SIZE 64
+#endif
+
+// Counter-based sampler [Salmon et al. 2011, Philox4x32-10]. Each number is a function of (pixel, sample, dimension)
+// only, a pixel sample gets the same numbers whichever thread or tile traces it and no state is shared.
+// The dimensions of a path are drawn in order, the camera jitter first.
+// With a blue noise texture the numbers come from an Owen-scrambled Sobol sequence instead (kTerraSamplingMethodSobol).
+typedef struct TerraSamplerCounter {
+    uint32_t pixel;         // Index across the framebuffer
+    uint32_t sample;        // Index of the sample of the pixel, across renders
+    uint32_t dimension;     // Next dimension to draw
+    uint32_t block[4];      // Numbers of dimensions [dimension & ~3, dimension | 3]
+    uint32_t x;             // Pixel coordinates, look up the blue noise texture
+    uint32_t y;
+    const uint32_t* blue_noise; // Toroidal shift of each texel as a 0.32 fixed point number, NULL for Philox
+} TerraSamplerCounter;
+
 // Sampler Interface
 typedef void* TerraSampler;
 typedef void ( *TerraSamplingRoutine ) ( TerraSampler sampler, float* e1, float* e2 );
@@ -61,12 +101,25 @@ typedef struct TerraSampler2D {
     TerraSamplingRoutine sample;
 } TerraSampler2D;
 
+//--------------------------------------------------------------------------------------------------
+// Memory
+//--------------------------------------------------------------------------------------------------
+// Goes through terra_malloc, alignment is a power of two. Has to be released with terra_free_aligned.
+void* terra_malloc_aligned ( size_t size, size_t alignment );
+void  terra_free_aligned ( void* ptr );
+
+//--------------------------------------------------------------------------------------------------
+// Jobs
+//--------------------------------------------------------------------------------------------------
+// Runs routine ( args, idx ) for idx in [0, count) through the client dispatch, serially if none is set.
+void  terra_jobs_run ( const TerraJobSystem* jobs, TerraJobRoutine* routine, void* args, size_t count );
+
 //--------------------------------------------------------------------------------------------------
 // Continuous random probability distribution sampling
 //--------------------------------------------------------------------------------------------------
 
 // Internal api
-void  terra_sampler_random_init ( TerraSamplerRandom* sampler );
+void  terra_sampler_random_init ( TerraSamplerRandom* sampler, uint64_t seed );
 void  terra_sampler_random_destroy ( TerraSamplerRandom* sampler );
 float terra_sampler_random_next ( void* sampler );
 
@@ -78,6 +131,13 @@ void  terra_sampler_halton_init ( TerraSamplerHalton* sampler );
 void  terra_sampler_halton_destroy ( TerraSamplerHalton* sampler );
 void  terra_sampler_halton_next_pair ( void* sampler, float* e1, float* e2 );
 
+// blue_noise is NULL or has been filled by terra_sampler_blue_noise_create
+void  terra_sampler_counter_init ( TerraSamplerCounter* sampler, const uint32_t* blue_noise, size_t x, size_t y, size_t width, uint32_t sample );
+float terra_sampler_counter_next ( void* sampler );
+float terra_sampler_sobol_next ( TerraSamplerCounter* sampler );
+// Void-and-cluster [Ulichney 1993] ranks of TERRA_SAMPLER_BLUE_NOISE_SIZE^2 texels, stored as 0.32 fixed point shifts
+void  terra_sampler_blue_noise_create ( uint32_t* shifts_out );
+
 //--------------------------------------------------------------------------------------------------
 // Discrete arbitrary probability distribution sampling
 //--------------------------------------------------------------------------------------------------
@@ -116,6 +176,11 @@ typedef struct TerraRayState {
     TerraFloat4 ray_transform_f4;
     TerraInt4   ray_transform_i4;
 
+    // ray/box slab test, the w components repeat z (see terra_ray_box_intersection_init)
+    TerraFloat4 box_inv_direction;
+    TerraFloat4 box_origin_inv_direction;   // origin * box_inv_direction
+    TerraInt4   box_sign;                   // 1 if the direction is negative, index of the near plane along the axis
+
     // .. differentials, current material state
 } TerraRayState;
 
@@ -130,20 +195,31 @@ typedef struct {
 
     TerraFloat3 point;             // Intersection point in world coordinates
 
-    uint32_t    object_idx : 8;    // Reference index to the model
-    uint32_t    triangle_idx : 24; // Reference index to the triangle
+    uint32_t    object_idx;        // Reference index to the model
+    uint32_t    triangle_idx;      // Reference index to the triangle
 } TerraRayIntersectionResult;
 
 // Ray/Primitive intersection routine arguments
 typedef struct {
-    TerraRay*      ray;
-    TerraRayState* state;
+    const TerraRay*      ray;
+    const TerraRayState* state;
     union {
         TerraAABB      box;
         TerraTriangle* triangle;
     } primitive;
 } TerraRayIntersectionQuery;
 
+// Triangles are stored by leaves in packets of TERRA_TRIANGLE_PACKET_WIDTH, coordinates split by axis ([axis][lane])
+// so that the SIMD tests load them directly. The width is fixed, AVX tests two consecutive packets at once.
+#define TERRA_TRIANGLE_PACKET_WIDTH 4
+#define TERRA_TRIANGLE_PACKETS_COUNT( triangles_count ) ( ( ( triangles_count ) + TERRA_TRIANGLE_PACKET_WIDTH - 1 ) / TERRA_TRIANGLE_PACKET_WIDTH )
+
+typedef struct {
+    float a[3][TERRA_TRIANGLE_PACKET_WIDTH];
+    float b[3][TERRA_TRIANGLE_PACKET_WIDTH];
+    float c[3][TERRA_TRIANGLE_PACKET_WIDTH];
+} TerraTrianglePacket;
+
 // TerraGeometry.c
 TerraFloat3 terra_ray_pos ( const TerraRay* ray, float depth );
 
@@ -153,7 +229,18 @@ int  terra_ray_triangle_intersection_query ( const TerraRayIntersectionQuery* qu
 void terra_ray_box_intersection_init       ( const TerraRay* ray, TerraRayState* state );
 int  terra_ray_box_intersection_query      ( const TerraRayIntersectionQuery* query, TerraRayIntersectionResult* result );
 
-bool  terra_ray_aabb_intersection ( const TerraRay* ray, const TerraAABB* aabb, float* tmin_out, float* tmax_out );
+// idx is the index of the triangle across the packets
+void terra_triangle_packet_set ( TerraTrianglePacket* packets, int idx, const TerraTriangle* triangle );
+void terra_triangle_packet_get ( const TerraTrianglePacket* packets, int idx, TerraTriangle* triangle_out );
+// Tests the triangles [first, first + count) of packets. Returns the index of the closest one hit before t_max
+// filling result (depth, barycentrics and point), -1 if none is.
+int  terra_ray_triangle_packet_intersection ( const TerraRay* ray, const TerraRayState* state, const TerraTrianglePacket* packets, int first, int count,
+        float t_max, TerraRayIntersectionResult* result );
+bool terra_ray_triangle_packet_occluded     ( const TerraRay* ray, const TerraRayState* state, const TerraTrianglePacket* packets, int first, int count,
+        float t_max );
+
+// Entry (clamped to 0) and exit distances of the ray, state has to be initialized (terra_ray_box_intersection_init is enough)
+bool  terra_ray_aabb_intersection ( const TerraRayState* state, const TerraAABB* aabb, float* tmin_out, float* tmax_out );
 void  terra_aabb_fit_triangle     ( TerraAABB* aabb, const TerraTriangle* triangle );
 float terra_triangle_area         ( const TerraTriangle* triangle );
 
@@ -412,8 +412,12 @@ TerraClockTime terra_clock() {
     return clock();
 }
 
-double terra_clock_elapsed_ms ( TerraClockTime delta_time ) {
-    return ( double ) ( delta_time / CLOCKS_PER_SEC * 1000 );
+double terra_clock_to_ms ( TerraClockTime delta_time ) {
+    return ( double ) delta_time * 1000 / CLOCKS_PER_SEC;
+}
+
+double terra_clock_to_us ( TerraClockTime delta_time ) {
+    return ( double ) delta_time * 1000 * 1000 / CLOCKS_PER_SEC;
 }
 
 #endif